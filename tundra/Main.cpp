@@ -14,6 +14,7 @@
 #include "src/StandardInputCanary.hpp"
 #include "src/Inspect.hpp"
 #include "src/EventLog.hpp"
+#include "src/CachePrefetch.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,6 +55,7 @@ static const struct OptionTemplate
     const char *m_Help;
 } g_OptionTemplates[] = {
     {'j', "threads", OptionType::kInt, offsetof(DriverOptions, m_ThreadCount), "Specify number of build threads"},
+    {0, "max-processes", OptionType::kInt, offsetof(DriverOptions, m_MaxProcesses), "Maximum number of actions running at once. When set, build threads don't wait for the actions they start, so this can exceed --threads"},
     {'t', "show-targets", OptionType::kBool, offsetof(DriverOptions, m_ShowTargets), "Show available targets and exit"},
     {'v', "verbose", OptionType::kBool, offsetof(DriverOptions, m_Verbose), "Enable verbose build messages"},
     {'Q', "silence-if-possible", OptionType::kBool, offsetof(DriverOptions, m_SilenceIfPossible), "If no actions taken, don't display a conclusion message"},
@@ -73,7 +75,13 @@ static const struct OptionTemplate
     {'C', "working-dir", OptionType::kString, offsetof(DriverOptions, m_WorkingDir), "Set working directory before building"},
     {'R', "dagfile", OptionType::kString, offsetof(DriverOptions, m_DAGFileName), "filename of where tundra should store the mmapped dag file"},
     {'O', "dagfilejson", OptionType::kString, offsetof(DriverOptions, m_DagFileNameJson), "Filename of the json to bake (only used in explicit baking mode)"},
+    {0, "dagfilestream", OptionType::kString, offsetof(DriverOptions, m_DagFileNameStream), "Filename of the binary dag stream to bake, instead of --dagfilejson (see DagStream.hpp)"},
     {'b', "binlog", OptionType::kString, offsetof(DriverOptions, m_BinLog), "Filename of the a binary structured log to produce"},
+    {0, "trust-stat-cache", OptionType::kBool, offsetof(DriverOptions, m_TrustStatCache), "Reuse file stats of the previous build for directories whose entries didn't change. Misses files modified in place"},
+    {0, "watch-daemon", OptionType::kBool, offsetof(DriverOptions, m_WatchDaemon), "Keep running and watch the directories of the stat cache for changes, so builds can trust the stat cache"},
+    {0, "learn-memory", OptionType::kBool, offsetof(DriverOptions, m_LearnMemoryWeights), "Limit the actions running at once by the peak memory each used in earlier builds, unless the dag declares MemMB for them"},
+    {0, "resource-report", OptionType::kInt, offsetof(DriverOptions, m_ResourceReportCount), "After the build, list the N actions that used the most cpu time, memory and I/O"},
+    {0, "scheduler", OptionType::kString, offsetof(DriverOptions, m_Scheduler), "Node scheduler to use: 'stack' (default, one shared queue) or 'stealing' (per-thread queues)"},
     {'I', "report-includes", OptionType::kString, offsetof(DriverOptions, m_IncludesOutput), "Output included files into a json file and exit"},
     {'h', "help", OptionType::kBool, offsetof(DriverOptions, m_ShowHelp), "Show help"},
 #if defined(TUNDRA_WIN32)
@@ -384,6 +392,18 @@ int main(int argc, char *argv[])
         options.m_ThreadCount = kMaxBuildThreads;
     }
 
+    if (options.m_MaxProcesses < 0)
+    {
+        fprintf(stderr, "--max-processes must not be negative\n");
+        return 1;
+    }
+
+    if (options.m_Scheduler != nullptr && 0 != strcmp(options.m_Scheduler, "stack") && 0 != strcmp(options.m_Scheduler, "stealing"))
+    {
+        fprintf(stderr, "unknown scheduler '%s', expected 'stack' or 'stealing'\n", options.m_Scheduler);
+        return 1;
+    }
+
     if (options.m_ShowHelp)
     {
         ShowHelp();
@@ -450,7 +470,7 @@ int main(int argc, char *argv[])
 
     // Initialize profiler if needed
     if (options.m_ProfileOutput)
-        ProfilerInit(options.m_ProfileOutput, options.m_ThreadCount + 1);
+        ProfilerInit(options.m_ProfileOutput, options.m_ThreadCount + 1 + kCachePrefetchThreadCount);
 
     // Initialize driver
     if (!DriverInit(&driver, &options))
@@ -477,6 +497,13 @@ int main(int argc, char *argv[])
         goto leave;
     }
 
+    if (driver.m_Options.m_WatchDaemon)
+    {
+        build_result = DriverRunWatchDaemon(&driver) ? BuildResult::kOk : BuildResult::kCroak;
+        Log(kDebug, "Watch daemon stopped - quitting");
+        goto leave;
+    }
+
     if (driver.m_Options.m_IncludesOutput != nullptr)
     {
         build_result = ReportIncludes(&driver) ? BuildResult::kOk : BuildResult::kBuildError;
@@ -489,10 +516,16 @@ int main(int argc, char *argv[])
 
     RemoveStaleOutputs(&driver);
 
+    // Runs alongside the build; SaveAllBuiltNodes() waits for it.
+    StartBuiltNodesCompaction(&driver);
+
     build_result = DriverBuild(&driver, &finished_node_count, frontend_rerun_reason, (const char**) argv, argc);
 
     EventLog::EmitBuildFinish(build_result);
 
+    if (options.m_ResourceReportCount > 0)
+        DriverReportResourceUsage(&driver, options.m_ResourceReportCount);
+
     if (!SaveAllBuiltNodes(&driver))
     {
         Log(kError, "Couldn't save AllBuiltNodes");
@@ -511,6 +544,13 @@ int main(int argc, char *argv[])
         build_result = BuildResult::kCroak;
     }
 
+    // Has to come last, the stat cache can't be used after it has been saved.
+    if (!DriverSaveStatCache(&driver))
+    {
+        Log(kWarning, "Couldn't save stat cache");
+        build_result = BuildResult::kCroak;
+    }
+
 leave:
 
     DriverDestroy(&driver);
@@ -525,6 +565,7 @@ leave:
     {
         printf("output cleanup:    %10.2f ms\n", TimerToSeconds(g_Stats.m_StaleCheckTimeCycles) * 1000.0);
         printf("json parse time:   %10.2f ms\n", TimerToSeconds(g_Stats.m_JsonParseTimeCycles) * 1000.0);
+        printf("dag stream decode: %10.2f ms\n", TimerToSeconds(g_Stats.m_DagStreamDecodeTimeCycles) * 1000.0);
         printf("scan cache:\n");
         printf("  hits (new):      %10u\n", g_Stats.m_NewScanCacheHits);
         printf("  hits (frozen):   %10u\n", g_Stats.m_OldScanCacheHits);
@@ -542,6 +583,11 @@ leave:
         printf("  hits:            %10u\n", g_Stats.m_StatCacheHits);
         printf("  misses:          %10u\n", g_Stats.m_StatCacheMisses);
         printf("  dirty:           %10u\n", g_Stats.m_StatCacheDirty);
+        printf("  frozen records:  %10u\n", g_Stats.m_StatCacheFrozenRecords);
+        printf("  dirs checked:    %10u\n", g_Stats.m_StatCacheDirectoriesChecked);
+        printf("  dirs changed:    %10u\n", g_Stats.m_StatCacheDirectoriesChanged);
+        printf("  load time:       %10.2f ms\n", TimerToSeconds(g_Stats.m_StatCacheLoadTimeCycles) * 1000.0);
+        printf("  save time:       %10.2f ms\n", TimerToSeconds(g_Stats.m_StatCacheSaveTimeCycles) * 1000.0);
         printf("building:\n");
         printf("  old records:     %10u\n", g_Stats.m_StateSaveOld);
         printf("  new records:     %10u\n", g_Stats.m_StateSaveNew);
@@ -549,6 +595,14 @@ leave:
         printf("  state save time: %10.2f ms\n", TimerToSeconds(g_Stats.m_StateSaveTimeCycles) * 1000.0);
         printf("  exec() count:    %10u\n", g_Stats.m_ExecCount);
         printf("  exec() time:     %10.2f s\n", TimerToSeconds(g_Stats.m_ExecTimeCycles));
+        printf("  resource waits:  %10u\n", g_Stats.m_ActionResourceWaitCount);
+        printf("  resource wait:   %10.2f s\n", TimerToSeconds(g_Stats.m_ActionResourceWaitTimeCycles));
+        printf("  build time:      %10.2f s\n", TimerToSeconds(g_Stats.m_BuildTimeCycles));
+        printf("  critical path:   %10.2f s\n", g_Stats.m_CriticalPathTimeMs / 1000.0);
+        printf("cache prefetch:\n");
+        printf("  lookups:         %10llu\n", (unsigned long long)g_Stats.m_CachePrefetchLookups);
+        printf("  hits:            %10llu\n", (unsigned long long)g_Stats.m_CachePrefetchHits);
+        printf("  downloads used:  %10u\n", g_Stats.m_CachePrefetchDownloadsUsed);
         printf("low-level syscalls:\n");
         printf("  mmap() calls:    %10u\n", g_Stats.m_MmapCalls);
         printf("  mmap() time:     %10.2f ms\n", TimerToSeconds(g_Stats.m_MmapTimeCycles) * 1000.0);
@@ -556,17 +610,23 @@ leave:
         printf("  munmap() time:   %10.2f ms\n", TimerToSeconds(g_Stats.m_MunmapTimeCycles) * 1000.0);
         printf("  stat() calls:    %10u\n", g_Stats.m_StatCount);
         printf("  stat() time:     %10.2f ms\n", TimerToSeconds(g_Stats.m_StatTimeCycles) * 1000.0);
+        printf("  io_uring stats:  %10u\n", g_Stats.m_IoRingStatCount);
+        printf("  io_uring reads:  %10u\n", g_Stats.m_IoRingReadCount);
+        printf("  io_uring waits:  %10u\n", g_Stats.m_IoRingBatchCount);
+        printf("  io_uring time:   %10.2f ms\n", TimerToSeconds(g_Stats.m_IoRingTimeCycles) * 1000.0);
 
         printf("compiledag:        %10.2f ms\n", TimerToSeconds(g_Stats.m_CompileDagTime) * 1000.0);
         printf("compilederived     %10.2f ms\n", TimerToSeconds(g_Stats.m_CompileDagDerivedTime) * 1000.0);
         printf("  cumulativepoints %10.2f ms\n", TimerToSeconds(g_Stats.m_CumulativePointsTime) * 1000.0);
         printf("  nongenindices    %10.2f ms\n", TimerToSeconds(g_Stats.m_CalculateNonGeneratedIndicesTime) * 1000.0);
+        printf("  reused nodes     %10u\n", g_Stats.m_CompileDagDerivedNodesReused);
 
         printf("pointless wakeups  %10u\n", g_Stats.m_PointlessThreadWakeup);
+        printf("stolen nodes       %10u\n", g_Stats.m_StolenNodeCount);
     }
 
     double total_time = TimerDiffSeconds(start_time, TimerGet());
-    bool haveTitle = strlen(buildTitle) > 0;
+    bool haveTitle = strlen(buildTitle) > 0 && !options.m_WatchDaemon;
     if (haveTitle && (build_result != 0 || !options.m_SilenceIfPossible))
     {
         MessageStatusLevel::Enum status = (build_result == BuildResult::kOk || build_result == BuildResult::kRequireFrontendRerun) ? MessageStatusLevel::Success : MessageStatusLevel::Failure;
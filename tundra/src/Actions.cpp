@@ -73,7 +73,7 @@ ExecResult WriteTextFile(const char* payload, const char* target_file, MemAllocH
 
 #if !defined(TUNDRA_APPLE) && !defined(TUNDRA_WIN32) && !defined(TUNDRA_LINUX)
 
-ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap)
+ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap, bool use_hardlinks)
 {
     ExecResult result;
     memset(&result, 0, sizeof(result));
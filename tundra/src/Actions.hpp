@@ -28,5 +28,8 @@ struct StatCache;
 struct FrozenFileAndHash;
 
 ExecResult WriteTextFile(const char* payload, const char* target_file, MemAllocHeap* heap);
-ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap);
+// Copies src_files[i] over target_files[i]. On Linux, targets that are still an unchanged copy of their source are
+// left alone, long lists are copied on several threads, and with use_hardlinks regular files are hardlinked where
+// possible; the targets must then never be modified in place.
+ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap, bool use_hardlinks);
 
@@ -5,11 +5,15 @@
 #include "StatCache.hpp"
 #include "BinaryData.hpp"
 #include "MemAllocLinear.hpp"
+#include "Thread.hpp"
+#include "ParallelFor.hpp"
 
 #if defined(TUNDRA_LINUX)
 
 #include <filesystem>
+#include <algorithm>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -44,220 +48,338 @@ char* ReadSymbolicLink(const char* path, MemAllocLinear* allocator, struct stat*
     return link_target;
 }
 
-ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap)
+enum
 {
-    ExecResult result;
-    memset(&result, 0, sizeof(result));
-    char tmpBuffer[1024];
+    // A copy action with more files than this is split over several threads.
+    kCopyFilesPerThread = 64,
+    kCopyFilesMaxThreads = 4
+};
+
+// A destination written by CopyFiles gets the mode and modification time of its source, so it is unchanged if those
+// and the size still match. A hardlink is unchanged if it is still the same file.
+static bool IsUnchangedCopy(const struct stat& src_stat, const struct stat& dst_stat, bool use_hardlinks)
+{
+    if (!S_ISREG(src_stat.st_mode) || !S_ISREG(dst_stat.st_mode))
+        return false;
 
-    int in_file = -1, out_file = -1;
-    int temporary_pipe[2] = { -1, -1 };
-    pipe(temporary_pipe);
+    if (use_hardlinks && src_stat.st_dev == dst_stat.st_dev && src_stat.st_ino == dst_stat.st_ino)
+        return true;
 
-    MemAllocLinear scratch;
-    LinearAllocInit(&scratch, heap, 4096, "CopyFiles scratch memory");
+    return src_stat.st_size == dst_stat.st_size
+        && src_stat.st_mtim.tv_sec == dst_stat.st_mtim.tv_sec
+        && src_stat.st_mtim.tv_nsec == dst_stat.st_mtim.tv_nsec
+        && (dst_stat.st_mode & 0x0fff) == ((src_stat.st_mode & 0x0fff) | S_IWUSR);
+}
 
-    for(size_t i = 0; i < files_count; ++i)
+// Returns false if copy_file_range isn't available for these files, so another way of copying should be tried.
+static bool CopyFileRange(int in_file, int out_file, size_t size, int* out_error)
+{
+#if defined(__NR_copy_file_range)
+    size_t copied = 0;
+    while (copied < size)
+    {
+        ssize_t n = syscall(__NR_copy_file_range, in_file, nullptr, out_file, nullptr, size - copied, 0);
+        if (n == -1)
+        {
+            // Not supported by the kernel or between these file systems, nothing was written yet.
+            if (copied == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+                return false;
+            *out_error = errno;
+            return true;
+        }
+        if (n == 0)
+            break;
+        copied += n;
+    }
+    *out_error = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct CopyFilesWorker
+{
+    const FrozenFileAndHash* m_SrcFiles;
+    const FrozenFileAndHash* m_TargetFiles;
+    StatCache* m_StatCache;
+    bool m_UseHardlinks;
+
+    int m_Pipe[2];
+    MemAllocLinear m_Scratch;
+    int m_ReturnCode;
+    char m_Error[1024];
+};
+
+static bool CopyOneFile(CopyFilesWorker* worker, size_t i)
+{
+    char* tmpBuffer = worker->m_Error;
+    const size_t tmpBufferSize = sizeof(worker->m_Error);
+    MemAllocLinear* scratch = &worker->m_Scratch;
+    StatCache* stat_cache = worker->m_StatCache;
+    LinearAllocReset(scratch);
+
+    const char* src_file = worker->m_SrcFiles[i].m_Filename;
+    const char* dst_file = worker->m_TargetFiles[i].m_Filename;
+    uint32_t dst_hash = worker->m_TargetFiles[i].m_FilenameHash;
+
+    // The StatCache is not used for the file info because we need full stat info (file modes, etc) which FileInfo doesn't give us
+    struct stat src_stat;
+    if (lstat(src_file, &src_stat) != 0)
     {
-        LinearAllocReset(&scratch);
+        snprintf(tmpBuffer, tmpBufferSize, "The properties of source file %s could not be retrieved: %s", src_file, strerror(errno));
+        return false;
+    }
 
-        const char* src_file = src_files[i].m_Filename;
-        const char* dst_file = target_files[i].m_Filename;
+    if (S_ISDIR(src_stat.st_mode))
+    {
+        snprintf(tmpBuffer, tmpBufferSize, "The source path %s is a directory, which is not supported.", src_file);
+        return false;
+    }
 
-        // The StatCache is not used for the file info because we need full stat info (file modes, etc) which FileInfo doesn't give us
-        struct stat src_stat;
-        if (lstat(src_file, &src_stat) != 0)
+    struct stat dst_stat;
+    if (lstat(dst_file, &dst_stat) != 0)
+    {
+        if (errno != ENOENT)
         {
-            result.m_ReturnCode = -1;
-            snprintf(tmpBuffer, sizeof(tmpBuffer), "The properties of source file %s could not be retrieved: %s", src_file, strerror(errno));
-            break;
+            snprintf(tmpBuffer, tmpBufferSize, "The properties of the destination file %s could not be retrieved: %s", src_file, strerror(errno));
+            return false;
         }
-
-        if (S_ISDIR(src_stat.st_mode))
+    }
+    else
+    {
+        if (S_ISDIR(dst_stat.st_mode))
         {
-            result.m_ReturnCode = -1;
-            snprintf(tmpBuffer, sizeof(tmpBuffer), "The source path %s is a directory, which is not supported.", src_file);
-            break;
+            snprintf(tmpBuffer, tmpBufferSize, "The target path %s already exists as a directory.", dst_file);
+            return false;
         }
 
-        struct stat dst_stat;
-        if (lstat(dst_file, &dst_stat) != 0)
+        if (IsUnchangedCopy(src_stat, dst_stat, worker->m_UseHardlinks))
+            return true;
+
+        // A previous hardlink of a read-only source is read-only too, and is replaced like any other stale link.
+        if (!worker->m_UseHardlinks && (dst_stat.st_mode & S_IWRITE) == 0)
         {
-            if (errno != ENOENT)
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The properties of the destination file %s could not be retrieved: %s", src_file, strerror(errno));
-                break;
-            }
+            snprintf(tmpBuffer, tmpBufferSize, "The target path %s already exists and is read-only.", dst_file);
+            return false;
         }
-        else
+
+        // Always remove the target file first if it existed, to avoid any weirdnesses when opening it for writing
+        unlink(dst_file);
+    }
+
+    if ((src_stat.st_mode & S_IFMT) == S_IFLNK)
+    {
+        // It's a symlink
+        char* link_target = ReadSymbolicLink(src_file, scratch, &src_stat);
+        if (link_target == nullptr)
         {
-            if (S_ISDIR(dst_stat.st_mode))
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The target path %s already exists as a directory.", dst_file);
-                break;
-            }
+            snprintf(tmpBuffer, tmpBufferSize, "The source symlink %s could not be read.", src_file);
+            return false;
+        }
 
-            if ((dst_stat.st_mode & S_IWRITE) == 0)
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The target path %s already exists and is read-only.", dst_file);
-                break;
-            }
+        if (symlink(link_target, dst_file) != 0)
+        {
+            snprintf(tmpBuffer, tmpBufferSize, "The target symlink %s could not be created.", dst_file);
+            return false;
+        }
 
-            // Always remove the target file first if it existed, to avoid any weirdnesses when opening it for writing
-            unlink(dst_file);
+        // Verify the link was copied correctly
+        char* final_target = ReadSymbolicLink(dst_file, scratch, nullptr);
+        if (final_target == nullptr)
+        {
+            snprintf(tmpBuffer, tmpBufferSize, "The destination symlink %s could not be read.", dst_file);
+            return false;
         }
 
-        if ((src_stat.st_mode & S_IFMT) == S_IFLNK)
+        if (strcmp(link_target, final_target) != 0)
         {
-            // It's a symlink
-            char* link_target = ReadSymbolicLink(src_file, &scratch, &src_stat);
-            if (link_target == nullptr)
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The source symlink %s could not be read.", src_file);
-                break;
-            }
+            snprintf(tmpBuffer, tmpBufferSize, "The copied symlink %s had contents \"%s\", but the source symlink %s had different contents \"%s\".", dst_file, final_target, src_file, link_target);
+            return false;
+        }
 
-            if (symlink(link_target, dst_file) != 0)
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The target symlink %s could not be created.", dst_file);
-                break;
-            }
+        // Mark the stat cache dirty
+        StatCacheMarkDirty(stat_cache, dst_file, dst_hash);
+        return true;
+    }
 
-            // Verify the link was copied correctly
-            char* final_target = ReadSymbolicLink(dst_file, &scratch, nullptr);
-            if (final_target == nullptr)
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The destination symlink %s could not be read.", dst_file);
-                break;
-            }
+    // It's a regular file. A hardlink shares everything with the source, so there is nothing left to do. Across file
+    // systems it fails, then the file is copied after all.
+    if (worker->m_UseHardlinks && link(src_file, dst_file) == 0)
+    {
+        StatCacheMarkDirty(stat_cache, dst_file, dst_hash);
+        return true;
+    }
 
-            if (strcmp(link_target, final_target) != 0)
-            {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The copied symlink %s had contents \"%s\", but the source symlink %s had different contents \"%s\".", dst_file, final_target, src_file, link_target);
-                break;
-            }
+    int in_file = open(src_file, O_RDONLY);
+    if (in_file == -1)
+    {
+        snprintf(tmpBuffer, tmpBufferSize, "The source file %s could not be opened for reading: %s", src_file, strerror(errno));
+        return false;
+    }
+
+    // Ensure that the target file is opened with a writable mode, even if the input file was readonly
+    int out_file = open(dst_file, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, (src_stat.st_mode & 0x0fff) | S_IWUSR);
+    if (out_file == -1)
+    {
+        snprintf(tmpBuffer, tmpBufferSize, "The destination file %s could not be opened for writing: %s", dst_file, strerror(errno));
+        close(in_file);
+        return false;
+    }
 
-            // Mark the stat cache dirty
-            StatCacheMarkDirty(stat_cache, dst_file, target_files[i].m_FilenameHash);
+    bool ok = true;
+    do {
+#ifdef FICLONE
+        // Try the IOCTL. We don't particularly care about errors here, we'll just fall back if this fails
+        if (ioctl(out_file, FICLONE, in_file) != -1)
+        {
+            // It worked!
+            break;
         }
-        else
+#endif
+
+        // Then let the kernel copy it without going through user space, or through the page cache where the file
+        // system can do better.
+        int copy_error;
+        if (CopyFileRange(in_file, out_file, src_stat.st_size, &copy_error))
         {
-            // It's a regular file
-            in_file = open(src_file, O_RDONLY);
-            if (in_file == -1)
+            if (copy_error != 0)
             {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The source file %s could not be opened for reading: %s", src_file, strerror(errno));
-                break;
+                ok = false;
+                snprintf(tmpBuffer, tmpBufferSize, "Copying file from %s to %s using 'copy_file_range' failed: %s", src_file, dst_file, strerror(copy_error));
             }
+            break;
+        }
+
+        // Otherwise, next fastest method is to ask the kernel to do the copy using splice
+        int* temporary_pipe = worker->m_Pipe;
+        if (temporary_pipe[0] == -1 && pipe(temporary_pipe) != 0)
+        {
+            ok = false;
+            snprintf(tmpBuffer, tmpBufferSize, "Creating a pipe to copy %s failed: %s", src_file, strerror(errno));
+            break;
+        }
 
-            // Ensure that the target file is opened with a writable mode, even if the input file was readonly
-            out_file = open(dst_file, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, (src_stat.st_mode & 0x0fff) | S_IWUSR);
-            if (out_file == -1)
+        ssize_t bytes_in, bytes_out;
+        bool successful_splice_to_target = false;
+        do
+        {
+            bytes_in = splice(in_file, NULL, temporary_pipe[1], NULL, src_stat.st_blksize, 0);
+            if (bytes_in == -1)
             {
-                result.m_ReturnCode = -1;
-                snprintf(tmpBuffer, sizeof(tmpBuffer), "The destination file %s could not be opened for writing: %s", dst_file, strerror(errno));
+                ok = false;
+                snprintf(tmpBuffer, tmpBufferSize, "Reading from the source file using 'splice' %s failed: %s", src_file, strerror(errno));
                 break;
             }
 
-            do {
-#ifdef FICLONE
-                // Try the IOCTL. We don't particularly care about errors here, we'll just fall back if this fails
-                if (ioctl(out_file, FICLONE, in_file) != -1)
-                {
-                    // It worked!
-                    break;
-                }
-#endif
-
-                // Otherwise, next fastest method is to ask the kernel to do the copy using splice
-                size_t bytes_in, bytes_out;
-                bool successful_splice_to_target = false;
-                do
+            bytes_out = splice(temporary_pipe[0], NULL, out_file, NULL, bytes_in, 0);
+            if (bytes_out == -1)
+            {
+                // If the writing splice call fails the first time with EINVAL, it might be that the target file system does not support splicing.
+                // This was observed on ecryptfs encrypted file systems. We encountered the same issue with sendfile as well.
+                if (errno == EINVAL && !successful_splice_to_target)
                 {
-                    bytes_in = splice(in_file, NULL, temporary_pipe[1], NULL, src_stat.st_blksize, 0);
-                    if (bytes_in == -1)
+                    // Unfortunately this fallback doesn't allow us to reuse the already opened file handles, but at least 
+                    std::error_code fs_copy_error;
+                    if (!std::filesystem::copy_file(src_file, dst_file, std::filesystem::copy_options::overwrite_existing, fs_copy_error))
                     {
-                        result.m_ReturnCode = -1;
-                        snprintf(tmpBuffer, sizeof(tmpBuffer), "Reading from the source file using 'splice' %s failed: %s", src_file, strerror(errno));
-                        break;
+                        ok = false;
+                        snprintf(tmpBuffer, tmpBufferSize, "Copying file from %s to %s using std::filesystem failed: %s", src_file, dst_file, fs_copy_error.message().c_str());
                     }
+                    break;
+                }
 
-                    bytes_out = splice(temporary_pipe[0], NULL, out_file, NULL, bytes_in, 0);
-                    if (bytes_out == -1)
-                    {
-                        // If the writing splice call fails the first time with EINVAL, it might be that the target file system does not support splicing.
-                        // This was observed on ecryptfs encrypted file systems. We encountered the same issue with sendfile as well.
-                        if (errno == EINVAL && !successful_splice_to_target)
-                        {
-                            // Unfortunately this fallback doesn't allow us to reuse the already opened file handles, but at least 
-                            std::error_code fs_copy_error;
-                            if (!std::filesystem::copy_file(src_file, dst_file, std::filesystem::copy_options::overwrite_existing, fs_copy_error))
-                            {
-                                result.m_ReturnCode = -1;
-                                snprintf(tmpBuffer, sizeof(tmpBuffer), "Copying file from %s to %s using std::filesystem failed: %s", src_file, dst_file, fs_copy_error.message().c_str());
-                            }
-                            break;
-                        }
-
-                        result.m_ReturnCode = -1;
-                        snprintf(tmpBuffer, sizeof(tmpBuffer), "Writing to the destination file using 'splice' %s failed: %s", dst_file, strerror(errno));
-                        break;
-                    }
+                ok = false;
+                snprintf(tmpBuffer, tmpBufferSize, "Writing to the destination file using 'splice' %s failed: %s", dst_file, strerror(errno));
+                break;
+            }
 
-                    // Splice worked at least once.
-                    successful_splice_to_target = true;
-                } while (bytes_out > 0);
-            } while (false);
+            // Splice worked at least once.
+            successful_splice_to_target = true;
+        } while (bytes_out > 0);
+    } while (false);
 
-            close(in_file);
-            in_file = -1;
+    close(in_file);
+    close(out_file);
 
-            close(out_file);
-            out_file = -1;
+    // Give it the time of the source, so the next build can tell it doesn't need copying again.
+    if (ok)
+    {
+        struct timespec times[2] = { src_stat.st_atim, src_stat.st_mtim };
+        utimensat(AT_FDCWD, dst_file, times, 0);
+    }
 
-            // Mark the stat cache dirty regardless of whether we failed or not - the target file is in an unknown state now
-            StatCacheMarkDirty(stat_cache, dst_file, target_files[i].m_FilenameHash);
+    // Mark the stat cache dirty regardless of whether we failed or not - the target file is in an unknown state now
+    StatCacheMarkDirty(stat_cache, dst_file, dst_hash);
 
-            if (result.m_ReturnCode == 0)
-            {
-                // Verify that the copied file is the same size as the source.
-                // It's OK to use the statcache for this now because we've finished modifying the file
-                FileInfo dst_file_info = StatCacheStat(stat_cache, dst_file);
-                if (dst_file_info.m_Size != src_stat.st_size)
-                {
-                    result.m_ReturnCode = -1;
-                    snprintf(tmpBuffer, sizeof(tmpBuffer), "The copied file %s is %" PRId64 " bytes, but the source file %s was %" PRId64 " bytes.", dst_file, dst_file_info.m_Size, src_file, src_stat.st_size);
-                    break;
-                }
-            }
-        }
+    if (!ok)
+        return false;
 
-        if (result.m_ReturnCode < 0)
-            break;
+    // Verify that the copied file is the same size as the source.
+    // It's OK to use the statcache for this now because we've finished modifying the file
+    FileInfo dst_file_info = StatCacheStat(stat_cache, dst_file);
+    if (dst_file_info.m_Size != src_stat.st_size)
+    {
+        snprintf(tmpBuffer, tmpBufferSize, "The copied file %s is %" PRId64 " bytes, but the source file %s was %" PRId64 " bytes.", dst_file, dst_file_info.m_Size, src_file, src_stat.st_size);
+        return false;
     }
 
-    close(temporary_pipe[0]);
-    close(temporary_pipe[1]);
-    if (in_file != -1)
-        close(in_file);
-    if (out_file != -1)
-        close(out_file);
+    return true;
+}
 
-    if (result.m_ReturnCode != 0)
+ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap, bool use_hardlinks)
+{
+    ExecResult result;
+    memset(&result, 0, sizeof(result));
+
+    int worker_count = ParallelForThreadCount(kCopyFilesMaxThreads, (int32_t)files_count, kCopyFilesPerThread);
+    CopyFilesWorker* workers = HeapAllocateArray<CopyFilesWorker>(heap, worker_count);
+    for (int w = 0; w < worker_count; ++w)
     {
-        InitOutputBuffer(&result.m_OutputBuffer, heap);
-        EmitOutputBytesToDestination(&result, tmpBuffer, strlen(tmpBuffer));
+        CopyFilesWorker* worker = &workers[w];
+        worker->m_SrcFiles = src_files;
+        worker->m_TargetFiles = target_files;
+        worker->m_StatCache = stat_cache;
+        worker->m_UseHardlinks = use_hardlinks;
+        worker->m_Pipe[0] = worker->m_Pipe[1] = -1;
+        worker->m_ReturnCode = 0;
+        worker->m_Error[0] = '\0';
+        LinearAllocInit(&worker->m_Scratch, heap, 4096, "CopyFiles scratch memory");
     }
 
-    LinearAllocDestroy(&scratch);
+    // Files are handed out one at a time; the first failure stops the rest.
+    ParallelFor(worker_count, (int32_t)files_count, 1, "CopyFiles", [&](int32_t start, int32_t end, int thread_index) {
+        CopyFilesWorker* worker = &workers[thread_index];
+        LinearAllocSetOwner(&worker->m_Scratch, ThreadCurrent());
+        for (int32_t i = start; i < end; ++i)
+        {
+            if (!CopyOneFile(worker, i))
+            {
+                worker->m_ReturnCode = -1;
+                return false;
+            }
+        }
+        return true;
+    });
+
+    for (int w = 0; w < worker_count; ++w)
+    {
+        CopyFilesWorker* worker = &workers[w];
+        if (worker->m_ReturnCode != 0 && result.m_ReturnCode == 0)
+        {
+            result.m_ReturnCode = worker->m_ReturnCode;
+            InitOutputBuffer(&result.m_OutputBuffer, heap);
+            EmitOutputBytesToDestination(&result, worker->m_Error, strlen(worker->m_Error));
+        }
+
+        if (worker->m_Pipe[0] != -1)
+        {
+            close(worker->m_Pipe[0]);
+            close(worker->m_Pipe[1]);
+        }
+        LinearAllocDestroy(&worker->m_Scratch);
+    }
+    HeapFree(heap, workers);
 
     return result;
 }
@@ -12,7 +12,7 @@
 
 #include "Banned.hpp"
 
-ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap)
+ExecResult CopyFiles(const FrozenFileAndHash* src_files, const FrozenFileAndHash* target_files, size_t files_count, StatCache* stat_cache, MemAllocHeap* heap, bool use_hardlinks)
 {
     ExecResult result;
     memset(&result, 0, sizeof(result));
@@ -11,6 +11,11 @@
 #include "MakeDirectories.hpp"
 #include "Driver.hpp"
 #include "SortedArrayUtil.hpp"
+#include "Thread.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
 
 #include "Banned.hpp"
 
@@ -46,7 +51,7 @@ bool NodeWasUsedByThisDagPreviously(const Frozen::BuiltNode *previously_built_no
 }
 
 template <class TNodeType>
-static void save_node_sharedcode(Frozen::BuiltNodeResult::Enum builtNodeResult, const HashDigest *input_signature, const HashDigest* leafinput_signature, const TNodeType *src_node, const HashDigest *guid, const StateSavingSegments &segments, const DynamicallyGrowingCollectionOfPaths* additionalDiscoveredOutputFiles, bool emitDataForBeeWhy)
+static void save_node_sharedcode(Frozen::BuiltNodeResult::Enum builtNodeResult, uint32_t execution_time_ms, uint32_t peak_memory_mb, const HashDigest *input_signature, const HashDigest* leafinput_signature, const TNodeType *src_node, const HashDigest *guid, const StateSavingSegments &segments, const DynamicallyGrowingCollectionOfPaths* additionalDiscoveredOutputFiles, bool emitDataForBeeWhy)
 {
     //we're writing to two arrays in one go.  the FrozenArray<HashDigest> m_NodeGuids and the FrozenArray<BuiltNode> m_BuiltNodes
     //the hashdigest is quick
@@ -54,6 +59,8 @@ static void save_node_sharedcode(Frozen::BuiltNodeResult::Enum builtNodeResult,
 
     //the rest not so much
     BinarySegmentWriteInt32(segments.built_nodes, builtNodeResult);
+    BinarySegmentWriteUint32(segments.built_nodes, execution_time_ms);
+    BinarySegmentWriteUint32(segments.built_nodes, peak_memory_mb);
     BinarySegmentWriteHashDigest(segments.built_nodes, *input_signature);
     BinarySegmentWriteHashDigest(segments.built_nodes, *leafinput_signature);
 
@@ -100,246 +107,586 @@ static void save_node_sharedcode(Frozen::BuiltNodeResult::Enum builtNodeResult,
 }
 
 
-bool SaveAllBuiltNodes(Driver *self)
+enum
 {
-    TimingScope timing_scope(nullptr, &g_Stats.m_StateSaveTimeCycles);
-    ProfilerScope prof_scope("Tundra Write AllBuiltNodes", 0);
-
-    MemAllocLinearScope alloc_scope(&self->m_Allocator);
+    // The state file is rewritten once the journal holds this many node records, or
+    // a quarter as many as the state file, whichever is more.
+    kJournalCompactMinRecords = 1024,
+    kJournalCompactRatio = 4
+};
 
-    BinaryWriter writer;
-    BinaryWriterInit(&writer, &self->m_Heap);
+static void GetJournalFileName(const Driver *self, char *out, const char *suffix)
+{
+    snprintf(out, kMaxPathLength, "%s.journal%s", self->m_DagData->m_StateFileName.Get(), suffix);
+}
 
-    StateSavingSegments segments;
-    BinarySegment *main_seg = BinaryWriterAddSegment(&writer);
-    BinarySegment *guid_seg = BinaryWriterAddSegment(&writer);
-    BinarySegment *built_nodes_seg = BinaryWriterAddSegment(&writer);
-    BinarySegment *array_seg = BinaryWriterAddSegment(&writer);
-    BinarySegment *string_seg = BinaryWriterAddSegment(&writer);
+// Tells state files apart, so a journal is never applied to a file it wasn't written against.
+static uint64_t NewStateGeneration()
+{
+    return (uint64_t(time(nullptr)) << 32) ^ TimerGet();
+}
 
-    HashTable<CommonStringRecord, kFlagCaseSensitive> shared_strings;
-    HashTableInit(&shared_strings, &self->m_Heap);
+// Writes an AllBuiltNodes image. Nodes have to be emitted in guid order.
+struct BuiltNodesWriter
+{
+    Driver *m_Driver;
+    MemAllocLinear *m_Scratch;
+    BinaryWriter m_Writer;
+    StateSavingSegments m_Segments;
+    BinaryLocator m_GuidPtr;
+    BinaryLocator m_BuiltNodesPtr;
+    HashTable<CommonStringRecord, kFlagCaseSensitive> m_SharedStrings;
+    int32_t m_NodeCount;
+};
 
-    segments.main = main_seg;
-    segments.guid = guid_seg;
-    segments.built_nodes = built_nodes_seg;
-    segments.array = array_seg;
-    segments.string = string_seg;
+static void BuiltNodesWriterInit(BuiltNodesWriter *self, Driver *driver, MemAllocLinear *scratch)
+{
+    self->m_Driver = driver;
+    self->m_Scratch = scratch;
 
-    BinaryLocator guid_ptr = BinarySegmentPosition(guid_seg);
-    BinaryLocator built_nodes_ptr = BinarySegmentPosition(built_nodes_seg);
+    BinaryWriterInit(&self->m_Writer, &driver->m_Heap);
 
-    uint32_t dag_node_count = self->m_DagData->m_NodeCount;
-    const HashDigest *dag_node_guids = self->m_DagData->m_NodeGuids;
-    const Frozen::DagNode *dag_nodes = self->m_DagData->m_DagNodes;
-    RuntimeNode *runtime_nodes = self->m_RuntimeNodes.m_Storage;
-    const size_t runtime_nodes_count = self->m_RuntimeNodes.m_Size;
+    self->m_Segments.main = BinaryWriterAddSegment(&self->m_Writer);
+    self->m_Segments.guid = BinaryWriterAddSegment(&self->m_Writer);
+    self->m_Segments.built_nodes = BinaryWriterAddSegment(&self->m_Writer);
+    self->m_Segments.array = BinaryWriterAddSegment(&self->m_Writer);
+    self->m_Segments.string = BinaryWriterAddSegment(&self->m_Writer);
 
-    std::sort(runtime_nodes, runtime_nodes + runtime_nodes_count, [=](const RuntimeNode &l, const RuntimeNode &r) {
-        // We know guids are sorted, so all we need to do is compare pointers into that table.
-        return l.m_DagNode < r.m_DagNode;
-    });
+    self->m_GuidPtr = BinarySegmentPosition(self->m_Segments.guid);
+    self->m_BuiltNodesPtr = BinarySegmentPosition(self->m_Segments.built_nodes);
 
-    const HashDigest *old_guids = nullptr;
-    const Frozen::BuiltNode *old_state = nullptr;
-    uint32_t previously_built_nodes_count = 0;
+    HashTableInit(&self->m_SharedStrings, &driver->m_Heap);
 
-    if (const Frozen::AllBuiltNodes *all_built_nodes = self->m_AllBuiltNodes)
-    {
-        old_guids = all_built_nodes->m_NodeGuids;
-        old_state = all_built_nodes->m_BuiltNodes;
-        previously_built_nodes_count = all_built_nodes->m_NodeCount;
-    }
+    self->m_NodeCount = 0;
+}
 
-    int emitted_built_nodes_count = 0;
-    uint32_t this_dag_hashed_identifier = self->m_DagData->m_HashedIdentifier;
+static void BuiltNodesWriterDestroy(BuiltNodesWriter *self)
+{
+    HashTableDestroy(&self->m_SharedStrings);
+    BinaryWriterDestroy(&self->m_Writer);
+}
 
-    // Collapse runtime state to persistent state
-    auto BuiltNodeResultFor = [](const RuntimeNode* runtime_node) -> Frozen::BuiltNodeResult::Enum {
-        switch (runtime_node->m_BuildResult)
-        {
-            case NodeBuildResult::kUpToDate:
-            case NodeBuildResult::kRanSuccesfully:
-            case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
-            case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
-                return RuntimeNodeGetInputSignatureMightBeIncorrect(runtime_node)
-                    ? Frozen::BuiltNodeResult::kRanSuccessfullyButInputSignatureMightBeIncorrect
-                    : Frozen::BuiltNodeResult::kRanSuccessfullyWithGuaranteedCorrectInputSignature;
-            case NodeBuildResult::kDidNotRun:
-            case NodeBuildResult::kRanFailed:
-                return Frozen::BuiltNodeResult::kRanFailed;
-        }
-        Croak("MSVC cannot see the switch statement above can never be left");
-    };
+// Complete main data structure.
+static void BuiltNodesWriterFinish(BuiltNodesWriter *self, uint64_t generation)
+{
+    BinarySegment *main_seg = self->m_Segments.main;
+    BinarySegmentWriteUint32(main_seg, Frozen::AllBuiltNodes::MagicNumber);
+    BinarySegmentWriteInt32(main_seg, self->m_NodeCount);
+    BinarySegmentWriteUint64(main_seg, generation);
+    BinarySegmentWritePointer(main_seg, self->m_GuidPtr);
+    BinarySegmentWritePointer(main_seg, self->m_BuiltNodesPtr);
+    BinarySegmentWriteUint32(main_seg, Frozen::AllBuiltNodes::MagicNumber);
+}
 
-    auto EmitBuiltNodeFromRuntimeNode = [=, &emitted_built_nodes_count, &shared_strings](const RuntimeNode* runtime_node, const HashDigest *guid) -> void {
-        emitted_built_nodes_count++;
-        MemAllocLinear *scratch = &self->m_Allocator;
+// Collapse runtime state to persistent state
+static Frozen::BuiltNodeResult::Enum BuiltNodeResultFor(const RuntimeNode *runtime_node)
+{
+    switch (runtime_node->m_BuildResult)
+    {
+        case NodeBuildResult::kUpToDate:
+        case NodeBuildResult::kRanSuccesfully:
+        case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
+        case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
+            return RuntimeNodeGetInputSignatureMightBeIncorrect(runtime_node)
+                ? Frozen::BuiltNodeResult::kRanSuccessfullyButInputSignatureMightBeIncorrect
+                : Frozen::BuiltNodeResult::kRanSuccessfullyWithGuaranteedCorrectInputSignature;
+        case NodeBuildResult::kDidNotRun:
+        case NodeBuildResult::kRanFailed:
+            return Frozen::BuiltNodeResult::kRanFailed;
+    }
+    Croak("MSVC cannot see the switch statement above can never be left");
+}
 
-        const Frozen::DagNode* dag_node = runtime_node->m_DagNode;
+static void EmitBuiltNodeFromRuntimeNode(BuiltNodesWriter *writer, const RuntimeNode *runtime_node, const HashDigest *guid)
+{
+    Driver *self = writer->m_Driver;
+    const StateSavingSegments &segments = writer->m_Segments;
+    BinarySegment *built_nodes_seg = segments.built_nodes;
+    BinarySegment *array_seg = segments.array;
+    BinarySegment *string_seg = segments.string;
+    MemAllocLinear *scratch = writer->m_Scratch;
+    const uint32_t this_dag_hashed_identifier = self->m_DagData->m_HashedIdentifier;
+
+    writer->m_NodeCount++;
+
+    const Frozen::DagNode *dag_node = runtime_node->m_DagNode;
+
+    HashDigest leafInputSignatureDigest = {};
+    if (runtime_node->m_CurrentLeafInputSignature)
+        leafInputSignatureDigest = runtime_node->m_CurrentLeafInputSignature->digest;
+
+    // A node that didn't run an action this time, like a cache hit, keeps the measurements of the last time it did.
+    uint32_t execution_time_ms = runtime_node->m_ExecutionTimeMs;
+    uint32_t peak_memory_mb = runtime_node->m_PeakMemoryMB;
+    if (execution_time_ms == 0 && runtime_node->m_BuiltNode != nullptr)
+    {
+        execution_time_ms = runtime_node->m_BuiltNode->m_ExecutionTimeMs;
+        peak_memory_mb = runtime_node->m_BuiltNode->m_PeakMemoryMB;
+    }
 
-        HashDigest leafInputSignatureDigest = {};
-        if (runtime_node->m_CurrentLeafInputSignature)
-            leafInputSignatureDigest = runtime_node->m_CurrentLeafInputSignature->digest;
+    save_node_sharedcode(BuiltNodeResultFor(runtime_node), execution_time_ms, peak_memory_mb, &runtime_node->m_CurrentInputSignature, &leafInputSignatureDigest, runtime_node->m_DagNode, guid, segments, runtime_node->m_DynamicallyDiscoveredOutputFiles, self->m_DagData->m_EmitDataForBeeWhy);
 
-        save_node_sharedcode(BuiltNodeResultFor(runtime_node), &runtime_node->m_CurrentInputSignature, &leafInputSignatureDigest, runtime_node->m_DagNode, guid, segments, runtime_node->m_DynamicallyDiscoveredOutputFiles, self->m_DagData->m_EmitDataForBeeWhy);
+    int32_t file_count = self->m_DagData->m_EmitDataForBeeWhy ? dag_node->m_InputFiles.GetCount() : 0;
+    BinarySegmentWriteInt32(built_nodes_seg, file_count);
+    BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
+    for (int32_t i = 0; i < file_count; ++i)
+    {
+        uint64_t timestamp = 0;
+        uint32_t filenameHash = dag_node->m_InputFiles[i].m_FilenameHash;
+        const FrozenString &filename = dag_node->m_InputFiles[i].m_Filename;
+        FileInfo fileInfo = StatCacheStat(&self->m_StatCache, filename, filenameHash);
+        if (fileInfo.Exists())
+            timestamp = fileInfo.m_Timestamp;
+
+        BinarySegmentWriteUint64(array_seg, timestamp);
+        BinarySegmentWriteUint32(array_seg, filenameHash);
+        WriteCommonStringPtr(array_seg, string_seg, filename, &writer->m_SharedStrings, scratch);
+    }
 
-        int32_t file_count = self->m_DagData->m_EmitDataForBeeWhy ? dag_node->m_InputFiles.GetCount() : 0;
-        BinarySegmentWriteInt32(built_nodes_seg, file_count);
+    if (dag_node->m_ScannerIndex != -1)
+    {
+        BinarySegmentWriteInt32(built_nodes_seg, runtime_node->m_ImplicitInputs.m_RecordCount);
         BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
-        for (int32_t i = 0; i < file_count; ++i)
-        {
+
+        HashSetWalk(&runtime_node->m_ImplicitInputs, [=](uint32_t index, uint32_t hash, const char *filename) {
             uint64_t timestamp = 0;
-            uint32_t filenameHash = dag_node->m_InputFiles[i].m_FilenameHash;
-            const FrozenString& filename = dag_node->m_InputFiles[i].m_Filename;
-            FileInfo fileInfo = StatCacheStat(&self->m_StatCache, filename, filenameHash);
+            FileInfo fileInfo = StatCacheStat(&self->m_StatCache, filename, hash);
             if (fileInfo.Exists())
                 timestamp = fileInfo.m_Timestamp;
 
             BinarySegmentWriteUint64(array_seg, timestamp);
-            BinarySegmentWriteUint32(array_seg, filenameHash);
-            WriteCommonStringPtr(array_seg, string_seg, filename, &shared_strings, scratch);
-        }
+            BinarySegmentWriteUint32(array_seg, hash);
+            WriteCommonStringPtr(array_seg, string_seg, filename, &writer->m_SharedStrings, scratch);
+        });
+    }
+    else
+    {
+        BinarySegmentWriteInt32(built_nodes_seg, 0);
+        BinarySegmentWriteNullPointer(built_nodes_seg);
+    }
+
+    const Frozen::BuiltNode *built_node = runtime_node->m_BuiltNode;
+    //we cast the empty_frozen_array below here to a FrozenArray<uint32_t> that is empty, so the code below gets a lot simpler.
+    const FrozenArray<uint32_t> &previous_dags = (built_node == nullptr) ? FrozenArray<uint32_t>::empty() : built_node->m_DagsWeHaveSeenThisNodeInPreviously;
+
+    bool haveToAddOurselves = std::find(previous_dags.begin(), previous_dags.end(), this_dag_hashed_identifier) == previous_dags.end();
+
+    BinarySegmentWriteUint32(built_nodes_seg, previous_dags.GetCount() + (haveToAddOurselves ? 1 : 0));
+    BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
+    for (auto &identifier : previous_dags)
+        BinarySegmentWriteUint32(array_seg, identifier);
+
+    if (haveToAddOurselves)
+        BinarySegmentWriteUint32(array_seg, this_dag_hashed_identifier);
+}
+
+static void EmitBuiltNodeFromPreviouslyBuiltNode(BuiltNodesWriter *writer, const Frozen::BuiltNode *built_node, const HashDigest *guid, const HashDigest *leafInputSignature = nullptr)
+{
+    Driver *self = writer->m_Driver;
+    const StateSavingSegments &segments = writer->m_Segments;
+    BinarySegment *built_nodes_seg = segments.built_nodes;
+    BinarySegment *array_seg = segments.array;
+    BinarySegment *string_seg = segments.string;
+
+    if (leafInputSignature == nullptr)
+        leafInputSignature = &built_node->m_LeafInputSignature;
+    save_node_sharedcode(built_node->m_Result, built_node->m_ExecutionTimeMs, built_node->m_PeakMemoryMB, &built_node->m_InputSignature, leafInputSignature, built_node, guid, segments, nullptr, self->m_DagData->m_EmitDataForBeeWhy);
+    writer->m_NodeCount++;
+
+    int32_t file_count = self->m_DagData->m_EmitDataForBeeWhy ? built_node->m_InputFiles.GetCount() : 0;
+    BinarySegmentWriteInt32(built_nodes_seg, file_count);
+    BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
+    for (int32_t i = 0; i < file_count; ++i)
+    {
+        BinarySegmentWriteUint64(array_seg, built_node->m_InputFiles[i].m_Timestamp);
+        BinarySegmentWriteUint32(array_seg, built_node->m_InputFiles[i].m_FilenameHash);
+        WriteCommonStringPtr(array_seg, string_seg, built_node->m_InputFiles[i].m_Filename, &writer->m_SharedStrings, writer->m_Scratch);
+    }
+
+    file_count = built_node->m_ImplicitInputFiles.GetCount();
+    BinarySegmentWriteInt32(built_nodes_seg, file_count);
+    BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
+    for (int32_t i = 0; i < file_count; ++i)
+    {
+        BinarySegmentWriteUint64(array_seg, built_node->m_ImplicitInputFiles[i].m_Timestamp);
+        BinarySegmentWriteUint32(array_seg, built_node->m_ImplicitInputFiles[i].m_FilenameHash);
+        WriteCommonStringPtr(array_seg, string_seg, built_node->m_ImplicitInputFiles[i].m_Filename, &writer->m_SharedStrings, writer->m_Scratch);
+    }
+
+    int32_t dag_count = built_node->m_DagsWeHaveSeenThisNodeInPreviously.GetCount();
+    BinarySegmentWriteInt32(built_nodes_seg, dag_count);
+    BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
+    BinarySegmentWrite(array_seg, built_node->m_DagsWeHaveSeenThisNodeInPreviously.GetArray(), dag_count * sizeof(uint32_t));
+}
+
+static void EmitBuiltNodeFromBothRuntimeNodeAndPreviouslyBuiltNode(BuiltNodesWriter *writer, const RuntimeNode *runtime_node, const Frozen::BuiltNode *built_node, const HashDigest *guid)
+{
+    switch (runtime_node->m_BuildResult)
+    {
+        case NodeBuildResult::kUpToDate:
+        case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
+            break;
+        case NodeBuildResult::kRanFailed:
+        case NodeBuildResult::kRanSuccesfully:
+        case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
+            //ok so the runtime node actually ran. In this case the previously built node is useless, and we should emit completely from the runtime node.
+            return EmitBuiltNodeFromRuntimeNode(writer, runtime_node, guid);
+        default:
+            Croak("Unexpected nodebuilt result %d", runtime_node->m_BuildResult);
+    }
 
-        if (dag_node->m_ScannerIndex != -1)
+    //ok, so the runtime node did not run, but was up to date. This situation is why this code path exists, because in this situation
+    //the data we want to write out needs to come partially from the previously built node: the m_OutputFiles, since they contain output
+    //files found in the node's targetdirectories after the node has succesfully ran in the past.
+    //But some other data needs to come from the runtime node: the leaf input signature. It's possible, and likely, for the leaf input signature
+    //of a node to change, but its actual direct-input-signature to not change. If we did not take special care in this scenario, the leaf input signature
+    //of the node right now, will always be different from the leafinputsignature stored in the buildstate, which will cause never ending cache-queries (and misses)
+    //to occur. To solve that we need to write the new leafinput signature into the buildstate.
+
+    EmitBuiltNodeFromPreviouslyBuiltNode(writer, built_node, guid, &runtime_node->m_CurrentLeafInputSignature->digest);
+}
+
+static bool IsRuntimeNodeValidForWritingToBuiltNodes(const RuntimeNode *runtime_node)
+{
+    switch (runtime_node->m_BuildResult)
+    {
+        case NodeBuildResult::kDidNotRun:
+            return false;
+        case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
+        case NodeBuildResult::kUpToDate:
+        case NodeBuildResult::kRanSuccesfully:
+        case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
+        case NodeBuildResult::kRanFailed:
+            return true;
+    }
+    Croak("Unexpected NodeBuildResult %d", runtime_node->m_BuildResult);
+    return true;
+}
+
+static bool IsPreviouslyBuiltNodeValidForWritingToBuiltNodes(Driver *self, const Frozen::BuiltNode *built_node, const HashDigest *guid)
+{
+    // Make sure this node is still relevant before saving.
+    bool node_is_in_dag = BinarySearch(self->m_DagData->m_NodeGuids.Get(), self->m_DagData->m_NodeCount, *guid) != nullptr;
+
+    if (node_is_in_dag)
+        return true;
+
+    if (!NodeWasUsedByThisDagPreviously(built_node, self->m_DagData->m_HashedIdentifier))
+        return true;
+
+    for (auto &outputfile : built_node->m_OutputFiles)
+    {
+        // We want to make sure we keep all nodes that have at some point written files to disk which are still present
+        if (StatCacheStat(&self->m_StatCache, outputfile.m_Filename.Get(), outputfile.m_FilenameHash).Exists())
+            return true;
+    }
+    return false;
+}
+
+// True if what the next build needs to know about this node differs from the previous state.
+static bool RuntimeNodeStateChanged(const RuntimeNode *runtime_node)
+{
+    switch (runtime_node->m_BuildResult)
+    {
+        case NodeBuildResult::kDidNotRun:
+            return false;
+        case NodeBuildResult::kRanSuccesfully:
+        case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
+        case NodeBuildResult::kRanFailed:
+            return true;
+        case NodeBuildResult::kUpToDate:
+        case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
+            break;
+    }
+
+    const Frozen::BuiltNode *built_node = runtime_node->m_BuiltNode;
+    if (built_node == nullptr)
+        return true;
+
+    // See EmitBuiltNodeFromBothRuntimeNodeAndPreviouslyBuiltNode() for why an up to date node is saved again.
+    return runtime_node->m_CurrentLeafInputSignature != nullptr && runtime_node->m_CurrentLeafInputSignature->digest != built_node->m_LeafInputSignature;
+}
+
+struct BuiltNodesJournalEntry
+{
+    const HashDigest *m_Guid;
+    const Frozen::BuiltNode *m_BuiltNode;
+};
+
+void BuiltNodesJournalLoad(BuiltNodesJournal *journal, const Frozen::AllBuiltNodes *state, const char *journal_fn, MemAllocHeap *heap)
+{
+    MmapFileInit(&journal->m_File);
+    journal->m_ValidSize = 0;
+    journal->m_RecordCount = 0;
+    journal->m_Damaged = false;
+    journal->m_Compaction = nullptr;
+
+    Buffer<BuiltNodesJournalEntry> entries;
+    BufferInit(&entries);
+
+    if (state)
+        MmapFileMap(&journal->m_File, journal_fn);
+
+    if (MmapFileValid(&journal->m_File))
+    {
+        const char *data = (const char *)journal->m_File.m_Address;
+        const size_t size = journal->m_File.m_Size;
+
+        Frozen::AllBuiltNodesJournalHeader header;
+        if (size >= sizeof header)
+            memcpy(&header, data, sizeof header);
+
+        if (size < sizeof header || header.m_MagicNumber != Frozen::AllBuiltNodesJournalHeader::MagicNumber || header.m_StateGeneration != state->m_Generation)
         {
-            BinarySegmentWriteInt32(built_nodes_seg, runtime_node->m_ImplicitInputs.m_RecordCount);
-            BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
-
-            HashSetWalk(&runtime_node->m_ImplicitInputs, [=, &shared_strings](uint32_t index, uint32_t hash, const char *filename) {
-                uint64_t timestamp = 0;
-                FileInfo fileInfo = StatCacheStat(&self->m_StatCache, filename, hash);
-                if (fileInfo.Exists())
-                    timestamp = fileInfo.m_Timestamp;
-
-                BinarySegmentWriteUint64(array_seg, timestamp);
-                BinarySegmentWriteUint32(array_seg, hash);
-                WriteCommonStringPtr(array_seg, string_seg, filename, &shared_strings, scratch);
-            });
+            // Left over from an older state file. Everything in it was saved there, or is lost.
+            Log(kDebug, "%s: not written against the current state file, ignoring it", journal_fn);
+            MmapFileUnmap(&journal->m_File);
         }
         else
         {
-            BinarySegmentWriteInt32(built_nodes_seg, 0);
-            BinarySegmentWriteNullPointer(built_nodes_seg);
-        }
+            size_t offset = sizeof header;
+            int batch_count = 0;
 
-        const Frozen::BuiltNode* built_node = runtime_node->m_BuiltNode;
-        //we cast the empty_frozen_array below here to a FrozenArray<uint32_t> that is empty, so the code below gets a lot simpler.
-        const FrozenArray<uint32_t> &previous_dags = (built_node == nullptr) ? FrozenArray<uint32_t>::empty() : built_node->m_DagsWeHaveSeenThisNodeInPreviously;
+            while (size - offset >= sizeof(Frozen::AllBuiltNodesJournalBatch))
+            {
+                Frozen::AllBuiltNodesJournalBatch batch;
+                memcpy(&batch, data + offset, sizeof batch);
+
+                if (batch.m_Size > size - offset - sizeof batch || batch.m_Size < sizeof(Frozen::AllBuiltNodes))
+                    break;
+
+                const Frozen::AllBuiltNodes *image = (const Frozen::AllBuiltNodes *)(data + offset + sizeof batch);
+                if (image->m_MagicNumber != Frozen::AllBuiltNodes::MagicNumber || image->m_MagicNumberEnd != Frozen::AllBuiltNodes::MagicNumber)
+                    break;
+
+                const HashDigest *guids = image->m_NodeGuids;
+                const Frozen::BuiltNode *built_nodes = image->m_BuiltNodes;
+                for (int32_t i = 0, count = image->m_NodeCount; i < count; ++i)
+                {
+                    BuiltNodesJournalEntry entry = {guids + i, built_nodes + i};
+                    BufferAppendOne(&entries, heap, entry);
+                }
+
+                offset += sizeof batch + batch.m_Size;
+                ++batch_count;
+            }
 
-        bool haveToAddOurselves = std::find(previous_dags.begin(), previous_dags.end(), this_dag_hashed_identifier) == previous_dags.end();
+            journal->m_ValidSize = offset;
+            journal->m_RecordCount = int32_t(entries.m_Size);
+            journal->m_Damaged = offset != size;
 
-        BinarySegmentWriteUint32(built_nodes_seg, previous_dags.GetCount() + (haveToAddOurselves ? 1 : 0));
-        BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
-        for (auto &identifier : previous_dags)
-            BinarySegmentWriteUint32(array_seg, identifier);
+            if (journal->m_Damaged)
+                Log(kWarning, "%s is damaged after %d builds, the state file will be rewritten", journal_fn, batch_count);
 
-        if (haveToAddOurselves)
-            BinarySegmentWriteUint32(array_seg, this_dag_hashed_identifier);
-    };
+            Log(kDebug, "%s: %d node records from %d builds", journal_fn, journal->m_RecordCount, batch_count);
+        }
+    }
 
-    auto EmitBuiltNodeFromPreviouslyBuiltNode = [=, &emitted_built_nodes_count, &shared_strings](const Frozen::BuiltNode *built_node, const HashDigest *guid, const HashDigest* leafInputSignature = nullptr) -> void {
+    // Later builds win, so keep the last record for every guid.
+    std::stable_sort(entries.begin(), entries.end(), [](const BuiltNodesJournalEntry &l, const BuiltNodesJournalEntry &r) {
+        return *l.m_Guid < *r.m_Guid;
+    });
 
-        if (leafInputSignature == nullptr)
-            leafInputSignature = &built_node->m_LeafInputSignature;
-        save_node_sharedcode(built_node->m_Result, &built_node->m_InputSignature, leafInputSignature, built_node, guid, segments, nullptr, self->m_DagData->m_EmitDataForBeeWhy);
-        emitted_built_nodes_count++;
+    size_t unique_count = 0;
+    for (size_t i = 0; i < entries.m_Size; ++i)
+    {
+        if (unique_count > 0 && *entries[unique_count - 1].m_Guid == *entries[i].m_Guid)
+            entries[unique_count - 1] = entries[i];
+        else
+            entries[unique_count++] = entries[i];
+    }
 
-        int32_t file_count = self->m_DagData->m_EmitDataForBeeWhy ? built_node->m_InputFiles.GetCount() : 0;
-        BinarySegmentWriteInt32(built_nodes_seg, file_count);
-        BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
-        for (int32_t i = 0; i < file_count; ++i)
+    // Merge with the state file, which is sorted by guid as well.
+    const int32_t state_count = state ? state->m_NodeCount : 0;
+    const HashDigest *state_guids = state ? state->m_NodeGuids.Get() : nullptr;
+    const Frozen::BuiltNode *state_nodes = state ? state->m_BuiltNodes.Get() : nullptr;
+
+    journal->m_NodeGuids = HeapAllocateArray<HashDigest>(heap, state_count + unique_count);
+    journal->m_BuiltNodes = HeapAllocateArray<const Frozen::BuiltNode *>(heap, state_count + unique_count);
+
+    int32_t out = 0;
+    int32_t si = 0;
+    size_t ji = 0;
+    while (si < state_count || ji < unique_count)
+    {
+        int compare;
+        if (si == state_count)
+            compare = 1;
+        else if (ji == unique_count)
+            compare = -1;
+        else
+            compare = CompareHashDigests(state_guids[si], *entries[ji].m_Guid);
+
+        if (compare < 0)
         {
-            BinarySegmentWriteUint64(array_seg, built_node->m_InputFiles[i].m_Timestamp);
-            BinarySegmentWriteUint32(array_seg, built_node->m_InputFiles[i].m_FilenameHash);
-            WriteCommonStringPtr(array_seg, string_seg, built_node->m_InputFiles[i].m_Filename, &shared_strings, &self->m_Allocator);
+            journal->m_NodeGuids[out] = state_guids[si];
+            journal->m_BuiltNodes[out] = state_nodes + si;
+            ++si;
         }
-
-        file_count = built_node->m_ImplicitInputFiles.GetCount();
-        BinarySegmentWriteInt32(built_nodes_seg, file_count);
-        BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
-        for (int32_t i = 0; i < file_count; ++i)
+        else
         {
-            BinarySegmentWriteUint64(array_seg, built_node->m_ImplicitInputFiles[i].m_Timestamp);
-            BinarySegmentWriteUint32(array_seg, built_node->m_ImplicitInputFiles[i].m_FilenameHash);
-            WriteCommonStringPtr(array_seg, string_seg, built_node->m_ImplicitInputFiles[i].m_Filename, &shared_strings, &self->m_Allocator);
+            journal->m_NodeGuids[out] = *entries[ji].m_Guid;
+            journal->m_BuiltNodes[out] = entries[ji].m_BuiltNode;
+            ++ji;
+            if (compare == 0)
+                ++si;
         }
+        ++out;
+    }
 
-        int32_t dag_count = built_node->m_DagsWeHaveSeenThisNodeInPreviously.GetCount();
-        BinarySegmentWriteInt32(built_nodes_seg, dag_count);
-        BinarySegmentWritePointer(built_nodes_seg, BinarySegmentPosition(array_seg));
-        BinarySegmentWrite(array_seg, built_node->m_DagsWeHaveSeenThisNodeInPreviously.GetArray(), dag_count * sizeof(uint32_t));
-    };
+    journal->m_NodeCount = out;
+
+    BufferDestroy(&entries, heap);
+}
+
+void BuiltNodesJournalDestroy(BuiltNodesJournal *journal, MemAllocHeap *heap)
+{
+    HeapFree(heap, journal->m_NodeGuids);
+    HeapFree(heap, journal->m_BuiltNodes);
+    journal->m_NodeGuids = nullptr;
+    journal->m_BuiltNodes = nullptr;
+    journal->m_NodeCount = 0;
+
+    MmapFileDestroy(&journal->m_File);
+}
+
+void LoadBuiltNodesJournal(Driver *self)
+{
+    ProfilerScope prof_scope("Tundra LoadBuiltNodesJournal", 0);
 
-    auto EmitBuiltNodeFromBothRuntimeNodeAndPreviouslyBuiltNode = [=](const RuntimeNode* runtime_node, const Frozen::BuiltNode* built_node, const HashDigest* guid)
+    char journal_fn[kMaxPathLength];
+    GetJournalFileName(self, journal_fn, "");
+
+    BuiltNodesJournalLoad(&self->m_StateJournal, self->m_AllBuiltNodes, journal_fn, &self->m_Heap);
+}
+
+struct BuiltNodesCompaction
+{
+    Driver *m_Driver;
+    ThreadId m_Thread;
+    uint64_t m_Generation;
+    bool m_Success;
+};
+
+// Writes the previous build state, journal applied, to the temporary state file.
+static ThreadRoutineReturnType TUNDRA_STDCALL BuiltNodesCompactionThread(void *param)
+{
+    BuiltNodesCompaction *compaction = (BuiltNodesCompaction *)param;
+    Driver *self = compaction->m_Driver;
+    const BuiltNodesJournal *journal = &self->m_StateJournal;
+
+    MemAllocLinear scratch;
+    LinearAllocInit(&scratch, &self->m_Heap, MB(1), "state compaction");
+
+    BuiltNodesWriter writer;
+    BuiltNodesWriterInit(&writer, self, &scratch);
+
+    for (int32_t i = 0, count = journal->m_NodeCount; i < count; ++i)
     {
-        switch (runtime_node->m_BuildResult)
-        {
-            case NodeBuildResult::kUpToDate:
-            case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
-                break;
-            case NodeBuildResult::kRanFailed:
-            case NodeBuildResult::kRanSuccesfully:
-            case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
-                //ok so the runtime node actually ran. In this case the previously built node is useless, and we should emit completely from the runtime node.
-                return EmitBuiltNodeFromRuntimeNode(runtime_node, guid);
-            default:
-                Croak("Unexpected nodebuilt result %d",runtime_node->m_BuildResult);
-        }
+        if (IsPreviouslyBuiltNodeValidForWritingToBuiltNodes(self, journal->m_BuiltNodes[i], &journal->m_NodeGuids[i]))
+            EmitBuiltNodeFromPreviouslyBuiltNode(&writer, journal->m_BuiltNodes[i], &journal->m_NodeGuids[i]);
+    }
 
-        //ok, so the runtime node did not run, but was up to date. This situation is why this code path exists, because in this situation
-        //the data we want to write out needs to come partially from the previously built node: the m_OutputFiles, since they contain output
-        //files found in the node's targetdirectories after the node has succesfully ran in the past.
-        //But some other data needs to come from the runtime node: the leaf input signature. It's possible, and likely, for the leaf input signature
-        //of a node to change, but its actual direct-input-signature to not change. If we did not take special care in this scenario, the leaf input signature
-        //of the node right now, will always be different from the leafinputsignature stored in the buildstate, which will cause never ending cache-queries (and misses)
-        //to occur. To solve that we need to write the new leafinput signature into the buildstate.
+    BuiltNodesWriterFinish(&writer, compaction->m_Generation);
 
-        EmitBuiltNodeFromPreviouslyBuiltNode(built_node, guid, &runtime_node->m_CurrentLeafInputSignature->digest);
-    };
+    // BinaryWriterFlush logs its own errors.
+    compaction->m_Success = BinaryWriterFlush(&writer.m_Writer, self->m_DagData->m_StateFileNameTmp);
 
-    auto RuntimeNodeGuidForRuntimeNodeIndex = [=](size_t index) -> const HashDigest * {
-        int dag_index = int(runtime_nodes[index].m_DagNode - dag_nodes);
-        return dag_node_guids + dag_index;
-    };
+    BuiltNodesWriterDestroy(&writer);
+    LinearAllocDestroy(&scratch);
 
-    auto BuiltNodeGuidForBuiltNodeIndex = [=](size_t index) -> const HashDigest * {
-        return old_guids + index;
-    };
+    return 0;
+}
 
-    auto IsRuntimeNodeValidForWritingToBuiltNodes = [=](const RuntimeNode* runtime_node) -> bool {
-        switch(runtime_node->m_BuildResult)
-        {
-            case NodeBuildResult::kDidNotRun:
-                return false;
-            case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
-            case NodeBuildResult::kUpToDate:
-            case NodeBuildResult::kRanSuccesfully:
-            case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
-            case NodeBuildResult::kRanFailed:
-                return true;
-        }
-        Croak("Unexpected NodeBuildResult %d",runtime_node->m_BuildResult);
-        return true;
-    };
+void StartBuiltNodesCompaction(Driver *self)
+{
+    BuiltNodesJournal *journal = &self->m_StateJournal;
+    const Frozen::AllBuiltNodes *state = self->m_AllBuiltNodes;
 
-    auto IsPreviouslyBuiltNodeValidForWritingToBuiltNodes = [=](const Frozen::BuiltNode* built_node, const HashDigest* guid) -> bool {
-        // Make sure this node is still relevant before saving.
-        bool node_is_in_dag = BinarySearch(dag_node_guids, dag_node_count, *guid) != nullptr;
+    // Never needed, see SaveAllBuiltNodes().
+    if (!state || journal->m_Compaction || self->m_DagData->m_EmitDataForBeeWhy)
+        return;
 
-        if (node_is_in_dag)
-            return true;
+    int32_t threshold = std::max(int32_t(kJournalCompactMinRecords), state->m_NodeCount / kJournalCompactRatio);
+    if (!journal->m_Damaged && journal->m_RecordCount < threshold)
+        return;
 
-        if (!NodeWasUsedByThisDagPreviously(built_node, this_dag_hashed_identifier))
-            return true;
+    Log(kDebug, "compacting state journal (%d records) in the background", journal->m_RecordCount);
 
-        for (auto& outputfile : built_node->m_OutputFiles)
-        {
-            // We want to make sure we keep all nodes that have at some point written files to disk which are still present
-            if (StatCacheStat(&self->m_StatCache, outputfile.m_Filename.Get(), outputfile.m_FilenameHash).Exists())
-                return true;
-        }
+    BuiltNodesCompaction *compaction = (BuiltNodesCompaction *)HeapAllocate(&self->m_Heap, sizeof(BuiltNodesCompaction));
+    compaction->m_Driver = self;
+    compaction->m_Generation = NewStateGeneration();
+    compaction->m_Success = false;
+    compaction->m_Thread = ThreadStart(BuiltNodesCompactionThread, compaction, "State compaction");
+
+    journal->m_Compaction = compaction;
+}
+
+// Wait for the background compaction, if there is one. Returns true if it
+// wrote a new temporary state file with the given generation.
+static bool FinishBuiltNodesCompaction(Driver *self, uint64_t *generation_out)
+{
+    BuiltNodesJournal *journal = &self->m_StateJournal;
+    BuiltNodesCompaction *compaction = journal->m_Compaction;
+
+    if (!compaction)
         return false;
+
+    ThreadJoin(compaction->m_Thread);
+    journal->m_Compaction = nullptr;
+
+    bool success = compaction->m_Success;
+    *generation_out = compaction->m_Generation;
+
+    HeapFree(&self->m_Heap, compaction);
+
+    if (!success)
+    {
+        Log(kWarning, "Failed to compact the state journal");
+        RemoveFileOrDir(self->m_DagData->m_StateFileNameTmp);
+    }
+
+    return success;
+}
+
+void DestroyBuiltNodesJournal(Driver *self)
+{
+    BuiltNodesJournal *journal = &self->m_StateJournal;
+
+    uint64_t generation;
+    if (FinishBuiltNodesCompaction(self, &generation))
+        RemoveFileOrDir(self->m_DagData->m_StateFileNameTmp);
+
+    BuiltNodesJournalDestroy(journal, &self->m_Heap);
+}
+
+// Rewrite the whole state file from this build and the previous state.
+static bool SaveAllBuiltNodesFull(Driver *self)
+{
+    BuiltNodesWriter writer;
+    BuiltNodesWriterInit(&writer, self, &self->m_Allocator);
+
+    const Frozen::DagNode *dag_nodes = self->m_DagData->m_DagNodes;
+    const HashDigest *dag_node_guids = self->m_DagData->m_NodeGuids;
+    RuntimeNode *runtime_nodes = self->m_RuntimeNodes.m_Storage;
+    const size_t runtime_nodes_count = self->m_RuntimeNodes.m_Size;
+
+    std::sort(runtime_nodes, runtime_nodes + runtime_nodes_count, [=](const RuntimeNode &l, const RuntimeNode &r) {
+        // We know guids are sorted, so all we need to do is compare pointers into that table.
+        return l.m_DagNode < r.m_DagNode;
+    });
+
+    const HashDigest *old_guids = self->m_StateJournal.m_NodeGuids;
+    const Frozen::BuiltNode **old_state = self->m_StateJournal.m_BuiltNodes;
+    const size_t previously_built_nodes_count = self->m_StateJournal.m_NodeCount;
+
+    auto RuntimeNodeGuidForRuntimeNodeIndex = [=](size_t index) -> const HashDigest * {
+        int dag_index = int(runtime_nodes[index].m_DagNode - dag_nodes);
+        return dag_node_guids + dag_index;
+    };
+
+    auto BuiltNodeGuidForBuiltNodeIndex = [=](size_t index) -> const HashDigest * {
+        return old_guids + index;
     };
 
     {
@@ -366,9 +713,9 @@ bool SaveAllBuiltNodes(Driver *self)
 
             const HashDigest * runtime_node_guid = RuntimeNodeGuidForRuntimeNodeIndex(runtime_nodes_iterator);
             const HashDigest * previously_built_guid = BuiltNodeGuidForBuiltNodeIndex(previously_built_nodes_iterator);
-            const Frozen::BuiltNode* previously_built_node = &old_state[previously_built_nodes_iterator];
+            const Frozen::BuiltNode* previously_built_node = old_state[previously_built_nodes_iterator];
 
-            if (!IsPreviouslyBuiltNodeValidForWritingToBuiltNodes(previously_built_node, previously_built_guid))
+            if (!IsPreviouslyBuiltNodeValidForWritingToBuiltNodes(self, previously_built_node, previously_built_guid))
             {
                 previously_built_nodes_iterator++;
                 continue;
@@ -382,20 +729,20 @@ bool SaveAllBuiltNodes(Driver *self)
             if (compare > 0)
             {
                 //for this one, we only have a previously built node. let's write it out.
-                EmitBuiltNodeFromPreviouslyBuiltNode(previously_built_node, previously_built_guid);
+                EmitBuiltNodeFromPreviouslyBuiltNode(&writer, previously_built_node, previously_built_guid);
 
                 previously_built_nodes_iterator++;
             }
             else if (compare < 0)
             {
                 //for this one, we only have a runtime node, let's write it out.
-                EmitBuiltNodeFromRuntimeNode(first_runtimenode_in_line, runtime_node_guid);
+                EmitBuiltNodeFromRuntimeNode(&writer, first_runtimenode_in_line, runtime_node_guid);
                 runtime_nodes_iterator++;
             }
             else
             {
                 //for this one, we have both a previously built node, and a runtime node. We have a special codepath for that
-                EmitBuiltNodeFromBothRuntimeNodeAndPreviouslyBuiltNode(first_runtimenode_in_line, previously_built_node, runtime_node_guid);
+                EmitBuiltNodeFromBothRuntimeNodeAndPreviouslyBuiltNode(&writer, first_runtimenode_in_line, previously_built_node, runtime_node_guid);
                 runtime_nodes_iterator++;
                 previously_built_nodes_iterator++;
             }
@@ -412,28 +759,24 @@ bool SaveAllBuiltNodes(Driver *self)
             }
 
             const HashDigest * runtime_node_guid = RuntimeNodeGuidForRuntimeNodeIndex(runtime_nodes_iterator);
-            EmitBuiltNodeFromRuntimeNode(first_runtimenode_in_line, runtime_node_guid);
+            EmitBuiltNodeFromRuntimeNode(&writer, first_runtimenode_in_line, runtime_node_guid);
         }
 
         for ( ; previously_built_nodes_iterator < previously_built_nodes_count; previously_built_nodes_iterator++)
         {
-            const Frozen::BuiltNode* previously_built_node = &old_state[previously_built_nodes_iterator];
+            const Frozen::BuiltNode* previously_built_node = old_state[previously_built_nodes_iterator];
             const HashDigest * previously_built_guid = BuiltNodeGuidForBuiltNodeIndex(previously_built_nodes_iterator);
 
-            if (IsPreviouslyBuiltNodeValidForWritingToBuiltNodes(previously_built_node, previously_built_guid))
-                EmitBuiltNodeFromPreviouslyBuiltNode(previously_built_node,previously_built_guid);
+            if (IsPreviouslyBuiltNodeValidForWritingToBuiltNodes(self, previously_built_node, previously_built_guid))
+                EmitBuiltNodeFromPreviouslyBuiltNode(&writer, previously_built_node,previously_built_guid);
         }
     }
 
-    // Complete main data structure.
-    BinarySegmentWriteUint32(main_seg, Frozen::AllBuiltNodes::MagicNumber);
-    BinarySegmentWriteInt32(main_seg, emitted_built_nodes_count);
-    BinarySegmentWritePointer(main_seg, guid_ptr);
-    BinarySegmentWritePointer(main_seg, built_nodes_ptr);
-    BinarySegmentWriteUint32(main_seg, Frozen::AllBuiltNodes::MagicNumber);
+    BuiltNodesWriterFinish(&writer, NewStateGeneration());
 
     // Unmap old state data.
     MmapFileUnmap(&self->m_StateFile);
+    MmapFileUnmap(&self->m_StateJournal.m_File);
     self->m_AllBuiltNodes = nullptr;
 
     bool success = true;
@@ -453,7 +796,7 @@ bool SaveAllBuiltNodes(Driver *self)
         success = false;
     }
 
-    if (!BinaryWriterFlush(&writer, self->m_DagData->m_StateFileNameTmp))
+    if (!BinaryWriterFlush(&writer.m_Writer, self->m_DagData->m_StateFileNameTmp))
     {
         // BinaryWriterFlush logs its own errors, don't bother doing so here.
         success = false;
@@ -469,15 +812,161 @@ bool SaveAllBuiltNodes(Driver *self)
                 self->m_DagData->m_StateFileNameTmp.Get(),
                 self->m_DagData->m_StateFileName.Get());
         }
+        else
+        {
+            // Written against the old state file, so it would be ignored anyway.
+            char journal_fn[kMaxPathLength];
+            GetJournalFileName(self, journal_fn, "");
+            RemoveFileOrDir(journal_fn);
+        }
     }
     else
     {
         RemoveFileOrDir(self->m_DagData->m_StateFileNameTmp);
     }
 
-    HashTableDestroy(&shared_strings);
+    BuiltNodesWriterDestroy(&writer);
+
+    return success;
+}
+
+// Write the nodes whose state changed in this build as a journal batch. If the
+// state file was just compacted, the batch goes into a new journal that replaces
+// the old one, otherwise it is appended.
+static bool SaveBuiltNodesJournal(Driver *self, bool compacted, uint64_t state_generation)
+{
+    MemAllocHeap *heap = &self->m_Heap;
+    BuiltNodesJournal *journal = &self->m_StateJournal;
+    const Frozen::DagNode *dag_nodes = self->m_DagData->m_DagNodes;
+    const HashDigest *dag_node_guids = self->m_DagData->m_NodeGuids;
+
+    Buffer<const RuntimeNode *> changed;
+    BufferInit(&changed);
+
+    for (const RuntimeNode &runtime_node : self->m_RuntimeNodes)
+    {
+        if (RuntimeNodeStateChanged(&runtime_node))
+            BufferAppendOne(&changed, heap, &runtime_node);
+    }
+
+    std::sort(changed.begin(), changed.end(), [](const RuntimeNode *l, const RuntimeNode *r) {
+        // We know guids are sorted, so all we need to do is compare pointers into that table.
+        return l->m_DagNode < r->m_DagNode;
+    });
+
+    BuiltNodesWriter writer;
+    BuiltNodesWriterInit(&writer, self, &self->m_Allocator);
+
+    for (const RuntimeNode *runtime_node : changed)
+    {
+        const HashDigest *guid = dag_node_guids + (runtime_node->m_DagNode - dag_nodes);
+        if (runtime_node->m_BuiltNode)
+            EmitBuiltNodeFromBothRuntimeNodeAndPreviouslyBuiltNode(&writer, runtime_node, runtime_node->m_BuiltNode, guid);
+        else
+            EmitBuiltNodeFromRuntimeNode(&writer, runtime_node, guid);
+    }
+
+    BufferDestroy(&changed, heap);
+
+    BuiltNodesWriterFinish(&writer, state_generation);
 
-    BinaryWriterDestroy(&writer);
+    Frozen::AllBuiltNodesJournalBatch batch;
+    batch.m_Size = BinaryWriterFinalize(&writer.m_Writer);
+    batch.m_Padding = 0;
+
+    // Everything needed from the previous state has been copied into the writer.
+    MmapFileUnmap(&self->m_StateFile);
+    MmapFileUnmap(&journal->m_File);
+    self->m_AllBuiltNodes = nullptr;
+
+    char journal_fn[kMaxPathLength];
+    GetJournalFileName(self, journal_fn, "");
+    char journal_tmp_fn[kMaxPathLength];
+    GetJournalFileName(self, journal_tmp_fn, ".tmp");
+
+    const bool fresh_journal = compacted || journal->m_ValidSize == 0;
+    const char *write_fn = compacted ? journal_tmp_fn : journal_fn;
+    bool success = true;
+
+    if (writer.m_NodeCount > 0 || compacted)
+    {
+        FILE *f = OpenFile(write_fn, fresh_journal ? "wb" : "r+b");
+
+        // Damaged journals are never appended to, so the part that was read is all there is.
+        if (f && !fresh_journal && 0 != fseek(f, long(journal->m_ValidSize), SEEK_SET))
+        {
+            fclose(f);
+            f = nullptr;
+        }
+
+        success = f != nullptr;
+
+        if (success && fresh_journal)
+        {
+            Frozen::AllBuiltNodesJournalHeader header;
+            header.m_MagicNumber = Frozen::AllBuiltNodesJournalHeader::MagicNumber;
+            header.m_Padding = 0;
+            header.m_StateGeneration = state_generation;
+            success = 1 == fwrite(&header, sizeof header, 1, f);
+        }
+
+        if (success && writer.m_NodeCount > 0)
+            success = 1 == fwrite(&batch, sizeof batch, 1, f) && BinaryWriterAppend(&writer.m_Writer, f);
+
+        if (f)
+            success = 0 == fclose(f) && success;
+
+        if (!success)
+            Log(kError, "Failed to write \"%s\"", write_fn);
+        else
+            Log(kDebug, "saved %d nodes to the state journal", writer.m_NodeCount);
+    }
+
+    BuiltNodesWriterDestroy(&writer);
+
+    if (compacted)
+    {
+        // The new journal goes in first; until the state file follows, it is simply ignored.
+        bool journal_replaced = false;
+        if (success)
+            success = journal_replaced = RenameFile(journal_tmp_fn, journal_fn);
+
+        if (success)
+            success = RenameFile(self->m_DagData->m_StateFileNameTmp, self->m_DagData->m_StateFileName);
+
+        if (!success)
+        {
+            Log(kError, "Failed to replace \"%s\" with its compacted version", self->m_DagData->m_StateFileName.Get());
+            // Don't leave a journal behind for a state file that never made it.
+            RemoveFileOrDir(journal_replaced ? journal_fn : journal_tmp_fn);
+            RemoveFileOrDir(self->m_DagData->m_StateFileNameTmp);
+        }
+    }
+    else
+    {
+        // The state file itself is unchanged, put it back where the next build looks for it.
+        success = RenameFile(self->m_DagData->m_StateFileNameMapped, self->m_DagData->m_StateFileName) && success;
+    }
 
     return success;
 }
+
+bool SaveAllBuiltNodes(Driver *self)
+{
+    TimingScope timing_scope(nullptr, &g_Stats.m_StateSaveTimeCycles);
+    ProfilerScope prof_scope("Tundra Write AllBuiltNodes", 0);
+
+    MemAllocLinearScope alloc_scope(&self->m_Allocator);
+
+    uint64_t compacted_generation;
+    if (FinishBuiltNodesCompaction(self, &compacted_generation))
+        return SaveBuiltNodesJournal(self, true, compacted_generation);
+
+    // Without a state file there is nothing to put a journal on top of, and a damaged journal
+    // can't be appended to. Bee reads the "why" data straight from the state file, and knows
+    // nothing of the journal.
+    if (!self->m_AllBuiltNodes || self->m_StateJournal.m_Damaged || self->m_DagData->m_EmitDataForBeeWhy)
+        return SaveAllBuiltNodesFull(self);
+
+    return SaveBuiltNodesJournal(self, false, self->m_AllBuiltNodes->m_Generation);
+}
@@ -2,9 +2,11 @@
 
 #include "Common.hpp"
 #include "BinaryData.hpp"
+#include "MemoryMappedFile.hpp"
 
 struct StatCache;
 struct Driver;
+struct MemAllocHeap;
 
 namespace Frozen
 {
@@ -32,6 +34,10 @@ namespace BuiltNodeResult
 struct BuiltNode
 {
     BuiltNodeResult::Enum m_Result;
+    // How long the action took the last time it ran, 0 if that isn't known. Used to find the critical path of the next build.
+    uint32_t m_ExecutionTimeMs;
+    // Peak resident memory of the action the last time it ran, 0 if that isn't known.
+    uint32_t m_PeakMemoryMB;
     HashDigest m_InputSignature;
     HashDigest m_LeafInputSignature;
     FrozenArray<FrozenFileAndHash> m_OutputFiles;
@@ -44,19 +50,87 @@ struct BuiltNode
 
 struct AllBuiltNodes
 {
-    static const uint32_t MagicNumber = 0x53533dc3 ^ kTundraHashMagic;
+    static const uint32_t MagicNumber = 0x53533dc6 ^ kTundraHashMagic;
 
     uint32_t m_MagicNumber;
 
     int32_t m_NodeCount;
+
+    // A journal is only applied on top of the state file with the same generation.
+    uint64_t m_Generation;
+
     FrozenPtr<HashDigest> m_NodeGuids;
     FrozenPtr<BuiltNode> m_BuiltNodes;
 
     uint32_t m_MagicNumberEnd;
 };
+
+// The journal holds the nodes saved by builds since the state file was written.
+// The header is followed by one batch per build.
+struct AllBuiltNodesJournalHeader
+{
+    static const uint32_t MagicNumber = 0x4a0b1d01 ^ kTundraHashMagic;
+
+    uint32_t m_MagicNumber;
+    uint32_t m_Padding;
+    uint64_t m_StateGeneration;
+};
+
+// Followed by m_Size bytes holding a complete AllBuiltNodes image of the nodes
+// saved by one build. Images are a multiple of 16 bytes, so they stay aligned.
+struct AllBuiltNodesJournalBatch
+{
+    uint64_t m_Size;
+    uint64_t m_Padding;
+};
+
+static_assert(sizeof(AllBuiltNodesJournalHeader) == 16, "struct layout");
+static_assert(sizeof(AllBuiltNodesJournalBatch) == 16, "struct layout");
 }
+
+struct BuiltNodesCompaction;
+
+// Nodes saved since the state file was last rewritten, and the previous build
+// state with them applied.
+struct BuiltNodesJournal
+{
+    MemoryMappedFile m_File;
+
+    // Number of bytes at the start of the journal that parsed, 0 if there is none.
+    uint64_t m_ValidSize;
+    // Node records in the journal, counting nodes saved more than once.
+    int32_t m_RecordCount;
+    // The journal has a damaged tail and must not be appended to.
+    bool m_Damaged;
+
+    // State file and journal merged, sorted by guid.
+    int32_t m_NodeCount;
+    HashDigest *m_NodeGuids;
+    const Frozen::BuiltNode **m_BuiltNodes;
+
+    // Rewrite of the state file running in the background, if any.
+    BuiltNodesCompaction *m_Compaction;
+};
+
 struct ThreadState;
 
 bool OutputFilesMissingFor(const Frozen::BuiltNode* builtNode, StatCache *stat_cache, ThreadState* thread_state);
+
+// Map the journal at journal_fn and merge it with state, which may be null.
+void BuiltNodesJournalLoad(BuiltNodesJournal *journal, const Frozen::AllBuiltNodes *state, const char *journal_fn, MemAllocHeap *heap);
+void BuiltNodesJournalDestroy(BuiltNodesJournal *journal, MemAllocHeap *heap);
+
+// Map the journal that goes with the loaded state file and merge the two.
+void LoadBuiltNodesJournal(Driver *self);
+
+// Once the journal has grown large, start rewriting the state file with it
+// applied on a background thread. SaveAllBuiltNodes() picks up the result.
+void StartBuiltNodesCompaction(Driver *self);
+
+void DestroyBuiltNodesJournal(Driver *self);
+
+// Saves the nodes that changed in this build to the journal, or rewrites the
+// state file if there is no state to add to yet.
 bool SaveAllBuiltNodes(Driver *self);
+
 bool NodeWasUsedByThisDagPreviously(const Frozen::BuiltNode *previously_built_node, uint32_t current_dag_identifier);
@@ -48,6 +48,49 @@ inline void* AtomicCompareExchange(void **ptr, void* newPtr, void* comparePtr)
 #endif    
 }
 
+inline uint32_t AtomicDecrement(uint32_t *value)
+{
+    return InterlockedDecrement((long *)value);
+}
+
+inline int32_t AtomicAdd32(int32_t *ptr, int32_t value)
+{
+    return InterlockedExchangeAdd((long *)ptr, value) + value;
+}
+
+// Returns the previous value.
+inline uint16_t AtomicOr16(uint16_t *ptr, uint16_t bits)
+{
+    return (uint16_t)_InterlockedOr16((short *)ptr, (short)bits);
+}
+
+// Returns the previous value.
+inline uint16_t AtomicAnd16(uint16_t *ptr, uint16_t bits)
+{
+    return (uint16_t)_InterlockedAnd16((short *)ptr, (short)bits);
+}
+
+inline bool AtomicCompareExchange16(uint16_t *ptr, uint16_t newValue, uint16_t compareValue)
+{
+    return (uint16_t)_InterlockedCompareExchange16((short *)ptr, (short)newValue, (short)compareValue) == compareValue;
+}
+
+template <typename T>
+inline T AtomicLoad(const T *ptr)
+{
+    T value = *(const volatile T *)ptr;
+    MemoryBarrier();
+    return value;
+}
+
+template <typename T>
+inline void AtomicStore(T *ptr, T value)
+{
+    MemoryBarrier();
+    *(volatile T *)ptr = value;
+    MemoryBarrier();
+}
+
 #elif defined(__GNUC__)
 inline uint32_t AtomicIncrement(uint32_t *value)
 {
@@ -68,6 +111,45 @@ inline void* AtomicCompareExchange(void **ptr, void* newPtr, void* comparePtr)
 {
     return __sync_val_compare_and_swap(ptr, comparePtr, newPtr);
 }
+
+inline uint32_t AtomicDecrement(uint32_t *value)
+{
+    return __sync_sub_and_fetch(value, 1);
+}
+
+inline int32_t AtomicAdd32(int32_t *ptr, int32_t value)
+{
+    return __sync_add_and_fetch(ptr, value);
+}
+
+// Returns the previous value.
+inline uint16_t AtomicOr16(uint16_t *ptr, uint16_t bits)
+{
+    return __sync_fetch_and_or(ptr, bits);
+}
+
+// Returns the previous value.
+inline uint16_t AtomicAnd16(uint16_t *ptr, uint16_t bits)
+{
+    return __sync_fetch_and_and(ptr, bits);
+}
+
+inline bool AtomicCompareExchange16(uint16_t *ptr, uint16_t newValue, uint16_t compareValue)
+{
+    return __sync_bool_compare_and_swap(ptr, compareValue, newValue);
+}
+
+template <typename T>
+inline T AtomicLoad(const T *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+inline void AtomicStore(T *ptr, T value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST);
+}
 #endif // __GNUC__
 
 #endif
@@ -20,7 +20,7 @@ namespace BinLogFormat
 // matches the identifier we expect. if it doesn't, the file is older or newer than the code that's trying to read it.
 struct StartOfFileHeader
 {
-    static const int ExpectedBinaryFormatIdentifier = 0x02dd1ffe;
+    static const int ExpectedBinaryFormatIdentifier = 0x02dd1fff;
     int BinaryFormatIdentifier;
 };
 
@@ -128,6 +128,15 @@ struct NodeFinishedMessage
     int duration_in_ms;
     BinLogStringRef output;
     BinLogStringRef cmdline;
+
+    //what the process and the children it waited for used, 0 where the platform doesn't report it. blocks are I/O operations on windows.
+    int user_cpu_ms;
+    int system_cpu_ms;
+    int max_rss_kb;
+    int blocks_read;
+    int blocks_written;
+    int voluntary_context_switches;
+    int involuntary_context_switches;
 };
 
 //Gets sent as final message in the build with the final build result
@@ -110,6 +110,26 @@ BinaryLocator BinarySegmentPosition(BinarySegment *self)
     return result;
 }
 
+void BinarySegmentAppend(BinarySegment *dst, BinarySegment *src)
+{
+    size_t base = dst->m_Bytes.m_Size;
+
+    BufferAppend(&dst->m_Bytes, dst->m_Heap, src->m_Bytes.m_Storage, src->m_Bytes.m_Size);
+
+    for (const BinaryFixup &fixup : src->m_Fixups)
+    {
+        BinaryFixup *moved = BufferAlloc(&dst->m_Fixups, dst->m_Heap, 1);
+        moved->m_PointerOffset = base + fixup.m_PointerOffset;
+        moved->m_Target = fixup.m_Target;
+    }
+
+    // Give the memory back right away, src is typically one of many temporary segments.
+    BufferDestroy(&src->m_Bytes, src->m_Heap);
+    BufferDestroy(&src->m_Fixups, src->m_Heap);
+    BufferInit(&src->m_Bytes);
+    BufferInit(&src->m_Fixups);
+}
+
 void BinaryWriterInit(BinaryWriter *w, MemAllocHeap *heap)
 {
     w->m_Heap = heap;
@@ -128,7 +148,7 @@ void BinaryWriterDestroy(BinaryWriter *self)
     self->m_Heap = nullptr;
 }
 
-static void BinaryWriterFinalize(BinaryWriter *w)
+size_t BinaryWriterFinalize(BinaryWriter *w)
 {
     const size_t seg_count = w->m_Segments.m_Size;
     BinarySegment **segs = w->m_Segments.m_Storage;
@@ -152,6 +172,22 @@ static void BinaryWriterFinalize(BinaryWriter *w)
     {
         BinarySegmentFixupPointers(segs[i], segs);
     }
+
+    return offset;
+}
+
+bool BinaryWriterAppend(BinaryWriter *self, FILE *f)
+{
+    const size_t seg_count = self->m_Segments.m_Size;
+    BinarySegment **segs = self->m_Segments.m_Storage;
+
+    for (size_t i = 0; i < seg_count; ++i)
+    {
+        if (!BinarySegmentWrite(segs[i], f))
+            return false;
+    }
+
+    return true;
 }
 
 bool BinaryWriterFlush(BinaryWriter *self, const char *out_fn)
@@ -166,21 +202,9 @@ bool BinaryWriterFlush(BinaryWriter *self, const char *out_fn)
         return false;
     }
 
-    bool success = true;
-
-    const size_t seg_count = self->m_Segments.m_Size;
-    BinarySegment **segs = self->m_Segments.m_Storage;
-
-    // Align all segments to 16 bytes
-    for (size_t i = 0; success && i < seg_count; ++i)
-    {
-        success = BinarySegmentWrite(segs[i], f);
-        if (!success)
-        {
-            Log(kWarning, "BinarySegmentWrite failed when writing \"%s\"", out_fn);
-            break;
-        }
-    }
+    bool success = BinaryWriterAppend(self, f);
+    if (!success)
+        Log(kWarning, "BinarySegmentWrite failed when writing \"%s\"", out_fn);
 
     fclose(f);
     return success;
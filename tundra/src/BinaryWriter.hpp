@@ -3,6 +3,8 @@
 #include "Buffer.hpp"
 #include "Hash.hpp"
 
+#include <stdio.h>
+
 struct MemAllocHeap;
 struct BinarySegment;
 
@@ -75,9 +77,19 @@ inline void BinarySegmentWriteNullPointer(BinarySegment* seg)
 
 BinaryLocator BinarySegmentPosition(BinarySegment *seg);
 
+// Move everything written to src onto the end of dst, leaving src empty. Pointers
+// stored in src come along, but nothing may point into src itself.
+void BinarySegmentAppend(BinarySegment* dst, BinarySegment* src);
+
 void BinaryWriterInit(BinaryWriter* w, MemAllocHeap* heap);
 void BinaryWriterDestroy(BinaryWriter* w);
 
 BinarySegment* BinaryWriterAddSegment(BinaryWriter* w);
 
 bool BinaryWriterFlush(BinaryWriter* w, const char* out_fn);
+
+// Lay out all segments and resolve pointers, returning the total size in bytes.
+// Follow up with BinaryWriterAppend() to write the result into an open file.
+size_t BinaryWriterFinalize(BinaryWriter* w);
+
+bool BinaryWriterAppend(BinaryWriter* w, FILE* f);
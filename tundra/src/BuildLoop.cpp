@@ -27,6 +27,8 @@
 #include "Driver.hpp"
 #include "LeafInputSignature.hpp"
 #include "CacheClient.hpp"
+#include "CachePrefetch.hpp"
+#include "IoRing.hpp"
 #include "FileInfoHelper.hpp"
 #include "EventLog.hpp"
 #include "SignalHandler.hpp"
@@ -50,6 +52,11 @@ static void WakeWaiters(BuildQueue *queue, int count)
         CondSignal(&queue->m_WorkAvailable);
 }
 
+static bool UsesWorkStealingScheduler(const BuildQueue *queue)
+{
+    return 0 != (queue->m_Config.m_Flags & BuildQueueConfig::kFlagWorkStealingScheduler);
+}
+
 
 static void LogFirstTimeEnqueue(MemAllocLinear* scratch, RuntimeNode* enqueuedNode, RuntimeNode* enqueueingNode)
 {
@@ -196,23 +203,12 @@ static bool IsNodeCacheableByLeafInputsAndCachingEnabled(BuildQueue* queue, Runt
     return 0 != (node->m_DagNode->m_FlagsAndActionType & Frozen::DagNode::kFlagCacheableByLeafInputs);
 }
 
-static bool AllDependenciesAreFinished(BuildQueue *queue, RuntimeNode *runtime_node)
-{
-    for (int32_t dep_index : queue->m_Config.m_DagDerived->m_CombinedDependencies[runtime_node->m_DagNodeIndex])
-    {
-        RuntimeNode *runtime_node = GetRuntimeNodeForDagNodeIndex(queue, dep_index);
-        if (!runtime_node->m_Finished)
-            return false;
-    }
-    return true;
-}
-
 static bool AllDependenciesAreSuccesful(BuildQueue *queue, RuntimeNode *runtime_node)
 {
     for (int32_t dep_index : queue->m_Config.m_DagDerived->m_CombinedDependencies[runtime_node->m_DagNodeIndex])
     {
         RuntimeNode *runtime_node = GetRuntimeNodeForDagNodeIndex(queue, dep_index);
-        CHECK(runtime_node->m_Finished);
+        CHECK(RuntimeNodeIsFinished(runtime_node));
 
         if (runtime_node->m_BuildResult != NodeBuildResult::kRanSuccesfully && runtime_node->m_BuildResult != NodeBuildResult::kUpToDate)
             return false;
@@ -240,6 +236,17 @@ static void EnqueueNodesNonGeneratedInputFilesForEarlyStatting(BuildQueue* queue
     }
 }
 
+static void EnqueueNodesPreviousImplicitInputFilesForEarlyStatting(BuildQueue* queue, RuntimeNode* runtime_node)
+{
+    CheckHasLock(&queue->m_Lock);
+
+    //a node has thousands of implicit inputs, so only the node is queued here. Whoever picks it up looks at the files
+    //outside of the lock, and the stat cache takes care of files that are shared with other nodes.
+    const Frozen::BuiltNode* built_node = runtime_node->m_BuiltNode;
+    if (built_node != nullptr && built_node->m_ImplicitInputFiles.GetCount() > 0)
+        BufferAppendOne(&queue->m_QueueForPreviousImplicitInputsToEarlyStat, queue->m_Config.m_Heap, built_node);
+}
+
 int EnqueueNodeWithoutWakingAwaiters(BuildQueue *queue, MemAllocLinear* scratch, RuntimeNode *runtime_node, RuntimeNode* queueing_node)
 {
     CheckHasLock(&queue->m_Lock);
@@ -249,9 +256,16 @@ int EnqueueNodeWithoutWakingAwaiters(BuildQueue *queue, MemAllocLinear* scratch,
 
     LogFirstTimeEnqueue(scratch, runtime_node, queueing_node);
     EventLog::EmitFirstTimeEnqueue(runtime_node, queueing_node);
-    queue->m_AmountOfNodesEverQueued++;
+    AtomicIncrement(&queue->m_AmountOfNodesEverQueued);
     RuntimeNodeFlagQueued(runtime_node);
 
+    //dependencies that finished before we got queued have already decremented our pending count below zero.
+    int32_t dependency_count = (int32_t)queue->m_Config.m_DagDerived->m_CombinedDependencies[runtime_node->m_DagNodeIndex].GetCount();
+    bool all_dependencies_are_finished = RuntimeNodeAddPendingDependencies(runtime_node, dependency_count);
+
+    //whether the node gets built, checked or found in the cache, scanning it will most likely stat what it included last time.
+    EnqueueNodesPreviousImplicitInputFilesForEarlyStatting(queue, runtime_node);
+
     //enqueueing a node means that we know we need it to complete our build. Some nodes
     //we know can be processed immediately:
     //1) those whose dependencies have all been completed,
@@ -261,7 +275,7 @@ int EnqueueNodeWithoutWakingAwaiters(BuildQueue *queue, MemAllocLinear* scratch,
     //we will only mark them as queued, but we don't actually put them on the workstack, since we already
     //know they cannot yet immediately be acted upon. They will be put on the workstack when their dependencies finish.
     int placed_on_workstack_count = 0;
-    if (AllDependenciesAreFinished(queue,runtime_node) || IsNodeCacheableByLeafInputsAndCachingEnabled(queue,runtime_node))
+    if (all_dependencies_are_finished || IsNodeCacheableByLeafInputsAndCachingEnabled(queue,runtime_node))
     {
         if (AddNodeToWorkStackIfNotAlreadyPresent(queue, runtime_node))
             placed_on_workstack_count++;
@@ -284,30 +298,72 @@ int EnqueueNodeWithoutWakingAwaiters(BuildQueue *queue, MemAllocLinear* scratch,
 
 //many operations add nodes to the working stack.  They just append the nodes at the end, not caring about sorting.
 //after all adds have been done, they're supposed to call SortWorkingStack() once at the end which will make sure to sort
-//the nodes based on how many points each nodes has. Nodes with more points should be preferred to start sooner than nodes with
-//less points if we have a choice to make. Today the amount of points are baked into the dag data, and calculated by seeing
-//how many other nodes end up directly or indirectly depending on this node. Maybe in the future we'll expose a bee setting where
-//you can manually specify points per node, but right now this seems to lead to optimal scheduling for most buildgraphs, so good enough for now.
+//the nodes based on their priority. Nodes with a higher priority should be preferred to start sooner than nodes with a lower
+//priority if we have a choice to make. The priority is the length of the longest chain of work from the node to the end of the build,
+//using how long each node took the last time it ran, see BuildQueueBuild(). Without any recorded durations it falls back to the points
+//that are baked into the dag data, calculated by seeing how many other nodes end up directly or indirectly depending on this node.
 void SortWorkingStack(BuildQueue* queue)
 {
     CheckHasLock(&queue->m_Lock);
 
-    const auto& nodePoints = queue->m_Config.m_DagDerived->m_NodePoints;
-    //we want to have the nodes with the highest amount of points at the end, since that's where they'll be popped from
+    const uint32_t* nodePriorities = queue->m_NodePriorities;
+    //we want to have the nodes with the highest priority at the end, since that's where they'll be popped from
     std::sort(queue->m_WorkStack.begin(), queue->m_WorkStack.end(), [&](int nodeIndexA, int nodeIndexB)
     {
-        return nodePoints[nodeIndexA] < nodePoints[nodeIndexB];
+        return nodePriorities[nodeIndexA] < nodePriorities[nodeIndexB];
     });
 }
 
+// With the work stealing scheduler, nodes that get enqueued while holding m_Lock are staged on m_WorkStack. This moves
+// them into the stealing queues, starting at the queue of first_thread_index and spreading them round robin over
+// queue_count queues. A thread that discovered new work keeps it for itself, the initial batch gets spread over all threads.
+static int MoveWorkStackToStealingQueues(BuildQueue* queue, int first_thread_index, int queue_count)
+{
+    CheckHasLock(&queue->m_Lock);
+
+    Buffer<int32_t>* workStack = &queue->m_WorkStack;
+    int count = (int)workStack->m_Size;
+    if (count == 0)
+        return 0;
+
+    const uint32_t* nodePriorities = queue->m_NodePriorities;
+    if (queue_count == 1)
+    {
+        WorkStealingQueuePush(&queue->m_StealingQueues[first_thread_index], queue->m_Config.m_Heap, nodePriorities, workStack->m_Storage, count);
+    }
+    else
+    {
+        //deal out the most valuable nodes first, so every thread starts out with some of them.
+        std::sort(workStack->begin(), workStack->end(), [&](int nodeIndexA, int nodeIndexB)
+        {
+            return nodePriorities[nodeIndexA] > nodePriorities[nodeIndexB];
+        });
+        for (int i = 0; i < count; ++i)
+        {
+            int thread_index = first_thread_index + (i % queue_count);
+            WorkStealingQueuePush(&queue->m_StealingQueues[thread_index], queue->m_Config.m_Heap, nodePriorities, &workStack->m_Storage[i], 1);
+        }
+    }
+
+    AtomicAdd32(&queue->m_StealableNodeCount, count);
+    BufferClear(workStack);
+    return count;
+}
+
+void DistributeWorkStackOverStealingQueues(BuildQueue* queue)
+{
+    //slot 0 belongs to the main thread, which doesn't build anything itself.
+    MoveWorkStackToStealingQueues(queue, 1, queue->m_StealingQueueCount - 1);
+}
+
 static void FinishNode(BuildQueue* queue, ThreadState* thread_state, RuntimeNode* node)
 {
     CheckHasLock(&queue->m_Lock);
 
-    node->m_Finished = true;
+    RuntimeNodeSetFinished(node);
     RuntimeNodeFlagInactive(node);
     
-    queue->m_FinishedNodeCount++;    
+    AtomicIncrement(&queue->m_FinishedNodeCount);
     
     int placed_on_workstack_count = 0;
 
@@ -315,19 +371,14 @@ static void FinishNode(BuildQueue* queue, ThreadState* thread_state, RuntimeNode
 
     for (int32_t link : backLinks)
     {
-        if (RuntimeNode *waiter = GetRuntimeNodeForDagNodeIndex(queue, link))
-        {
-            //we should only enqueue nodes that depend on us that we are actually trying to build
-            if (!RuntimeNodeHasEverBeenQueued(waiter))
-                continue;
+        RuntimeNode *waiter = GetRuntimeNodeForDagNodeIndex(queue, link);
 
-            // If the node isn't ready, skip it.
-            if (!AllDependenciesAreFinished(queue, waiter))
-                continue;
+        //this only reaches zero for nodes that have been queued, so we never put nodes on the workstack that we are not trying to build.
+        if (!RuntimeNodeDependencyFinished(waiter))
+            continue;
 
-            if (AddNodeToWorkStackIfNotAlreadyPresent(queue,waiter))
-                placed_on_workstack_count++;
-        }
+        if (AddNodeToWorkStackIfNotAlreadyPresent(queue,waiter))
+            placed_on_workstack_count++;
     }
 
     if (placed_on_workstack_count > 0)
@@ -340,6 +391,71 @@ static void FinishNode(BuildQueue* queue, ThreadState* thread_state, RuntimeNode
         WakeWaiters(queue, placed_on_workstack_count-1);
 }
 
+static void WakeIdleThreadsForWorkStealing(BuildQueue* queue, int count, bool build_might_be_finished)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    //threads only go to sleep while holding m_Lock, after announcing themselves in m_IdleThreadCount and checking for work.
+    //So if nobody is idle, we can skip taking the lock altogether, which is the common case on a busy build.
+    if (!build_might_be_finished && (count <= 0 || AtomicLoad(&queue->m_IdleThreadCount) == 0))
+        return;
+
+    MutexLock(&queue->m_Lock);
+    WakeWaiters(queue, build_might_be_finished ? kMaxBuildThreads : count);
+    MutexUnlock(&queue->m_Lock);
+}
+
+//The work stealing counterpart of FinishNode(). It runs without m_Lock, so all node state it touches is atomic. Nodes that become
+//ready go onto this thread's own queue, so the thread that finished a dependency typically picks up the dependee next.
+static void FinishNodeForWorkStealing(BuildQueue* queue, ThreadState* thread_state, RuntimeNode* node)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    RuntimeNodeSetFinished(node);
+    RuntimeNodeFlagInactive(node);
+
+    uint32_t finished_node_count = AtomicIncrement(&queue->m_FinishedNodeCount);
+
+    MemAllocLinearScope allocScope(&thread_state->m_ScratchAlloc);
+
+    const FrozenArray<uint32_t>& backLinks = queue->m_Config.m_DagDerived->m_NodeBacklinks[node->m_DagNodeIndex];
+    int32_t* ready_nodes = LinearAllocateArray<int32_t>(&thread_state->m_ScratchAlloc, backLinks.GetCount());
+    int ready_count = 0;
+
+    for (int32_t link : backLinks)
+    {
+        //exactly one of the dependencies finishing, or the enqueueing of the waiter itself, sees the pending count reach zero.
+        //That side is the one that hands the node out.
+        if (RuntimeNodeDependencyFinished(GetRuntimeNodeForDagNodeIndex(queue, link)))
+            ready_nodes[ready_count++] = link;
+    }
+
+    if (ready_count > 0)
+    {
+        const uint32_t* nodePriorities = queue->m_NodePriorities;
+        WorkStealingQueuePush(&queue->m_StealingQueues[thread_state->m_ThreadIndex], queue->m_Config.m_Heap, nodePriorities, ready_nodes, ready_count);
+        AtomicAdd32(&queue->m_StealableNodeCount, ready_count);
+    }
+
+    //we'll pick up one of the ready nodes ourselves.
+    bool build_might_be_finished = finished_node_count == AtomicLoad(&queue->m_AmountOfNodesEverQueued);
+    WakeIdleThreadsForWorkStealing(queue, ready_count - 1, build_might_be_finished);
+}
+
+static void FinishNodeWithoutHoldingQueueLock(BuildQueue* queue, ThreadState* thread_state, RuntimeNode* node)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    if (UsesWorkStealingScheduler(queue))
+    {
+        FinishNodeForWorkStealing(queue, thread_state, node);
+        return;
+    }
+
+    MutexScope scope(&queue->m_Lock);
+    FinishNode(queue, thread_state, node);
+}
+
 
 static void AttemptCacheWrite(BuildQueue* queue, ThreadState* thread_state, RuntimeNode* node)
 {
@@ -357,7 +473,7 @@ static void AttemptCacheWrite(BuildQueue* queue, ThreadState* thread_state, Runt
     }
 
     //we already calculated the leaf input signature before, but we'll do it again because now we want to have the ingredient stream written out to disk.
-    CalculateLeafInputSignature(queue, node->m_DagNode, node, &thread_state->m_ScratchAlloc, thread_state->m_ThreadIndex, sig);
+    CalculateLeafInputSignature(queue, node->m_DagNode, node, &thread_state->m_ScratchAlloc, thread_state->m_IoRing, thread_state->m_ThreadIndex, sig);
 
     fclose(sig);
 
@@ -471,10 +587,193 @@ static bool AreNodeFileAndGlobSignaturesStillValid(RuntimeNode* node, ThreadStat
     return VerifyNodeGlobSignatures() && VerifyNodeFileSignatures() && VerifyNodeStatSignatures();
 }
 
-static NodeBuildResult::Enum ExecuteNode(BuildQueue* queue, RuntimeNode* node, Mutex *queue_lock, ThreadState* thread_state, StatCache* stat_cache, const Frozen::DagDerived* dagDerived)
+static NodeBuildResult::Enum FinishExecuteNode(BuildQueue* queue, RuntimeNode* node, ThreadState* thread_state, const Frozen::DagDerived* dagDerived, NodeBuildResult::Enum runActionResult, bool thereIsAtLeastOneInputFileDatedInTheFuture, const Buffer<uint64_t>& inputTimestamps);
+
+static void LinkRunningAction(BuildQueue* queue, RunningAction* running)
+{
+    CheckHasLock(&queue->m_Lock);
+
+    running->m_PrevRunning = nullptr;
+    running->m_NextRunning = queue->m_RunningActions;
+    if (queue->m_RunningActions)
+        queue->m_RunningActions->m_PrevRunning = running;
+    queue->m_RunningActions = running;
+}
+
+static void UnlinkRunningAction(BuildQueue* queue, RunningAction* running)
 {
+    CheckHasLock(&queue->m_Lock);
+
+    if (running->m_PrevRunning)
+        running->m_PrevRunning->m_NextRunning = running->m_NextRunning;
+    else
+        queue->m_RunningActions = running->m_NextRunning;
+    if (running->m_NextRunning)
+        running->m_NextRunning->m_PrevRunning = running->m_PrevRunning;
+}
+
+//Called by the exec reactor once the child of an async action has exited. Hands the node to a build thread for post-processing.
+static void OnRunningActionExited(ExecReactorJob* job)
+{
+    RunningAction* running = (RunningAction*)job->m_UserData;
+    BuildQueue* queue = running->m_Queue;
+
+    running->m_TimeOfExit = TimerGet();
+
+    //give the capacity back right away, the build threads might all be waiting for it.
+    ActionResourcesRelease(queue, running->m_Node);
+
+    //threads only go to sleep while holding m_Lock, after checking for exited actions, so the wakeup can't get lost.
+    MutexLock(&queue->m_Lock);
+    running->m_NextExited = queue->m_ExitedActions;
+    queue->m_ExitedActions = running;
+    AtomicAdd32(&queue->m_ExitedActionCount, 1);
+    WakeWaiters(queue, 1);
+    MutexUnlock(&queue->m_Lock);
+}
+
+static RunningAction* NextExitedAction(BuildQueue* queue)
+{
+    CheckHasLock(&queue->m_Lock);
+
+    RunningAction* running = queue->m_ExitedActions;
+    if (running == nullptr)
+        return nullptr;
+
+    queue->m_ExitedActions = running->m_NextExited;
+    AtomicAdd32(&queue->m_ExitedActionCount, -1);
+    UnlinkRunningAction(queue, running);
+    return running;
+}
+
+static void DestroyRunningAction(BuildQueue* queue, RunningAction* running)
+{
+    BufferDestroy(&running->m_InputTimestamps, queue->m_Config.m_Heap);
+    HeapFree(queue->m_Config.m_Heap, running);
+}
+
+//Start the action of a node without waiting for it. Returns nullptr, with the node's action result in out_result, if the
+//action was done right away instead.
+static RunningAction* StartRunningAction(BuildQueue* queue, ThreadState* thread_state, RuntimeNode* node, bool thereIsAtLeastOneInputFileDatedInTheFuture, const Buffer<uint64_t>& inputTimestamps, NodeBuildResult::Enum* out_result)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    MemAllocHeap* heap = queue->m_Config.m_Heap;
+    RunningAction* running = HeapAllocateArray<RunningAction>(heap, 1);
+    running->m_Node = node;
+    running->m_Queue = queue;
+    running->m_Job.m_OnComplete = OnRunningActionExited;
+    running->m_Job.m_UserData = running;
+    running->m_Job.m_HoldsProcessSlot = false;
+    running->m_TimeOfStart = TimerGet();
+    running->m_TimeOfSpawn = running->m_TimeOfStart;
+    running->m_TimeOfExit = running->m_TimeOfStart;
+    running->m_PreTimestamps = nullptr;
+    running->m_UntouchedOutputs = nullptr;
+    BufferInit(&running->m_InputTimestamps);
+    BufferAppend(&running->m_InputTimestamps, heap, inputTimestamps.m_Storage, inputTimestamps.m_Size);
+    running->m_InputFileDatedInTheFuture = thereIsAtLeastOneInputFileDatedInTheFuture;
+    running->m_NextExited = nullptr;
+
+    //the action has to be listed before it starts, as the node can be picked up again as soon as its child exits.
+    MutexLock(&queue->m_Lock);
+    LinkRunningAction(queue, running);
+    AtomicAdd32(&queue->m_RunningActionCount, 1);
+    MutexUnlock(&queue->m_Lock);
+
+    if (RunActionAsync(queue, thread_state, running, out_result))
+        return running;
+
+    MutexLock(&queue->m_Lock);
+    UnlinkRunningAction(queue, running);
+    AtomicAdd32(&queue->m_RunningActionCount, -1);
+    MutexUnlock(&queue->m_Lock);
+
+    DestroyRunningAction(queue, running);
+    return nullptr;
+}
+
+//Do the post-processing of an async action whose child has exited. Returns the build result of the node, which the caller
+//still has to finish.
+static NodeBuildResult::Enum ResumeRunningAction(ThreadState* thread_state, RunningAction* running)
+{
+    BuildQueue* queue = running->m_Queue;
+
+    NodeBuildResult::Enum runActionResult = CompleteRunningAction(thread_state, running);
+    NodeBuildResult::Enum nodeBuildResult = FinishExecuteNode(queue, running->m_Node, thread_state, queue->m_Config.m_DagDerived, runActionResult, running->m_InputFileDatedInTheFuture, running->m_InputTimestamps);
+
+    DestroyRunningAction(queue, running);
+    return nodeBuildResult;
+}
+
+//Threads running an action themselves report on it through the exec slow callback. Nobody waits on async actions, so
+//sleeping threads do it for them.
+static void PrintRunningActionsInProgress(BuildQueue* queue)
+{
+    CheckHasLock(&queue->m_Lock);
+
+    for (RunningAction* running = queue->m_RunningActions; running != nullptr; running = running->m_NextRunning)
+        PrintNodeInProgress(running->m_Node->m_DagNode, running->m_TimeOfStart, queue);
+}
+
+//The part of ExecuteNode() from when the action has its resources. Sets out_pending if the node is left to whoever picks it up
+//after its child exits.
+static NodeBuildResult::Enum RunNodeAction(BuildQueue* queue, RuntimeNode* node, Mutex *queue_lock, ThreadState* thread_state, const Frozen::DagDerived* dagDerived, bool thereIsAtLeastOneInputFileDatedInTheFuture, const Buffer<uint64_t>& inputTimestamps, bool* out_pending)
+{
+    NodeBuildResult::Enum runActionResult;
+    if (CanRunActionAsync(queue, node))
+    {
+        if (StartRunningAction(queue, thread_state, node, thereIsAtLeastOneInputFileDatedInTheFuture, inputTimestamps, &runActionResult) != nullptr)
+        {
+            *out_pending = true;
+            return NodeBuildResult::kDidNotRun;
+        }
+    }
+    else
+    {
+        runActionResult = RunAction(queue, thread_state, node, queue_lock);
+    }
+
+    ActionResourcesRelease(queue, node);
+
+    return FinishExecuteNode(queue, node, thread_state, dagDerived, runActionResult, thereIsAtLeastOneInputFileDatedInTheFuture, inputTimestamps);
+}
+
+//Park a node whose action doesn't fit in the resource limits yet, so this thread can go on with other work. A thread looking
+//for work runs it once it fits, see PickAndDoDeferredActionTask().
+static void DeferAction(BuildQueue* queue, ThreadState* thread_state, RuntimeNode* node, bool thereIsAtLeastOneInputFileDatedInTheFuture)
+{
+    MemAllocHeap* heap = queue->m_Config.m_Heap;
+    DeferredAction* deferred = HeapAllocateArray<DeferredAction>(heap, 1);
+    deferred->m_Node = node;
+    BufferInit(&deferred->m_InputTimestamps);
+    BufferAppend(&deferred->m_InputTimestamps, heap, thread_state->m_TimestampStorage.m_Storage, thread_state->m_TimestampStorage.m_Size);
+    deferred->m_InputFileDatedInTheFuture = thereIsAtLeastOneInputFileDatedInTheFuture;
+    ActionResourcesDefer(queue, deferred);
+}
+
+//Run the action of a deferred node, which ActionResourcesAdmitDeferred() took the resources for.
+static NodeBuildResult::Enum RunDeferredAction(ThreadState* thread_state, DeferredAction* deferred, bool* out_pending)
+{
+    BuildQueue* queue = thread_state->m_Queue;
     CheckDoesNotHaveLock(&queue->m_Lock);
 
+    *out_pending = false;
+    NodeBuildResult::Enum nodeBuildResult = RunNodeAction(queue, deferred->m_Node, &queue->m_Lock, thread_state, queue->m_Config.m_DagDerived, deferred->m_InputFileDatedInTheFuture, deferred->m_InputTimestamps, out_pending);
+
+    BufferDestroy(&deferred->m_InputTimestamps, queue->m_Config.m_Heap);
+    HeapFree(queue->m_Config.m_Heap, deferred);
+    return nodeBuildResult;
+}
+
+//Sets out_pending if the node isn't done yet, because its action is still running or waits for resources. Whoever picks it up
+//again finishes it.
+static NodeBuildResult::Enum ExecuteNode(BuildQueue* queue, RuntimeNode* node, Mutex *queue_lock, ThreadState* thread_state, StatCache* stat_cache, const Frozen::DagDerived* dagDerived, bool* out_pending)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    *out_pending = false;
+
     bool haveToRunAction = CheckInputSignatureToSeeNodeNeedsExecuting(queue, thread_state, node);
     if (!haveToRunAction)
     {
@@ -526,7 +825,21 @@ static NodeBuildResult::Enum ExecuteNode(BuildQueue* queue, RuntimeNode* node, M
 
     LogRunNodeAction(&thread_state->m_ScratchAlloc, node);
 
-    NodeBuildResult::Enum runActionResult = RunAction(queue, thread_state, node, queue_lock);
+    if (!ActionResourcesTryAcquire(queue, node))
+    {
+        DeferAction(queue, thread_state, node, thereIsAtLeastOneInputFileDatedInTheFuture);
+        *out_pending = true;
+        return NodeBuildResult::kDidNotRun;
+    }
+
+    return RunNodeAction(queue, node, queue_lock, thread_state, dagDerived, thereIsAtLeastOneInputFileDatedInTheFuture, thread_state->m_TimestampStorage, out_pending);
+}
+
+//The part of ExecuteNode() that comes after the action has run. With async actions this runs on whichever thread picks the node
+//up again after its child exited, so all state from before the action is passed in.
+static NodeBuildResult::Enum FinishExecuteNode(BuildQueue* queue, RuntimeNode* node, ThreadState* thread_state, const Frozen::DagDerived* dagDerived, NodeBuildResult::Enum runActionResult, bool thereIsAtLeastOneInputFileDatedInTheFuture, const Buffer<uint64_t>& inputTimestamps)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
 
     if (runActionResult == NodeBuildResult::kRanSuccesfully && !AreNodeFileAndGlobSignaturesStillValid(node,thread_state))
         runActionResult = NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun;
@@ -542,11 +855,11 @@ static NodeBuildResult::Enum ExecuteNode(BuildQueue* queue, RuntimeNode* node, M
     // If signatures don't match, someone touched files on disk while we were checking input signature or action was executing.
     const char* fileWhoseModificationDateChangedDuringBuild = nullptr;
     uint64_t oldTimestamp, newTimestamp;
-    if (!ValidateTimestampsOfNonGeneratedInputFiles(thread_state->m_TimestampStorage, queue, node, &fileWhoseModificationDateChangedDuringBuild, &oldTimestamp, &newTimestamp))
+    if (!ValidateTimestampsOfNonGeneratedInputFiles(inputTimestamps, queue, node, &fileWhoseModificationDateChangedDuringBuild, &oldTimestamp, &newTimestamp))
     {
         MutexLock(&queue->m_Lock);
         PrintMessage(MessageStatusLevel::Info, "Modification date of `%s` changed while running `%s`. Old timestamp: %llu, new timestamp: %llu", fileWhoseModificationDateChangedDuringBuild, node->m_DagNode->m_Annotation.Get(), oldTimestamp, newTimestamp);
-        LogModificationDateChangedDuringBuild(&thread_state->m_ScratchAlloc, nonGeneratedInputFileWithTimestamp, node, oldTimestamp, newTimestamp);
+        LogModificationDateChangedDuringBuild(&thread_state->m_ScratchAlloc, fileWhoseModificationDateChangedDuringBuild, node, oldTimestamp, newTimestamp);
         MutexUnlock(&queue->m_Lock);
 
         RuntimeNodeSetInputSignatureMightBeIncorrect(node);
@@ -576,9 +889,8 @@ static bool AttemptToMakeConsistentWithoutNeedingDependenciesBuilt(RuntimeNode*
         auto wasSuccessfulWithGuaranteedCorrectInputSignature = node->m_BuiltNode->m_Result == Frozen::BuiltNodeResult::kRanSuccessfullyWithGuaranteedCorrectInputSignature;
         if (wasSuccessfulWithGuaranteedCorrectInputSignature && node->m_BuiltNode->m_LeafInputSignature == node->m_CurrentLeafInputSignature->digest && !OutputFilesMissingFor(node->m_BuiltNode, queue->m_Config.m_StatCache, thread_state))
         {
-            MutexScope scope(&queue->m_Lock);
             node->m_BuildResult = NodeBuildResult::kUpToDate;
-            FinishNode(queue, thread_state, node);
+            FinishNodeWithoutHoldingQueueLock(queue, thread_state, node);
             return true;
         }
     }
@@ -586,8 +898,10 @@ static bool AttemptToMakeConsistentWithoutNeedingDependenciesBuilt(RuntimeNode*
     RuntimeNodeSetAttemptedCacheLookup(node);
 
     uint64_t time_exec_started = TimerGet();
-    auto cacheReadResult = CacheClient::AttemptRead(queue->m_Config.m_Dag, node->m_DagNode, node->m_CurrentLeafInputSignature->digest, queue->m_Config.m_StatCache, thread_state);
-    
+    CacheResult::Enum cacheReadResult;
+    if (!CachePrefetchTakeResult(queue, node, &cacheReadResult))
+        cacheReadResult = CacheClient::AttemptRead(queue->m_Config.m_Dag, node->m_DagNode, node->m_CurrentLeafInputSignature->digest, queue->m_Config.m_StatCache, thread_state);
+
     uint64_t now = TimerGet();
     double duration = TimerDiffSeconds(time_exec_started, now);
     char digestString[kDigestStringSize];
@@ -605,12 +919,9 @@ static bool AttemptToMakeConsistentWithoutNeedingDependenciesBuilt(RuntimeNode*
         case CacheResult::Success:
             PostRunActionBookkeeping(node, thread_state);
             PrintCacheHit(queue, thread_state, duration, node);
-            
-            {
-                MutexScope scope(&queue->m_Lock);
-                node->m_BuildResult = NodeBuildResult::kRanSuccesfully;
-                FinishNode(queue, thread_state, node);
-            }
+
+            node->m_BuildResult = NodeBuildResult::kRanSuccesfully;
+            FinishNodeWithoutHoldingQueueLock(queue, thread_state, node);
             return true;
 
         case CacheResult::CacheMiss:
@@ -631,7 +942,9 @@ static void EnqueueToBuildDependencies(BuildQueue *queue, ThreadState *thread_st
     auto& dependencies = node->m_DagNode->m_ToBuildDependencies;
     int placed_on_workstack_count = EnqueueNodeListWithoutWakingAwaiters(queue,&thread_state->m_ScratchAlloc, dependencies, node);
 
-    if (placed_on_workstack_count > 0)
+    if (UsesWorkStealingScheduler(queue))
+        MoveWorkStackToStealingQueues(queue, thread_state->m_ThreadIndex, 1);
+    else if (placed_on_workstack_count > 0)
         SortWorkingStack(queue);
 
     if (placed_on_workstack_count > 1)
@@ -659,13 +972,45 @@ static void LogOutOfDateSignaturePath(RuntimeNode* node, const char* signaturePa
     LogStructured(&msg);
 }
 
+static void UpdateFinalBuildResult(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, NodeBuildResult::Enum nodeBuildResult)
+{
+    CheckHasLock(&queue->m_Lock);
+
+    switch (nodeBuildResult)
+    {
+        case NodeBuildResult::kRanFailed:
+            
+            //in the case where we defer the dag verification, we should not set the buildresult to failed if it is already set to require-frontend-rerun,
+            //since we were compiling speculatively, we should not worry users with failures for a dag that was invalid. If we have already verified the dag
+            //then we know this is a real failure, and it's okay if the failure overwrites a frontend rerun request.
+            if (queue->m_FinalBuildResult == BuildResult::kRequireFrontendRerun && queue->m_Config.m_DriverOptions->m_DeferDagVerification)
+                break;
+
+            queue->m_FinalBuildResult = BuildResult::kBuildError;
+            break;
+        case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
+        case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
+            if (queue->m_FinalBuildResult == BuildResult::kOk)
+            {
+                queue->m_FinalBuildResult = BuildResult::kRequireFrontendRerun;
+                if (thread_state->m_GlobCausingFrontendRerun)
+                    LogOutOfDateSignaturePath(node, thread_state->m_GlobCausingFrontendRerun->m_Path.Get(), &thread_state->m_ScratchAlloc);
+                if (thread_state->m_FileCausingFrontendRerun)
+                    LogOutOfDateSignaturePath(node, thread_state->m_FileCausingFrontendRerun->Get(), &thread_state->m_ScratchAlloc);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
 static void ProcessNode(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, Mutex *queue_lock)
 {
     CheckHasLock(&queue->m_Lock);
 
     Log(kSpam, "T=%d, Advancing %s\n", thread_state->m_ThreadIndex, node->m_DagNode->m_Annotation.Get());
 
-    CHECK(!node->m_Finished);
+    CHECK(!RuntimeNodeIsFinished(node));
     CHECK(RuntimeNodeIsActive(node));
     CHECK(!RuntimeNodeIsQueued(node));
 
@@ -677,7 +1022,7 @@ static void ProcessNode(BuildQueue *queue, ThreadState *thread_state, RuntimeNod
 
             // Maybe the node's signature was already calculated as part of a parent's signature, then we can skip.
             if (node->m_CurrentLeafInputSignature == nullptr)
-                CalculateLeafInputSignature(queue, node->m_DagNode, node, &thread_state->m_ScratchAlloc, thread_state->m_ThreadIndex, nullptr);
+                CalculateLeafInputSignature(queue, node->m_DagNode, node, &thread_state->m_ScratchAlloc, thread_state->m_IoRing, thread_state->m_ThreadIndex, nullptr);
 
             bool madeConsistent = false;
             if (queue->m_Config.m_AttemptCacheReads)
@@ -689,7 +1034,7 @@ static void ProcessNode(BuildQueue *queue, ThreadState *thread_state, RuntimeNod
         }
     }
 
-    if (!AllDependenciesAreFinished(queue,node))
+    if (!RuntimeNodeAllDependenciesAreFinished(node))
     {
         EnqueueToBuildDependencies(queue,thread_state,node);
         RuntimeNodeFlagInactive(node);
@@ -698,38 +1043,90 @@ static void ProcessNode(BuildQueue *queue, ThreadState *thread_state, RuntimeNod
 
     if (AllDependenciesAreSuccesful(queue, node))
     {
+        bool pending;
         MutexUnlock(queue_lock);
-        NodeBuildResult::Enum nodeBuildResult = ExecuteNode(queue, node, queue_lock, thread_state, thread_state->m_Queue->m_Config.m_StatCache, queue->m_Config.m_DagDerived);
+        NodeBuildResult::Enum nodeBuildResult = ExecuteNode(queue, node, queue_lock, thread_state, thread_state->m_Queue->m_Config.m_StatCache, queue->m_Config.m_DagDerived, &pending);
         MutexLock(queue_lock);
 
-        switch (node->m_BuildResult = nodeBuildResult)
+        //the node stays active while its action runs or waits for resources, whoever picks it up again finishes it.
+        if (pending)
+            return;
+
+        UpdateFinalBuildResult(queue, thread_state, node, node->m_BuildResult = nodeBuildResult);
+    }
+    FinishNode(queue, thread_state, node);
+}
+
+static bool NodeBuildResultAffectsFinalBuildResult(NodeBuildResult::Enum nodeBuildResult)
+{
+    switch (nodeBuildResult)
+    {
+        case NodeBuildResult::kRanFailed:
+        case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
+        case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
+            return true;
+        default:
+            return false;
+    }
+}
+
+//The work stealing counterpart of ProcessNode(). It is entered without holding m_Lock, and only takes it for the rare
+//operations that still need it: enqueueing dependencies and recording a failure or a frontend rerun request.
+static void ProcessNodeWithoutQueueLock(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    Log(kSpam, "T=%d, Advancing %s\n", thread_state->m_ThreadIndex, node->m_DagNode->m_Annotation.Get());
+
+    CHECK(!RuntimeNodeIsFinished(node));
+    CHECK(RuntimeNodeIsActive(node));
+
+    if (IsNodeCacheableByLeafInputsAndCachingEnabled(queue,node) && !RuntimeNodeHasAttemptedCacheLookup(node))
+    {
+        // Maybe the node's signature was already calculated as part of a parent's signature, then we can skip.
+        if (node->m_CurrentLeafInputSignature == nullptr)
+            CalculateLeafInputSignature(queue, node->m_DagNode, node, &thread_state->m_ScratchAlloc, thread_state->m_IoRing, thread_state->m_ThreadIndex, nullptr);
+
+        if (queue->m_Config.m_AttemptCacheReads && AttemptToMakeConsistentWithoutNeedingDependenciesBuilt(node, queue, thread_state))
+            return;
+    }
+
+    if (!RuntimeNodeAllDependenciesAreFinished(node))
+    {
+        MutexLock(&queue->m_Lock);
+        EnqueueToBuildDependencies(queue,thread_state,node);
+        MutexUnlock(&queue->m_Lock);
+
+        RuntimeNodeFlagInactive(node);
+
+        //our last dependency might have finished after we checked, while we were still active. In that case its FinishNode
+        //handed us out to a thread that couldn't claim us, so we have to put ourselves back.
+        if (RuntimeNodeAllDependenciesAreFinished(node))
         {
-            case NodeBuildResult::kRanFailed:
-                
-                //in the case where we defer the dag verification, we should not set the buildresult to failed if it is already set to require-frontend-rerun,
-                //since we were compiling speculatively, we should not worry users with failures for a dag that was invalid. If we have already verified the dag
-                //then we know this is a real failure, and it's okay if the failure overwrites a frontend rerun request.
-                if (queue->m_FinalBuildResult == BuildResult::kRequireFrontendRerun && queue->m_Config.m_DriverOptions->m_DeferDagVerification)
-                    break;
-
-                queue->m_FinalBuildResult = BuildResult::kBuildError;
-                break;
-            case NodeBuildResult::kRanSuccessButDependeesRequireFrontendRerun:
-            case NodeBuildResult::kUpToDateButDependeesRequireFrontendRerun:
-                if (queue->m_FinalBuildResult == BuildResult::kOk)
-                {
-                    queue->m_FinalBuildResult = BuildResult::kRequireFrontendRerun;
-                    if (thread_state->m_GlobCausingFrontendRerun)
-                        LogOutOfDateSignaturePath(node, thread_state->m_GlobCausingFrontendRerun->m_Path.Get(), &thread_state->m_ScratchAlloc);
-                    if (thread_state->m_FileCausingFrontendRerun)
-                        LogOutOfDateSignaturePath(node, thread_state->m_FileCausingFrontendRerun->Get(), &thread_state->m_ScratchAlloc);
-                }
-                break;
-            default:
-                break;
+            int32_t node_index = node->m_DagNodeIndex;
+            const uint32_t* nodePriorities = queue->m_NodePriorities;
+            WorkStealingQueuePush(&queue->m_StealingQueues[thread_state->m_ThreadIndex], queue->m_Config.m_Heap, nodePriorities, &node_index, 1);
+            AtomicAdd32(&queue->m_StealableNodeCount, 1);
         }
+        return;
     }
-    FinishNode(queue, thread_state, node);
+
+    if (AllDependenciesAreSuccesful(queue, node))
+    {
+        bool pending;
+        NodeBuildResult::Enum nodeBuildResult = ExecuteNode(queue, node, &queue->m_Lock, thread_state, queue->m_Config.m_StatCache, queue->m_Config.m_DagDerived, &pending);
+        if (pending)
+            return;
+
+        node->m_BuildResult = nodeBuildResult;
+
+        if (NodeBuildResultAffectsFinalBuildResult(nodeBuildResult))
+        {
+            MutexScope scope(&queue->m_Lock);
+            UpdateFinalBuildResult(queue, thread_state, node, nodeBuildResult);
+        }
+    }
+    FinishNodeForWorkStealing(queue, thread_state, node);
 }
 
 static RuntimeNode *NextNode(BuildQueue *queue)
@@ -744,7 +1141,7 @@ static RuntimeNode *NextNode(BuildQueue *queue)
 
         RuntimeNode *runtime_node = queue->m_Config.m_RuntimeNodes + node_index;
 
-        if (RuntimeNodeIsActive(runtime_node) || runtime_node->m_Finished)
+        if (RuntimeNodeIsActive(runtime_node) || RuntimeNodeIsFinished(runtime_node))
         {
             //this can happen in legit situations. we allow nodes to appear on the workstack more than once. This happens in situations where
             //a node gets queued as not-very-urgent (aka at the end of a dependency list). But later, the same node is also a dependency of something
@@ -779,13 +1176,42 @@ static int NextBatchOfNonGeneratedFileForEarlyStatting(BuildQueue* queue, const
     return amount;
 }
 
-static void EarlyStatNonGeneratedFile(BuildQueue* queue, const FrozenFileAndHash* file, ThreadState* thread_state)
+static void EarlyStatNonGeneratedFiles(BuildQueue* queue, const FrozenFileAndHash** files, int count, ThreadState* thread_state)
 {
     CheckDoesNotHaveLock(&queue->m_Lock);
-    StatCache* statCache = queue->m_Config.m_StatCache;
-    StatCacheStat(statCache, file->m_Filename.Get(), file->m_FilenameHash);
+    FileAndHash batch[kIoRingEntries];
+    for (int i = 0; i != count; i++)
+    {
+        batch[i].m_Filename = files[i]->m_Filename.Get();
+        batch[i].m_FilenameHash = files[i]->m_FilenameHash;
+    }
+    StatCacheStatMany(queue->m_Config.m_StatCache, thread_state->m_IoRing, batch, count);
 }
 
+static void EarlyStatPreviousImplicitInputFiles(BuildQueue* queue, const Frozen::BuiltNode* built_node, ThreadState* thread_state)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+    StatCache* statCache = queue->m_Config.m_StatCache;
+
+    //generated files might not have been written yet, those are left for when they are needed.
+    FileAndHash batch[kIoRingEntries];
+    int count = 0;
+    for (const Frozen::NodeInputFileData& input : built_node->m_ImplicitInputFiles)
+    {
+        const char* filename = input.m_Filename.Get();
+        if (IsFileGenerated(&queue->m_Config.m_DagRuntimeData, input.m_FilenameHash, filename))
+            continue;
+
+        batch[count].m_Filename = filename;
+        batch[count].m_FilenameHash = input.m_FilenameHash;
+        if (++count == kIoRingEntries)
+        {
+            StatCacheStatMany(statCache, thread_state->m_IoRing, batch, count);
+            count = 0;
+        }
+    }
+    StatCacheStatMany(statCache, thread_state->m_IoRing, batch, count);
+}
 
 static bool PickAndDoDagVerificationTask(ThreadState* thread_state)
 {
@@ -816,7 +1242,7 @@ static bool PickAndDoDagVerificationTask(ThreadState* thread_state)
     //It's also common that all buildthreads are sleeping, because none of them were allowed to pick up any tasks from the workstack,
     //until dag verification was done. Now that dag verification is done, we should wake up enough buildthreads so that all the available
     //work on the workstack can immediately be started
-    WakeWaiters(queue, queue->m_WorkStack.m_Size);
+    WakeWaiters(queue, (int)queue->m_WorkStack.m_Size + AtomicLoad(&queue->m_StealableNodeCount));
     if (!isValid)
     {
         queue->m_FinalBuildResult = BuildResult::kRequireFrontendRerun;
@@ -837,6 +1263,84 @@ static bool PickAndDoProcessNodeTask(ThreadState* thread_state)
     return true;
 }
 
+static bool PickAndDoResumeNodeTask(ThreadState* thread_state)
+{
+    BuildQueue* queue = thread_state->m_Queue;
+    RunningAction* running = NextExitedAction(queue);
+    if (running == nullptr)
+        return false;
+
+    RuntimeNode* node = running->m_Node;
+
+    MutexUnlock(&queue->m_Lock);
+    NodeBuildResult::Enum nodeBuildResult = ResumeRunningAction(thread_state, running);
+    MutexLock(&queue->m_Lock);
+
+    UpdateFinalBuildResult(queue, thread_state, node, node->m_BuildResult = nodeBuildResult);
+    FinishNode(queue, thread_state, node);
+    AtomicAdd32(&queue->m_RunningActionCount, -1);
+    return true;
+}
+
+static bool PickAndDoDeferredActionTask(ThreadState* thread_state)
+{
+    BuildQueue* queue = thread_state->m_Queue;
+    CheckHasLock(&queue->m_Lock);
+
+    DeferredAction* deferred = ActionResourcesAdmitDeferred(queue);
+    if (deferred == nullptr)
+        return false;
+
+    //more of them might fit, let another thread have a look.
+    if (ActionResourcesMightAdmitDeferred(queue))
+        WakeWaiters(queue, 1);
+
+    RuntimeNode* node = deferred->m_Node;
+
+    bool pending;
+    MutexUnlock(&queue->m_Lock);
+    NodeBuildResult::Enum nodeBuildResult = RunDeferredAction(thread_state, deferred, &pending);
+    MutexLock(&queue->m_Lock);
+
+    if (pending)
+        return true;
+
+    UpdateFinalBuildResult(queue, thread_state, node, node->m_BuildResult = nodeBuildResult);
+    FinishNode(queue, thread_state, node);
+    return true;
+}
+
+static RuntimeNode *NextNodeForWorkStealing(BuildQueue *queue, ThreadState* thread_state)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    const uint32_t* nodePriorities = queue->m_NodePriorities;
+    int queue_count = queue->m_StealingQueueCount;
+    int own_index = thread_state->m_ThreadIndex;
+
+    //look at our own queue first, then go around the other threads' queues and steal from them.
+    for (int i = 0; i < queue_count; ++i)
+    {
+        WorkStealingQueue* victim = &queue->m_StealingQueues[(own_index + i) % queue_count];
+
+        int32_t node_index;
+        while (WorkStealingQueuePop(victim, nodePriorities, &node_index))
+        {
+            AtomicAdd32(&queue->m_StealableNodeCount, -1);
+
+            //same as in NextNode(), a node can be handed out more than once. Whoever claims it first gets to process it.
+            RuntimeNode *runtime_node = queue->m_Config.m_RuntimeNodes + node_index;
+            if (!RuntimeNodeTryFlagActive(runtime_node))
+                continue;
+
+            if (i != 0)
+                AtomicIncrement(&g_Stats.m_StolenNodeCount);
+            return runtime_node;
+        }
+    }
+    return nullptr;
+}
+
 
 namespace TaskKind
 {
@@ -845,26 +1349,49 @@ namespace TaskKind
         None,
         DagVerification,
         ProcessNode,
-        EarlyStat
+        EarlyStat,
+        ResumeNode,
+        RunDeferredAction
     };
 }
 
 
+//the explicit inputs are certain to be needed, so these only come up once those have all been statted.
+static bool PickAndDoEarlyStatPreviousImplicitInputsTask(ThreadState* thread_state)
+{
+    BuildQueue* queue = thread_state->m_Queue;
+    CheckHasLock(&queue->m_Lock);
+
+    Buffer<const Frozen::BuiltNode*>* stack = &queue->m_QueueForPreviousImplicitInputsToEarlyStat;
+    if (stack->GetCount() == 0)
+        return false;
+    const Frozen::BuiltNode* built_node = BufferPopOne(stack);
+
+    MutexUnlock(&queue->m_Lock);
+    {
+        ProfilerScope scope("EarlyStatPreviousImplicitInputs", thread_state->m_ThreadIndex);
+        EarlyStatPreviousImplicitInputFiles(queue, built_node, thread_state);
+    }
+
+    MutexLock(&queue->m_Lock);
+    return true;
+}
+
 static bool PickAndDoEarlyStatTask(ThreadState* thread_state)
 {
     BuildQueue* queue = thread_state->m_Queue;
-    const int batchSize = 20;
-    const FrozenFileAndHash* files[batchSize];
+    // With io_uring a batch costs about as much as a single stat, so a thread takes a whole ring's worth.
+    const int batchSize = thread_state->m_IoRing != nullptr ? kIoRingEntries : 20;
+    const FrozenFileAndHash* files[kIoRingEntries];
 
     int amount = NextBatchOfNonGeneratedFileForEarlyStatting(queue, &files[0], batchSize);
     if (amount == 0)
-        return false;
+        return PickAndDoEarlyStatPreviousImplicitInputsTask(thread_state);
 
     MutexUnlock(&queue->m_Lock);
     {
         ProfilerScope scope("EarlyStatNonGeneratedFile", thread_state->m_ThreadIndex);
-        for (int i=0; i!=amount; i++)
-            EarlyStatNonGeneratedFile(queue, files[i], thread_state);
+        EarlyStatNonGeneratedFiles(queue, files, amount, thread_state);
     }
     
     MutexLock(&queue->m_Lock);
@@ -873,6 +1400,10 @@ static bool PickAndDoEarlyStatTask(ThreadState* thread_state)
 
 static TaskKind::Enum PickAndDoNextTask(ThreadState* thread_state)
 {
+    //nodes whose action already ran are always finished, even when the build is stopping.
+    if (PickAndDoResumeNodeTask(thread_state))
+        return TaskKind::ResumeNode;
+
     if (PickAndDoDagVerificationTask(thread_state))
         return TaskKind::DagVerification;
     
@@ -891,6 +1422,8 @@ static TaskKind::Enum PickAndDoNextTask(ThreadState* thread_state)
     
     if (allowedToPickUpProcesNodeTask)
     {
+        if (PickAndDoDeferredActionTask(thread_state))
+            return TaskKind::RunDeferredAction;
         if (PickAndDoProcessNodeTask(thread_state))
             return TaskKind::ProcessNode;
     }
@@ -899,12 +1432,102 @@ static TaskKind::Enum PickAndDoNextTask(ThreadState* thread_state)
     return TaskKind::None;
 }
 
+//Same rules as in PickAndDoNextTask(), but checked without holding m_Lock. The fields involved are only ever written while holding
+//m_Lock, so the worst that can happen is that we act on a decision a moment late, which the lock based loop can do as well.
+static bool IsAllowedToPickUpProcessNodeTaskWithoutQueueLock(BuildQueue* queue)
+{
+    int dagVerificationStatus = AtomicLoad((const int*)&queue->m_DagVerificationStatus);
+    if (dagVerificationStatus == VerificationStatus::Failed)
+        return false;
+
+    auto& options = queue->m_Config.m_DriverOptions;
+    if (AtomicLoad((const int*)&queue->m_FinalBuildResult) == BuildResult::kBuildError && !options->m_ContinueOnFailure)
+        return false;
+
+    return options->m_DeferDagVerification || dagVerificationStatus == VerificationStatus::Passed;
+}
+
+static bool PickAndDoProcessNodeTaskWithoutQueueLock(ThreadState* thread_state)
+{
+    BuildQueue* queue = thread_state->m_Queue;
+    if (!IsAllowedToPickUpProcessNodeTaskWithoutQueueLock(queue))
+        return false;
+
+    RuntimeNode *node = NextNodeForWorkStealing(queue, thread_state);
+    if (node == nullptr)
+        return false;
+
+    ProcessNodeWithoutQueueLock(queue, thread_state, node);
+    return true;
+}
+
+static bool PickAndDoResumeNodeTaskWithoutQueueLock(ThreadState* thread_state)
+{
+    BuildQueue* queue = thread_state->m_Queue;
+    if (AtomicLoad(&queue->m_ExitedActionCount) == 0)
+        return false;
+
+    MutexLock(&queue->m_Lock);
+    RunningAction* running = NextExitedAction(queue);
+    MutexUnlock(&queue->m_Lock);
+    if (running == nullptr)
+        return false;
+
+    RuntimeNode* node = running->m_Node;
+    NodeBuildResult::Enum nodeBuildResult = ResumeRunningAction(thread_state, running);
+    node->m_BuildResult = nodeBuildResult;
+
+    if (NodeBuildResultAffectsFinalBuildResult(nodeBuildResult))
+    {
+        MutexScope scope(&queue->m_Lock);
+        UpdateFinalBuildResult(queue, thread_state, node, nodeBuildResult);
+    }
+    FinishNodeForWorkStealing(queue, thread_state, node);
+    AtomicAdd32(&queue->m_RunningActionCount, -1);
+    return true;
+}
+
+static bool PickAndDoDeferredActionTaskWithoutQueueLock(ThreadState* thread_state)
+{
+    BuildQueue* queue = thread_state->m_Queue;
+    if (!IsAllowedToPickUpProcessNodeTaskWithoutQueueLock(queue))
+        return false;
+
+    DeferredAction* deferred = ActionResourcesAdmitDeferred(queue);
+    if (deferred == nullptr)
+        return false;
+
+    //more of them might fit, let an idle thread have a look.
+    if (ActionResourcesMightAdmitDeferred(queue))
+        WakeIdleThreadsForWorkStealing(queue, 1, false);
+
+    RuntimeNode* node = deferred->m_Node;
+
+    bool pending;
+    NodeBuildResult::Enum nodeBuildResult = RunDeferredAction(thread_state, deferred, &pending);
+    if (pending)
+        return true;
+
+    node->m_BuildResult = nodeBuildResult;
+
+    if (NodeBuildResultAffectsFinalBuildResult(nodeBuildResult))
+    {
+        MutexScope scope(&queue->m_Lock);
+        UpdateFinalBuildResult(queue, thread_state, node, nodeBuildResult);
+    }
+    FinishNodeForWorkStealing(queue, thread_state, node);
+    return true;
+}
+
 static bool MightMoreWorkArrive(BuildQueue* queue)
 {
     CheckHasLock(&queue->m_Lock);
 
     if (queue->m_DagVerificationStatus == VerificationStatus::WaitingForBuildProgramInputToBecomeAvailable)
         return true;
+    //children that are still running have to be waited for and their nodes finished, whatever else happened.
+    if (AtomicLoad(&queue->m_RunningActionCount) > 0)
+        return true;
     if (queue->m_DagVerificationStatus == VerificationStatus::Failed)
         return false;
     if (queue->m_FinishedNodeCount == queue->m_AmountOfNodesEverQueued)
@@ -926,13 +1549,79 @@ static void SleepUntilWorkAvailable(ThreadState* thread_state)
     ProfilerBegin("WaitingForWork", thread_state->m_ThreadIndex, nullptr, "thread_state_sleeping");
     //This API call will release our lock. The api contract is that this function will sleep until CV is triggered from another thread
     //and during that sleep the mutex will be released,  and before CondWait returns, the lock will be re-aquired
-    CondWait(&queue->m_WorkAvailable, &queue->m_Lock);
+    if (queue->m_RunningActions != nullptr)
+    {
+        CondWait(&queue->m_WorkAvailable, &queue->m_Lock, 1000);
+        PrintRunningActionsInProgress(queue);
+    }
+    else
+    {
+        CondWait(&queue->m_WorkAvailable, &queue->m_Lock);
+    }
     ProfilerEnd(thread_state->m_ThreadIndex);
 }
 
+//The work stealing variant of the build loop. Picking, processing and finishing nodes happens without m_Lock. Only when a thread
+//runs out of nodes does it take m_Lock, to do the remaining task kinds or to go to sleep until there is more work.
+static void BuildLoopWorkStealing(ThreadState *thread_state)
+{
+    BuildQueue *queue = thread_state->m_Queue;
+
+    while(true)
+    {
+        if (PickAndDoResumeNodeTaskWithoutQueueLock(thread_state))
+            continue;
+
+        if (PickAndDoDeferredActionTaskWithoutQueueLock(thread_state))
+            continue;
+
+        if (PickAndDoProcessNodeTaskWithoutQueueLock(thread_state))
+            continue;
+
+        MutexLock(&queue->m_Lock);
+
+        bool keepRunning = true;
+        if (!PickAndDoDagVerificationTask(thread_state) && !PickAndDoEarlyStatTask(thread_state))
+        {
+            //announce that we are about to sleep before checking for work one final time. Threads that make work available check
+            //m_IdleThreadCount after publishing it, so either we see their work here, or they see us and wake us up.
+            AtomicIncrement(&queue->m_IdleThreadCount);
+
+            bool workAvailable = queue->m_ExitedActions != nullptr
+                || ((AtomicLoad(&queue->m_StealableNodeCount) > 0 || ActionResourcesMightAdmitDeferred(queue)) && IsAllowedToPickUpProcessNodeTaskWithoutQueueLock(queue));
+            if (!workAvailable)
+            {
+                keepRunning = MightMoreWorkArrive(queue);
+                if (keepRunning)
+                    SleepUntilWorkAvailable(thread_state);
+            }
+
+            AtomicDecrement(&queue->m_IdleThreadCount);
+        }
+
+        MutexUnlock(&queue->m_Lock);
+
+        if (!keepRunning)
+            break;
+    }
+
+    MutexLock(&queue->m_Lock);
+    //ensure to wake up all other buildthreads that might be waiting on this CV so they can exit too.
+    CondBroadcast(&queue->m_WorkAvailable);
+    CondBroadcast(&queue->m_BuildFinishedConditionalVariable);
+    MutexUnlock(&queue->m_Lock);
+    Log(kSpam, "build thread %d exiting\n", thread_state->m_ThreadIndex);
+}
+
 void BuildLoop(ThreadState *thread_state)
 {
     BuildQueue *queue = thread_state->m_Queue;
+    if (UsesWorkStealingScheduler(queue))
+    {
+        BuildLoopWorkStealing(thread_state);
+        return;
+    }
+
     {
         ProfilerScope scope("FirstLock", thread_state->m_ThreadIndex);
         MutexLock(&queue->m_Lock);
@@ -8,3 +8,4 @@ struct BuildQueue;
 void BuildLoop(ThreadState *thread_state);
 int EnqueueNodeWithoutWakingAwaiters(BuildQueue *queue, MemAllocLinear* scratch, RuntimeNode *runtime_node, RuntimeNode* queueing_node);
 void SortWorkingStack(BuildQueue* queue);
+void DistributeWorkStackOverStealingQueues(BuildQueue* queue);
@@ -9,7 +9,13 @@
 #include "Driver.hpp"
 #include "NodeResultPrinting.hpp"
 #include "BinLogFormat.hpp"
+#include "AllBuiltNodes.hpp"
+#include "Actions.hpp"
+#include "Stats.hpp"
+#include "CachePrefetch.hpp"
+#include "IoRing.hpp"
 #include <stdarg.h>
+#include <string.h>
 #include <algorithm>
 
 #include <stdio.h>
@@ -17,7 +23,7 @@
 
 using namespace BinLogFormat;
 
-static void ThreadStateInit(ThreadState *self, BuildQueue *queue, size_t scratch_size, int thread_index)
+void ThreadStateInit(ThreadState *self, BuildQueue *queue, size_t scratch_size, int thread_index)
 {
     HeapInit(&self->m_LocalHeap);
     LinearAllocInit(&self->m_ScratchAlloc, &self->m_LocalHeap, scratch_size, "thread-local scratch");
@@ -26,10 +32,12 @@ static void ThreadStateInit(ThreadState *self, BuildQueue *queue, size_t scratch
     self->m_GlobCausingFrontendRerun = nullptr;
     self->m_FileCausingFrontendRerun = nullptr;
     BufferInitWithCapacity(&self->m_TimestampStorage, &self->m_LocalHeap, 100);
+    self->m_IoRing = IoRingCreate(&self->m_LocalHeap);
 }
 
-static void ThreadStateDestroy(ThreadState *self)
+void ThreadStateDestroy(ThreadState *self)
 {
+    IoRingDestroy(self->m_IoRing);
     LinearAllocDestroy(&self->m_ScratchAlloc, true);
     BufferDestroy(&self->m_TimestampStorage, &self->m_LocalHeap);
     HeapDestroy(&self->m_LocalHeap);
@@ -48,6 +56,140 @@ static ThreadRoutineReturnType TUNDRA_STDCALL BuildThreadRoutine(void *param)
 
 
 
+static bool NodeHasAction(const Frozen::DagNode *dag_node)
+{
+    if ((dag_node->m_FlagsAndActionType & Frozen::DagNode::kFlagActionTypeMask) != ActionType::kRunShellCommand)
+        return true;
+    const char *cmd_line = dag_node->m_Action;
+    return cmd_line != nullptr && cmd_line[0] != '\0';
+}
+
+// For every node, the longest chain of costs from the node to the end of the build, its own cost included. A node is
+// visited once all of its backlinks have been, so nodes in a dependency cycle are left with just their own cost.
+static void CalculateBottomLevels(const Frozen::DagDerived *dag_derived, const uint64_t *costs, uint64_t *out_levels, MemAllocHeap *heap)
+{
+    int node_count = dag_derived->m_NodeCount;
+    int32_t *pending_backlinks = HeapAllocateArray<int32_t>(heap, node_count);
+    Buffer<int32_t> ready;
+    BufferInitWithCapacity(&ready, heap, node_count);
+
+    for (int i = 0; i < node_count; ++i)
+    {
+        out_levels[i] = costs[i];
+        pending_backlinks[i] = dag_derived->m_NodeBacklinks[i].GetCount();
+        if (pending_backlinks[i] == 0)
+            BufferAppendOne(&ready, heap, i);
+    }
+
+    while (ready.m_Size > 0)
+    {
+        int32_t node_index = BufferPopOne(&ready);
+
+        uint64_t longest_dependee = 0;
+        for (uint32_t backlink : dag_derived->m_NodeBacklinks[node_index])
+            longest_dependee = std::max(longest_dependee, out_levels[backlink]);
+        out_levels[node_index] = costs[node_index] + longest_dependee;
+
+        for (int32_t dep : dag_derived->m_CombinedDependencies[node_index])
+        {
+            if (--pending_backlinks[dep] == 0)
+                BufferAppendOne(&ready, heap, dep);
+        }
+    }
+
+    BufferDestroy(&ready, heap);
+    HeapFree(heap, pending_backlinks);
+}
+
+// The priority of a node is its bottom level: how long the longest chain of work is that can't finish before the node
+// itself has, using the execution times recorded by previous builds. Starting the nodes on the critical path first
+// keeps the build from ending with a long tail of serial work. A node that never ran gets the average execution time.
+// Without any recorded execution times we fall back to the static points from the dag.
+static void CalculateNodePriorities(BuildQueue *queue)
+{
+    MemAllocHeap *heap = queue->m_Config.m_Heap;
+    const Frozen::DagDerived *dag_derived = queue->m_Config.m_DagDerived;
+    const RuntimeNode *runtime_nodes = queue->m_Config.m_RuntimeNodes;
+    int node_count = dag_derived->m_NodeCount;
+
+    queue->m_NodePriorities = HeapAllocateArray<uint32_t>(heap, node_count);
+
+    uint64_t known_time = 0;
+    int known_count = 0;
+    for (int i = 0; i < node_count; ++i)
+    {
+        const Frozen::BuiltNode *built_node = runtime_nodes[i].m_BuiltNode;
+        if (built_node != nullptr && built_node->m_ExecutionTimeMs != 0)
+        {
+            known_time += built_node->m_ExecutionTimeMs;
+            known_count++;
+        }
+    }
+
+    if (known_count == 0)
+    {
+        memcpy(queue->m_NodePriorities, dag_derived->m_NodePoints.GetArray(), node_count * sizeof(uint32_t));
+        return;
+    }
+
+    uint64_t estimated_time = std::max<uint64_t>(known_time / known_count, 1);
+
+    uint64_t *costs = HeapAllocateArray<uint64_t>(heap, node_count);
+    uint64_t *levels = HeapAllocateArray<uint64_t>(heap, node_count);
+    for (int i = 0; i < node_count; ++i)
+    {
+        const Frozen::BuiltNode *built_node = runtime_nodes[i].m_BuiltNode;
+        if (built_node != nullptr && built_node->m_ExecutionTimeMs != 0)
+            costs[i] = built_node->m_ExecutionTimeMs;
+        else
+            costs[i] = NodeHasAction(runtime_nodes[i].m_DagNode) ? estimated_time : 0;
+    }
+
+    CalculateBottomLevels(dag_derived, costs, levels, heap);
+
+    uint64_t longest = 0;
+    for (int i = 0; i < node_count; ++i)
+    {
+        longest = std::max(longest, levels[i]);
+        queue->m_NodePriorities[i] = (uint32_t)std::min<uint64_t>(levels[i], UINT32_MAX);
+    }
+
+    Log(kDebug, "expected critical path: %llu ms (%d of %d nodes have a recorded execution time)", (unsigned long long)longest, known_count, node_count);
+
+    HeapFree(heap, levels);
+    HeapFree(heap, costs);
+}
+
+// The critical path using the execution times of this build is a lower bound for how long the build could have taken
+// with unlimited build threads.
+static void ReportCriticalPath(BuildQueue *queue)
+{
+    MemAllocHeap *heap = queue->m_Config.m_Heap;
+    const Frozen::DagDerived *dag_derived = queue->m_Config.m_DagDerived;
+    const RuntimeNode *runtime_nodes = queue->m_Config.m_RuntimeNodes;
+    int node_count = dag_derived->m_NodeCount;
+
+    uint64_t *costs = HeapAllocateArray<uint64_t>(heap, node_count);
+    uint64_t *levels = HeapAllocateArray<uint64_t>(heap, node_count);
+    for (int i = 0; i < node_count; ++i)
+        costs[i] = runtime_nodes[i].m_ExecutionTimeMs;
+
+    CalculateBottomLevels(dag_derived, costs, levels, heap);
+
+    uint64_t longest = 0;
+    for (int i = 0; i < node_count; ++i)
+        longest = std::max(longest, levels[i]);
+
+    HeapFree(heap, levels);
+    HeapFree(heap, costs);
+
+    g_Stats.m_CriticalPathTimeMs = longest;
+
+    double build_ms = TimerToSeconds(g_Stats.m_BuildTimeCycles) * 1000.0;
+    if (longest > 0)
+        Log(kDebug, "build took %.0f ms, %.2fx its critical path of %llu ms", build_ms, build_ms / longest, (unsigned long long)longest);
+}
+
 void BuildQueueInit(BuildQueue *queue, const BuildQueueConfig *config, const char** targets, int target_count)
 {
     ProfilerScope prof_scope("Tundra BuildQueueInit", 0);
@@ -63,6 +205,7 @@ void BuildQueueInit(BuildQueue *queue, const BuildQueueConfig *config, const cha
 
     BufferInitWithCapacity(&queue->m_WorkStack, heap, 1024);
     BufferInitWithCapacity(&queue->m_QueueForNonGeneratedFileToEartlyStat, heap, 1024);
+    BufferInitWithCapacity(&queue->m_QueueForPreviousImplicitInputsToEarlyStat, heap, 1024);
 
     HashSetInit(&queue->m_InputFilesAlreadyQueuedForEarlyStatting, heap);
 
@@ -71,17 +214,36 @@ void BuildQueueInit(BuildQueue *queue, const BuildQueueConfig *config, const cha
     queue->m_FinishedNodeCount = 0;
     queue->m_BuildFinishedConditionalVariableSignaled = false;
     queue->m_AmountOfNodesEverQueued = 0;
+    queue->m_NodePriorities = nullptr;
+    queue->m_BuildStartTime = 0;
     queue->m_DagVerificationStatus = config->m_DriverOptions->m_DeferDagVerification
             ? VerificationStatus::WaitingForBuildProgramInputToBecomeAvailable
             : VerificationStatus::RequiredVerification;
     queue->m_SharedResourcesCreated = HeapAllocateArrayZeroed<uint32_t>(heap, config->m_SharedResourcesCount);
     MutexInit(&queue->m_SharedResourcesLock);
+    ActionResourcesInit(queue);
 
     BufferInitWithCapacity(&queue->m_Config.m_RequestedNodes, queue->m_Config.m_Heap, 32);
     DriverSelectNodes(queue->m_Config.m_Dag, targets, target_count, &queue->m_Config.m_RequestedNodes,  queue->m_Config.m_Heap);
 
     SignalHandlerSetCondition(&queue->m_BuildFinishedConditionalVariable);
 
+    queue->m_StealingQueueCount = 0;
+    queue->m_StealableNodeCount = 0;
+    queue->m_IdleThreadCount = 0;
+    queue->m_RunningActions = nullptr;
+    queue->m_ExitedActions = nullptr;
+    queue->m_RunningActionCount = 0;
+    queue->m_ExitedActionCount = 0;
+    queue->m_CachePrefetch = nullptr;
+    if (queue->m_Config.m_Flags & BuildQueueConfig::kFlagWorkStealingScheduler)
+    {
+        // One queue per build thread, plus one for the main thread so queues can be indexed by thread index.
+        queue->m_StealingQueueCount = queue->m_Config.m_DriverOptions->m_ThreadCount + 1;
+        for (int i = 0; i < queue->m_StealingQueueCount; ++i)
+            WorkStealingQueueInit(&queue->m_StealingQueues[i], heap);
+    }
+
     // Create build threads.
     for (int i = 0, thread_count = queue->m_Config.m_DriverOptions->m_ThreadCount; i < thread_count; ++i)
     {
@@ -110,6 +272,8 @@ void BuildQueueDestroy(BuildQueue *queue)
         ThreadStateDestroy(&queue->m_ThreadState[i]);
     }
 
+    CachePrefetchDestroy(queue);
+
 
     {
         //It is an attractive optimization to destroy these resources before the threadjoins, so that the threadjoins take less time.
@@ -126,6 +290,10 @@ void BuildQueueDestroy(BuildQueue *queue)
     // Output any deferred error messages.
     PrintDeferredMessages(queue);
 
+    // Only now that all build threads are gone the execution times of the nodes are final.
+    if (queue->m_BuildStartTime != 0)
+        ReportCriticalPath(queue);
+
     ProfilerScope profile_scope("BuildQueueDestroyTail", 0);
     MemAllocHeap *heap = queue->m_Config.m_Heap;
     BufferDestroy(&queue->m_Config.m_RequestedNodes, heap);
@@ -133,11 +301,17 @@ void BuildQueueDestroy(BuildQueue *queue)
     // Deallocate storage.
     BufferDestroy(&queue->m_WorkStack, heap);
     BufferDestroy(&queue->m_QueueForNonGeneratedFileToEartlyStat, heap);
+    BufferDestroy(&queue->m_QueueForPreviousImplicitInputsToEarlyStat, heap);
+
+    for (int i = 0; i < queue->m_StealingQueueCount; ++i)
+        WorkStealingQueueDestroy(&queue->m_StealingQueues[i], heap);
 
     HashSetDestroy(&queue->m_InputFilesAlreadyQueuedForEarlyStatting);
 
     HeapFree(heap, queue->m_SharedResourcesCreated);
+    HeapFree(heap, queue->m_NodePriorities);
     MutexDestroy(&queue->m_SharedResourcesLock);
+    ActionResourcesDestroy(queue);
 
     CondDestroy(&queue->m_WorkAvailable);
 
@@ -150,6 +324,13 @@ void BuildQueueDestroy(BuildQueue *queue)
 
 BuildResult::Enum BuildQueueBuild(BuildQueue *queue, MemAllocLinear* scratch)
 {    
+    queue->m_BuildStartTime = TimerGet();
+
+    {
+        ProfilerScope scope("CalculateNodePriorities",0);
+        CalculateNodePriorities(queue);
+    }
+
     // Initialize build queue with index range to build
     RuntimeNode *runtime_nodes = queue->m_Config.m_RuntimeNodes;
     {
@@ -161,15 +342,30 @@ BuildResult::Enum BuildQueueBuild(BuildQueue *queue, MemAllocLinear* scratch)
         }
     }
 
+    if (queue->m_Config.m_Flags & BuildQueueConfig::kFlagWorkStealingScheduler)
+    {
+        ProfilerScope scope("DistributeWorkStack",0);
+        DistributeWorkStackOverStealingQueues(queue);
+    }
+    else
     {
         ProfilerScope scope("SortWorkingStack",0);
         SortWorkingStack(queue);
     }
 
+    {
+        ProfilerScope scope("CachePrefetchStart",0);
+        CachePrefetchStart(queue);
+    }
+
     CondBroadcast(&queue->m_WorkAvailable);
     CondWait(&queue->m_BuildFinishedConditionalVariable, &queue->m_Lock);
     MutexUnlock(&queue->m_Lock);
 
+    CachePrefetchStop(queue);
+
+    g_Stats.m_BuildTimeCycles = TimerGet() - queue->m_BuildStartTime;
+
     const char* signalReason = SignalGetReason();
     if (signalReason)
     {
@@ -11,13 +11,23 @@
 #include "BuildLoop.hpp"
 #include "Buffer.hpp"
 #include "BinLogFormat.hpp"
+#include "WorkStealingQueue.hpp"
 
 struct MemAllocHeap;
 struct RuntimeNode;
+struct RunningAction;
+struct DeferredAction;
 struct ScanCache;
 struct StatCache;
 struct DigestCache;
 struct DriverOptions;
+struct CachePrefetch;
+struct IoRing;
+
+namespace Frozen
+{
+    struct BuiltNode;
+}
 
 enum
 {
@@ -30,6 +40,13 @@ struct BuildQueueConfig
     {
         // Print command lines to the TTY as actions are executed.
         kFlagEchoCommandLines = 1 << 0,
+
+        // Hand out work through per-thread queues with work stealing, instead of through the single work stack.
+        kFlagWorkStealingScheduler = 1 << 1,
+
+        // Start shell command actions without blocking the build thread until the child exits, so the number of
+        // running processes is not tied to the number of build threads.
+        kFlagAsyncActions = 1 << 2,
     };
 
     const DriverOptions* m_DriverOptions;
@@ -66,6 +83,9 @@ struct ThreadState
     BuildQueue *m_Queue;
     Buffer<uint64_t> m_TimestampStorage;
 
+    // For stats and reads in batches, null where io_uring isn't available.
+    IoRing *m_IoRing;
+
     // For tracking which invalidated glob/file signature is causing a frontend rerun to be required
     // Only storing one of each type is sufficient for figuring out what message to give the user
     const Frozen::DagGlobSignature *m_GlobCausingFrontendRerun;
@@ -97,19 +117,61 @@ struct BuildQueue
     Buffer<int32_t> m_WorkStack;
     Buffer<const FrozenFileAndHash*> m_QueueForNonGeneratedFileToEartlyStat;
     HashSet<kFlagCaseSensitive> m_InputFilesAlreadyQueuedForEarlyStatting;
+    // Previous builds of queued nodes, whose implicit inputs are statted early on the guess that they are still included.
+    Buffer<const Frozen::BuiltNode*> m_QueueForPreviousImplicitInputsToEarlyStat;
 
     BuildQueueConfig m_Config;
 
+    // Scheduling priority of every dag node, higher goes first. See CalculateNodePriorities().
+    uint32_t *m_NodePriorities;
+    uint64_t m_BuildStartTime;
+
     BuildResult::Enum m_FinalBuildResult;
     uint32_t m_FinishedNodeCount;
     uint32_t m_AmountOfNodesEverQueued;
 
+    // Only used with BuildQueueConfig::kFlagWorkStealingScheduler. Indexed by thread index, so slot 0 belongs
+    // to the main thread. m_WorkStack is then only a staging area for nodes enqueued while holding m_Lock.
+    WorkStealingQueue m_StealingQueues[kMaxBuildThreads + 1];
+    int m_StealingQueueCount;
+    int32_t m_StealableNodeCount;
+    uint32_t m_IdleThreadCount;
+
+    // Only used with BuildQueueConfig::kFlagAsyncActions. Both lists are protected by m_Lock. Running actions are
+    // listed so sleeping threads can report on long running ones; exited ones wait for a thread to finish their node.
+    RunningAction *m_RunningActions;
+    RunningAction *m_ExitedActions;
+    int32_t m_RunningActionCount;
+    int32_t m_ExitedActionCount;
+
     ThreadId m_Threads[kMaxBuildThreads];
     ThreadState m_ThreadState[kMaxBuildThreads];
     uint32_t *m_SharedResourcesCreated;
     Mutex m_SharedResourcesLock;
+
+    // What the running actions take from the capacities declared in the dag, see ActionResourcesTryAcquire(). Protected
+    // by m_ActionResourcesLock. Actions waiting to fit are in m_DeferredActions, highest priority first. The version
+    // goes up whenever capacity is released or an action is deferred, so threads only look through the deferred
+    // actions again when one of them might fit.
+    Mutex m_ActionResourcesLock;
+    int64_t m_CpuCapacity;
+    int64_t m_MemoryCapacityMB;
+    int64_t m_CpuInUse;
+    int64_t m_MemoryInUseMB;
+    int32_t *m_SharedResourceUsers;
+    bool *m_SharedResourceHeldUp;
+    Buffer<DeferredAction*> m_DeferredActions;
+    int32_t m_DeferredActionCount;
+    uint32_t m_ActionResourcesVersion;
+    uint32_t m_ActionResourcesVersionWithoutAdmissions;
+
+    // Looks up cacheable nodes before the build threads get to them, null when the cache can't be asked in bulk.
+    CachePrefetch *m_CachePrefetch;
 };
 
+void ThreadStateInit(ThreadState *self, BuildQueue *queue, size_t scratch_size, int thread_index);
+void ThreadStateDestroy(ThreadState *self);
+
 void BuildQueueInit(BuildQueue *queue, const BuildQueueConfig *config, const char** targets, int target_count);
 
 BuildResult::Enum BuildQueueBuild(BuildQueue *queue, MemAllocLinear* scratch);
@@ -0,0 +1,215 @@
+#include "CacheBackend.hpp"
+#include "FileInfo.hpp"
+#include "MemAllocHeap.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(TUNDRA_UNIX)
+#include <sys/stat.h>
+#endif
+
+#include "Banned.hpp"
+
+static const size_t kCopyChunkSize = 64 * 1024;
+
+static void PutU32(uint8_t *dst, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        dst[i] = (uint8_t)(value >> (i * 8));
+}
+
+static void PutU64(uint8_t *dst, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        dst[i] = (uint8_t)(value >> (i * 8));
+}
+
+static uint32_t GetU32(const uint8_t *src)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= (uint32_t)src[i] << (i * 8);
+    return value;
+}
+
+static uint64_t GetU64(const uint8_t *src)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= (uint64_t)src[i] << (i * 8);
+    return value;
+}
+
+static uint32_t GetFileMode(FILE *f)
+{
+#if defined(TUNDRA_UNIX)
+    struct stat st;
+    if (0 == fstat(fileno(f), &st))
+        return (uint32_t)(st.st_mode & 07777);
+#endif
+    return 0;
+}
+
+bool CacheEntrySourceOpen(CacheEntrySource *source, MemAllocHeap *heap, const char *const *files, int file_count, const char *ingredients_file)
+{
+    source->m_Heap = heap;
+    source->m_FileCount = file_count;
+    source->m_Files = HeapAllocateArray<FILE *>(heap, file_count + 1);
+    source->m_Modes = HeapAllocateArray<uint32_t>(heap, file_count + 1);
+    source->m_Sizes = HeapAllocateArray<uint64_t>(heap, file_count + 1);
+    source->m_EntrySize = 8 + 12 * (uint64_t)file_count + 8;
+
+    bool ok = true;
+    for (int i = 0; i <= file_count; ++i)
+    {
+        const char *path = i < file_count ? files[i] : ingredients_file;
+        FILE *f = nullptr;
+        if (ok && path)
+        {
+            f = GetFileInfo(path).IsFile() ? OpenFile(path, "rb") : nullptr;
+            ok = f != nullptr;
+        }
+
+        source->m_Files[i] = f;
+        source->m_Modes[i] = 0;
+        source->m_Sizes[i] = 0;
+        if (f)
+        {
+            fseek(f, 0, SEEK_END);
+            source->m_Sizes[i] = (uint64_t)ftell(f);
+            source->m_Modes[i] = GetFileMode(f);
+            source->m_EntrySize += source->m_Sizes[i];
+        }
+    }
+
+    if (!ok)
+        CacheEntrySourceClose(source);
+    return ok;
+}
+
+void CacheEntrySourceClose(CacheEntrySource *source)
+{
+    for (int i = 0; i <= source->m_FileCount; ++i)
+    {
+        if (source->m_Files[i])
+            fclose(source->m_Files[i]);
+    }
+    HeapFree(source->m_Heap, source->m_Sizes);
+    HeapFree(source->m_Heap, source->m_Modes);
+    HeapFree(source->m_Heap, source->m_Files);
+}
+
+// Writes the header with the size filled in at size_offset, then exactly size bytes of f.
+static bool WriteFileContents(CacheEntryWriteFunc write, void *user_data, FILE *f, uint64_t size, const uint8_t *header, size_t header_size, size_t size_offset)
+{
+    uint8_t header_with_size[16];
+    memcpy(header_with_size, header, header_size);
+    PutU64(header_with_size + size_offset, size);
+
+    bool ok = write(user_data, header_with_size, header_size);
+    if (ok && f)
+        ok = 0 == fseek(f, 0, SEEK_SET);
+
+    char chunk[kCopyChunkSize];
+    uint64_t remaining = size;
+    while (ok && remaining > 0)
+    {
+        size_t n = fread(chunk, 1, remaining < sizeof(chunk) ? (size_t)remaining : sizeof(chunk), f);
+        if (n == 0)
+        {
+            ok = false;
+            break;
+        }
+        ok = write(user_data, chunk, n);
+        remaining -= n;
+    }
+
+    return ok;
+}
+
+bool CacheEntryWrite(CacheEntryWriteFunc write, void *user_data, const CacheEntrySource *source)
+{
+    int file_count = source->m_FileCount;
+
+    uint8_t header[8];
+    PutU32(header, kCacheEntryMagic);
+    PutU32(header + 4, (uint32_t)file_count);
+    if (!write(user_data, header, sizeof(header)))
+        return false;
+
+    for (int i = 0; i < file_count; ++i)
+    {
+        uint8_t file_header[12];
+        PutU32(file_header, source->m_Modes[i]);
+        if (!WriteFileContents(write, user_data, source->m_Files[i], source->m_Sizes[i], file_header, sizeof(file_header), 4))
+            return false;
+    }
+
+    uint8_t ingredients_header[8];
+    return WriteFileContents(write, user_data, source->m_Files[file_count], source->m_Sizes[file_count], ingredients_header, sizeof(ingredients_header), 0);
+}
+
+// Copies size bytes from the entry into f, or skips them if f is null.
+static bool ReadFileContents(CacheEntryReadFunc read, void *user_data, FILE *f, uint64_t size)
+{
+    char chunk[kCopyChunkSize];
+    bool write_ok = true;
+    while (size > 0)
+    {
+        size_t n = size < sizeof(chunk) ? (size_t)size : sizeof(chunk);
+        if (!read(user_data, chunk, n))
+            return false;
+        if (f && write_ok)
+            write_ok = n == fwrite(chunk, 1, n, f);
+        size -= n;
+    }
+    return write_ok;
+}
+
+CacheResult::Enum CacheEntryRead(CacheEntryReadFunc read, void *user_data, const char *const *files, int file_count)
+{
+    uint8_t header[8];
+    if (!read(user_data, header, sizeof(header)))
+        return CacheResult::Failure;
+
+    if (GetU32(header) != kCacheEntryMagic || GetU32(header + 4) != (uint32_t)file_count)
+        return CacheResult::CacheMiss;
+
+    for (int i = 0; i < file_count; ++i)
+    {
+        uint8_t file_header[12];
+        if (!read(user_data, file_header, sizeof(file_header)))
+            return CacheResult::Failure;
+
+        uint32_t mode = GetU32(file_header);
+        uint64_t size = GetU64(file_header + 4);
+
+        // Remove it first, the previous output might be read-only or a hardlink into somewhere else.
+        RemoveFileOrDir(files[i]);
+        FILE *f = OpenFile(files[i], "wb");
+        bool ok = f != nullptr && ReadFileContents(read, user_data, f, size);
+        if (f)
+            ok = (0 == fclose(f)) && ok;
+        if (!ok)
+        {
+            Log(kWarning, "cache: failed to write %s", files[i]);
+            return CacheResult::Failure;
+        }
+
+#if defined(TUNDRA_UNIX)
+        if (mode != 0)
+            chmod(files[i], (mode_t)mode);
+#else
+        (void)mode;
+#endif
+    }
+
+    uint8_t ingredients_header[8];
+    if (!read(user_data, ingredients_header, sizeof(ingredients_header)))
+        return CacheResult::Failure;
+    if (!ReadFileContents(read, user_data, nullptr, GetU64(ingredients_header)))
+        return CacheResult::Failure;
+
+    return CacheResult::Success;
+}
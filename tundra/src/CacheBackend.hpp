@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Hash.hpp"
+#include "CacheClient.hpp"
+
+#include <stdio.h>
+
+struct MemAllocHeap;
+
+// An in-process cache backend. The cache maps the leaf input signature of a node to the contents of its output
+// files. Backends are shared by all build threads, so all functions must be thread safe.
+struct CacheBackend
+{
+    const char *m_Name;
+
+    // Ask about many keys in one go; sets out_present[i] for each keys[i]. Returns false if the cache couldn't be asked,
+    // out_present is unspecified then.
+    bool (*m_Contains)(CacheBackend *self, const HashDigest *keys, int key_count, bool *out_present);
+
+    // Write the cached outputs for key over files[0..file_count).
+    CacheResult::Enum (*m_Read)(CacheBackend *self, const HashDigest &key, const char *const *files, int file_count);
+
+    // Store files[0..file_count) under key, along with the ingredients of the signature if ingredients_file isn't null.
+    CacheResult::Enum (*m_Write)(CacheBackend *self, const HashDigest &key, const char *const *files, int file_count, const char *ingredients_file);
+
+    void (*m_Destroy)(CacheBackend *self);
+};
+
+// Cache entries are stored in a cache directory, for example on a network share. root must exist.
+CacheBackend *CacheBackendCreateFileSystem(MemAllocHeap *heap, const char *root);
+
+// Cache entries are stored on an http server at address (host:port), with
+//   POST /contains        a body of one hex key per line, answered with one '0' or '1' per key
+//   GET  /entries/<key>   the entry, 404 if there is none
+//   PUT  /entries/<key>   store the entry
+// Connections are kept alive and shared by the build threads.
+CacheBackend *CacheBackendCreateHttp(MemAllocHeap *heap, const char *address);
+
+// Cache entries are stored content addressed in a directory on this machine, meant to sit in front of a shared cache.
+// If use_hardlinks is set, outputs are restored as hardlinks into the store, which must then never be modified in place.
+// Outputs that can't be linked, or whose stored file has a different mode, are restored as copy-on-write clones where
+// the file system supports them and as copies otherwise. Least recently used files are removed at the end
+// of a build that took the store past max_size bytes. The ingredients of the signatures are not kept. root is created
+// if it doesn't exist.
+CacheBackend *CacheBackendCreateLocal(MemAllocHeap *heap, const char *root, uint64_t max_size, bool use_hardlinks);
+
+// Serialized form of a cache entry, used by the backends that keep an entry in one piece. Little endian:
+//   uint32_t magic, uint32_t file_count,
+//   file_count times: uint32_t mode, uint64_t size, size bytes,
+//   uint64_t ingredients size, ingredients bytes.
+enum
+{
+    kCacheEntryMagic = 0x31454354
+};
+
+typedef bool (*CacheEntryWriteFunc)(void *user_data, const void *data, size_t size);
+typedef bool (*CacheEntryReadFunc)(void *user_data, void *data, size_t size);
+
+// The files of an entry that is about to be written, opened once so that the size of the entry and the bytes that
+// are written come from the same handles, even if the files change in between.
+struct CacheEntrySource
+{
+    MemAllocHeap *m_Heap;
+    int m_FileCount;
+    FILE **m_Files; // m_FileCount files, then the ingredients file or null
+    uint32_t *m_Modes;
+    uint64_t *m_Sizes;
+    uint64_t m_EntrySize;
+};
+
+// Returns false, with nothing left open, if one of the files can't be opened.
+bool CacheEntrySourceOpen(CacheEntrySource *source, MemAllocHeap *heap, const char *const *files, int file_count, const char *ingredients_file);
+void CacheEntrySourceClose(CacheEntrySource *source);
+
+// Writes exactly source->m_EntrySize bytes, or fails. Starts from the beginning of the files every time, so a
+// failed write can be retried with the same source.
+bool CacheEntryWrite(CacheEntryWriteFunc write, void *user_data, const CacheEntrySource *source);
+
+// Unpack an entry over files[0..file_count). Returns CacheMiss if the entry is for a different number of files or
+// in an older format, Failure if it couldn't be read or written out.
+CacheResult::Enum CacheEntryRead(CacheEntryReadFunc read, void *user_data, const char *const *files, int file_count);
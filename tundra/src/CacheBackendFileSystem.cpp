@@ -0,0 +1,144 @@
+#include "CacheBackend.hpp"
+#include "MemAllocHeap.hpp"
+#include "FileInfo.hpp"
+#include "Atomic.hpp"
+#include "PathUtil.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(TUNDRA_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "Banned.hpp"
+
+// Entries live in <root>/<first two digits of the key>/<key>, one file each. They are written next to where they go
+// and renamed into place, so readers never see half an entry and concurrent writers of the same key don't mix.
+struct CacheBackendFileSystem
+{
+    CacheBackend m_Backend;
+    MemAllocHeap *m_Heap;
+    char m_Root[kMaxPathLength];
+};
+
+static uint32_t s_TempFileCounter;
+
+// Returns false if the paths don't fit in kMaxPathLength.
+static bool EntryPath(CacheBackendFileSystem *self, const HashDigest &key, char *out_dir, char *out_path)
+{
+    char digest[kDigestStringSize];
+    DigestToString(digest, key);
+    int dir_len = snprintf(out_dir, kMaxPathLength, "%s/%.2s", self->m_Root, digest);
+    int path_len = snprintf(out_path, kMaxPathLength, "%s/%s", out_dir, digest);
+    return dir_len < kMaxPathLength && path_len < kMaxPathLength;
+}
+
+static bool FileSystemContains(CacheBackend *backend, const HashDigest *keys, int key_count, bool *out_present)
+{
+    CacheBackendFileSystem *self = (CacheBackendFileSystem *)backend;
+    for (int i = 0; i < key_count; ++i)
+    {
+        char dir[kMaxPathLength], path[kMaxPathLength];
+        out_present[i] = EntryPath(self, keys[i], dir, path) && GetFileInfo(path).IsFile();
+    }
+    return true;
+}
+
+static bool ReadFromFile(void *user_data, void *data, size_t size)
+{
+    return size == fread(data, 1, size, (FILE *)user_data);
+}
+
+static bool WriteToFile(void *user_data, const void *data, size_t size)
+{
+    return size == fwrite(data, 1, size, (FILE *)user_data);
+}
+
+static CacheResult::Enum FileSystemRead(CacheBackend *backend, const HashDigest &key, const char *const *files, int file_count)
+{
+    CacheBackendFileSystem *self = (CacheBackendFileSystem *)backend;
+    char dir[kMaxPathLength], path[kMaxPathLength];
+    if (!EntryPath(self, key, dir, path))
+        return CacheResult::CacheMiss;
+
+    FILE *f = OpenFile(path, "rb");
+    if (!f)
+        return CacheResult::CacheMiss;
+
+    CacheResult::Enum result = CacheEntryRead(ReadFromFile, f, files, file_count);
+    fclose(f);
+    return result;
+}
+
+static CacheResult::Enum FileSystemWrite(CacheBackend *backend, const HashDigest &key, const char *const *files, int file_count, const char *ingredients_file)
+{
+    CacheBackendFileSystem *self = (CacheBackendFileSystem *)backend;
+    char dir[kMaxPathLength], path[kMaxPathLength];
+    if (!EntryPath(self, key, dir, path))
+        return CacheResult::Failure;
+
+    if (!GetFileInfo(dir).IsDirectory() && !MakeDirectory(dir) && !GetFileInfo(dir).IsDirectory())
+    {
+        Log(kWarning, "cache: couldn't create %s", dir);
+        return CacheResult::Failure;
+    }
+
+#if defined(TUNDRA_WIN32)
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    char temp_path[kMaxPathLength];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.%lu.%u.tmp", path, pid, AtomicIncrement(&s_TempFileCounter)) >= (int)sizeof(temp_path))
+        return CacheResult::Failure;
+
+    CacheEntrySource source;
+    if (!CacheEntrySourceOpen(&source, self->m_Heap, files, file_count, ingredients_file))
+        return CacheResult::Failure;
+
+    FILE *f = OpenFile(temp_path, "wb");
+    if (!f)
+    {
+        Log(kWarning, "cache: couldn't create %s", temp_path);
+        CacheEntrySourceClose(&source);
+        return CacheResult::Failure;
+    }
+
+    bool ok = CacheEntryWrite(WriteToFile, f, &source);
+    ok = (0 == fclose(f)) && ok;
+    CacheEntrySourceClose(&source);
+
+    if (ok && RenameFile(temp_path, path))
+        return CacheResult::Success;
+
+    RemoveFileOrDir(temp_path);
+    return CacheResult::Failure;
+}
+
+static void FileSystemDestroy(CacheBackend *backend)
+{
+    CacheBackendFileSystem *self = (CacheBackendFileSystem *)backend;
+    HeapFree(self->m_Heap, self);
+}
+
+CacheBackend *CacheBackendCreateFileSystem(MemAllocHeap *heap, const char *root)
+{
+    if (!GetFileInfo(root).IsDirectory())
+    {
+        Log(kError, "cache: %s is not a directory", root);
+        return nullptr;
+    }
+
+    CacheBackendFileSystem *self = HeapAllocateArray<CacheBackendFileSystem>(heap, 1);
+    self->m_Backend.m_Name = "filesystem";
+    self->m_Backend.m_Contains = FileSystemContains;
+    self->m_Backend.m_Read = FileSystemRead;
+    self->m_Backend.m_Write = FileSystemWrite;
+    self->m_Backend.m_Destroy = FileSystemDestroy;
+    self->m_Heap = heap;
+    snprintf(self->m_Root, sizeof(self->m_Root), "%s", root);
+    return &self->m_Backend;
+}
@@ -0,0 +1,538 @@
+// winsock2.h has to come before anything that pulls in windows.h
+#if defined(TUNDRA_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#endif
+
+#include "CacheBackend.hpp"
+#include "MemAllocHeap.hpp"
+#include "Buffer.hpp"
+#include "Mutex.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(TUNDRA_UNIX)
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "Banned.hpp"
+
+#if defined(TUNDRA_WIN32)
+typedef SOCKET Socket;
+static const Socket kInvalidSocket = INVALID_SOCKET;
+#define CloseSocket closesocket
+#else
+typedef int Socket;
+static const Socket kInvalidSocket = -1;
+#define CloseSocket close
+#endif
+
+#if defined(MSG_NOSIGNAL)
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+// A stuck server shouldn't hang the build; after this long the operation fails like any other cache failure.
+static const int kSocketTimeoutSeconds = 60;
+
+static const size_t kConnectionBufferSize = 64 * 1024;
+
+struct HttpConnection
+{
+    Socket m_Socket;
+    bool m_Broken;
+
+    size_t m_ReadPos;
+    size_t m_ReadEnd;
+    size_t m_WriteEnd;
+    uint64_t m_BodyRemaining;
+
+    char m_ReadBuffer[kConnectionBufferSize];
+    char m_WriteBuffer[kConnectionBufferSize];
+};
+
+struct CacheBackendHttp
+{
+    CacheBackend m_Backend;
+    MemAllocHeap *m_Heap;
+    char m_Address[256];
+
+    struct sockaddr_storage m_SocketAddress;
+    int m_SocketAddressLength;
+
+    // Connections not in use by a request right now. A build thread takes one for the duration of a request and
+    // puts it back afterwards, so there are never more connections than threads talking to the cache at once.
+    Mutex m_Lock;
+    Buffer<HttpConnection *> m_IdleConnections;
+};
+
+static void CloseConnection(CacheBackendHttp *self, HttpConnection *conn)
+{
+    CloseSocket(conn->m_Socket);
+    HeapFree(self->m_Heap, conn);
+}
+
+static HttpConnection *OpenConnection(CacheBackendHttp *self)
+{
+    Socket s = socket(self->m_SocketAddress.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == kInvalidSocket)
+        return nullptr;
+
+#if defined(TUNDRA_WIN32)
+    DWORD timeout = kSocketTimeoutSeconds * 1000;
+#else
+    struct timeval timeout = {kSocketTimeoutSeconds, 0};
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+
+    // Requests are small and answered right away, don't let Nagle hold them back.
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+#if defined(SO_NOSIGPIPE)
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const char *)&one, sizeof(one));
+#endif
+
+    if (0 != connect(s, (const struct sockaddr *)&self->m_SocketAddress, self->m_SocketAddressLength))
+    {
+        CloseSocket(s);
+        return nullptr;
+    }
+
+    HttpConnection *conn = HeapAllocateArray<HttpConnection>(self->m_Heap, 1);
+    conn->m_Socket = s;
+    conn->m_Broken = false;
+    return conn;
+}
+
+static HttpConnection *AcquireConnection(CacheBackendHttp *self, bool *out_reused)
+{
+    HttpConnection *conn = nullptr;
+
+    MutexLock(&self->m_Lock);
+    if (self->m_IdleConnections.m_Size > 0)
+        conn = BufferPopOne(&self->m_IdleConnections);
+    MutexUnlock(&self->m_Lock);
+
+    *out_reused = conn != nullptr;
+    if (conn == nullptr)
+        conn = OpenConnection(self);
+
+    if (conn)
+    {
+        conn->m_ReadPos = conn->m_ReadEnd = conn->m_WriteEnd = 0;
+        conn->m_BodyRemaining = 0;
+    }
+    return conn;
+}
+
+static void ReleaseConnection(CacheBackendHttp *self, HttpConnection *conn)
+{
+    if (conn->m_Broken)
+    {
+        CloseConnection(self, conn);
+        return;
+    }
+
+    MutexLock(&self->m_Lock);
+    BufferAppendOne(&self->m_IdleConnections, self->m_Heap, conn);
+    MutexUnlock(&self->m_Lock);
+}
+
+static bool SendAll(HttpConnection *conn, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        int n = send(conn->m_Socket, data, (int)(size < 0x40000000 ? size : 0x40000000), kSendFlags);
+        if (n <= 0)
+        {
+#if defined(TUNDRA_UNIX)
+            if (n < 0 && errno == EINTR)
+                continue;
+#endif
+            conn->m_Broken = true;
+            return false;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+static bool Flush(HttpConnection *conn)
+{
+    bool ok = SendAll(conn, conn->m_WriteBuffer, conn->m_WriteEnd);
+    conn->m_WriteEnd = 0;
+    return ok;
+}
+
+static bool Write(void *user_data, const void *data, size_t size)
+{
+    HttpConnection *conn = (HttpConnection *)user_data;
+    if (conn->m_WriteEnd + size > sizeof(conn->m_WriteBuffer))
+    {
+        if (!Flush(conn))
+            return false;
+        if (size > sizeof(conn->m_WriteBuffer))
+            return SendAll(conn, (const char *)data, size);
+    }
+    memcpy(conn->m_WriteBuffer + conn->m_WriteEnd, data, size);
+    conn->m_WriteEnd += size;
+    return true;
+}
+
+static bool Fill(HttpConnection *conn)
+{
+    for (;;)
+    {
+        int n = recv(conn->m_Socket, conn->m_ReadBuffer, (int)sizeof(conn->m_ReadBuffer), 0);
+        if (n > 0)
+        {
+            conn->m_ReadPos = 0;
+            conn->m_ReadEnd = (size_t)n;
+            return true;
+        }
+#if defined(TUNDRA_UNIX)
+        if (n < 0 && errno == EINTR)
+            continue;
+#endif
+        conn->m_Broken = true;
+        return false;
+    }
+}
+
+static bool ReadRaw(HttpConnection *conn, void *data, size_t size)
+{
+    char *dst = (char *)data;
+    while (size > 0)
+    {
+        if (conn->m_ReadPos == conn->m_ReadEnd && !Fill(conn))
+            return false;
+        size_t n = conn->m_ReadEnd - conn->m_ReadPos;
+        if (n > size)
+            n = size;
+        memcpy(dst, conn->m_ReadBuffer + conn->m_ReadPos, n);
+        conn->m_ReadPos += n;
+        dst += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Reads from the body of the response, never past it.
+static bool ReadBody(void *user_data, void *data, size_t size)
+{
+    HttpConnection *conn = (HttpConnection *)user_data;
+    if (size > conn->m_BodyRemaining)
+        return false;
+    conn->m_BodyRemaining -= size;
+    return ReadRaw(conn, data, size);
+}
+
+static bool SkipBody(HttpConnection *conn)
+{
+    char chunk[4096];
+    while (conn->m_BodyRemaining > 0)
+    {
+        size_t n = conn->m_BodyRemaining < sizeof(chunk) ? (size_t)conn->m_BodyRemaining : sizeof(chunk);
+        if (!ReadBody(conn, chunk, n))
+            return false;
+    }
+    return true;
+}
+
+static bool ReadLine(HttpConnection *conn, char *line, size_t line_size)
+{
+    size_t len = 0;
+    for (;;)
+    {
+        char c;
+        if (!ReadRaw(conn, &c, 1))
+            return false;
+        if (c == '\n')
+            break;
+        if (len + 1 >= line_size)
+        {
+            conn->m_Broken = true;
+            return false;
+        }
+        line[len++] = c;
+    }
+    if (len > 0 && line[len - 1] == '\r')
+        --len;
+    line[len] = '\0';
+    return true;
+}
+
+static bool HeaderIs(const char *line, const char *name, const char **out_value)
+{
+    size_t len = strlen(name);
+#if defined(TUNDRA_WIN32)
+    if (0 != _strnicmp(line, name, len) || line[len] != ':')
+#else
+    if (0 != strncasecmp(line, name, len) || line[len] != ':')
+#endif
+        return false;
+    const char *value = line + len + 1;
+    while (*value == ' ' || *value == '\t')
+        ++value;
+    *out_value = value;
+    return true;
+}
+
+// Reads the status line and headers, leaving the connection at the start of the body. Returns the status code, or -1
+// if no response could be read.
+static int ReadResponseHead(HttpConnection *conn)
+{
+    char line[8192];
+    if (!ReadLine(conn, line, sizeof(line)))
+        return -1;
+
+    int status = -1;
+    if (1 != sscanf(line, "HTTP/%*d.%*d %d", &status))
+    {
+        conn->m_Broken = true;
+        return -1;
+    }
+
+    bool have_length = false;
+    for (;;)
+    {
+        if (!ReadLine(conn, line, sizeof(line)))
+            return -1;
+        if (line[0] == '\0')
+            break;
+
+        const char *value;
+        if (HeaderIs(line, "Content-Length", &value))
+        {
+            conn->m_BodyRemaining = strtoull(value, nullptr, 10);
+            have_length = true;
+        }
+        else if (HeaderIs(line, "Connection", &value) && 0 == strncmp(value, "close", 5))
+        {
+            conn->m_Broken = true;
+        }
+    }
+
+    // Without a length the body runs until the server closes the connection. Our servers don't do that, and
+    // rather than supporting it we don't reuse such a connection.
+    if (!have_length)
+        conn->m_Broken = true;
+
+    return status;
+}
+
+static bool SendRequestHead(HttpConnection *conn, CacheBackendHttp *self, const char *method, const char *path, uint64_t content_length)
+{
+    char head[1024];
+    int len = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %" PRIu64 "\r\n\r\n", method, path, self->m_Address, content_length);
+    return Write(conn, head, (size_t)len);
+}
+
+static void EntryPath(const HashDigest &key, char *out_path, size_t out_size)
+{
+    char digest[kDigestStringSize];
+    DigestToString(digest, key);
+    snprintf(out_path, out_size, "/entries/%s", digest);
+}
+
+// Runs one request, retrying once on a fresh connection when a pooled one turns out to have been closed by the
+// server in the meantime. send_body writes content_length bytes; on success the connection is returned with
+// the head of the response read. Returns nullptr if the server couldn't be reached.
+template <typename SendBody>
+static HttpConnection *Request(CacheBackendHttp *self, const char *method, const char *path, uint64_t content_length, SendBody send_body, int *out_status)
+{
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        bool reused;
+        HttpConnection *conn = AcquireConnection(self, &reused);
+        if (conn == nullptr)
+            return nullptr;
+
+        if (SendRequestHead(conn, self, method, path, content_length) && send_body(conn) && Flush(conn))
+        {
+            int status = ReadResponseHead(conn);
+            if (status != -1)
+            {
+                *out_status = status;
+                return conn;
+            }
+        }
+
+        conn->m_Broken = true;
+        ReleaseConnection(self, conn);
+        if (!reused)
+            break;
+    }
+    return nullptr;
+}
+
+static bool HttpContains(CacheBackend *backend, const HashDigest *keys, int key_count, bool *out_present)
+{
+    CacheBackendHttp *self = (CacheBackendHttp *)backend;
+
+    // Every key is its hex digest plus a newline.
+    uint64_t content_length = (uint64_t)key_count * kDigestStringSize;
+    auto send_keys = [&](HttpConnection *conn) {
+        for (int i = 0; i < key_count; ++i)
+        {
+            char line[kDigestStringSize];
+            DigestToString(line, keys[i]);
+            line[kDigestStringSize - 1] = '\n';
+            if (!Write(conn, line, sizeof(line)))
+                return false;
+        }
+        return true;
+    };
+
+    int status;
+    HttpConnection *conn = Request(self, "POST", "/contains", content_length, send_keys, &status);
+    if (conn == nullptr)
+        return false;
+
+    bool ok = status == 200 && conn->m_BodyRemaining == (uint64_t)key_count;
+    for (int i = 0; ok && i < key_count; ++i)
+    {
+        char c;
+        ok = ReadBody(conn, &c, 1);
+        if (ok)
+            out_present[i] = c == '1';
+    }
+
+    if (!SkipBody(conn))
+        conn->m_Broken = true;
+    ReleaseConnection(self, conn);
+    return ok;
+}
+
+static CacheResult::Enum HttpRead(CacheBackend *backend, const HashDigest &key, const char *const *files, int file_count)
+{
+    CacheBackendHttp *self = (CacheBackendHttp *)backend;
+    char path[128];
+    EntryPath(key, path, sizeof(path));
+
+    int status;
+    HttpConnection *conn = Request(self, "GET", path, 0, [](HttpConnection *) { return true; }, &status);
+    if (conn == nullptr)
+        return CacheResult::Failure;
+
+    CacheResult::Enum result;
+    if (status == 200)
+        result = CacheEntryRead(ReadBody, conn, files, file_count);
+    else if (status == 404)
+        result = CacheResult::CacheMiss;
+    else
+        result = CacheResult::Failure;
+
+    if (!SkipBody(conn))
+        conn->m_Broken = true;
+    ReleaseConnection(self, conn);
+    return result;
+}
+
+static CacheResult::Enum HttpWrite(CacheBackend *backend, const HashDigest &key, const char *const *files, int file_count, const char *ingredients_file)
+{
+    CacheBackendHttp *self = (CacheBackendHttp *)backend;
+    char path[128];
+    EntryPath(key, path, sizeof(path));
+
+    CacheEntrySource source;
+    if (!CacheEntrySourceOpen(&source, self->m_Heap, files, file_count, ingredients_file))
+        return CacheResult::Failure;
+
+    auto send_entry = [&](HttpConnection *conn) {
+        return CacheEntryWrite(Write, conn, &source);
+    };
+
+    int status;
+    HttpConnection *conn = Request(self, "PUT", path, source.m_EntrySize, send_entry, &status);
+    CacheEntrySourceClose(&source);
+    if (conn == nullptr)
+        return CacheResult::Failure;
+
+    if (!SkipBody(conn))
+        conn->m_Broken = true;
+    ReleaseConnection(self, conn);
+    return status >= 200 && status < 300 ? CacheResult::Success : CacheResult::Failure;
+}
+
+static void HttpDestroy(CacheBackend *backend)
+{
+    CacheBackendHttp *self = (CacheBackendHttp *)backend;
+    for (HttpConnection *conn : self->m_IdleConnections)
+        CloseConnection(self, conn);
+    BufferDestroy(&self->m_IdleConnections, self->m_Heap);
+    MutexDestroy(&self->m_Lock);
+    HeapFree(self->m_Heap, self);
+#if defined(TUNDRA_WIN32)
+    WSACleanup();
+#endif
+}
+
+CacheBackend *CacheBackendCreateHttp(MemAllocHeap *heap, const char *address)
+{
+#if defined(TUNDRA_WIN32)
+    WSADATA wsa_data;
+    if (0 != WSAStartup(MAKEWORD(2, 2), &wsa_data))
+    {
+        Log(kError, "cache: couldn't initialize winsock");
+        return nullptr;
+    }
+#endif
+
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (colon == nullptr || colon == address || (size_t)(colon - address) >= sizeof(host))
+    {
+        Log(kError, "cache: expected host:port, got '%s'", address);
+#if defined(TUNDRA_WIN32)
+        WSACleanup();
+#endif
+        return nullptr;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses = nullptr;
+    if (0 != getaddrinfo(host, colon + 1, &hints, &addresses) || addresses == nullptr)
+    {
+        Log(kError, "cache: couldn't resolve '%s'", address);
+#if defined(TUNDRA_WIN32)
+        WSACleanup();
+#endif
+        return nullptr;
+    }
+
+    CacheBackendHttp *self = HeapAllocateArray<CacheBackendHttp>(heap, 1);
+    self->m_Backend.m_Name = "http";
+    self->m_Backend.m_Contains = HttpContains;
+    self->m_Backend.m_Read = HttpRead;
+    self->m_Backend.m_Write = HttpWrite;
+    self->m_Backend.m_Destroy = HttpDestroy;
+    self->m_Heap = heap;
+    snprintf(self->m_Address, sizeof(self->m_Address), "%s", address);
+    memcpy(&self->m_SocketAddress, addresses->ai_addr, addresses->ai_addrlen);
+    self->m_SocketAddressLength = (int)addresses->ai_addrlen;
+    freeaddrinfo(addresses);
+
+    MutexInit(&self->m_Lock);
+    BufferInit(&self->m_IdleConnections);
+    return &self->m_Backend;
+}
@@ -0,0 +1,539 @@
+#include "CacheBackend.hpp"
+#include "MemAllocHeap.hpp"
+#include "FileInfo.hpp"
+#include "Atomic.hpp"
+#include "PathUtil.hpp"
+#include "Buffer.hpp"
+#include "HashTable.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#if defined(TUNDRA_WIN32)
+#include <windows.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#endif
+
+#if defined(TUNDRA_LINUX)
+#include <linux/fs.h>
+#ifdef FICLONE
+#include <sys/ioctl.h>
+#endif
+#endif
+
+#if defined(TUNDRA_APPLE)
+#include <sys/clonefile.h>
+#endif
+
+#include "Banned.hpp"
+
+// A content addressed store on the local disk:
+//   <root>/objects/<first two digits>/<content digest>   the contents of an output file
+//   <root>/entries/<first two digits>/<signature>        which objects make up the outputs for a signature
+// Outputs that are the same for many signatures, which is most of them when switching back and forth between
+// branches, are only stored once. Everything is written next to where it goes and renamed into place. The store only
+// ever lives on this machine, so entries are in native byte order.
+//
+// Reading an entry touches the entry file. Objects are never touched: outputs restored as hardlinks share their
+// timestamp, and changing it would make nodes that depend on them rebuild. Instead an object counts as used as
+// recently as the newest entry that refers to it. When the store grows past its size the least recently used files
+// are removed, see Evict(). An entry whose objects were evicted reads as a miss.
+struct CacheBackendLocal
+{
+    CacheBackend m_Backend;
+    MemAllocHeap *m_Heap;
+    char m_Root[kMaxPathLength];
+    uint64_t m_MaxSize;
+    bool m_UseHardlinks;
+    uint64_t m_BytesAdded;
+};
+
+enum
+{
+    kLocalEntryMagic = 0x314c4354
+};
+
+struct LocalEntryHeader
+{
+    uint32_t m_Magic;
+    uint32_t m_FileCount;
+};
+
+struct LocalEntryFile
+{
+    uint32_t m_Mode;
+    uint32_t m_Padding;
+    uint64_t m_Size;
+    HashDigest m_Content;
+};
+
+static const size_t kCopyChunkSize = 64 * 1024;
+
+static uint32_t s_TempFileCounter;
+
+// Returns false if the paths don't fit in kMaxPathLength.
+static bool StorePath(CacheBackendLocal *self, const char *kind, const HashDigest &digest, char *out_dir, char *out_path)
+{
+    char digest_string[kDigestStringSize];
+    DigestToString(digest_string, digest);
+    int dir_len = snprintf(out_dir, kMaxPathLength, "%s/%s/%.2s", self->m_Root, kind, digest_string);
+    int path_len = snprintf(out_path, kMaxPathLength, "%s/%s", out_dir, digest_string);
+    return dir_len < kMaxPathLength && path_len < kMaxPathLength;
+}
+
+static bool EnsureDirectory(const char *path)
+{
+    return GetFileInfo(path).IsDirectory() || MakeDirectory(path) || GetFileInfo(path).IsDirectory();
+}
+
+static bool TempPathFor(const char *path, char *out_temp_path)
+{
+#if defined(TUNDRA_WIN32)
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    return snprintf(out_temp_path, kMaxPathLength, "%s.%lu.%u.tmp", path, pid, AtomicIncrement(&s_TempFileCounter)) < kMaxPathLength;
+}
+
+static void TouchFile(const char *path)
+{
+#if defined(TUNDRA_WIN32)
+    _utime(path, nullptr);
+#else
+    utimes(path, nullptr);
+#endif
+}
+
+static uint32_t GetFileMode(const char *path)
+{
+#if defined(TUNDRA_UNIX)
+    struct stat st;
+    if (0 == stat(path, &st))
+        return (uint32_t)(st.st_mode & 07777);
+#endif
+    return 0;
+}
+
+static bool HashFileContents(const char *path, HashDigest *out_digest, uint64_t *out_size)
+{
+    FILE *f = OpenFile(path, "rb");
+    if (!f)
+        return false;
+
+    HashState hash;
+    HashInit(&hash);
+    uint64_t size = 0;
+    char chunk[kCopyChunkSize];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    {
+        HashUpdate(&hash, chunk, n);
+        size += n;
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+
+    HashFinalize(&hash, out_digest);
+    *out_size = size;
+    return ok;
+}
+
+static bool CopyFileContents(const char *src, const char *dst)
+{
+    FILE *in = OpenFile(src, "rb");
+    if (!in)
+        return false;
+    FILE *out = OpenFile(dst, "wb");
+    if (!out)
+    {
+        fclose(in);
+        return false;
+    }
+
+    char chunk[kCopyChunkSize];
+    bool ok = true;
+    size_t n;
+    while (ok && (n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+        ok = n == fwrite(chunk, 1, n, out);
+    ok = ok && !ferror(in);
+
+    fclose(in);
+    ok = (0 == fclose(out)) && ok;
+    return ok;
+}
+
+// Makes dst a copy of src, sharing the data blocks when the file system can do that. dst must not exist.
+static bool CloneFile(const char *src, const char *dst)
+{
+#if defined(TUNDRA_LINUX) && defined(FICLONE)
+    int in_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (in_fd != -1)
+    {
+        int out_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        bool cloned = out_fd != -1 && ioctl(out_fd, FICLONE, in_fd) != -1;
+        if (out_fd != -1)
+            close(out_fd);
+        close(in_fd);
+        if (cloned)
+            return true;
+    }
+#elif defined(TUNDRA_APPLE)
+    if (0 == clonefile(src, dst, 0))
+        return true;
+#endif
+    return CopyFileContents(src, dst);
+}
+
+static bool LinkFile(const char *src, const char *dst)
+{
+#if defined(TUNDRA_WIN32)
+    return CreateHardLinkA(dst, src, nullptr) != 0;
+#else
+    return 0 == link(src, dst);
+#endif
+}
+
+// Adds the contents of path to the objects, unless they are already there.
+static bool StoreObject(CacheBackendLocal *self, const char *path, LocalEntryFile *out_file)
+{
+    if (!HashFileContents(path, &out_file->m_Content, &out_file->m_Size))
+        return false;
+    out_file->m_Mode = GetFileMode(path);
+    out_file->m_Padding = 0;
+
+    char dir[kMaxPathLength], object_path[kMaxPathLength];
+    if (!StorePath(self, "objects", out_file->m_Content, dir, object_path))
+        return false;
+    if (GetFileInfo(object_path).IsFile())
+        return true;
+
+    if (!EnsureDirectory(dir))
+        return false;
+
+    char temp_path[kMaxPathLength];
+    if (!TempPathFor(object_path, temp_path))
+        return false;
+    if (CloneFile(path, temp_path) && RenameFile(temp_path, object_path))
+    {
+        AtomicAdd(&self->m_BytesAdded, (int64_t)out_file->m_Size);
+        return true;
+    }
+
+    RemoveFileOrDir(temp_path);
+    return false;
+}
+
+static bool LocalContains(CacheBackend *backend, const HashDigest *keys, int key_count, bool *out_present)
+{
+    CacheBackendLocal *self = (CacheBackendLocal *)backend;
+    for (int i = 0; i < key_count; ++i)
+    {
+        char dir[kMaxPathLength], path[kMaxPathLength];
+        out_present[i] = StorePath(self, "entries", keys[i], dir, path) && GetFileInfo(path).IsFile();
+    }
+    return true;
+}
+
+static CacheResult::Enum LocalRead(CacheBackend *backend, const HashDigest &key, const char *const *files, int file_count)
+{
+    CacheBackendLocal *self = (CacheBackendLocal *)backend;
+    char dir[kMaxPathLength], entry_path[kMaxPathLength];
+    if (!StorePath(self, "entries", key, dir, entry_path))
+        return CacheResult::CacheMiss;
+
+    FILE *f = OpenFile(entry_path, "rb");
+    if (!f)
+        return CacheResult::CacheMiss;
+
+    LocalEntryHeader header;
+    LocalEntryFile *entry_files = HeapAllocateArray<LocalEntryFile>(self->m_Heap, file_count);
+    bool complete = 1 == fread(&header, sizeof(header), 1, f)
+        && header.m_Magic == kLocalEntryMagic
+        && header.m_FileCount == (uint32_t)file_count
+        && (size_t)file_count == fread(entry_files, sizeof(LocalEntryFile), file_count, f);
+    fclose(f);
+
+    CacheResult::Enum result = complete ? CacheResult::Success : CacheResult::CacheMiss;
+    for (int i = 0; i < file_count && result == CacheResult::Success; ++i)
+    {
+        char object_path[kMaxPathLength];
+        if (!StorePath(self, "objects", entry_files[i].m_Content, dir, object_path))
+        {
+            result = CacheResult::CacheMiss;
+            break;
+        }
+
+        // Remove it first, the previous output might be read-only or a hardlink into the store.
+        RemoveFileOrDir(files[i]);
+
+        // A link shares the mode of the stored file, which is that of whichever output stored it first. Changing it
+        // would change every other link too, so outputs that need a different mode get a clone instead.
+        bool same_mode = entry_files[i].m_Mode == 0 || entry_files[i].m_Mode == GetFileMode(object_path);
+        if (self->m_UseHardlinks && same_mode && LinkFile(object_path, files[i]))
+            continue;
+
+        if (!CloneFile(object_path, files[i]))
+        {
+            if (!GetFileInfo(object_path).IsFile())
+            {
+                // Evicted, the entry is no use any more.
+                RemoveFileOrDir(entry_path);
+                result = CacheResult::CacheMiss;
+            }
+            else
+            {
+                Log(kWarning, "cache: failed to write %s", files[i]);
+                result = CacheResult::Failure;
+            }
+            break;
+        }
+
+#if defined(TUNDRA_UNIX)
+        if (entry_files[i].m_Mode != 0)
+            chmod(files[i], (mode_t)entry_files[i].m_Mode);
+#endif
+    }
+
+    if (result == CacheResult::Success)
+        TouchFile(entry_path);
+
+    HeapFree(self->m_Heap, entry_files);
+    return result;
+}
+
+static CacheResult::Enum LocalWrite(CacheBackend *backend, const HashDigest &key, const char *const *files, int file_count, const char *ingredients_file)
+{
+    CacheBackendLocal *self = (CacheBackendLocal *)backend;
+
+    LocalEntryHeader header;
+    header.m_Magic = kLocalEntryMagic;
+    header.m_FileCount = (uint32_t)file_count;
+    LocalEntryFile *entry_files = HeapAllocateArray<LocalEntryFile>(self->m_Heap, file_count);
+
+    bool ok = true;
+    for (int i = 0; i < file_count && ok; ++i)
+        ok = StoreObject(self, files[i], &entry_files[i]);
+
+    char dir[kMaxPathLength], entry_path[kMaxPathLength], temp_path[kMaxPathLength];
+    ok = ok && StorePath(self, "entries", key, dir, entry_path) && TempPathFor(entry_path, temp_path);
+
+    if (ok && EnsureDirectory(dir))
+    {
+        FILE *f = OpenFile(temp_path, "wb");
+        ok = f != nullptr
+            && 1 == fwrite(&header, sizeof(header), 1, f)
+            && (size_t)file_count == fwrite(entry_files, sizeof(LocalEntryFile), file_count, f);
+        if (f)
+            ok = (0 == fclose(f)) && ok;
+        ok = ok && RenameFile(temp_path, entry_path);
+        if (!ok)
+            RemoveFileOrDir(temp_path);
+    }
+    else
+    {
+        ok = false;
+    }
+
+    HeapFree(self->m_Heap, entry_files);
+    if (!ok)
+    {
+        Log(kWarning, "cache: couldn't add %s to the local cache", files[0]);
+        return CacheResult::Failure;
+    }
+    return CacheResult::Success;
+}
+
+struct StoredFile
+{
+    uint64_t m_Timestamp;
+    uint64_t m_Size;
+    size_t m_PathOffset;
+    bool m_IsEntry;
+    bool m_Referenced;
+};
+
+struct EvictionScan
+{
+    MemAllocHeap *m_Heap;
+    Buffer<StoredFile> m_Files;
+    Buffer<char> m_Paths;
+    uint64_t m_TotalSize;
+    bool m_ScanningEntries;
+};
+
+static void CollectStoredFile(void *user_data, const FileInfo &info, const char *path)
+{
+    EvictionScan *scan = (EvictionScan *)user_data;
+    size_t path_length = strlen(path);
+
+    // Files that are still being written by someone.
+    if (!info.IsFile() || (path_length > 4 && 0 == strcmp(path + path_length - 4, ".tmp")))
+        return;
+
+    StoredFile file;
+    file.m_Timestamp = info.m_Timestamp;
+    file.m_Size = info.m_Size;
+    file.m_PathOffset = scan->m_Paths.m_Size;
+    file.m_IsEntry = scan->m_ScanningEntries;
+    file.m_Referenced = false;
+    BufferAppend(&scan->m_Paths, scan->m_Heap, path, path_length + 1);
+    BufferAppendOne(&scan->m_Files, scan->m_Heap, file);
+    scan->m_TotalSize += info.m_Size;
+}
+
+// Dates every object by the newest entry that refers to it. Objects that no entry refers to keep their own timestamp,
+// which is when they were stored.
+static void DateObjectsByTheirEntries(CacheBackendLocal *self, EvictionScan *scan)
+{
+    HashTable<size_t, kFlagPathStrings> objects;
+    HashTableInit(&objects, self->m_Heap);
+    for (size_t i = 0; i < scan->m_Files.m_Size; ++i)
+    {
+        const char *path = scan->m_Paths.m_Storage + scan->m_Files[i].m_PathOffset;
+        if (!scan->m_Files[i].m_IsEntry)
+            HashTableInsert(&objects, Djb2HashPath(path), path, i);
+    }
+
+    Buffer<LocalEntryFile> entry_files;
+    BufferInit(&entry_files);
+    for (const StoredFile &entry : scan->m_Files)
+    {
+        if (!entry.m_IsEntry)
+            continue;
+
+        FILE *f = OpenFile(scan->m_Paths.m_Storage + entry.m_PathOffset, "rb");
+        if (!f)
+            continue;
+        LocalEntryHeader header;
+        bool complete = 1 == fread(&header, sizeof(header), 1, f) && header.m_Magic == kLocalEntryMagic;
+        BufferClear(&entry_files);
+        if (complete)
+        {
+            LocalEntryFile *files = BufferAlloc(&entry_files, self->m_Heap, header.m_FileCount);
+            complete = header.m_FileCount == fread(files, sizeof(LocalEntryFile), header.m_FileCount, f);
+        }
+        fclose(f);
+        if (!complete)
+            continue;
+
+        for (const LocalEntryFile &file : entry_files)
+        {
+            char dir[kMaxPathLength], object_path[kMaxPathLength];
+            if (!StorePath(self, "objects", file.m_Content, dir, object_path))
+                continue;
+            size_t *index = HashTableLookup(&objects, Djb2HashPath(object_path), object_path);
+            if (!index)
+                continue;
+
+            StoredFile *object = &scan->m_Files[*index];
+            if (!object->m_Referenced || object->m_Timestamp < entry.m_Timestamp)
+                object->m_Timestamp = entry.m_Timestamp;
+            object->m_Referenced = true;
+        }
+    }
+
+    BufferDestroy(&entry_files, self->m_Heap);
+    HashTableDestroy(&objects);
+}
+
+// Removes the least recently used files until the store is well below its size, so it doesn't need to be done again
+// after every build.
+static void Evict(CacheBackendLocal *self)
+{
+    EvictionScan scan;
+    scan.m_Heap = self->m_Heap;
+    BufferInit(&scan.m_Files);
+    BufferInit(&scan.m_Paths);
+    scan.m_TotalSize = 0;
+
+    char dir[kMaxPathLength];
+    scan.m_ScanningEntries = true;
+    if (snprintf(dir, sizeof(dir), "%s/entries", self->m_Root) < (int)sizeof(dir))
+        ListDirectory(dir, nullptr, true, &scan, CollectStoredFile);
+    scan.m_ScanningEntries = false;
+    if (snprintf(dir, sizeof(dir), "%s/objects", self->m_Root) < (int)sizeof(dir))
+        ListDirectory(dir, nullptr, true, &scan, CollectStoredFile);
+
+    if (scan.m_TotalSize > self->m_MaxSize)
+    {
+        DateObjectsByTheirEntries(self, &scan);
+
+        // An object is never older than the entries using it, so those go first and read as misses afterwards
+        // instead of pointing at missing objects.
+        uint64_t target = self->m_MaxSize / 10 * 9;
+        std::sort(scan.m_Files.begin(), scan.m_Files.end(), [](const StoredFile &a, const StoredFile &b) {
+            return a.m_Timestamp != b.m_Timestamp ? a.m_Timestamp < b.m_Timestamp : a.m_IsEntry > b.m_IsEntry;
+        });
+
+        int removed = 0;
+        for (const StoredFile &file : scan.m_Files)
+        {
+            if (scan.m_TotalSize <= target)
+                break;
+            if (RemoveFileOrDir(scan.m_Paths.m_Storage + file.m_PathOffset))
+            {
+                scan.m_TotalSize -= file.m_Size;
+                ++removed;
+            }
+        }
+        Log(kDebug, "cache: evicted %d files from the local cache", removed);
+    }
+
+    BufferDestroy(&scan.m_Paths, self->m_Heap);
+    BufferDestroy(&scan.m_Files, self->m_Heap);
+}
+
+static void LocalDestroy(CacheBackend *backend)
+{
+    CacheBackendLocal *self = (CacheBackendLocal *)backend;
+    if (self->m_BytesAdded > 0)
+        Evict(self);
+    HeapFree(self->m_Heap, self);
+}
+
+CacheBackend *CacheBackendCreateLocal(MemAllocHeap *heap, const char *root, uint64_t max_size, bool use_hardlinks)
+{
+    // Create the root and any missing parents.
+    char path[kMaxPathLength];
+    snprintf(path, sizeof(path), "%s", root);
+    for (char *p = path + 1; *p; ++p)
+    {
+        if (*p != '/' && *p != '\\')
+            continue;
+        char separator = *p;
+        *p = '\0';
+        EnsureDirectory(path);
+        *p = separator;
+    }
+
+    if (!EnsureDirectory(root))
+    {
+        Log(kError, "cache: couldn't create %s", root);
+        return nullptr;
+    }
+
+    CacheBackendLocal *self = HeapAllocateArray<CacheBackendLocal>(heap, 1);
+    self->m_Backend.m_Name = "local";
+    self->m_Backend.m_Contains = LocalContains;
+    self->m_Backend.m_Read = LocalRead;
+    self->m_Backend.m_Write = LocalWrite;
+    self->m_Backend.m_Destroy = LocalDestroy;
+    self->m_Heap = heap;
+    snprintf(self->m_Root, sizeof(self->m_Root), "%s", root);
+    self->m_MaxSize = max_size;
+    self->m_UseHardlinks = use_hardlinks;
+    self->m_BytesAdded = 0;
+
+    if (snprintf(path, sizeof(path), "%s/entries", root) < (int)sizeof(path))
+        EnsureDirectory(path);
+    if (snprintf(path, sizeof(path), "%s/objects", root) < (int)sizeof(path))
+        EnsureDirectory(path);
+    return &self->m_Backend;
+}
@@ -1,4 +1,5 @@
 #include "CacheClient.hpp"
+#include "CacheBackend.hpp"
 #include "Hash.hpp"
 #include "DagData.hpp"
 #include "RunAction.hpp"
@@ -8,14 +9,30 @@
 #include "Exec.hpp"
 #include "BuildQueue.hpp"
 #include "MakeDirectories.hpp"
+#include "MemAllocLinear.hpp"
 #include "Banned.hpp"
 
 // The path the reapi client executable used to talk to the cache server
 const char* kENV_REAPI_CACHE_CLIENT = "REAPI_CACHE_CLIENT";
 
-// The cache server address, in the format hostname:port
+// The cache server address, in the format hostname:port. Or, to use the cache without the reapi client,
+// http://hostname:port for an http cache server, or file://path for a cache directory.
 const char* kENV_CACHE_SERVER_ADDRESS = "CACHE_SERVER_ADDRESS";
 
+// A directory on this machine for a content addressed cache that is consulted before the cache server, and
+// written through to. Can be used without a cache server as well.
+const char* kENV_BEE_LOCAL_CACHE_DIR = "BEE_LOCAL_CACHE_DIR";
+
+// Size the local cache is kept under, in megabytes. Defaults to 10 GB.
+const char* kENV_BEE_LOCAL_CACHE_SIZE_MB = "BEE_LOCAL_CACHE_SIZE_MB";
+
+// Set to 1 to restore outputs from the local cache as hardlinks rather than clones or copies. Only safe when no action
+// modifies its outputs in place.
+const char* kENV_BEE_LOCAL_CACHE_HARDLINKS = "BEE_LOCAL_CACHE_HARDLINKS";
+
+static const char kHttpScheme[] = "http://";
+static const char kFileScheme[] = "file://";
+
 // The cache behavior, one of `_`, `R`, `W`, `RW` - enabling cache reading and/or cache writing.
 // Alternatively: `disabled`, `read`, `write`, `readwrite`.
 const char* kENV_BEE_CACHE_BEHAVIOUR = "BEE_CACHE_BEHAVIOUR";
@@ -65,6 +82,30 @@ static int AppendFileToCommandLine(int totalWritten, char* buffer, int bufferSiz
 static uint32_t s_CacheClientFailureCount = 0;
 const uint32_t kMaxClientFailureCount = 5;
 
+// The in-process backend, if CACHE_SERVER_ADDRESS asks for one. Otherwise the reapi client is run for every operation.
+static CacheBackend* s_CacheBackend = nullptr;
+static bool s_HasCacheServer = false;
+
+// The local tier from BEE_LOCAL_CACHE_DIR, if any. Its failures are only warned about, they don't stop the use of the
+// cache server.
+static CacheBackend* s_LocalCache = nullptr;
+
+static void ReportClientFailure(const Frozen::DagNode* dagNode, const char* msg)
+{
+    PrintServiceMessage(MessageStatusLevel::Warning, "Failure while invoking caching client: %s\n%s\n", dagNode->m_Annotation.Get(), msg);
+
+    s_CacheClientFailureCount++;
+    if (s_CacheClientFailureCount > kMaxClientFailureCount)
+    {
+        PrintServiceMessage(MessageStatusLevel::Warning, "We encountered %d cache client failures. The rest of the build will not attempt any more cache client operations\n", s_CacheClientFailureCount);
+    }
+}
+
+static bool HasScheme(const char* address, const char* scheme)
+{
+    return 0 == strncmp(address, scheme, strlen(scheme));
+}
+
 static CacheResult::Enum Invoke_REAPI_Cache_Client(const HashDigest& digest, StatCache *stat_cache, const FrozenArray<FrozenFileAndHash>& outputFiles, ThreadState* thread_state, Operation operation, const Frozen::Dag* dag, const Frozen::DagNode* dagNode, const char* ingredients_file)
 {
     if (s_CacheClientFailureCount > kMaxClientFailureCount)
@@ -93,13 +134,7 @@ static CacheResult::Enum Invoke_REAPI_Cache_Client(const HashDigest& digest, Sta
 
     auto processFailure = [dagNode](const char* msg)
     {
-        PrintServiceMessage(MessageStatusLevel::Warning, "Failure while invoking caching client: %s\n%s\n", dagNode->m_Annotation.Get(), msg);
-        
-        s_CacheClientFailureCount++;
-        if (s_CacheClientFailureCount > kMaxClientFailureCount)
-        {
-            PrintServiceMessage(MessageStatusLevel::Warning, "We encountered %d cache client failures. The rest of the build will not attempt any more cache client operations\n", s_CacheClientFailureCount);
-        }
+        ReportClientFailure(dagNode, msg);
     };
 
     //when we start caching nodes with tons of outputs, we should move the filelist to a separate file. for now this will do,
@@ -156,16 +191,183 @@ static CacheResult::Enum Invoke_REAPI_Cache_Client(const HashDigest& digest, Sta
     return cacheResult;
 }
 
-CacheResult::Enum CacheClient::AttemptRead(const Frozen::Dag* dag, const Frozen::DagNode* dagNode, HashDigest signature, StatCache* stat_cache, ThreadState* thread_state)
+static CacheResult::Enum Invoke_Cache_Backend(CacheBackend* backend, const HashDigest& digest, StatCache *stat_cache, const FrozenArray<FrozenFileAndHash>& outputFiles, ThreadState* thread_state, Operation operation, const Frozen::DagNode* dagNode, const char* ingredients_file)
 {
+    bool is_local = backend == s_LocalCache;
+    if (!is_local && s_CacheClientFailureCount > kMaxClientFailureCount)
+        return CacheResult::DidNotTry;
+
+    const char* label = operation == kOperationRead ? (is_local ? "LocalCacheRead" : "CacheRead") : (is_local ? "LocalCacheWrite" : "CacheWrite");
+    ProfilerScope profiler_scope(label, thread_state->m_ThreadIndex, outputFiles[0].m_Filename);
+
+    MemAllocLinearScope alloc_scope(&thread_state->m_ScratchAlloc);
+    int file_count = outputFiles.GetCount();
+    const char** files = LinearAllocateArray<const char*>(&thread_state->m_ScratchAlloc, file_count);
+    for (int i = 0; i < file_count; ++i)
+    {
+        files[i] = outputFiles[i].m_Filename;
+        if (operation == kOperationRead)
+        {
+            PathBuffer output;
+            PathInit(&output, files[i]);
+            MakeDirectoriesForFile(stat_cache, output);
+        }
+    }
+
+    CacheResult::Enum cacheResult;
+    if (operation == kOperationRead)
+    {
+        cacheResult = backend->m_Read(backend, digest, files, file_count);
+        for (auto &it : outputFiles)
+            StatCacheMarkDirty(stat_cache, it.m_Filename, it.m_FilenameHash);
+    }
+    else
+    {
+        cacheResult = backend->m_Write(backend, digest, files, file_count, ingredients_file);
+    }
+
+    if (cacheResult == CacheResult::Failure && !is_local)
+    {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "%s cache %s failed", backend->m_Name, operation == kOperationRead ? "read" : "write");
+        ReportClientFailure(dagNode, msg);
+    }
+
+    return cacheResult;
+}
+
+static CacheResult::Enum AttemptRemoteRead(const Frozen::Dag* dag, const Frozen::DagNode* dagNode, HashDigest signature, StatCache* stat_cache, ThreadState* thread_state)
+{
+    if (s_CacheBackend)
+        return Invoke_Cache_Backend(s_CacheBackend, signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationRead, dagNode, nullptr);
     return Invoke_REAPI_Cache_Client(signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationRead, dag, dagNode, nullptr );
 }
 
+CacheResult::Enum CacheClient::AttemptRead(const Frozen::Dag* dag, const Frozen::DagNode* dagNode, HashDigest signature, StatCache* stat_cache, ThreadState* thread_state)
+{
+    if (s_LocalCache == nullptr)
+        return AttemptRemoteRead(dag, dagNode, signature, stat_cache, thread_state);
+
+    CacheResult::Enum localResult = Invoke_Cache_Backend(s_LocalCache, signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationRead, dagNode, nullptr);
+    if (localResult == CacheResult::Success || !s_HasCacheServer)
+        return localResult;
+
+    CacheResult::Enum result = AttemptRemoteRead(dag, dagNode, signature, stat_cache, thread_state);
+
+    // Keep what came from the cache server, so it doesn't have to be fetched again on this machine.
+    if (result == CacheResult::Success)
+        Invoke_Cache_Backend(s_LocalCache, signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationWrite, dagNode, nullptr);
+    return result;
+}
+
 CacheResult::Enum CacheClient::AttemptWrite(const Frozen::Dag* dag, const Frozen::DagNode* dagNode, HashDigest signature, StatCache* stat_cache, ThreadState* thread_state, const char* ingredients_file)
 {
+    CacheResult::Enum localResult = CacheResult::DidNotTry;
+    if (s_LocalCache)
+        localResult = Invoke_Cache_Backend(s_LocalCache, signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationWrite, dagNode, ingredients_file);
+
+    if (!s_HasCacheServer)
+        return localResult;
+    if (s_CacheBackend)
+        return Invoke_Cache_Backend(s_CacheBackend, signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationWrite, dagNode, ingredients_file);
     return Invoke_REAPI_Cache_Client(signature, stat_cache, dagNode->m_OutputFiles, thread_state, Operation::kOperationWrite, dag, dagNode, ingredients_file );
 }
 
+bool CacheClient::CanLookUpMany()
+{
+    // The reapi client can only be asked about one signature at a time.
+    if (s_HasCacheServer)
+        return s_CacheBackend != nullptr;
+    return s_LocalCache != nullptr;
+}
+
+bool CacheClient::AttemptContains(const HashDigest* signatures, int count, bool* out_present)
+{
+    if (!CanLookUpMany())
+        return false;
+
+    for (int i = 0; i < count; ++i)
+        out_present[i] = false;
+
+    if (s_LocalCache != nullptr && !s_LocalCache->m_Contains(s_LocalCache, signatures, count, out_present))
+        return false;
+
+    if (s_CacheBackend == nullptr)
+        return true;
+    if (s_CacheClientFailureCount > kMaxClientFailureCount)
+        return false;
+
+    // Only ask the cache server about what isn't here already.
+    for (int start = 0; start < count; )
+    {
+        HashDigest missing[128];
+        int missing_index[128];
+        bool missing_present[128];
+        int missing_count = 0;
+        for (; start < count && missing_count < 128; ++start)
+        {
+            if (out_present[start])
+                continue;
+            missing[missing_count] = signatures[start];
+            missing_index[missing_count++] = start;
+        }
+
+        if (missing_count == 0)
+            break;
+        if (!s_CacheBackend->m_Contains(s_CacheBackend, missing, missing_count, missing_present))
+            return false;
+        for (int i = 0; i < missing_count; ++i)
+            out_present[missing_index[i]] = missing_present[i];
+    }
+    return true;
+}
+
+void CacheClientInit(MemAllocHeap* heap)
+{
+    CHECK(s_CacheBackend == nullptr && s_LocalCache == nullptr);
+
+    if (const char* local_dir = getenv(kENV_BEE_LOCAL_CACHE_DIR))
+    {
+        uint64_t size_mb = 10 * 1024;
+        if (const char* size = getenv(kENV_BEE_LOCAL_CACHE_SIZE_MB))
+            size_mb = strtoull(size, nullptr, 10);
+        const char* hardlinks = getenv(kENV_BEE_LOCAL_CACHE_HARDLINKS);
+
+        s_LocalCache = CacheBackendCreateLocal(heap, local_dir, size_mb * 1024 * 1024, hardlinks != nullptr && 0 == strcmp(hardlinks, "1"));
+        if (s_LocalCache == nullptr)
+            Croak("Couldn't use %s=%s as a local cache", kENV_BEE_LOCAL_CACHE_DIR, local_dir);
+    }
+
+    const char* server = getenv(kENV_CACHE_SERVER_ADDRESS);
+    s_HasCacheServer = server != nullptr;
+    if (server == nullptr)
+        return;
+
+    if (HasScheme(server, kHttpScheme))
+    {
+        s_CacheBackend = CacheBackendCreateHttp(heap, server + strlen(kHttpScheme));
+        if (s_CacheBackend == nullptr)
+            Croak("Couldn't use %s=%s as a cache server", kENV_CACHE_SERVER_ADDRESS, server);
+    }
+    else if (HasScheme(server, kFileScheme))
+    {
+        s_CacheBackend = CacheBackendCreateFileSystem(heap, server + strlen(kFileScheme));
+        if (s_CacheBackend == nullptr)
+            Croak("Couldn't use %s=%s as a cache directory", kENV_CACHE_SERVER_ADDRESS, server);
+    }
+}
+
+void CacheClientDestroy()
+{
+    if (s_CacheBackend)
+        s_CacheBackend->m_Destroy(s_CacheBackend);
+    if (s_LocalCache)
+        s_LocalCache->m_Destroy(s_LocalCache);
+    s_CacheBackend = nullptr;
+    s_LocalCache = nullptr;
+    s_HasCacheServer = false;
+}
+
 
 static const char* ModeNameFor(bool read, bool write)
 {
@@ -184,16 +386,20 @@ void GetCachingBehaviourSettingsFromEnvironment(bool* attemptReads, bool* attemp
     *attemptWrites = false;
 
     const char* server = getenv(kENV_CACHE_SERVER_ADDRESS);
-    if (server == nullptr)
+    const char* local_dir = getenv(kENV_BEE_LOCAL_CACHE_DIR);
+    if (server == nullptr && local_dir == nullptr)
         return;
 
     const char* reapi_cache_client = getenv(kENV_REAPI_CACHE_CLIENT);
-    if (reapi_cache_client == nullptr)
+    bool in_process = server == nullptr || HasScheme(server, kHttpScheme) || HasScheme(server, kFileScheme);
+    if (in_process)
+        reapi_cache_client = "<in-process>";
+    else if (reapi_cache_client == nullptr)
         Croak("%s is set, but %s is not.",kENV_CACHE_SERVER_ADDRESS, kENV_REAPI_CACHE_CLIENT);
 
     const char* behaviour = getenv(kENV_BEE_CACHE_BEHAVIOUR);
     if (behaviour == nullptr)
-        Croak("%s is set, but %s is not.", kENV_CACHE_SERVER_ADDRESS,kENV_BEE_CACHE_BEHAVIOUR);
+        Croak("%s is set, but %s is not.", server != nullptr ? kENV_CACHE_SERVER_ADDRESS : kENV_BEE_LOCAL_CACHE_DIR, kENV_BEE_CACHE_BEHAVIOUR);
 
     if (strcmp("readwrite", behaviour) == 0)
     {
@@ -239,5 +445,5 @@ void GetCachingBehaviourSettingsFromEnvironment(bool* attemptReads, bool* attemp
         }
     }
 
-    Log(kDebug, "Caching enabled with %s=%s %s=%s and mode: %s%s%s\n", kENV_CACHE_SERVER_ADDRESS, server, kENV_REAPI_CACHE_CLIENT, reapi_cache_client, ModeNameFor(*attemptReads, *attemptWrites));
+    Log(kDebug, "Caching enabled with %s=%s %s=%s %s=%s and mode: %s\n", kENV_CACHE_SERVER_ADDRESS, server ? server : "<none>", kENV_REAPI_CACHE_CLIENT, reapi_cache_client, kENV_BEE_LOCAL_CACHE_DIR, local_dir ? local_dir : "<none>", ModeNameFor(*attemptReads, *attemptWrites));
 }
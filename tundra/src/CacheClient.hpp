@@ -5,6 +5,7 @@ namespace Frozen { struct DagNode; struct Dag; }
 struct StatCache;
 struct Mutex;
 struct ThreadState;
+struct MemAllocHeap;
 
 namespace CacheResult
 {
@@ -22,6 +23,14 @@ struct CacheClient
 {
     static CacheResult::Enum AttemptRead(const Frozen::Dag* dag, const Frozen::DagNode* dagNode, HashDigest signature, StatCache* stat_cache, ThreadState* thread_state);
     static CacheResult::Enum AttemptWrite(const Frozen::Dag* dag, const Frozen::DagNode* dagNode, HashDigest signature, StatCache* stat_cache, ThreadState* thread_state, const char* ingredients_file);
+
+    // Whether AttemptContains can be used, only the in-process backends can answer for many signatures in one request.
+    static bool CanLookUpMany();
+    static bool AttemptContains(const HashDigest* signatures, int count, bool* out_present);
 };
 
 void GetCachingBehaviourSettingsFromEnvironment(bool* attemptReads, bool* attemptWrites);
+
+// Set up the in-process cache backend when the environment asks for one.
+void CacheClientInit(MemAllocHeap* heap);
+void CacheClientDestroy();
@@ -0,0 +1,368 @@
+#include "CachePrefetch.hpp"
+#include "BuildQueue.hpp"
+#include "RuntimeNode.hpp"
+#include "LeafInputSignature.hpp"
+#include "DagData.hpp"
+#include "AllBuiltNodes.hpp"
+#include "SignalHandler.hpp"
+#include "Profiler.hpp"
+#include "Stats.hpp"
+#include "Atomic.hpp"
+#include "Driver.hpp"
+
+#include <algorithm>
+
+#include "Banned.hpp"
+
+// RuntimeNode::m_CachePrefetchState. Whoever moves a node out of kNone or kPresent owns its cache lookup; the build
+// thread claims it to do the lookup itself, a download thread to fetch a hit.
+namespace CachePrefetchState
+{
+    enum Enum
+    {
+        kNone = 0,
+        kPresent,      // The cache has it, waiting for a download thread.
+        kAbsent,       // The cache doesn't have it.
+        kDownloading,
+        kDownloaded,   // The outputs are in place.
+        kFailed,       // The download failed, the failure has been reported.
+        kNotTried,     // The cache client gave up on the cache before the download.
+        kClaimed,      // The build thread got there first.
+    };
+}
+
+enum
+{
+    // Signatures per request to the cache.
+    kLookupBatchSize = 512
+};
+
+struct CachePrefetch
+{
+    BuildQueue *m_Queue;
+    ThreadId m_Threads[kCachePrefetchThreadCount];
+    ThreadState m_ThreadState[kCachePrefetchThreadCount];
+
+    // Protects the download queue; m_DownloadFinished is broadcast whenever a download leaves kDownloading.
+    Mutex m_Lock;
+    ConditionVariable m_DownloadAvailable;
+    ConditionVariable m_DownloadFinished;
+    Buffer<int32_t> m_Downloads;
+    size_t m_NextDownload;
+    bool m_ScanFinished;
+    bool m_Stop;
+};
+
+static bool ShouldStop(CachePrefetch *self)
+{
+    return AtomicLoad(&self->m_Stop) || SignalGetReason() != nullptr;
+}
+
+static bool IsUpToDate(const RuntimeNode *node)
+{
+    const Frozen::BuiltNode *built_node = node->m_BuiltNode;
+    return built_node != nullptr
+        && built_node->m_Result == Frozen::BuiltNodeResult::kRanSuccessfullyWithGuaranteedCorrectInputSignature
+        && built_node->m_LeafInputSignature == node->m_CurrentLeafInputSignature->digest;
+}
+
+static bool TryMoveState(RuntimeNode *node, CachePrefetchState::Enum from, CachePrefetchState::Enum to)
+{
+    return AtomicCompareExchange16(&node->m_CachePrefetchState, (uint16_t)to, (uint16_t)from);
+}
+
+static void QueueDownloads(CachePrefetch *self, const int32_t *node_indices, int count)
+{
+    MutexLock(&self->m_Lock);
+    BufferAppend(&self->m_Downloads, self->m_Queue->m_Config.m_Heap, node_indices, count);
+    CondBroadcast(&self->m_DownloadAvailable);
+    MutexUnlock(&self->m_Lock);
+}
+
+// Looks up frontier[0..count) and queues the hits for download. The dependencies of the misses go on the stack, they
+// will have to be built and might be in the cache themselves.
+static bool LookUpBatch(CachePrefetch *self, ThreadState *thread_state, const int32_t *frontier, int count, Buffer<int32_t> *stack)
+{
+    BuildQueue *queue = self->m_Queue;
+    const BuildQueueConfig &config = queue->m_Config;
+    MemAllocLinear *scratch = &thread_state->m_ScratchAlloc;
+    MemAllocLinearScope alloc_scope(scratch);
+
+    int32_t *lookups = LinearAllocateArray<int32_t>(scratch, count);
+    HashDigest *signatures = LinearAllocateArray<HashDigest>(scratch, count);
+    bool *present = LinearAllocateArray<bool>(scratch, count);
+    int lookup_count = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        RuntimeNode *node = config.m_RuntimeNodes + frontier[i];
+        if (AtomicLoad(&node->m_CurrentLeafInputSignature) == nullptr)
+            CalculateLeafInputSignature(queue, node->m_DagNode, node, scratch, thread_state->m_IoRing, thread_state->m_ThreadIndex, nullptr);
+
+        // The build thread won't ask the cache for it, nor build anything below it.
+        if (IsUpToDate(node))
+            continue;
+
+        lookups[lookup_count] = frontier[i];
+        signatures[lookup_count] = node->m_CurrentLeafInputSignature->digest;
+        ++lookup_count;
+    }
+
+    if (lookup_count == 0)
+        return true;
+
+    {
+        ProfilerScope prof_scope("CacheContains", thread_state->m_ThreadIndex);
+        if (!CacheClient::AttemptContains(signatures, lookup_count, present))
+            return false;
+    }
+    AtomicAdd(&g_Stats.m_CachePrefetchLookups, lookup_count);
+
+    int32_t *hits = LinearAllocateArray<int32_t>(scratch, lookup_count);
+    int hit_count = 0;
+    for (int i = 0; i < lookup_count; ++i)
+    {
+        RuntimeNode *node = config.m_RuntimeNodes + lookups[i];
+        if (present[i])
+        {
+            if (TryMoveState(node, CachePrefetchState::kNone, CachePrefetchState::kPresent))
+                hits[hit_count++] = lookups[i];
+            continue;
+        }
+
+        TryMoveState(node, CachePrefetchState::kNone, CachePrefetchState::kAbsent);
+        for (int32_t dependency : node->m_DagNode->m_ToBuildDependencies)
+            BufferAppendOne(stack, &thread_state->m_LocalHeap, dependency);
+    }
+
+    if (hit_count == 0)
+        return true;
+
+    AtomicAdd(&g_Stats.m_CachePrefetchHits, hit_count);
+
+    // Whatever the build threads need first, they pick nodes in the same order.
+    const uint32_t *priorities = queue->m_NodePriorities;
+    std::sort(hits, hits + hit_count, [priorities](int32_t a, int32_t b) { return priorities[a] > priorities[b]; });
+    QueueDownloads(self, hits, hit_count);
+    return true;
+}
+
+// Walks the graph from the requested nodes, stopping at each cacheable node until it is known to be a miss.
+static void Scan(CachePrefetch *self, ThreadState *thread_state)
+{
+    ProfilerScope prof_scope("CachePrefetchScan", thread_state->m_ThreadIndex);
+
+    const BuildQueueConfig &config = self->m_Queue->m_Config;
+    MemAllocHeap *heap = &thread_state->m_LocalHeap;
+
+    uint8_t *visited = HeapAllocateArrayZeroed<uint8_t>(heap, config.m_TotalRuntimeNodeCount);
+    Buffer<int32_t> stack;
+    Buffer<int32_t> frontier;
+    BufferInit(&stack);
+    BufferInit(&frontier);
+    BufferAppend(&stack, heap, config.m_RequestedNodes.m_Storage, config.m_RequestedNodes.m_Size);
+
+    bool ok = true;
+    while (ok && stack.m_Size > 0)
+    {
+        while (stack.m_Size > 0)
+        {
+            int32_t index = BufferPopOne(&stack);
+            if (visited[index])
+                continue;
+            visited[index] = 1;
+
+            const Frozen::DagNode *dag_node = config.m_DagNodes + index;
+            if (dag_node->m_FlagsAndActionType & Frozen::DagNode::kFlagCacheableByLeafInputs)
+                BufferAppendOne(&frontier, heap, index);
+            else
+                BufferAppend(&stack, heap, dag_node->m_ToBuildDependencies.GetArray(), dag_node->m_ToBuildDependencies.GetCount());
+        }
+
+        for (size_t start = 0; ok && start < frontier.m_Size; start += kLookupBatchSize)
+        {
+            if (ShouldStop(self))
+            {
+                ok = false;
+                break;
+            }
+
+            int count = (int)std::min<size_t>(kLookupBatchSize, frontier.m_Size - start);
+            ok = LookUpBatch(self, thread_state, frontier.m_Storage + start, count, &stack);
+            if (!ok)
+                Log(kDebug, "cache prefetch: lookup failed, leaving the rest to the build threads");
+        }
+        BufferClear(&frontier);
+    }
+
+    BufferDestroy(&frontier, heap);
+    BufferDestroy(&stack, heap);
+    HeapFree(heap, visited);
+}
+
+static void Download(CachePrefetch *self, ThreadState *thread_state, int32_t index)
+{
+    BuildQueue *queue = self->m_Queue;
+    RuntimeNode *node = queue->m_Config.m_RuntimeNodes + index;
+    if (!TryMoveState(node, CachePrefetchState::kPresent, CachePrefetchState::kDownloading))
+        return;
+
+    CacheResult::Enum result = CacheClient::AttemptRead(queue->m_Config.m_Dag, node->m_DagNode, node->m_CurrentLeafInputSignature->digest, queue->m_Config.m_StatCache, thread_state);
+
+    CachePrefetchState::Enum state = CachePrefetchState::kFailed;
+    if (result == CacheResult::Success)
+        state = CachePrefetchState::kDownloaded;
+    else if (result == CacheResult::CacheMiss)
+        state = CachePrefetchState::kAbsent;
+    else if (result == CacheResult::DidNotTry)
+        state = CachePrefetchState::kNotTried;
+
+    MutexLock(&self->m_Lock);
+    AtomicStore(&node->m_CachePrefetchState, (uint16_t)state);
+    CondBroadcast(&self->m_DownloadFinished);
+    MutexUnlock(&self->m_Lock);
+}
+
+static ThreadRoutineReturnType TUNDRA_STDCALL PrefetchThreadRoutine(void *param)
+{
+    ThreadState *thread_state = static_cast<ThreadState *>(param);
+    LinearAllocSetOwner(&thread_state->m_ScratchAlloc, ThreadCurrent());
+
+    CachePrefetch *self = thread_state->m_Queue->m_CachePrefetch;
+
+    // The first thread finds the work, then helps the others with it.
+    if (thread_state == &self->m_ThreadState[0])
+    {
+        Scan(self, thread_state);
+
+        MutexLock(&self->m_Lock);
+        self->m_ScanFinished = true;
+        CondBroadcast(&self->m_DownloadAvailable);
+        MutexUnlock(&self->m_Lock);
+    }
+
+    MutexLock(&self->m_Lock);
+    while (!self->m_Stop)
+    {
+        if (self->m_NextDownload == self->m_Downloads.m_Size)
+        {
+            if (self->m_ScanFinished)
+                break;
+            CondWait(&self->m_DownloadAvailable, &self->m_Lock);
+            continue;
+        }
+
+        int32_t index = self->m_Downloads[self->m_NextDownload++];
+        MutexUnlock(&self->m_Lock);
+        Download(self, thread_state, index);
+        MutexLock(&self->m_Lock);
+    }
+    MutexUnlock(&self->m_Lock);
+
+    return 0;
+}
+
+void CachePrefetchStart(BuildQueue *queue)
+{
+    const BuildQueueConfig &config = queue->m_Config;
+    if (!config.m_AttemptCacheReads || !CacheClient::CanLookUpMany())
+        return;
+
+    CachePrefetch *self = HeapAllocateArrayZeroed<CachePrefetch>(config.m_Heap, 1);
+    self->m_Queue = queue;
+    MutexInit(&self->m_Lock);
+    CondInit(&self->m_DownloadAvailable);
+    CondInit(&self->m_DownloadFinished);
+    BufferInit(&self->m_Downloads);
+    queue->m_CachePrefetch = self;
+
+    for (int i = 0; i < kCachePrefetchThreadCount; ++i)
+    {
+        ThreadState *thread_state = &self->m_ThreadState[i];
+
+        // Profiler thread indices after the main thread and the build threads.
+        ThreadStateInit(thread_state, queue, MB(16), config.m_DriverOptions->m_ThreadCount + 1 + i);
+        self->m_Threads[i] = ThreadStart(PrefetchThreadRoutine, thread_state, "Cache Prefetch Thread");
+    }
+}
+
+void CachePrefetchStop(BuildQueue *queue)
+{
+    CachePrefetch *self = queue->m_CachePrefetch;
+    if (self == nullptr)
+        return;
+
+    MutexLock(&self->m_Lock);
+    AtomicStore(&self->m_Stop, true);
+    CondBroadcast(&self->m_DownloadAvailable);
+    MutexUnlock(&self->m_Lock);
+
+    for (int i = 0; i < kCachePrefetchThreadCount; ++i)
+    {
+        ThreadJoin(self->m_Threads[i]);
+        ThreadStateDestroy(&self->m_ThreadState[i]);
+    }
+}
+
+void CachePrefetchDestroy(BuildQueue *queue)
+{
+    CachePrefetch *self = queue->m_CachePrefetch;
+    if (self == nullptr)
+        return;
+
+    MemAllocHeap *heap = queue->m_Config.m_Heap;
+    BufferDestroy(&self->m_Downloads, heap);
+    CondDestroy(&self->m_DownloadFinished);
+    CondDestroy(&self->m_DownloadAvailable);
+    MutexDestroy(&self->m_Lock);
+    HeapFree(heap, self);
+    queue->m_CachePrefetch = nullptr;
+}
+
+bool CachePrefetchTakeResult(BuildQueue *queue, RuntimeNode *node, CacheResult::Enum *out_result)
+{
+    CachePrefetch *self = queue->m_CachePrefetch;
+    if (self == nullptr)
+        return false;
+
+    for (;;)
+    {
+        uint16_t state = AtomicLoad(&node->m_CachePrefetchState);
+        switch (state)
+        {
+            case CachePrefetchState::kNone:
+            case CachePrefetchState::kPresent:
+                // Nobody is downloading it yet, quicker to look it up right away than to wait for a download thread.
+                if (TryMoveState(node, (CachePrefetchState::Enum)state, CachePrefetchState::kClaimed))
+                    return false;
+                break;
+
+            case CachePrefetchState::kDownloading:
+                MutexLock(&self->m_Lock);
+                while (AtomicLoad(&node->m_CachePrefetchState) == CachePrefetchState::kDownloading)
+                    CondWait(&self->m_DownloadFinished, &self->m_Lock);
+                MutexUnlock(&self->m_Lock);
+                break;
+
+            case CachePrefetchState::kAbsent:
+                *out_result = CacheResult::CacheMiss;
+                return true;
+
+            case CachePrefetchState::kDownloaded:
+                AtomicIncrement(&g_Stats.m_CachePrefetchDownloadsUsed);
+                *out_result = CacheResult::Success;
+                return true;
+
+            case CachePrefetchState::kFailed:
+                *out_result = CacheResult::Failure;
+                return true;
+
+            case CachePrefetchState::kNotTried:
+                *out_result = CacheResult::DidNotTry;
+                return true;
+
+            default:
+                return false;
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "CacheClient.hpp"
+
+struct BuildQueue;
+struct RuntimeNode;
+
+enum
+{
+    // Threads downloading cache hits ahead of the build threads. They come after the build threads in the profiler.
+    kCachePrefetchThreadCount = 4
+};
+
+// When the cache backend can answer for many signatures at once, the cacheable nodes nearest to the requested nodes get
+// their leaf input signatures calculated right away and looked up in bulk, and the hits are downloaded in the
+// background while the build threads work on the rest of the graph. Only the dependencies of misses are looked at next.
+void CachePrefetchStart(BuildQueue *queue);
+
+// Stops looking up and downloading, the nodes that were not downloaded yet are left to the build threads.
+void CachePrefetchStop(BuildQueue *queue);
+
+void CachePrefetchDestroy(BuildQueue *queue);
+
+// Called by a build thread about to look up node in the cache. Returns false if it should do so itself, otherwise
+// out_result says what the prefetch found; on CacheResult::Success the outputs are already in place.
+bool CachePrefetchTakeResult(BuildQueue *queue, RuntimeNode *node, CacheResult::Enum *out_result);
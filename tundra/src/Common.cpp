@@ -551,6 +551,23 @@ int GetCpuCount()
 #endif
 }
 
+uint64_t GetPhysicalMemoryMB()
+{
+#if defined(TUNDRA_WIN32)
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status))
+        return 0;
+    return status.ullTotalPhys / (1024 * 1024);
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages < 0 || page_size < 0)
+        return 0;
+    return uint64_t(pages) * uint64_t(page_size) / (1024 * 1024);
+#endif
+}
+
 int CountTrailingZeroes(uint32_t v)
 {
     v &= -int32_t(v);
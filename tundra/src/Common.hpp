@@ -166,6 +166,8 @@ double TimerDiffSeconds(uint64_t start, uint64_t end);
 
 int GetCpuCount();
 
+uint64_t GetPhysicalMemoryMB();
+
 int CountTrailingZeroes(uint32_t word);
 
 #if ENABLED(USE_LITTLE_ENDIAN)
@@ -5,6 +5,8 @@
 
 #if defined(TUNDRA_UNIX)
 #include <pthread.h>
+#include <errno.h>
+#include <time.h>
 #elif defined(TUNDRA_WIN32)
 #include <windows.h>
 #endif
@@ -36,6 +38,23 @@ inline void CondWait(ConditionVariable *var, Mutex *mutex)
         CroakErrno("pthread_cond_wait() failed");
 }
 
+inline void CondWait(ConditionVariable *var, Mutex *mutex, int timeoutMilliseconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMilliseconds / 1000;
+    deadline.tv_nsec += (timeoutMilliseconds % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = pthread_cond_timedwait(&var->m_Impl, &mutex->m_Impl, &deadline);
+    if (0 != rc && ETIMEDOUT != rc)
+        CroakErrno("pthread_cond_timedwait() failed");
+}
+
 inline void CondSignal(ConditionVariable *var)
 {
     if (0 != pthread_cond_signal(&var->m_Impl))
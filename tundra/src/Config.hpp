@@ -12,6 +12,10 @@
 #define USE_SHA1_HASH NO
 #define USE_FAST_HASH YES
 
+// Which USE_FAST_HASH implementation to use: xxh3-style 64-bit lanes with SIMD
+// kernels picked at runtime, or the original four 32-bit xxhash lanes.
+#define USE_FAST_HASH_XXH3 YES
+
 #if defined(_DEBUG)
 #define CHECKED_BUILD YES
 #else
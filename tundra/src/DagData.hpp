@@ -117,7 +117,14 @@ struct DagNode
         kFlagAllowUnwrittenOutputFiles = 1 << 11,
         kFlagBanContentDigestForInputs = 1 << 12,
 
-        kFlagCacheableByLeafInputs = 1 << 13
+        kFlagCacheableByLeafInputs = 1 << 13,
+
+        // Set in m_Flags if the frontend has tokenised m_Action so that it can be
+        // executed directly, without starting a shell to interpret it.
+        kFlagDirectExec = 1 << 14,
+
+        // Set in m_Flags of a CopyFiles node whose outputs may be hardlinks to its inputs.
+        kFlagCopyAsHardlinks = 1 << 15
     };
 
     union {
@@ -147,6 +154,11 @@ struct DagNode
     uint32_t m_FlagsAndActionType;
     uint32_t m_OriginalIndex;
     uint32_t m_DagNodeIndex;
+
+    // What the action takes from Dag::m_CpuCapacity and Dag::m_MemoryCapacityMB while it runs. A memory weight of 0 is unknown,
+    // see DriverOptions::m_LearnMemoryWeights.
+    uint32_t m_CpuWeight;
+    uint32_t m_MemoryWeightMB;
 };
 
 
@@ -156,11 +168,14 @@ struct SharedResourceData
     FrozenString m_CreateAction;
     FrozenString m_DestroyAction;
     FrozenArray<EnvVarData> m_EnvVars;
+
+    // How many nodes using this resource can run their action at the same time, 0 for no limit.
+    int32_t m_Capacity;
 };
 
 struct Dag
 {
-    static const uint32_t MagicNumber = 0x29a22148 ^ kTundraHashMagic;
+    static const uint32_t MagicNumber = 0x29a22149 ^ kTundraHashMagic;
 
     uint32_t m_MagicNumber;
 
@@ -191,6 +206,11 @@ struct Dag
     int32_t m_DaysToKeepUnreferencedNodesAround;
     int32_t m_EmitDataForBeeWhy;
 
+    // Limits on the summed weights of the actions running at the same time. No cpu capacity means no limit beyond the
+    // number of build threads, no memory capacity means the physical memory of the machine.
+    int32_t m_CpuCapacity;
+    int32_t m_MemoryCapacityMB;
+
     FrozenString m_StateFileName;
     FrozenString m_StateFileNameTmp;
     FrozenString m_StateFileNameMapped;
@@ -207,7 +227,7 @@ struct Dag
 
 struct DagDerived
 {
-    static const uint32_t MagicNumber = 0x921ad1a8 ^ kTundraHashMagic;
+    static const uint32_t MagicNumber = 0x921ad1a9 ^ kTundraHashMagic;
 
     uint32_t m_MagicNumber;
     uint32_t m_NodeCount;
@@ -247,6 +267,11 @@ struct DagDerived
     //we have already hashed them down so we no longer have to do that at runtime.
     FrozenArray<HashDigest> m_LeafInputHash_Offline;
 
+    //the guids of the dag this was compiled from, and for each node a hash of everything its entries above were computed from. When the
+    //dag is refrozen, entries of nodes whose key didn't change are copied over from the previous file instead of being computed again.
+    FrozenArray<HashDigest> m_NodeGuids;
+    FrozenArray<HashDigest> m_NodeDerivedKeys;
+
     //convenience accessors to the arrays above, to make callsites a bit easier to read
     const FrozenArray<FrozenFileAndHash>& LeafInputsFor(int leafInputCacheableNode) const { return m_LeafInputs[leafInputCacheableNode]; }
     const FrozenArray<uint32_t>& DependentNodesThatThemselvesAreLeafInputCacheableFor(int leafInputCacheableNode) const { return m_DependentNodesThatThemselvesAreLeafInputCacheable[leafInputCacheableNode]; }
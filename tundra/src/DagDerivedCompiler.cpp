@@ -16,6 +16,10 @@
 #include "MakeDirectories.hpp"
 #include "StatCache.hpp"
 #include "Stats.hpp"
+#include "Atomic.hpp"
+#include "ParallelFor.hpp"
+#include "LoadFrozenData.hpp"
+#include "SortedArrayUtil.hpp"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -33,6 +37,41 @@ static bool HasFlag(int value, int flag)
     return (value & flag) != 0;
 }
 
+// The per-node parts of the derived data are computed in batches of nodes, spread
+// over a number of threads.
+static const int kMaxDagDerivedThreads = 32;
+static const int32_t kDagDerivedBatchSize = 256;
+static const int32_t kDagDerivedShardCount = 64;
+static const int32_t kParallelDagDerivedMinNodes = 1024;
+
+// Where the per-node entries of a shard are written. The node entries are written in a fixed number of shards,
+// each a contiguous range of nodes with segments and a shared string table of its own. The fixed-size entries of
+// the shards are concatenated in order once all shards are done, and the data they point to stays where it is.
+// The split depends only on the node count, so the output is the same however many threads wrote it.
+struct DerivedNodeOutput
+{
+    BinarySegment *nonGeneratedInputIndices_seg;
+    BinarySegment *leafInputsArray_seg;
+    BinarySegment *dependentNodesThatThemselvesAreLeafInputCacheableArray_seg;
+    BinarySegment *dependentNodesWithScannersArray_seg;
+    BinarySegment *scannersWithListOfFilesArray_seg;
+    BinarySegment *leafInputHashOfflineArray_seg;
+
+    BinarySegment *arraydata_seg;
+    BinarySegment *arraydata2_seg;
+    BinarySegment *str_seg;
+    HashTable<CommonStringRecord, kFlagCaseSensitive> *shared_strings;
+    MemAllocLinear *scratch;
+};
+
+enum
+{
+    kDerivedKeyNotVisited = 0,
+    kDerivedKeyVisiting = 1,
+    kDerivedKeyDone = 2,
+    kDerivedKeyUnusable = 3
+};
+
 struct CompileDagDerivedWorker
 {
     BinaryWriter _writer;
@@ -53,6 +92,8 @@ struct CompileDagDerivedWorker
     BinarySegment *dependentNodesWithScannersArray_seg;
     BinarySegment *scannersWithListOfFilesArray_seg;
     BinarySegment *leafInputHashOfflineArray_seg;
+    BinarySegment *nodeGuids_seg;
+    BinarySegment *nodeDerivedKeys_seg;
     BinarySegment *str_seg;
 
     DagRuntimeData dagRuntimeData;
@@ -61,11 +102,22 @@ struct CompileDagDerivedWorker
     MemAllocLinear* scratch;
     int node_count;
     int max_points;
+    int thread_count;
     StatCache *stat_cache;
 
     Buffer<int32_t> *combinedDependenciesBuffers;
     Buffer<int32_t> *backlinksBuffers;
 
+    //the derived file this dag replaces, if there was one. Entries of nodes whose derived key is unchanged are copied from it.
+    MemoryMappedFile previous_file;
+    const Frozen::DagDerived* previous;
+
+    HashDigest *ownKeys;
+    HashDigest *derivedKeys;
+    uint8_t *derivedKeyStates;
+    Buffer<int32_t> *generatingNodesBuffers;
+    int32_t *previousIndices;
+
     void AddToUseDependenciesOfDagNodeRecursive(const Frozen::DagNode* node, int i)
     {
         for(int dep : node->m_ToUseDependencies)
@@ -80,26 +132,28 @@ struct CompileDagDerivedWorker
         return HasFlag(dagNode.m_FlagsAndActionType, Frozen::DagNode::kFlagCacheableByLeafInputs);
     }
 
-    void WriteIndexArray(BinarySegment* segment, Buffer<int32_t>& buffer)
+    template <typename Array>
+    void WriteIndexArray(DerivedNodeOutput& out, BinarySegment* segment, Array& buffer)
     {
-        BinarySegmentWriteInt32(segment, buffer.m_Size);
-        BinarySegmentWritePointer(segment, BinarySegmentPosition(arraydata_seg));
+        BinarySegmentWriteInt32(segment, buffer.GetCount());
+        BinarySegmentWritePointer(segment, BinarySegmentPosition(out.arraydata_seg));
         for(int index: buffer)
-            BinarySegmentWriteInt32(arraydata_seg, index);
+            BinarySegmentWriteInt32(out.arraydata_seg, index);
     }
 
-    void WriteFileAndHashArray(BinarySegment* segment, Buffer<FileAndHash>& fileAndHashes)
+    template <typename Array>
+    void WriteFileAndHashArray(DerivedNodeOutput& out, BinarySegment* segment, Array& fileAndHashes)
     {
-        BinarySegmentWriteInt32(segment, fileAndHashes.m_Size);
-        BinarySegmentWritePointer(segment, BinarySegmentPosition(arraydata_seg));
-        for(const FileAndHash& fileAndHash: fileAndHashes)
+        BinarySegmentWriteInt32(segment, fileAndHashes.GetCount());
+        BinarySegmentWritePointer(segment, BinarySegmentPosition(out.arraydata_seg));
+        for(const auto& fileAndHash: fileAndHashes)
         {
-            WriteCommonStringPtr(arraydata_seg, str_seg, fileAndHash.m_Filename, &shared_strings, scratch);
-            BinarySegmentWriteInt32(arraydata_seg, fileAndHash.m_FilenameHash);
+            WriteCommonStringPtr(out.arraydata_seg, out.str_seg, fileAndHash.m_Filename, out.shared_strings, out.scratch);
+            BinarySegmentWriteInt32(out.arraydata_seg, fileAndHash.m_FilenameHash);
         }
     }
 
-    void WriteSortedPathsHashSetAsFrozenFileAndHash(BinarySegment* segment, HashSet<kFlagPathStrings>& paths)
+    void WriteSortedPathsHashSetAsFrozenFileAndHash(DerivedNodeOutput& out, BinarySegment* segment, HashSet<kFlagPathStrings>& paths)
     {
         Buffer<FileAndHash> buffer;
         BufferInitWithCapacity(&buffer, heap, paths.m_RecordCount);
@@ -112,7 +166,7 @@ struct CompileDagDerivedWorker
         });
 
         SortBufferOfFileAndHash(buffer);
-        WriteFileAndHashArray(segment, buffer);
+        WriteFileAndHashArray(out, segment, buffer);
         BufferDestroy(&buffer, heap);
     };
 
@@ -140,25 +194,25 @@ struct CompileDagDerivedWorker
         CollectNonGeneratedFilesBeingOperatedOnByScanner(dagNode, result, dagNode.m_InputFiles);
     };
 
-    void WriteIntoCacheableNodeDataArraysFor(int nodeIndex)
+    void WriteIntoCacheableNodeDataArraysFor(DerivedNodeOutput& out, int nodeIndex)
     {
         const Frozen::DagNode& node = dag->m_DagNodes[nodeIndex];
         if (!IsLeafInputCacheable(node))
         {
-            BinarySegmentWriteInt32(leafInputsArray_seg, 0);
-            BinarySegmentWriteNullPointer(leafInputsArray_seg);
+            BinarySegmentWriteInt32(out.leafInputsArray_seg, 0);
+            BinarySegmentWriteNullPointer(out.leafInputsArray_seg);
 
-            BinarySegmentWriteInt32(dependentNodesThatThemselvesAreLeafInputCacheableArray_seg, 0);
-            BinarySegmentWriteNullPointer(dependentNodesThatThemselvesAreLeafInputCacheableArray_seg);
+            BinarySegmentWriteInt32(out.dependentNodesThatThemselvesAreLeafInputCacheableArray_seg, 0);
+            BinarySegmentWriteNullPointer(out.dependentNodesThatThemselvesAreLeafInputCacheableArray_seg);
 
-            BinarySegmentWriteInt32(scannersWithListOfFilesArray_seg, 0);
-            BinarySegmentWriteNullPointer(scannersWithListOfFilesArray_seg);
+            BinarySegmentWriteInt32(out.scannersWithListOfFilesArray_seg, 0);
+            BinarySegmentWriteNullPointer(out.scannersWithListOfFilesArray_seg);
 
-            BinarySegmentWriteInt32(dependentNodesWithScannersArray_seg, 0);
-            BinarySegmentWriteNullPointer(dependentNodesWithScannersArray_seg);
+            BinarySegmentWriteInt32(out.dependentNodesWithScannersArray_seg, 0);
+            BinarySegmentWriteNullPointer(out.dependentNodesWithScannersArray_seg);
 
             HashDigest empty = {};
-            BinarySegmentWriteHashDigest(leafInputHashOfflineArray_seg, empty);
+            BinarySegmentWriteHashDigest(out.leafInputHashOfflineArray_seg, empty);
             return;
         }
 
@@ -168,7 +222,7 @@ struct CompileDagDerivedWorker
 
         FindDependentNodesFromRootIndex_IncludingSelf_NotRecursingIntoCacheableNodes(heap, dag, dag->m_DagNodes[nodeIndex], dependenciesAndSelf, &dependenciesThatAreLeafInputCacheableThemselves);
 
-        WriteIndexArray(dependentNodesThatThemselvesAreLeafInputCacheableArray_seg, dependenciesThatAreLeafInputCacheableThemselves);
+        WriteIndexArray(out, out.dependentNodesThatThemselvesAreLeafInputCacheableArray_seg, dependenciesThatAreLeafInputCacheableThemselves);
         BufferDestroy(&dependenciesThatAreLeafInputCacheableThemselves, heap);
 
 
@@ -220,28 +274,352 @@ struct CompileDagDerivedWorker
             }
         }
 
-        WriteSortedPathsHashSetAsFrozenFileAndHash(this->leafInputsArray_seg, leafInputFiles);
+        WriteSortedPathsHashSetAsFrozenFileAndHash(out, out.leafInputsArray_seg, leafInputFiles);
         HashSetDestroy(&leafInputFiles);
         HashSetDestroy(&ignoreSet);
 
         HashDigest offlineHash = CalculateLeafInputHashOffline(heap, dag, nodeIndex, nullptr);
-        BinarySegmentWriteHashDigest(this->leafInputHashOfflineArray_seg, offlineHash);
+        BinarySegmentWriteHashDigest(out.leafInputHashOfflineArray_seg, offlineHash);
 
-        BinarySegmentWriteInt32(scannersWithListOfFilesArray_seg, dag->m_Scanners.GetCount());
-        BinarySegmentWritePointer(scannersWithListOfFilesArray_seg, BinarySegmentPosition(arraydata2_seg));
+        BinarySegmentWriteInt32(out.scannersWithListOfFilesArray_seg, dag->m_Scanners.GetCount());
+        BinarySegmentWritePointer(out.scannersWithListOfFilesArray_seg, BinarySegmentPosition(out.arraydata2_seg));
         for (int scannerIndex=0; scannerIndex != dag->m_Scanners.GetCount(); scannerIndex++)
-            WriteSortedPathsHashSetAsFrozenFileAndHash(arraydata2_seg, filesAffectedByScanners[scannerIndex]);
+            WriteSortedPathsHashSetAsFrozenFileAndHash(out, out.arraydata2_seg, filesAffectedByScanners[scannerIndex]);
 
         for(auto& fileList: filesAffectedByScanners)
             HashSetDestroy(&fileList);
 
-        WriteIndexArray(dependentNodesWithScannersArray_seg, dependentNodesWithScanners);
+        WriteIndexArray(out, out.dependentNodesWithScannersArray_seg, dependentNodesWithScanners);
         BufferDestroy(&dependentNodesWithScanners, heap);
         BufferDestroy(&filesAffectedByScanners, heap);
 
         BufferDestroy(&dependenciesAndSelf, heap);
     }
 
+    void WriteNodeEntries(DerivedNodeOutput& out, int32_t nodeIndex, Buffer<int32_t>& indices)
+    {
+        BufferClear(&indices);
+        {
+            TimingScope timing_scope(nullptr, &g_Stats.m_CalculateNonGeneratedIndicesTime);
+            int count = dag->m_DagNodes[nodeIndex].m_InputFiles.GetCount();
+            for (int i=0; i!=count; i++)
+            {
+                auto& inputFile = dag->m_DagNodes[nodeIndex].m_InputFiles[i];
+                if (IsFileGenerated(&dagRuntimeData, inputFile.m_FilenameHash, inputFile.m_Filename))
+                    continue;
+                BufferAppendOne(&indices, heap, i);
+            }
+        }
+
+        WriteIndexArray(out, out.nonGeneratedInputIndices_seg, indices);
+        WriteIntoCacheableNodeDataArraysFor(out, nodeIndex);
+    }
+
+    //maps node indices of the previous dag to this one, which fails if one of those nodes is gone.
+    bool RemapPreviousNodeIndices(const FrozenArray<uint32_t>& previousNodeIndices, Buffer<int32_t>& result)
+    {
+        for (uint32_t previousNodeIndex : previousNodeIndices)
+        {
+            const HashDigest* guid = BinarySearch(dag->m_NodeGuids.Get(), dag->m_NodeCount, previous->m_NodeGuids[previousNodeIndex]);
+            if (guid == nullptr)
+                return false;
+            BufferAppendOne(&result, heap, int32_t(guid - dag->m_NodeGuids.Get()));
+        }
+        return true;
+    }
+
+    bool WriteReusedNodeEntries(DerivedNodeOutput& out, int32_t nodeIndex, int32_t previousIndex)
+    {
+        Buffer<int32_t> cacheableDependencies, dependenciesWithScanners;
+        BufferInit(&cacheableDependencies);
+        BufferInit(&dependenciesWithScanners);
+
+        bool remapped = RemapPreviousNodeIndices(previous->m_DependentNodesThatThemselvesAreLeafInputCacheable[previousIndex], cacheableDependencies) &&
+                        RemapPreviousNodeIndices(previous->m_DependentNodesWithScanners[previousIndex], dependenciesWithScanners);
+
+        if (remapped)
+        {
+            WriteIndexArray(out, out.nonGeneratedInputIndices_seg, previous->m_NodeNonGeneratedInputIndicies[previousIndex]);
+
+            if (!IsLeafInputCacheable(dag->m_DagNodes[nodeIndex]))
+            {
+                WriteIntoCacheableNodeDataArraysFor(out, nodeIndex);
+            }
+            else
+            {
+                WriteIndexArray(out, out.dependentNodesThatThemselvesAreLeafInputCacheableArray_seg, cacheableDependencies);
+                WriteFileAndHashArray(out, out.leafInputsArray_seg, previous->m_LeafInputs[previousIndex]);
+                BinarySegmentWriteHashDigest(out.leafInputHashOfflineArray_seg, previous->m_LeafInputHash_Offline[previousIndex]);
+
+                const FrozenArray<FrozenArray<FrozenFileAndHash>>& scannersWithListOfFiles = previous->m_ScannersWithListOfFiles[previousIndex];
+                BinarySegmentWriteInt32(out.scannersWithListOfFilesArray_seg, scannersWithListOfFiles.GetCount());
+                BinarySegmentWritePointer(out.scannersWithListOfFilesArray_seg, BinarySegmentPosition(out.arraydata2_seg));
+                for (const FrozenArray<FrozenFileAndHash>& files : scannersWithListOfFiles)
+                    WriteFileAndHashArray(out, out.arraydata2_seg, files);
+
+                WriteIndexArray(out, out.dependentNodesWithScannersArray_seg, dependenciesWithScanners);
+            }
+        }
+
+        BufferDestroy(&dependenciesWithScanners, heap);
+        BufferDestroy(&cacheableDependencies, heap);
+        return remapped;
+    }
+
+    void HashFileAndGeneratingNode(HashState* h, const FrozenFileAndHash& file, int32_t nodeIndex)
+    {
+        HashAddString(h, file.m_Filename);
+        HashAddSeparator(h);
+
+        const Frozen::DagNode* generatingNode;
+        if (!FindDagNodeForFile(&dagRuntimeData, file.m_FilenameHash, file.m_Filename, &generatingNode))
+        {
+            HashAddInteger(h, 0);
+        }
+        else if (generatingNode == nullptr)
+        {
+            HashAddInteger(h, 1);
+        }
+        else
+        {
+            HashAddInteger(h, 2);
+            HashAddHashDigest(h, dag->m_NodeGuids[generatingNode->m_DagNodeIndex]);
+            BufferAppendOne(&generatingNodesBuffers[nodeIndex], heap, int32_t(generatingNode->m_DagNodeIndex));
+        }
+    }
+
+    //hashes everything of the node itself that goes into its derived entries, including which nodes generate the files it reads.
+    void CalculateOwnKey(int32_t nodeIndex)
+    {
+        const Frozen::DagNode& node = dag->m_DagNodes[nodeIndex];
+
+        HashState h;
+        HashInit(&h);
+
+        HashAddInteger(&h, dag->m_Scanners.GetCount());
+        HashAddHashDigest(&h, dag->m_NodeGuids[nodeIndex]);
+        HashAddString(&h, node.m_Annotation);
+        HashAddSeparator(&h);
+        HashAddString(&h, node.m_Action);
+        HashAddSeparator(&h);
+        HashAddInteger(&h, node.m_FlagsAndActionType);
+        HashAddInteger(&h, node.m_ScannerIndex);
+
+        for (auto& env: node.m_EnvVars)
+        {
+            HashAddString(&h, env.m_Name);
+            HashAddSeparator(&h);
+            HashAddString(&h, env.m_Value);
+            HashAddSeparator(&h);
+        }
+        HashAddInteger(&h, node.m_EnvVars.GetCount());
+
+        for (auto& s: node.m_AllowedOutputSubstrings)
+        {
+            HashAddString(&h, s);
+            HashAddSeparator(&h);
+        }
+        HashAddInteger(&h, node.m_AllowedOutputSubstrings.GetCount());
+
+        for (auto& file: node.m_OutputFiles)
+        {
+            HashAddString(&h, file.m_Filename);
+            HashAddSeparator(&h);
+        }
+        HashAddInteger(&h, node.m_OutputFiles.GetCount());
+
+        for (auto& file: node.m_CachingInputIgnoreList)
+        {
+            HashAddString(&h, file.m_Filename);
+            HashAddSeparator(&h);
+        }
+        HashAddInteger(&h, node.m_CachingInputIgnoreList.GetCount());
+
+        for (auto& file: node.m_InputFiles)
+            HashFileAndGeneratingNode(&h, file, nodeIndex);
+        HashAddInteger(&h, node.m_InputFiles.GetCount());
+
+        for (auto& file: node.m_FilesThatMightBeIncluded)
+            HashFileAndGeneratingNode(&h, file, nodeIndex);
+        HashAddInteger(&h, node.m_FilesThatMightBeIncluded.GetCount());
+
+        HashAddInteger(&h, node.m_ToBuildDependencies.GetCount());
+        HashAddInteger(&h, node.m_ToUseDependencies.GetCount());
+
+        HashFinalize(&h, &ownKeys[nodeIndex]);
+    }
+
+    //a node's derived key covers its own key and the derived keys of its dependencies and of the nodes generating its files,
+    //so it changes whenever anything its entries are computed from changes. Nodes that end up depending on themselves get no key.
+    bool CalculateDerivedKey(int32_t nodeIndex)
+    {
+        switch (derivedKeyStates[nodeIndex])
+        {
+        case kDerivedKeyDone:
+            return true;
+        case kDerivedKeyVisiting:
+        case kDerivedKeyUnusable:
+            return false;
+        }
+
+        derivedKeyStates[nodeIndex] = kDerivedKeyVisiting;
+
+        bool usable = true;
+
+        HashState h;
+        HashInit(&h);
+        HashAddHashDigest(&h, ownKeys[nodeIndex]);
+
+        auto AddDerivedKeyOf = [&](int32_t otherIndex) {
+            usable = CalculateDerivedKey(otherIndex) && usable;
+            HashAddHashDigest(&h, derivedKeys[otherIndex]);
+        };
+
+        for (int dep : dag->m_DagNodes[nodeIndex].m_ToBuildDependencies)
+            AddDerivedKeyOf(dep);
+        HashAddSeparator(&h);
+        for (int dep : dag->m_DagNodes[nodeIndex].m_ToUseDependencies)
+            AddDerivedKeyOf(dep);
+        HashAddSeparator(&h);
+        for (int32_t generatingNode : generatingNodesBuffers[nodeIndex])
+            AddDerivedKeyOf(generatingNode);
+
+        HashFinalize(&h, &derivedKeys[nodeIndex]);
+        if (!usable)
+        {
+            HashDigest empty = {};
+            derivedKeys[nodeIndex] = empty;
+        }
+
+        derivedKeyStates[nodeIndex] = usable ? kDerivedKeyDone : kDerivedKeyUnusable;
+        return usable;
+    }
+
+    void CalculateDerivedKeys()
+    {
+        ownKeys = HeapAllocateArray<HashDigest>(heap, node_count);
+        derivedKeys = HeapAllocateArrayZeroed<HashDigest>(heap, node_count);
+        derivedKeyStates = HeapAllocateArrayZeroed<uint8_t>(heap, node_count);
+        generatingNodesBuffers = HeapAllocateArrayZeroed<Buffer<int32_t>>(heap, node_count);
+        previousIndices = HeapAllocateArray<int32_t>(heap, node_count);
+
+        ParallelFor(thread_count, node_count, kDagDerivedBatchSize, "Dag Derived", [&](int32_t start, int32_t end, int thread_index) {
+            for (int32_t nodeIndex = start; nodeIndex < end; ++nodeIndex)
+                CalculateOwnKey(nodeIndex);
+            return true;
+        });
+
+        for (int32_t nodeIndex = 0; nodeIndex < node_count; ++nodeIndex)
+        {
+            previousIndices[nodeIndex] = -1;
+
+            if (!CalculateDerivedKey(nodeIndex) || previous == nullptr)
+                continue;
+
+            const HashDigest* previousGuids = previous->m_NodeGuids.GetArray();
+            const HashDigest* previousGuid = BinarySearch(previousGuids, previous->m_NodeGuids.GetCount(), dag->m_NodeGuids[nodeIndex]);
+            if (previousGuid == nullptr)
+                continue;
+
+            int32_t previousIndex = int32_t(previousGuid - previousGuids);
+            if (previous->m_NodeDerivedKeys[previousIndex] == derivedKeys[nodeIndex])
+                previousIndices[nodeIndex] = previousIndex;
+        }
+    }
+
+    void WriteAllNodeEntries()
+    {
+        // Segments can only be added from this thread, so set them all up front. The first shard writes its data into
+        // the main segments.
+        const int32_t shard_count = std::max(1, std::min(kDagDerivedShardCount, (node_count + kDagDerivedBatchSize - 1) / kDagDerivedBatchSize));
+        const int32_t shard_size = (node_count + shard_count - 1) / shard_count;
+        DerivedNodeOutput* shardOutputs = HeapAllocateArray<DerivedNodeOutput>(heap, shard_count);
+        for (int32_t i = 0; i < shard_count; ++i)
+        {
+            DerivedNodeOutput& out = shardOutputs[i];
+            out.nonGeneratedInputIndices_seg = BinaryWriterAddSegment(writer);
+            out.leafInputsArray_seg = BinaryWriterAddSegment(writer);
+            out.dependentNodesThatThemselvesAreLeafInputCacheableArray_seg = BinaryWriterAddSegment(writer);
+            out.dependentNodesWithScannersArray_seg = BinaryWriterAddSegment(writer);
+            out.scannersWithListOfFilesArray_seg = BinaryWriterAddSegment(writer);
+            out.leafInputHashOfflineArray_seg = BinaryWriterAddSegment(writer);
+            out.scratch = nullptr;
+            if (i == 0)
+            {
+                out.arraydata_seg = arraydata_seg;
+                out.arraydata2_seg = arraydata2_seg;
+                out.str_seg = str_seg;
+                out.shared_strings = &shared_strings;
+                continue;
+            }
+
+            out.arraydata_seg = BinaryWriterAddSegment(writer);
+            out.arraydata2_seg = BinaryWriterAddSegment(writer);
+            out.str_seg = BinaryWriterAddSegment(writer);
+            out.shared_strings = HeapAllocateArray<HashTable<CommonStringRecord, kFlagCaseSensitive>>(heap, 1);
+            HashTableInit(out.shared_strings, heap);
+        }
+
+        const int shard_thread_count = std::min(thread_count, int(shard_count));
+        MemAllocLinear* threadScratch[kMaxDagDerivedThreads];
+        threadScratch[0] = scratch;
+        for (int i = 1; i < shard_thread_count; ++i)
+        {
+            threadScratch[i] = HeapAllocateArray<MemAllocLinear>(heap, 1);
+            LinearAllocInit(threadScratch[i], heap, MB(64), "dag derived scratch");
+        }
+
+        int32_t reusedCount = 0;
+
+        ParallelFor(shard_thread_count, shard_count, 1, "Dag Derived", [&](int32_t start, int32_t end, int thread_index) {
+            Buffer<int32_t> indices;
+            BufferInitWithCapacity(&indices, heap, 1024);
+
+            for (int32_t shard = start; shard < end; ++shard)
+            {
+                DerivedNodeOutput out = shardOutputs[shard];
+                out.scratch = threadScratch[thread_index];
+
+                int32_t shard_end = std::min(node_count, (shard + 1) * shard_size);
+                for (int32_t nodeIndex = shard * shard_size; nodeIndex < shard_end; ++nodeIndex)
+                {
+                    if (previousIndices[nodeIndex] != -1 && WriteReusedNodeEntries(out, nodeIndex, previousIndices[nodeIndex]))
+                        AtomicAdd32(&reusedCount, 1);
+                    else
+                        WriteNodeEntries(out, nodeIndex, indices);
+                }
+            }
+
+            BufferDestroy(&indices, heap);
+            return true;
+        });
+
+        for (int32_t i = 0; i < shard_count; ++i)
+        {
+            DerivedNodeOutput& out = shardOutputs[i];
+            BinarySegmentAppend(nonGeneratedInputIndices_seg, out.nonGeneratedInputIndices_seg);
+            BinarySegmentAppend(leafInputsArray_seg, out.leafInputsArray_seg);
+            BinarySegmentAppend(dependentNodesThatThemselvesAreLeafInputCacheableArray_seg, out.dependentNodesThatThemselvesAreLeafInputCacheableArray_seg);
+            BinarySegmentAppend(dependentNodesWithScannersArray_seg, out.dependentNodesWithScannersArray_seg);
+            BinarySegmentAppend(scannersWithListOfFilesArray_seg, out.scannersWithListOfFilesArray_seg);
+            BinarySegmentAppend(leafInputHashOfflineArray_seg, out.leafInputHashOfflineArray_seg);
+
+            if (i != 0)
+            {
+                HashTableDestroy(out.shared_strings);
+                HeapFree(heap, out.shared_strings);
+            }
+        }
+        HeapFree(heap, shardOutputs);
+
+        for (int i = 1; i < shard_thread_count; ++i)
+        {
+            LinearAllocDestroy(threadScratch[i]);
+            HeapFree(heap, threadScratch[i]);
+        }
+
+        g_Stats.m_CompileDagDerivedNodesReused = reusedCount;
+    }
 
     void PrintStats()
     {
@@ -264,14 +642,17 @@ struct CompileDagDerivedWorker
         MemAllocLinearScope scratchScope(scratch);
 
         combinedDependenciesBuffers = HeapAllocateArrayZeroed<Buffer<int32_t>>(heap, node_count);
-            for (int32_t i = 0; i < node_count; ++i)
+        ParallelFor(thread_count, node_count, kDagDerivedBatchSize, "Dag Derived", [&](int32_t start, int32_t end, int thread_index) {
+            for (int32_t i = start; i < end; ++i)
             {
                 for(int dep : dag->m_DagNodes[i].m_ToBuildDependencies)
                 {
                     if (BufferAppendOneIfNotPresent(&combinedDependenciesBuffers[i], heap, dep))
                         AddToUseDependenciesOfDagNodeRecursive(dag->m_DagNodes + dep, i);
                 }
-        }
+            }
+            return true;
+        });
 
         backlinksBuffers = HeapAllocateArrayZeroed<Buffer<int32_t>>(heap, node_count);
         for (int32_t i = 0; i < node_count; ++i)
@@ -317,13 +698,13 @@ struct CompileDagDerivedWorker
         BinarySegmentWriteUint32(main_seg, node_count);
         BinarySegmentWritePointer(main_seg, BinarySegmentPosition(leafInputHashOfflineArray_seg));
 
-        DagRuntimeDataInit(&dagRuntimeData, dag, heap);
+        BinarySegmentWriteUint32(main_seg, node_count);
+        BinarySegmentWritePointer(main_seg, BinarySegmentPosition(nodeGuids_seg));
 
-        Buffer<int32_t> indices;
-        BufferInitWithCapacity(&indices, heap, 1024);
+        BinarySegmentWriteUint32(main_seg, node_count);
+        BinarySegmentWritePointer(main_seg, BinarySegmentPosition(nodeDerivedKeys_seg));
 
-        Buffer<uint32_t> all_nodes_depending_on_me;
-        BufferInitWithCapacity(&all_nodes_depending_on_me, heap, 1024);
+        DagRuntimeDataInit(&dagRuntimeData, dag, heap);
 
         for (int32_t nodeIndex = 0; nodeIndex < node_count; ++nodeIndex)
         {
@@ -369,35 +750,30 @@ struct CompileDagDerivedWorker
             BufferDestroy(&all_scores, heap);
         }
 
+        CalculateDerivedKeys();
+        WriteAllNodeEntries();
+
         for (int32_t nodeIndex = 0; nodeIndex < node_count; ++nodeIndex)
         {
-            BufferClear(&indices);
-            {
-                TimingScope timing_scope(nullptr, &g_Stats.m_CalculateNonGeneratedIndicesTime);
-                int count = dag->m_DagNodes[nodeIndex].m_InputFiles.GetCount();
-                for (int i=0; i!=count; i++)
-                {
-                    auto& inputFile = dag->m_DagNodes[nodeIndex].m_InputFiles[i];
-                    if (IsFileGenerated(&dagRuntimeData, inputFile.m_FilenameHash, inputFile.m_Filename))
-                        continue;
-                    BufferAppendOne(&indices, heap, i);
-                }
-            }
-
-            WriteArrayOfIndices(nonGeneratedInputIndices_seg, indices);
-            WriteIntoCacheableNodeDataArraysFor(nodeIndex);
+            BinarySegmentWriteHashDigest(nodeGuids_seg, dag->m_NodeGuids[nodeIndex]);
+            BinarySegmentWriteHashDigest(nodeDerivedKeys_seg, derivedKeys[nodeIndex]);
         }
-        BufferDestroy(&indices, heap);
-        BufferDestroy(&all_nodes_depending_on_me, heap);
 
         DagRuntimeDataDestroy(&dagRuntimeData);
 
+        // Everything still needed from the previous file has been copied by now, and it's about to be overwritten.
+        if (previous != nullptr)
+        {
+            MmapFileUnmap(&previous_file);
+            previous = nullptr;
+        }
+
         BinarySegmentWriteUint32(main_seg, Frozen::DagDerived::MagicNumber);
         return BinaryWriterFlush(writer, dagderived_filename);
     }
 };
 
-static void CompileDagDerivedWorkerInit(CompileDagDerivedWorker* data, const Frozen::Dag* dag, MemAllocHeap* heap, MemAllocLinear* scratch, StatCache *stat_cache)
+static void CompileDagDerivedWorkerInit(CompileDagDerivedWorker* data, const Frozen::Dag* dag, MemAllocHeap* heap, MemAllocLinear* scratch, StatCache *stat_cache, const char* dagderived_filename)
 {
     data->heap = heap;
     data->scratch = scratch;
@@ -418,11 +794,21 @@ static void CompileDagDerivedWorkerInit(CompileDagDerivedWorker* data, const Fro
     data->dependentNodesWithScannersArray_seg = BinaryWriterAddSegment(data->writer);
     data->scannersWithListOfFilesArray_seg = BinaryWriterAddSegment(data->writer);
     data->leafInputHashOfflineArray_seg = BinaryWriterAddSegment(data->writer);
+    data->nodeGuids_seg = BinaryWriterAddSegment(data->writer);
+    data->nodeDerivedKeys_seg = BinaryWriterAddSegment(data->writer);
     data->str_seg = BinaryWriterAddSegment(data->writer);
 
     data->node_count = dag->m_NodeCount;
     data->max_points = 0;
     data->stat_cache = stat_cache;
+
+    data->thread_count = 1;
+    if (data->node_count >= kParallelDagDerivedMinNodes)
+        data->thread_count = ParallelForThreadCount(kMaxDagDerivedThreads, data->node_count, kDagDerivedBatchSize);
+
+    data->previous = nullptr;
+    MmapFileInit(&data->previous_file);
+    LoadFrozenData<Frozen::DagDerived>(dagderived_filename, &data->previous_file, &data->previous);
 }
 
 static void CompileDagDerivedWorkerDestroy(CompileDagDerivedWorker* data)
@@ -434,16 +820,25 @@ static void CompileDagDerivedWorkerDestroy(CompileDagDerivedWorker* data)
     {
         BufferDestroy(&data->backlinksBuffers[i], data->heap);
         BufferDestroy(&data->combinedDependenciesBuffers[i], data->heap);
+        BufferDestroy(&data->generatingNodesBuffers[i], data->heap);
     }
     HeapFree(data->heap, data->backlinksBuffers);
     HeapFree(data->heap, data->combinedDependenciesBuffers);
+    HeapFree(data->heap, data->generatingNodesBuffers);
+    HeapFree(data->heap, data->ownKeys);
+    HeapFree(data->heap, data->derivedKeys);
+    HeapFree(data->heap, data->derivedKeyStates);
+    HeapFree(data->heap, data->previousIndices);
+
+    if (data->previous != nullptr)
+        MmapFileUnmap(&data->previous_file);
 }
 
 bool CompileDagDerived(const Frozen::Dag* dag, MemAllocHeap* heap, MemAllocLinear* scratch, StatCache *stat_cache, const char* dagderived_filename)
 {
     TimingScope timing_scope(nullptr, &g_Stats.m_CompileDagDerivedTime);
     CompileDagDerivedWorker worker;
-    CompileDagDerivedWorkerInit(&worker,dag,heap,scratch,stat_cache);
+    CompileDagDerivedWorkerInit(&worker,dag,heap,scratch,stat_cache,dagderived_filename);
     bool result = worker.WriteStreams(dagderived_filename);
     worker.PrintStats();
     CompileDagDerivedWorkerDestroy(&worker);
@@ -6,6 +6,8 @@
 #include "MemAllocHeap.hpp"
 #include "MemAllocLinear.hpp"
 #include "JsonParse.hpp"
+#include "DagStream.hpp"
+#include "MemoryMappedFile.hpp"
 #include "BinaryWriter.hpp"
 #include "DagData.hpp"
 #include "HashTable.hpp"
@@ -15,6 +17,9 @@
 #include "FileInfoHelper.hpp"
 #include "Actions.hpp"
 #include "Stats.hpp"
+#include "Thread.hpp"
+#include "Atomic.hpp"
+#include "ParallelFor.hpp"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -131,6 +136,33 @@ static bool EmptyArray(const JsonArrayValue *a)
     return nullptr == a || a->m_Count == 0;
 }
 
+// The nodes of the dag being compiled: the "Nodes" array of a parsed JSON
+// document, or the nodes of an indexed dag stream, which are decoded one at a
+// time when they're needed.
+struct DagNodeSource
+{
+    const JsonArrayValue *m_Array;
+    const DagStreamIndex *m_Stream;
+    size_t m_Count;
+};
+
+// Returns null if the node isn't an object. Stream nodes are decoded into `alloc`.
+static const JsonObjectValue *GetDagNode(const DagNodeSource *nodes, size_t index, MemAllocLinear *alloc)
+{
+    if (!nodes->m_Stream)
+        return nodes->m_Array->m_Values[index]->AsObject();
+
+    char error_msg[1024];
+    const JsonValue *node = DagStreamDecodeNode(nodes->m_Stream, index, alloc, error_msg);
+    if (!node)
+    {
+        Log(kError, "failed to decode node %d: %s", int(index), error_msg);
+        return nullptr;
+    }
+
+    return node->AsObject();
+}
+
 struct TempNodeGuid
 {
     HashDigest m_Digest;
@@ -292,233 +324,345 @@ static void EmitGlobSignatures(const JsonObjectValue *json, BinarySegment *main_
     }
 }
 
-static bool WriteNodes(
-    const JsonArrayValue *nodes,
-    BinarySegment *main_seg,
+static bool WriteNode(
+    const JsonObjectValue *node,
     BinarySegment *node_data_seg,
     BinarySegment *array2_seg,
     BinarySegment *str_seg,
     BinarySegment *writetextfile_payloads_seg,
-    BinaryLocator scanner_ptrs[],
     MemAllocHeap *heap,
     HashTable<CommonStringRecord, kFlagCaseSensitive> *shared_strings,
     MemAllocLinear *scratch,
-    const TempNodeGuid *order,
-    const int32_t *remap_table)
+    const int32_t *remap_table,
+    uint32_t original_index,
+    uint32_t dag_index)
 {
-    BinarySegmentWritePointer(main_seg, BinarySegmentPosition(node_data_seg)); // m_DagNodes
+    const char* type = FindStringValue(node, "ActionType");
+    const char *action = FindStringValue(node, "Action");
+    const char *annotation = FindStringValue(node, "Annotation");
+    const char *profilerOutput = FindStringValue(node, "ProfilerOutput");
+    const JsonArrayValue *toBuildDependencies = FindArrayValue(node, "ToBuildDependencies");
+    if (toBuildDependencies == nullptr)
+        toBuildDependencies = FindArrayValue(node, "Deps");
+    const JsonArrayValue *toUseDependencies = FindArrayValue(node, "ToUseDependencies");
+    const JsonArrayValue *inputs = FindArrayValue(node, "Inputs");
+    const JsonArrayValue *filesThatMightBeIncluded = FindArrayValue(node, "FilesThatMightBeIncluded");
+    const JsonArrayValue *outputs = FindArrayValue(node, "Outputs");
+    const JsonArrayValue *output_dirs = FindArrayValue(node, "TargetDirectories");
+    const JsonArrayValue *aux_outputs = FindArrayValue(node, "AuxOutputs");
+    const JsonArrayValue *env_vars = FindArrayValue(node, "Env");
+    const int scanner_index = (int)FindIntValue(node, "ScannerIndex", -1);
+    const JsonArrayValue *shared_resources = FindArrayValue(node, "SharedResources");
+    const JsonArrayValue *frontend_rsps = FindArrayValue(node, "FrontendResponseFiles");
+    const JsonArrayValue *allowedOutputSubstrings = FindArrayValue(node, "AllowedOutputSubstrings");
+    const JsonArrayValue *cachingInputIgnoreList = FindArrayValue(node, "CachingInputIgnoreList");
+    const char *writetextfile_payload = FindStringValue(node, "WriteTextFilePayload");
+
+    // For compatibility with DAG.json writer code which isn't emitting this field yet, we allow it to be
+    // omitted and pick a sensible default.
+    //
+    // In the future we will still want to allow the field to be omitted for the most common type of action,
+    // but we will want to get rid of 'magically detect that it is a WriteTextFile action if there is a
+    // WriteTextFilePayload' and enforce that all actions other than the most common one actually specify what
+    // kind of action they are.
+    ActionType::Enum actionType = (writetextfile_payload != nullptr) ? ActionType::kWriteTextFile : ActionType::kRunShellCommand;
+    if (type != nullptr)
+        actionType = ActionType::FromString(type);
+
+    // WriteTextFilePayload for non-WriteTextFile actions is invalid, and so is a WriteTextFile action with no WriteTextFilePayload
+    if ((writetextfile_payload != nullptr) ^ (actionType == ActionType::kWriteTextFile))
+        return false;
 
-    MemAllocLinearScope scratch_scope(scratch);
+    switch (actionType) {
+        case ActionType::kRunShellCommand:
+            WriteStringPtr(node_data_seg, str_seg, action);
+            break;
+        case ActionType::kWriteTextFile:
+            WriteStringPtr(node_data_seg, writetextfile_payloads_seg, writetextfile_payload);
+            break;
+        case ActionType::kCopyFiles:
+            BinarySegmentWriteNullPointer(node_data_seg);
+            break;
+        case ActionType::kUnknown:
+            return false;
+    }
 
-    size_t node_count = nodes->m_Count;
+    WriteStringPtr(node_data_seg, str_seg, annotation);
 
-    uint32_t *reverse_remap = (uint32_t *)HeapAllocate(heap, node_count * sizeof(uint32_t));
-    for (uint32_t i = 0; i < node_count; ++i)
+    WriteStringPtr(node_data_seg, str_seg, profilerOutput);
+
+    auto writeDependencyIndexList = [=](const JsonArrayValue* deps)->void{
+        if (deps)
+        {
+            BinarySegmentAlign(array2_seg, 4);
+            BinarySegmentWriteInt32(node_data_seg, (int)deps->m_Count);
+            BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
+            for (size_t i = 0, count = deps->m_Count; i < count; ++i)
+            {
+                if (const JsonNumberValue *dep_index = deps->m_Values[i]->AsNumber())
+                {
+                    int index = (int)dep_index->m_Number;
+                    int remapped_index = remap_table[index];
+                    BinarySegmentWriteInt32(array2_seg, remapped_index);
+                }
+                else
+                {
+                    Croak("dependency node index out of range for node %s.", annotation);
+                }
+            }
+        }
+        else
+        {
+            BinarySegmentWriteInt32(node_data_seg, 0);
+            BinarySegmentWriteNullPointer(node_data_seg);
+        }
+    };
+
+    writeDependencyIndexList(toBuildDependencies);
+    writeDependencyIndexList(toUseDependencies);
+
+    if (actionType == ActionType::kCopyFiles && (inputs->m_Count != outputs->m_Count))
     {
-        reverse_remap[remap_table[i]] = i;
+        return false;
     }
 
-    for (size_t ni = 0; ni < node_count; ++ni)
+    WriteFileArray(node_data_seg, array2_seg, str_seg, inputs);
+    WriteFileArray(node_data_seg, array2_seg, str_seg, filesThatMightBeIncluded);
+    WriteFileArray(node_data_seg, array2_seg, str_seg, outputs);
+    WriteFileArray(node_data_seg, array2_seg, str_seg, output_dirs);
+
+    WriteFileArray(node_data_seg, array2_seg, str_seg, aux_outputs);
+    WriteFileArray(node_data_seg, array2_seg, str_seg, frontend_rsps);
+
+    if (allowedOutputSubstrings)
     {
-        const int32_t i = order[ni].m_Node;
-        const JsonObjectValue *node = nodes->m_Values[i]->AsObject();
-
-        const char* type = FindStringValue(node, "ActionType");
-        const char *action = FindStringValue(node, "Action");
-        const char *annotation = FindStringValue(node, "Annotation");
-        const char *profilerOutput = FindStringValue(node, "ProfilerOutput");
-        const JsonArrayValue *toBuildDependencies = FindArrayValue(node, "ToBuildDependencies");
-        if (toBuildDependencies == nullptr)
-            toBuildDependencies = FindArrayValue(node, "Deps");
-        const JsonArrayValue *toUseDependencies = FindArrayValue(node, "ToUseDependencies");
-        const JsonArrayValue *inputs = FindArrayValue(node, "Inputs");
-        const JsonArrayValue *filesThatMightBeIncluded = FindArrayValue(node, "FilesThatMightBeIncluded");
-        const JsonArrayValue *outputs = FindArrayValue(node, "Outputs");
-        const JsonArrayValue *output_dirs = FindArrayValue(node, "TargetDirectories");
-        const JsonArrayValue *aux_outputs = FindArrayValue(node, "AuxOutputs");
-        const JsonArrayValue *env_vars = FindArrayValue(node, "Env");
-        const int scanner_index = (int)FindIntValue(node, "ScannerIndex", -1);
-        const JsonArrayValue *shared_resources = FindArrayValue(node, "SharedResources");
-        const JsonArrayValue *frontend_rsps = FindArrayValue(node, "FrontendResponseFiles");
-        const JsonArrayValue *allowedOutputSubstrings = FindArrayValue(node, "AllowedOutputSubstrings");
-        const JsonArrayValue *cachingInputIgnoreList = FindArrayValue(node, "CachingInputIgnoreList");
-        const char *writetextfile_payload = FindStringValue(node, "WriteTextFilePayload");
-
-        // For compatibility with DAG.json writer code which isn't emitting this field yet, we allow it to be
-        // omitted and pick a sensible default.
-        //
-        // In the future we will still want to allow the field to be omitted for the most common type of action,
-        // but we will want to get rid of 'magically detect that it is a WriteTextFile action if there is a
-        // WriteTextFilePayload' and enforce that all actions other than the most common one actually specify what
-        // kind of action they are.
-        ActionType::Enum actionType = (writetextfile_payload != nullptr) ? ActionType::kWriteTextFile : ActionType::kRunShellCommand;
-        if (type != nullptr)
-            actionType = ActionType::FromString(type);
-
-        // WriteTextFilePayload for non-WriteTextFile actions is invalid, and so is a WriteTextFile action with no WriteTextFilePayload
-        if ((writetextfile_payload != nullptr) ^ (actionType == ActionType::kWriteTextFile))
-            return false;
+        int count = allowedOutputSubstrings->m_Count;
+        BinarySegmentWriteInt32(node_data_seg, count);
+        BinarySegmentAlign(array2_seg, 4);
+        BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
+        for (int i = 0; i != count; i++)
+            WriteCommonStringPtr(array2_seg, str_seg, allowedOutputSubstrings->m_Values[i]->AsString()->m_String, shared_strings, scratch);
+    }
+    else
+    {
+        BinarySegmentWriteInt32(node_data_seg, 0);
+        BinarySegmentWriteNullPointer(node_data_seg);
+    }
 
-        switch (actionType) {
-            case ActionType::kRunShellCommand:
-                WriteStringPtr(node_data_seg, str_seg, action);
-                break;
-            case ActionType::kWriteTextFile:
-                WriteStringPtr(node_data_seg, writetextfile_payloads_seg, writetextfile_payload);
-                break;
-            case ActionType::kCopyFiles:
-                BinarySegmentWriteNullPointer(node_data_seg);
-                break;
-            case ActionType::kUnknown:
+    // Environment variables
+    if (env_vars && env_vars->m_Count > 0)
+    {
+        BinarySegmentAlign(array2_seg, 4);
+        BinarySegmentWriteInt32(node_data_seg, (int)env_vars->m_Count);
+        BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
+        for (size_t i = 0, count = env_vars->m_Count; i < count; ++i)
+        {
+            const char *key = FindStringValue(env_vars->m_Values[i], "Key");
+            const char *value = FindStringValue(env_vars->m_Values[i], "Value");
+
+            if (!key || !value)
                 return false;
-        }
 
-        WriteStringPtr(node_data_seg, str_seg, annotation);
+            WriteCommonStringPtr(array2_seg, str_seg, key, shared_strings, scratch);
+            WriteCommonStringPtr(array2_seg, str_seg, value, shared_strings, scratch);
+        }
+    }
+    else
+    {
+        BinarySegmentWriteInt32(node_data_seg, 0);
+        BinarySegmentWriteNullPointer(node_data_seg);
+    }
 
-        WriteStringPtr(node_data_seg, str_seg, profilerOutput);
+    BinarySegmentWriteInt32(node_data_seg, scanner_index);
 
-        auto writeDependencyIndexList = [=](const JsonArrayValue* deps)->void{
-            if (deps)
+    if (shared_resources && shared_resources->m_Count > 0)
+    {
+        BinarySegmentAlign(array2_seg, 4);
+        BinarySegmentWriteInt32(node_data_seg, static_cast<int>(shared_resources->m_Count));
+        BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
+        for (size_t i = 0, count = shared_resources->m_Count; i < count; ++i)
+        {
+            if (const JsonNumberValue *res_index = shared_resources->m_Values[i]->AsNumber())
             {
-                BinarySegmentAlign(array2_seg, 4);
-                BinarySegmentWriteInt32(node_data_seg, (int)deps->m_Count);
-                BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-                for (size_t i = 0, count = deps->m_Count; i < count; ++i)
-                {
-                    if (const JsonNumberValue *dep_index = deps->m_Values[i]->AsNumber())
-                    {
-                        int index = (int)dep_index->m_Number;
-                        int remapped_index = remap_table[index];
-                        BinarySegmentWriteInt32(array2_seg, remapped_index);
-                    }
-                    else
-                    {
-                        Croak("dependency node index out of range for node %s.", annotation);
-                    }
-                }
+                BinarySegmentWriteInt32(array2_seg, static_cast<int>(res_index->m_Number));
             }
             else
             {
-                BinarySegmentWriteInt32(node_data_seg, 0);
-                BinarySegmentWriteNullPointer(node_data_seg);
+                return false;
             }
-        };
+        }
+    }
+    else
+    {
+        BinarySegmentWriteInt32(node_data_seg, 0);
+        BinarySegmentWriteNullPointer(node_data_seg);
+    }
 
-        writeDependencyIndexList(toBuildDependencies);
-        writeDependencyIndexList(toUseDependencies);
+    EmitFileSignatures(node, node_data_seg, array2_seg, str_seg);
+    EmitStatSignatures(node, node_data_seg, array2_seg, str_seg);
+    EmitGlobSignatures(node, node_data_seg, array2_seg, str_seg, heap, scratch);
+    
 
-        if (actionType == ActionType::kCopyFiles && (inputs->m_Count != outputs->m_Count))
-        {
-            return false;
-        }
+    WriteFileArray(node_data_seg, array2_seg, str_seg, cachingInputIgnoreList);
 
-        WriteFileArray(node_data_seg, array2_seg, str_seg, inputs);
-        WriteFileArray(node_data_seg, array2_seg, str_seg, filesThatMightBeIncluded);
-        WriteFileArray(node_data_seg, array2_seg, str_seg, outputs);
-        WriteFileArray(node_data_seg, array2_seg, str_seg, output_dirs);
+    uint32_t flags = 0;
 
-        WriteFileArray(node_data_seg, array2_seg, str_seg, aux_outputs);
-        WriteFileArray(node_data_seg, array2_seg, str_seg, frontend_rsps);
+    flags |= static_cast<uint8_t>(actionType);
 
-        if (allowedOutputSubstrings)
-        {
-            int count = allowedOutputSubstrings->m_Count;
-            BinarySegmentWriteInt32(node_data_seg, count);
-            BinarySegmentAlign(array2_seg, 4);
-            BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-            for (int i = 0; i != count; i++)
-                WriteCommonStringPtr(array2_seg, str_seg, allowedOutputSubstrings->m_Values[i]->AsString()->m_String, shared_strings, scratch);
-        }
-        else
-        {
-            BinarySegmentWriteInt32(node_data_seg, 0);
-            BinarySegmentWriteNullPointer(node_data_seg);
-        }
+    flags |= GetNodeFlag(node, "OverwriteOutputs", Frozen::DagNode::kFlagOverwriteOutputs, true);
+    flags |= GetNodeFlag(node, "AllowUnexpectedOutput", Frozen::DagNode::kFlagAllowUnexpectedOutput, false);
+    flags |= GetNodeFlag(node, "AllowUnwrittenOutputFiles", Frozen::DagNode::kFlagAllowUnwrittenOutputFiles, false);
+    flags |= GetNodeFlag(node, "BanContentDigestForInputs", Frozen::DagNode::kFlagBanContentDigestForInputs, false);
+    flags |= GetNodeFlag(node, "DirectExec", Frozen::DagNode::kFlagDirectExec, false);
+    flags |= GetNodeFlag(node, "CopyAsHardlinks", Frozen::DagNode::kFlagCopyAsHardlinks, false);
 
-        // Environment variables
-        if (env_vars && env_vars->m_Count > 0)
-        {
-            BinarySegmentAlign(array2_seg, 4);
-            BinarySegmentWriteInt32(node_data_seg, (int)env_vars->m_Count);
-            BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-            for (size_t i = 0, count = env_vars->m_Count; i < count; ++i)
-            {
-                const char *key = FindStringValue(env_vars->m_Values[i], "Key");
-                const char *value = FindStringValue(env_vars->m_Values[i], "Value");
+    const char* cachingMode = FindStringValue(node, "CachingMode");
+    if (cachingMode != nullptr)
+    {
+        if (0==strcmp(cachingMode, "ByLeafInputs"))
+            flags |= Frozen::DagNode::kFlagCacheableByLeafInputs;
+    }
 
-                if (!key || !value)
-                    return false;
+    BinarySegmentWriteUint32(node_data_seg, flags);
 
-                WriteCommonStringPtr(array2_seg, str_seg, key, shared_strings, scratch);
-                WriteCommonStringPtr(array2_seg, str_seg, value, shared_strings, scratch);
-            }
-        }
-        else
-        {
-            BinarySegmentWriteInt32(node_data_seg, 0);
-            BinarySegmentWriteNullPointer(node_data_seg);
-        }
+    //write m_OriginalIndex
+    BinarySegmentWriteUint32(node_data_seg, original_index);
 
-        BinarySegmentWriteInt32(node_data_seg, scanner_index);
+    //write dagNodeIndex
+    BinarySegmentWriteUint32(node_data_seg, dag_index);
 
-        if (shared_resources && shared_resources->m_Count > 0)
+    BinarySegmentWriteUint32(node_data_seg, (uint32_t)std::max<int64_t>(FindIntValue(node, "Cpu", 1), 0));
+    BinarySegmentWriteUint32(node_data_seg, (uint32_t)std::max<int64_t>(FindIntValue(node, "MemMB", 0), 0));
+
+    return true;
+}
+
+// Large dags are written in a fixed number of shards, each a contiguous range of
+// nodes with segments and a shared string table of its own, and the shards are
+// spread over a number of threads. The node records of the shards are concatenated
+// in order once all threads are done, and the variable-size data they point to
+// stays in the shard's segments. How nodes are split into shards depends only on
+// the node count, so the .dag comes out the same however many threads wrote it.
+static const int kMaxDagWriterThreads = 32;
+static const int kDagWriterShardCount = 64;
+static const int kDagWriterBatchSize = 256;
+static const size_t kParallelDagMinNodes = 1024;
+
+struct DagWriterShard
+{
+    BinarySegment *m_NodeSeg;
+    BinarySegment *m_ArraySeg;
+    BinarySegment *m_StrSeg;
+    BinarySegment *m_PayloadSeg;
+    HashTable<CommonStringRecord, kFlagCaseSensitive> m_SharedStrings;
+};
+
+static bool WriteNodesParallel(
+    const DagNodeSource *nodes,
+    BinaryWriter *writer,
+    BinarySegment *node_data_seg,
+    MemAllocHeap *heap,
+    const TempNodeGuid *order,
+    const int32_t *remap_table,
+    const uint32_t *reverse_remap)
+{
+    int32_t node_count = (int32_t)nodes->m_Count;
+    int32_t shard_count = std::min(kDagWriterShardCount, (node_count + kDagWriterBatchSize - 1) / kDagWriterBatchSize);
+    int32_t shard_size = (node_count + shard_count - 1) / shard_count;
+
+    // Segments can only be added from this thread, so set them all up front.
+    DagWriterShard *shards = HeapAllocateArray<DagWriterShard>(heap, shard_count);
+    for (int32_t i = 0; i < shard_count; ++i)
+    {
+        shards[i].m_NodeSeg = BinaryWriterAddSegment(writer);
+        shards[i].m_ArraySeg = BinaryWriterAddSegment(writer);
+        shards[i].m_StrSeg = BinaryWriterAddSegment(writer);
+        shards[i].m_PayloadSeg = BinaryWriterAddSegment(writer);
+        HashTableInit(&shards[i].m_SharedStrings, heap);
+    }
+
+    int thread_count = ParallelForThreadCount(kMaxDagWriterThreads, shard_count, 1);
+    MemAllocLinear *scratch = HeapAllocateArray<MemAllocLinear>(heap, thread_count);
+    for (int i = 0; i < thread_count; ++i)
+        LinearAllocInit(&scratch[i], heap, MB(64), "dag writer scratch");
+
+    bool success = ParallelFor(thread_count, shard_count, 1, "Dag Writer", [&](int32_t start, int32_t end, int thread_index) {
+        for (int32_t si = start; si < end; ++si)
         {
-            BinarySegmentAlign(array2_seg, 4);
-            BinarySegmentWriteInt32(node_data_seg, static_cast<int>(shared_resources->m_Count));
-            BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-            for (size_t i = 0, count = shared_resources->m_Count; i < count; ++i)
+            DagWriterShard *shard = &shards[si];
+            int32_t shard_end = std::min(node_count, (si + 1) * shard_size);
+            for (int32_t ni = si * shard_size; ni < shard_end; ++ni)
             {
-                if (const JsonNumberValue *res_index = shared_resources->m_Values[i]->AsNumber())
-                {
-                    BinarySegmentWriteInt32(array2_seg, static_cast<int>(res_index->m_Number));
-                }
-                else
-                {
+                MemAllocLinearScope scratch_scope(&scratch[thread_index]);
+                const JsonObjectValue *node = GetDagNode(nodes, order[ni].m_Node, &scratch[thread_index]);
+
+                if (!node || !WriteNode(node, shard->m_NodeSeg, shard->m_ArraySeg, shard->m_StrSeg, shard->m_PayloadSeg,
+                               heap, &shard->m_SharedStrings, &scratch[thread_index], remap_table, reverse_remap[ni], ni))
                     return false;
-                }
             }
         }
-        else
-        {
-            BinarySegmentWriteInt32(node_data_seg, 0);
-            BinarySegmentWriteNullPointer(node_data_seg);
-        }
+        return true;
+    });
 
-        EmitFileSignatures(node, node_data_seg, array2_seg, str_seg);
-        EmitStatSignatures(node, node_data_seg, array2_seg, str_seg);
-        EmitGlobSignatures(node, node_data_seg, array2_seg, str_seg, heap, scratch);
-        
+    for (int i = 0; i < thread_count; ++i)
+        LinearAllocDestroy(&scratch[i]);
+    HeapFree(heap, scratch);
 
-        WriteFileArray(node_data_seg, array2_seg, str_seg, cachingInputIgnoreList);
+    for (int32_t i = 0; i < shard_count; ++i)
+    {
+        BinarySegmentAppend(node_data_seg, shards[i].m_NodeSeg);
+        HashTableDestroy(&shards[i].m_SharedStrings);
+    }
+    HeapFree(heap, shards);
 
-        uint32_t flags = 0;
+    return success;
+}
 
-        flags |= static_cast<uint8_t>(actionType);
+static bool WriteNodes(
+    const DagNodeSource *nodes,
+    BinaryWriter *writer,
+    BinarySegment *main_seg,
+    BinarySegment *node_data_seg,
+    BinarySegment *array2_seg,
+    BinarySegment *str_seg,
+    BinarySegment *writetextfile_payloads_seg,
+    MemAllocHeap *heap,
+    HashTable<CommonStringRecord, kFlagCaseSensitive> *shared_strings,
+    MemAllocLinear *scratch,
+    const TempNodeGuid *order,
+    const int32_t *remap_table)
+{
+    BinarySegmentWritePointer(main_seg, BinarySegmentPosition(node_data_seg)); // m_DagNodes
 
-        flags |= GetNodeFlag(node, "OverwriteOutputs", Frozen::DagNode::kFlagOverwriteOutputs, true);
-        flags |= GetNodeFlag(node, "AllowUnexpectedOutput", Frozen::DagNode::kFlagAllowUnexpectedOutput, false);
-        flags |= GetNodeFlag(node, "AllowUnwrittenOutputFiles", Frozen::DagNode::kFlagAllowUnwrittenOutputFiles, false);
-        flags |= GetNodeFlag(node, "BanContentDigestForInputs", Frozen::DagNode::kFlagBanContentDigestForInputs, false);
+    MemAllocLinearScope scratch_scope(scratch);
 
-        const char* cachingMode = FindStringValue(node, "CachingMode");
-        if (cachingMode != nullptr)
-        {
-            if (0==strcmp(cachingMode, "ByLeafInputs"))
-                flags |= Frozen::DagNode::kFlagCacheableByLeafInputs;
-        }
+    size_t node_count = nodes->m_Count;
 
-        BinarySegmentWriteUint32(node_data_seg, flags);
+    uint32_t *reverse_remap = (uint32_t *)HeapAllocate(heap, node_count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < node_count; ++i)
+    {
+        reverse_remap[remap_table[i]] = i;
+    }
 
-        //write m_OriginalIndex
-        BinarySegmentWriteUint32(node_data_seg, reverse_remap[ni]);
+    bool success = true;
 
-        //write dagNodeIndex
-        BinarySegmentWriteUint32(node_data_seg, ni);
+    if (node_count >= kParallelDagMinNodes)
+    {
+        success = WriteNodesParallel(nodes, writer, node_data_seg, heap, order, remap_table, reverse_remap);
+    }
+    else
+    {
+        for (size_t ni = 0; ni < node_count && success; ++ni)
+        {
+            MemAllocLinearScope node_scope(scratch);
+            const JsonObjectValue *node = GetDagNode(nodes, order[ni].m_Node, scratch);
+            success = node && WriteNode(node, node_data_seg, array2_seg, str_seg, writetextfile_payloads_seg, heap, shared_strings, scratch, remap_table, reverse_remap[ni], (uint32_t)ni);
+        }
     }
 
     HeapFree(heap, reverse_remap);
 
-    return true;
+    return success;
 }
 
 static bool WriteNodeArray(BinarySegment *top_seg, BinarySegment *data_seg, const JsonArrayValue *ints, const int32_t remap_table[])
@@ -649,75 +793,100 @@ static bool WriteScanner(BinaryLocator *ptr_out, BinarySegment *seg, BinarySegme
     return true;
 }
 
-bool ComputeNodeGuids(const JsonArrayValue *nodes, int32_t *remap_table, TempNodeGuid *guid_table)
+static bool ComputeNodeGuid(const JsonObjectValue *nobj, HashDigest *digest_out)
 {
-    size_t node_count = nodes->m_Count;
-    for (size_t i = 0; i < node_count; ++i)
+    HashState h;
+    HashInit(&h);
+
+    const JsonArrayValue *outputs = FindArrayValue(nobj, "Outputs");
+    bool didHashAnyOutputs = false;
+    if (outputs)
     {
-        const JsonObjectValue *nobj = nodes->m_Values[i]->AsObject();
+        for (size_t fi = 0, fi_count = outputs->m_Count; fi < fi_count; ++fi)
+        {
+            if (const JsonStringValue *str = outputs->m_Values[fi]->AsString())
+            {
+                HashAddString(&h, str->m_String);
+                didHashAnyOutputs = true;
+            }
+        }
+    }
 
-        if (!nobj)
-            return false;
+    if (didHashAnyOutputs)
+    {
+        HashAddString(&h, "salt for outputs");
+    }
+    else
+    {
+        // For nodes with no outputs, preserve the legacy behaviour
 
-        guid_table[i].m_Node = (int)i;
+        const char *action = FindStringValue(nobj, "Action");
+        const JsonArrayValue *inputs = FindArrayValue(nobj, "Inputs");
 
-        HashState h;
-        HashInit(&h);
+        if (action && action[0])
+            HashAddString(&h, action);
 
-        const JsonArrayValue *outputs = FindArrayValue(nobj, "Outputs");
-        bool didHashAnyOutputs = false;
-        if (outputs)
+        if (inputs)
         {
-            for (size_t fi = 0, fi_count = outputs->m_Count; fi < fi_count; ++fi)
+            for (size_t fi = 0, fi_count = inputs->m_Count; fi < fi_count; ++fi)
             {
-                if (const JsonStringValue *str = outputs->m_Values[fi]->AsString())
+                if (const JsonStringValue *str = inputs->m_Values[fi]->AsString())
                 {
                     HashAddString(&h, str->m_String);
-                    didHashAnyOutputs = true;
                 }
             }
         }
 
-        if (didHashAnyOutputs)
+        const char *annotation = FindStringValue(nobj, "Annotation");
+
+        if (annotation)
+            HashAddString(&h, annotation);
+
+        if ((!action || action[0] == '\0') && !inputs && !annotation)
         {
-            HashAddString(&h, "salt for outputs");
+            return false;
         }
-        else
-        {
-            // For nodes with no outputs, preserve the legacy behaviour
 
-            const char *action = FindStringValue(nobj, "Action");
-            const JsonArrayValue *inputs = FindArrayValue(nobj, "Inputs");
+        HashAddString(&h, "salt for legacy");
+    }
 
-            if (action && action[0])
-                HashAddString(&h, action);
+    HashFinalize(&h, digest_out);
+    return true;
+}
 
-            if (inputs)
-            {
-                for (size_t fi = 0, fi_count = inputs->m_Count; fi < fi_count; ++fi)
-                {
-                    if (const JsonStringValue *str = inputs->m_Values[fi]->AsString())
-                    {
-                        HashAddString(&h, str->m_String);
-                    }
-                }
-            }
+bool ComputeNodeGuids(const DagNodeSource *nodes, int32_t *remap_table, TempNodeGuid *guid_table, MemAllocHeap *heap, MemAllocLinear *scratch)
+{
+    size_t node_count = nodes->m_Count;
 
-            const char *annotation = FindStringValue(nobj, "Annotation");
+    // Only worth spreading over threads for a large dag; every thread gets at least kParallelDagMinNodes nodes.
+    int thread_count = ParallelForThreadCount(kMaxDagWriterThreads, (int32_t)node_count, (int32_t)kParallelDagMinNodes);
 
-            if (annotation)
-                HashAddString(&h, annotation);
+    // Stream nodes are decoded into a scratch allocator per thread.
+    MemAllocLinear *thread_scratch = HeapAllocateArray<MemAllocLinear>(heap, thread_count);
+    for (int i = 1; i < thread_count && nodes->m_Stream; ++i)
+        LinearAllocInit(&thread_scratch[i], heap, MB(64), "node guid scratch");
 
-            if ((!action || action[0] == '\0') && !inputs && !annotation)
-            {
-                return false;
-            }
+    bool success = ParallelFor(thread_count, (int32_t)node_count, kDagWriterBatchSize, "Node Guids", [&](int32_t start, int32_t end, int thread_index) {
+        MemAllocLinear *alloc = thread_index ? &thread_scratch[thread_index] : scratch;
+        for (int32_t i = start; i < end; ++i)
+        {
+            MemAllocLinearScope scratch_scope(alloc);
+            const JsonObjectValue *nobj = GetDagNode(nodes, i, alloc);
+
+            guid_table[i].m_Node = i;
 
-            HashAddString(&h, "salt for legacy");
+            if (!nobj || !ComputeNodeGuid(nobj, &guid_table[i].m_Digest))
+                return false;
         }
+        return true;
+    });
 
-        HashFinalize(&h, &guid_table[i].m_Digest);
-    }
+    for (int i = 1; i < thread_count && nodes->m_Stream; ++i)
+        LinearAllocDestroy(&thread_scratch[i]);
+    HeapFree(heap, thread_scratch);
+
+    if (!success)
+        return false;
 
     std::sort(guid_table, guid_table + node_count);
 
@@ -727,10 +896,9 @@ bool ComputeNodeGuids(const JsonArrayValue *nodes, int32_t *remap_table, TempNod
         {
             int i0 = guid_table[i - 1].m_Node;
             int i1 = guid_table[i].m_Node;
-            const JsonObjectValue *o0 = nodes->m_Values[i0]->AsObject();
-            const JsonObjectValue *o1 = nodes->m_Values[i1]->AsObject();
-            const char *anno0 = FindStringValue(o0, "Annotation");
-            const char *anno1 = FindStringValue(o1, "Annotation");
+            MemAllocLinearScope scratch_scope(scratch);
+            const char *anno0 = FindStringValue(GetDagNode(nodes, i0, scratch), "Annotation");
+            const char *anno1 = FindStringValue(GetDagNode(nodes, i1, scratch), "Annotation");
             char digest[kDigestStringSize];
             DigestToString(digest, guid_table[i].m_Digest);
             Log(kError, "duplicate node guids: %s and %s share common GUID (%s)", anno0, anno1, digest);
@@ -817,12 +985,14 @@ bool WriteSharedResources(const JsonArrayValue *resources, BinarySegment *main_s
             BinarySegmentWriteInt32(aux_seg, 0);
             BinarySegmentWriteNullPointer(aux_seg);
         }
+
+        BinarySegmentWriteInt32(aux_seg, (int)FindIntValue(resource, "Capacity", 0));
     }
 
     return true;
 }
 
-static bool CompileDag(const JsonObjectValue *root, BinaryWriter *writer, MemAllocHeap *heap, MemAllocLinear *scratch)
+static bool CompileDag(const JsonObjectValue *root, const DagNodeSource *nodes, BinaryWriter *writer, MemAllocHeap *heap, MemAllocLinear *scratch)
 {
     HashTable<CommonStringRecord, kFlagCaseSensitive> shared_strings;
     HashTableInit(&shared_strings, heap);
@@ -835,7 +1005,6 @@ static bool CompileDag(const JsonObjectValue *root, BinaryWriter *writer, MemAll
     BinarySegment *str_seg = BinaryWriterAddSegment(writer);
     BinarySegment *writetextfile_payloads_seg = BinaryWriterAddSegment(writer);
 
-    const JsonArrayValue *nodes = FindArrayValue(root, "Nodes");
     const JsonArrayValue *directoriesCausingImplicitDependencies = FindArrayValue(root, "DirectoriesCausingImplicitDependencies");
     const JsonArrayValue *scanners = FindArrayValue(root, "Scanners");
     const JsonArrayValue *shared_resources = FindArrayValue(root, "SharedResources");
@@ -866,7 +1035,7 @@ static bool CompileDag(const JsonObjectValue *root, BinaryWriter *writer, MemAll
     int32_t *remap_table = HeapAllocateArray<int32_t>(heap, nodes->m_Count);
     TempNodeGuid *guid_table = HeapAllocateArray<TempNodeGuid>(heap, nodes->m_Count);
 
-    if (!ComputeNodeGuids(nodes, remap_table, guid_table))
+    if (!ComputeNodeGuids(nodes, remap_table, guid_table, heap, scratch))
         return false;
 
     // m_NodeCount
@@ -881,7 +1050,7 @@ static bool CompileDag(const JsonObjectValue *root, BinaryWriter *writer, MemAll
     }
 
     // Write nodes.
-    if (!WriteNodes(nodes, main_seg, node_data_seg, aux_seg, str_seg, writetextfile_payloads_seg, scanner_ptrs, heap, &shared_strings, scratch, guid_table, remap_table))
+    if (!WriteNodes(nodes, writer, main_seg, node_data_seg, aux_seg, str_seg, writetextfile_payloads_seg, heap, &shared_strings, scratch, guid_table, remap_table))
         return false;
 
     const JsonObjectValue *named_nodes = FindObjectValue(root, "NamedNodes");
@@ -975,6 +1144,10 @@ static bool CompileDag(const JsonObjectValue *root, BinaryWriter *writer, MemAll
     BinarySegmentWriteInt32(main_seg, (int)FindIntValue(root, "DaysToKeepUnreferencedNodesAround", -1));
     BinarySegmentWriteInt32(main_seg, (int)FindIntValue(root, "EmitDataForBeeWhy", 1));
 
+    const JsonObjectValue *resource_limits = FindObjectValue(root, "ResourceLimits");
+    BinarySegmentWriteInt32(main_seg, resource_limits ? (int)FindIntValue(resource_limits, "Cpu", 0) : 0);
+    BinarySegmentWriteInt32(main_seg, resource_limits ? (int)FindIntValue(resource_limits, "MemMB", 0) : 0);
+
     WriteStringPtr(main_seg, str_seg, FindStringValue(root, "StateFileName", ".tundra2.state"));
     WriteStringPtr(main_seg, str_seg, FindStringValue(root, "StateFileNameTmp", ".tundra2.state.tmp"));
     WriteStringPtr(main_seg, str_seg, FindStringValue(root, "StateFileNameMapped", ".tundra2.state.mapped"));
@@ -998,7 +1171,41 @@ static bool CompileDag(const JsonObjectValue *root, BinaryWriter *writer, MemAll
     return true;
 }
 
-static bool CreateDagFromJsonData(char *json_memory, const char *dag_fn)
+// The nodes come from `stream` if it is set, and from the document otherwise.
+static bool CompileDagFile(const JsonValue *value, const DagStreamIndex *stream, const char *dag_fn, MemAllocHeap *heap, MemAllocLinear *scratch)
+{
+    const JsonObjectValue *obj = value->AsObject();
+    if (!obj)
+    {
+        Log(kError, "bad JSON structure");
+        return false;
+    }
+
+    if (obj->m_Count == 0)
+    {
+        Log(kInfo, "Nothing to do");
+        FlushAndExit(BuildResult::kOk);
+    }
+
+    TimingScope timing_scope(nullptr, &g_Stats.m_CompileDagTime);
+
+    DagNodeSource nodes;
+    nodes.m_Array = stream ? nullptr : FindArrayValue(obj, "Nodes");
+    nodes.m_Stream = stream;
+    nodes.m_Count = stream ? DagStreamIndexNodeCount(stream) : nodes.m_Array ? nodes.m_Array->m_Count : 0;
+
+    BinaryWriter writer;
+    BinaryWriterInit(&writer, heap);
+
+    bool result = CompileDag(obj, &nodes, &writer, heap, scratch);
+
+    result = result && BinaryWriterFlush(&writer, dag_fn);
+
+    BinaryWriterDestroy(&writer);
+    return result;
+}
+
+static bool CreateDagFromJsonData(char *json_memory, size_t json_size, const char *dag_fn)
 {
     MemAllocHeap heap;
     HeapInit(&heap);
@@ -1009,43 +1216,21 @@ static bool CreateDagFromJsonData(char *json_memory, const char *dag_fn)
     LinearAllocInit(&alloc, &heap, MB(256), "json alloc");
     LinearAllocInit(&scratch, &heap, MB(64), "json scratch");
 
+    JsonParseWorkers workers;
+    JsonParseWorkersInit(&workers, &heap);
+
     char error_msg[1024];
 
     bool result = false;
 
-    const JsonValue *value = JsonParse(json_memory, &alloc, &scratch, error_msg);
+    const JsonValue *value = JsonParseParallel(json_memory, json_size, &alloc, &scratch, &workers, error_msg);
 
     if (value)
-    {
-        if (const JsonObjectValue *obj = value->AsObject())
-        {
-            if (obj->m_Count == 0)
-            {
-                Log(kInfo, "Nothing to do");
-                FlushAndExit(BuildResult::kOk);
-            }
-
-            TimingScope timing_scope(nullptr, &g_Stats.m_CompileDagTime);
-
-            BinaryWriter writer;
-            BinaryWriterInit(&writer, &heap);
-
-            result = CompileDag(obj, &writer, &heap, &scratch);
-
-            result = result && BinaryWriterFlush(&writer, dag_fn);
-
-            BinaryWriterDestroy(&writer);
-        }
-        else
-        {
-            Log(kError, "bad JSON structure");
-        }
-    }
+        result = CompileDagFile(value, nullptr, dag_fn, &heap, &scratch);
     else
-    {
         Log(kError, "failed to parse JSON: %s", error_msg);
-    }
 
+    JsonParseWorkersDestroy(&workers);
     LinearAllocDestroy(&scratch);
     LinearAllocDestroy(&alloc);
 
@@ -1088,9 +1273,63 @@ bool FreezeDagJson(const char* json_filename, const char* dag_fn)
 
     json_memory[json_size - 1] = 0;
 
-    bool success = CreateDagFromJsonData(json_memory, dag_fn);
+    bool success = CreateDagFromJsonData(json_memory, json_size - 1, dag_fn);
 
     free(json_memory);
 
     return success;
 }
+
+bool FreezeDagStream(const char* stream_filename, const char* dag_fn)
+{
+    FileInfo stream_info = GetFileInfo(stream_filename);
+    if (!stream_info.Exists())
+    {
+        Log(kError, "build script didn't generate %s", stream_filename);
+        return false;
+    }
+
+    // The decoded strings point straight into the mapping, so it stays mapped
+    // until the dag is written.
+    MemoryMappedFile stream_file;
+    MmapFileInit(&stream_file);
+    MmapFileMap(&stream_file, stream_filename);
+
+    if (!MmapFileValid(&stream_file))
+    {
+        Log(kError, "couldn't map %s", stream_filename);
+        return false;
+    }
+
+    MemAllocHeap heap;
+    HeapInit(&heap);
+
+    MemAllocLinear alloc;
+    MemAllocLinear scratch;
+
+    LinearAllocInit(&alloc, &heap, MB(256), "dag stream alloc");
+    LinearAllocInit(&scratch, &heap, MB(64), "dag stream scratch");
+
+    char error_msg[1024];
+
+    bool result = false;
+
+    // Only the small values in the root object are decoded up front. The nodes
+    // are decoded one at a time as the dag is written.
+    DagStreamIndex index;
+    const JsonObjectValue *root = DagStreamIndexInit(&index, (const char *)stream_file.m_Address, stream_file.m_Size, &alloc, &heap, error_msg);
+
+    if (root)
+        result = CompileDagFile(root, &index, dag_fn, &heap, &scratch);
+    else
+        Log(kError, "failed to decode %s: %s", stream_filename, error_msg);
+
+    DagStreamIndexDestroy(&index, &heap);
+
+    LinearAllocDestroy(&scratch);
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+
+    MmapFileUnmap(&stream_file);
+    return result;
+}
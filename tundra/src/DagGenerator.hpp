@@ -10,4 +10,5 @@ struct CommonStringRecord
 struct MemAllocLinear;
 
 bool FreezeDagJson(const char* json_filename, const char* dag_filename);
+bool FreezeDagStream(const char* stream_filename, const char* dag_filename);
 void WriteCommonStringPtr(BinarySegment *segment, BinarySegment *str_seg, const char *ptr, HashTable<CommonStringRecord, 0> *table, MemAllocLinear *scratch);
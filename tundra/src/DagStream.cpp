@@ -0,0 +1,636 @@
+#include "DagStream.hpp"
+#include "JsonParse.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemAllocLinear.hpp"
+#include "Stats.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Banned.hpp"
+
+#ifdef _MSC_VER
+#define snprintf _snprintf
+#endif
+
+// Nesting in a DAG document is shallow; anything deeper than this is garbage.
+static const int kDagStreamMaxDepth = 64;
+
+static const JsonValue s_NullValue = {JsonValue::kNull};
+static const JsonBooleanValue s_FalseValue = {{JsonValue::kBoolean}, false};
+static const JsonBooleanValue s_TrueValue = {{JsonValue::kBoolean}, true};
+
+struct DagStreamReader
+{
+    const uint8_t *m_Begin;
+    const uint8_t *m_Cursor;
+    const uint8_t *m_End;
+    MemAllocLinear *m_Allocator;
+
+    // Strings seen so far, by number. Only added to on the first pass over a
+    // stream; when a node is decoded again later, all of its strings are known.
+    Buffer<const char *> *m_Strings;
+    MemAllocHeap *m_Heap;
+    bool m_AddStrings;
+
+    char *m_Error;
+};
+
+static const JsonValue *DagStreamError(DagStreamReader *reader, const char *error)
+{
+    // Only the first error is interesting; later ones are fallout while unwinding.
+    if (0 == reader->m_Error[0])
+        snprintf(reader->m_Error, 1024, "offset %llu: %s", (unsigned long long)(reader->m_Cursor - reader->m_Begin), error);
+    return nullptr;
+}
+
+static void DagStreamReaderInit(DagStreamReader *reader, const char *data, size_t size, MemAllocLinear *allocator, char *error)
+{
+    reader->m_Begin = (const uint8_t *)data;
+    reader->m_Cursor = reader->m_Begin;
+    reader->m_End = reader->m_Begin + size;
+    reader->m_Allocator = allocator;
+    reader->m_Strings = nullptr;
+    reader->m_Heap = nullptr;
+    reader->m_AddStrings = false;
+    reader->m_Error = error;
+}
+
+// Allocations are checked against what is left in the allocator, so a stream
+// that decodes to more than it can hold fails like any other bad stream.
+static void *DagStreamAllocate(DagStreamReader *reader, size_t size, size_t align)
+{
+    MemAllocLinear *allocator = reader->m_Allocator;
+    size_t offset = (allocator->m_Offset + align - 1) & ~(align - 1);
+    if (offset > allocator->m_Size || size > allocator->m_Size - offset)
+    {
+        DagStreamError(reader, "stream too large to decode");
+        return nullptr;
+    }
+
+    return LinearAllocate(allocator, size, align);
+}
+
+template <typename T>
+static T *DagStreamAllocateArray(DagStreamReader *reader, size_t count)
+{
+    return static_cast<T *>(DagStreamAllocate(reader, sizeof(T) * count, ALIGNOF(T)));
+}
+
+static bool ReadVarint(DagStreamReader *reader, uint64_t *out)
+{
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (reader->m_Cursor == reader->m_End)
+            return false;
+
+        uint8_t byte = *reader->m_Cursor++;
+        value |= uint64_t(byte & 0x7f) << shift;
+
+        if (0 == (byte & 0x80))
+        {
+            *out = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Every value takes at least a byte, so a count can't exceed what is left. This
+// keeps a corrupt count from turning into a huge allocation.
+static bool ReadCount(DagStreamReader *reader, size_t *out)
+{
+    uint64_t count;
+    if (!ReadVarint(reader, &count) || count > uint64_t(reader->m_End - reader->m_Cursor))
+        return false;
+
+    *out = size_t(count);
+    return true;
+}
+
+static const char *ReadString(DagStreamReader *reader, uint8_t tag)
+{
+    uint64_t n;
+    if (!ReadVarint(reader, &n))
+    {
+        DagStreamError(reader, "bad string");
+        return nullptr;
+    }
+
+    if (kDagStreamStringRef == tag)
+    {
+        if (n >= reader->m_Strings->m_Size)
+        {
+            DagStreamError(reader, "string reference out of range");
+            return nullptr;
+        }
+        return reader->m_Strings->m_Storage[n];
+    }
+
+    // The terminator is part of the stream, so strings can be used in place.
+    if (n >= uint64_t(reader->m_End - reader->m_Cursor) || 0 != reader->m_Cursor[n])
+    {
+        DagStreamError(reader, "bad string");
+        return nullptr;
+    }
+
+    const char *value = (const char *)reader->m_Cursor;
+    reader->m_Cursor += n + 1;
+
+    if (reader->m_AddStrings)
+        BufferAppendOne(reader->m_Strings, reader->m_Heap, value);
+    return value;
+}
+
+// Checks a value and steps over it without decoding it; its strings are still
+// numbered.
+static bool SkipValue(DagStreamReader *reader, int depth)
+{
+    if (reader->m_Cursor == reader->m_End)
+        return DagStreamError(reader, "unexpected end of stream");
+
+    if (depth > kDagStreamMaxDepth)
+        return DagStreamError(reader, "values nested too deeply");
+
+    uint8_t tag = *reader->m_Cursor++;
+    uint64_t scratch;
+    size_t count;
+
+    switch (tag)
+    {
+    case kDagStreamNull:
+    case kDagStreamFalse:
+    case kDagStreamTrue:
+        return true;
+
+    case kDagStreamInteger:
+        return ReadVarint(reader, &scratch) || DagStreamError(reader, "bad integer");
+
+    case kDagStreamDouble:
+        if (reader->m_End - reader->m_Cursor < 8)
+            return DagStreamError(reader, "bad number");
+        reader->m_Cursor += 8;
+        return true;
+
+    case kDagStreamString:
+    case kDagStreamStringRef:
+        return nullptr != ReadString(reader, tag);
+
+    case kDagStreamArray:
+        if (!ReadCount(reader, &count))
+            return DagStreamError(reader, "bad array size");
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!SkipValue(reader, depth + 1))
+                return false;
+        }
+        return true;
+
+    case kDagStreamObject:
+        if (!ReadCount(reader, &count))
+            return DagStreamError(reader, "bad object size");
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint8_t key_tag = reader->m_Cursor < reader->m_End ? *reader->m_Cursor++ : 0;
+            if (kDagStreamString != key_tag && kDagStreamStringRef != key_tag)
+                return DagStreamError(reader, "expected a string key");
+
+            if (!ReadString(reader, key_tag) || !SkipValue(reader, depth + 1))
+                return false;
+        }
+        return true;
+
+    default:
+        --reader->m_Cursor;
+        return DagStreamError(reader, "unknown tag");
+    }
+}
+
+static const JsonValue *ReadValue(DagStreamReader *reader, int depth)
+{
+    if (reader->m_Cursor == reader->m_End)
+        return DagStreamError(reader, "unexpected end of stream");
+
+    if (depth > kDagStreamMaxDepth)
+        return DagStreamError(reader, "values nested too deeply");
+
+    uint8_t tag = *reader->m_Cursor++;
+
+    switch (tag)
+    {
+    case kDagStreamNull:
+        return &s_NullValue;
+
+    case kDagStreamFalse:
+        return &s_FalseValue;
+
+    case kDagStreamTrue:
+        return &s_TrueValue;
+
+    case kDagStreamInteger:
+    {
+        uint64_t zigzag;
+        if (!ReadVarint(reader, &zigzag))
+            return DagStreamError(reader, "bad integer");
+
+        JsonNumberValue *value = DagStreamAllocateArray<JsonNumberValue>(reader, 1);
+        if (!value)
+            return nullptr;
+        value->m_Type = JsonValue::kNumber;
+        value->m_Number = double(int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1));
+        return value;
+    }
+
+    case kDagStreamDouble:
+    {
+        if (reader->m_End - reader->m_Cursor < 8)
+            return DagStreamError(reader, "bad number");
+
+        JsonNumberValue *value = DagStreamAllocateArray<JsonNumberValue>(reader, 1);
+        if (!value)
+            return nullptr;
+        value->m_Type = JsonValue::kNumber;
+        memcpy(&value->m_Number, reader->m_Cursor, 8);
+        reader->m_Cursor += 8;
+        return value;
+    }
+
+    case kDagStreamString:
+    case kDagStreamStringRef:
+    {
+        const char *string = ReadString(reader, tag);
+        JsonStringValue *value = string ? DagStreamAllocateArray<JsonStringValue>(reader, 1) : nullptr;
+        if (!value)
+            return nullptr;
+        value->m_Type = JsonValue::kString;
+        value->m_String = string;
+        return value;
+    }
+
+    case kDagStreamArray:
+    {
+        size_t count;
+        if (!ReadCount(reader, &count))
+            return DagStreamError(reader, "bad array size");
+
+        JsonArrayValue *array = DagStreamAllocateArray<JsonArrayValue>(reader, 1);
+        const JsonValue **values = array ? DagStreamAllocateArray<const JsonValue *>(reader, count) : nullptr;
+        if (!values)
+            return nullptr;
+
+        array->m_Type = JsonValue::kArray;
+        array->m_Count = count;
+        array->m_Values = values;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (nullptr == (values[i] = ReadValue(reader, depth + 1)))
+                return nullptr;
+        }
+
+        return array;
+    }
+
+    case kDagStreamObject:
+    {
+        size_t count;
+        if (!ReadCount(reader, &count))
+            return DagStreamError(reader, "bad object size");
+
+        JsonObjectValue *object = DagStreamAllocateArray<JsonObjectValue>(reader, 1);
+        const char **names = object ? DagStreamAllocateArray<const char *>(reader, count) : nullptr;
+        const JsonValue **values = names ? DagStreamAllocateArray<const JsonValue *>(reader, count) : nullptr;
+        if (!values)
+            return nullptr;
+
+        object->m_Type = JsonValue::kObject;
+        object->m_Count = count;
+        object->m_Names = names;
+        object->m_Values = values;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint8_t key_tag = reader->m_Cursor < reader->m_End ? *reader->m_Cursor++ : 0;
+            if (kDagStreamString != key_tag && kDagStreamStringRef != key_tag)
+                return DagStreamError(reader, "expected a string key");
+
+            if (nullptr == (names[i] = ReadString(reader, key_tag)))
+                return nullptr;
+
+            if (nullptr == (values[i] = ReadValue(reader, depth + 1)))
+                return nullptr;
+        }
+
+        return object;
+    }
+
+    default:
+        --reader->m_Cursor;
+        return DagStreamError(reader, "unknown tag");
+    }
+}
+
+static bool ReadMagic(DagStreamReader *reader)
+{
+    uint32_t magic;
+    if (size_t(reader->m_End - reader->m_Cursor) < sizeof magic || (memcpy(&magic, reader->m_Cursor, sizeof magic), kDagStreamMagic != magic))
+        return DagStreamError(reader, "not a dag stream");
+
+    reader->m_Cursor += sizeof magic;
+    return true;
+}
+
+const JsonValue *DagStreamDecode(
+    const char *data,
+    size_t size,
+    MemAllocLinear *allocator,
+    MemAllocHeap *heap,
+    char (&error_message)[1024])
+{
+    TimingScope timing_scope(nullptr, &g_Stats.m_DagStreamDecodeTimeCycles);
+
+    error_message[0] = '\0';
+
+    Buffer<const char *> strings;
+    BufferInit(&strings);
+
+    DagStreamReader reader;
+    DagStreamReaderInit(&reader, data, size, allocator, error_message);
+    reader.m_Strings = &strings;
+    reader.m_Heap = heap;
+    reader.m_AddStrings = true;
+
+    const JsonValue *root = nullptr;
+
+    if (ReadMagic(&reader))
+    {
+        root = ReadValue(&reader, 0);
+
+        if (root && reader.m_Cursor != reader.m_End)
+            root = DagStreamError(&reader, "trailing data after the root value");
+    }
+
+    BufferDestroy(&strings, heap);
+    return root;
+}
+
+const JsonObjectValue *DagStreamIndexInit(
+    DagStreamIndex *index,
+    const char *data,
+    size_t size,
+    MemAllocLinear *allocator,
+    MemAllocHeap *heap,
+    char (&error_message)[1024])
+{
+    TimingScope timing_scope(nullptr, &g_Stats.m_DagStreamDecodeTimeCycles);
+
+    error_message[0] = '\0';
+
+    index->m_Data = data;
+    index->m_Size = size;
+    BufferInit(&index->m_Strings);
+    BufferInit(&index->m_NodeOffsets);
+
+    DagStreamReader reader;
+    DagStreamReaderInit(&reader, data, size, allocator, error_message);
+    reader.m_Strings = &index->m_Strings;
+    reader.m_Heap = heap;
+    reader.m_AddStrings = true;
+
+    if (!ReadMagic(&reader))
+        return nullptr;
+
+    size_t count;
+    if (reader.m_Cursor == reader.m_End || kDagStreamObject != *reader.m_Cursor++ || !ReadCount(&reader, &count))
+    {
+        DagStreamError(&reader, "the root value must be an object");
+        return nullptr;
+    }
+
+    JsonObjectValue *root = DagStreamAllocateArray<JsonObjectValue>(&reader, 1);
+    const char **names = root ? DagStreamAllocateArray<const char *>(&reader, count) : nullptr;
+    const JsonValue **values = names ? DagStreamAllocateArray<const JsonValue *>(&reader, count) : nullptr;
+    JsonArrayValue *no_nodes = values ? DagStreamAllocateArray<JsonArrayValue>(&reader, 1) : nullptr;
+    if (!no_nodes)
+        return nullptr;
+
+    root->m_Type = JsonValue::kObject;
+    root->m_Count = count;
+    root->m_Names = names;
+    root->m_Values = values;
+    no_nodes->m_Type = JsonValue::kArray;
+    no_nodes->m_Count = 0;
+    no_nodes->m_Values = nullptr;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t key_tag = reader.m_Cursor < reader.m_End ? *reader.m_Cursor++ : 0;
+        if (kDagStreamString != key_tag && kDagStreamStringRef != key_tag)
+        {
+            DagStreamError(&reader, "expected a string key");
+            return nullptr;
+        }
+
+        if (nullptr == (names[i] = ReadString(&reader, key_tag)))
+            return nullptr;
+
+        bool is_nodes = 0 == strcmp(names[i], "Nodes");
+        if (!is_nodes || reader.m_Cursor == reader.m_End || kDagStreamArray != *reader.m_Cursor)
+        {
+            if (nullptr == (values[i] = ReadValue(&reader, 1)))
+                return nullptr;
+            continue;
+        }
+
+        ++reader.m_Cursor;
+
+        size_t node_count;
+        if (!ReadCount(&reader, &node_count))
+        {
+            DagStreamError(&reader, "bad array size");
+            return nullptr;
+        }
+
+        // Only the nodes of the last "Nodes" key count, like they do for a parsed document.
+        BufferClear(&index->m_NodeOffsets);
+        for (size_t n = 0; n < node_count; ++n)
+        {
+            BufferAppendOne(&index->m_NodeOffsets, heap, size_t(reader.m_Cursor - reader.m_Begin));
+            if (!SkipValue(&reader, 2))
+                return nullptr;
+        }
+        BufferAppendOne(&index->m_NodeOffsets, heap, size_t(reader.m_Cursor - reader.m_Begin));
+
+        values[i] = no_nodes;
+    }
+
+    if (reader.m_Cursor != reader.m_End)
+    {
+        DagStreamError(&reader, "trailing data after the root value");
+        return nullptr;
+    }
+
+    return root;
+}
+
+void DagStreamIndexDestroy(DagStreamIndex *index, MemAllocHeap *heap)
+{
+    BufferDestroy(&index->m_NodeOffsets, heap);
+    BufferDestroy(&index->m_Strings, heap);
+}
+
+const JsonValue *DagStreamDecodeNode(const DagStreamIndex *index, size_t node, MemAllocLinear *allocator, char (&error_message)[1024])
+{
+    error_message[0] = '\0';
+
+    DagStreamReader reader;
+    DagStreamReaderInit(&reader, index->m_Data, index->m_NodeOffsets.m_Storage[node + 1], allocator, error_message);
+    reader.m_Cursor = reader.m_Begin + index->m_NodeOffsets.m_Storage[node];
+    reader.m_Strings = const_cast<Buffer<const char *> *>(&index->m_Strings);
+
+    return ReadValue(&reader, 2);
+}
+
+static void WriteVarint(DagStreamWriter *writer, uint64_t value)
+{
+    uint8_t bytes[10];
+    size_t count = 0;
+
+    do
+    {
+        bytes[count] = uint8_t(value & 0x7f);
+        value >>= 7;
+        if (value)
+            bytes[count] |= 0x80;
+        ++count;
+    } while (value);
+
+    BufferAppend(&writer->m_Data, writer->m_Heap, bytes, count);
+}
+
+static void WriteTag(DagStreamWriter *writer, DagStreamTag tag)
+{
+    BufferAppendOne(&writer->m_Data, writer->m_Heap, uint8_t(tag));
+}
+
+void DagStreamWriterInit(DagStreamWriter *writer, MemAllocHeap *heap)
+{
+    writer->m_Heap = heap;
+    BufferInit(&writer->m_Data);
+    HashTableInit(&writer->m_Strings, heap);
+
+    uint32_t magic = kDagStreamMagic;
+    BufferAppend(&writer->m_Data, heap, (const uint8_t *)&magic, sizeof magic);
+}
+
+void DagStreamWriterDestroy(DagStreamWriter *writer)
+{
+    HashTableDestroy(&writer->m_Strings);
+    BufferDestroy(&writer->m_Data, writer->m_Heap);
+}
+
+void DagStreamWriteNull(DagStreamWriter *writer)
+{
+    WriteTag(writer, kDagStreamNull);
+}
+
+void DagStreamWriteBool(DagStreamWriter *writer, bool value)
+{
+    WriteTag(writer, value ? kDagStreamTrue : kDagStreamFalse);
+}
+
+void DagStreamWriteNumber(DagStreamWriter *writer, double value)
+{
+    // Integers that a double holds exactly get the compact encoding.
+    if (value >= -9007199254740992.0 && value <= 9007199254740992.0 && double(int64_t(value)) == value && !(value == 0 && signbit(value)))
+    {
+        int64_t i = int64_t(value);
+        WriteTag(writer, kDagStreamInteger);
+        WriteVarint(writer, (uint64_t(i) << 1) ^ uint64_t(i >> 63));
+        return;
+    }
+
+    WriteTag(writer, kDagStreamDouble);
+    BufferAppend(&writer->m_Data, writer->m_Heap, (const uint8_t *)&value, sizeof value);
+}
+
+void DagStreamWriteString(DagStreamWriter *writer, const char *value)
+{
+    uint32_t hash = Djb2Hash(value);
+
+    if (uint32_t *index = HashTableLookup(&writer->m_Strings, hash, value))
+    {
+        WriteTag(writer, kDagStreamStringRef);
+        WriteVarint(writer, *index);
+        return;
+    }
+
+    uint32_t new_index = writer->m_Strings.m_RecordCount;
+    HashTableInsert(&writer->m_Strings, hash, value, new_index);
+
+    size_t length = strlen(value);
+    WriteTag(writer, kDagStreamString);
+    WriteVarint(writer, length);
+    BufferAppend(&writer->m_Data, writer->m_Heap, (const uint8_t *)value, length + 1);
+}
+
+void DagStreamBeginArray(DagStreamWriter *writer, size_t count)
+{
+    WriteTag(writer, kDagStreamArray);
+    WriteVarint(writer, count);
+}
+
+void DagStreamBeginObject(DagStreamWriter *writer, size_t count)
+{
+    WriteTag(writer, kDagStreamObject);
+    WriteVarint(writer, count);
+}
+
+void DagStreamWriteValue(DagStreamWriter *writer, const JsonValue *value)
+{
+    switch (value->m_Type)
+    {
+    case JsonValue::kNull:
+        DagStreamWriteNull(writer);
+        break;
+
+    case JsonValue::kBoolean:
+        DagStreamWriteBool(writer, value->GetBoolean());
+        break;
+
+    case JsonValue::kNumber:
+        DagStreamWriteNumber(writer, value->GetNumber());
+        break;
+
+    case JsonValue::kString:
+        DagStreamWriteString(writer, value->GetString());
+        break;
+
+    case JsonValue::kArray:
+    {
+        const JsonArrayValue *array = value->AsArray();
+        DagStreamBeginArray(writer, array->m_Count);
+        for (size_t i = 0; i < array->m_Count; ++i)
+            DagStreamWriteValue(writer, array->m_Values[i]);
+        break;
+    }
+
+    case JsonValue::kObject:
+    {
+        const JsonObjectValue *object = value->AsObject();
+        DagStreamBeginObject(writer, object->m_Count);
+        for (size_t i = 0; i < object->m_Count; ++i)
+        {
+            DagStreamWriteString(writer, object->m_Names[i]);
+            DagStreamWriteValue(writer, object->m_Values[i]);
+        }
+        break;
+    }
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "Common.hpp"
+#include "Buffer.hpp"
+#include "HashTable.hpp"
+
+struct JsonValue;
+struct JsonObjectValue;
+struct MemAllocHeap;
+struct MemAllocLinear;
+
+// Binary DAG stream.
+//
+// A binary encoding of the document a frontend would otherwise write as JSON
+// for --dagfilejson, to be passed with --dagfilestream instead. It has the same
+// structure and keys (see DagGenerator.cpp), but needs no lexing, escaping or
+// number conversion, every array and object says up front how many entries it
+// has, and repeated strings are only stored once. Reading it is a single pass
+// over the file, in place.
+//
+// All integers are little endian. A file is the 32-bit magic number followed by
+// exactly one value, the root object. A value is a one-byte tag followed by its
+// payload:
+//
+//   kDagStreamNull        -
+//   kDagStreamFalse       -
+//   kDagStreamTrue        -
+//   kDagStreamInteger     zigzag encoded varint
+//   kDagStreamDouble      8-byte IEEE 754 double
+//   kDagStreamString      varint byte count, the bytes (UTF-8), a zero byte
+//   kDagStreamStringRef   varint index of an earlier kDagStreamString
+//   kDagStreamArray       varint count, then that many values
+//   kDagStreamObject      varint count, then that many key/value pairs, where
+//                         the key is a kDagStreamString or kDagStreamStringRef
+//
+// Varints are LEB128: seven bits at a time, least significant first, with the
+// top bit set on all bytes but the last. Strings are numbered from zero in the
+// order their kDagStreamString records appear, keys included; a writer should
+// emit each distinct string once and refer back to it after that.
+
+enum
+{
+    kDagStreamMagic = 0x31534454 // "TDS1"
+};
+
+enum DagStreamTag
+{
+    kDagStreamNull = 0,
+    kDagStreamFalse = 1,
+    kDagStreamTrue = 2,
+    kDagStreamInteger = 3,
+    kDagStreamDouble = 4,
+    kDagStreamString = 5,
+    kDagStreamStringRef = 6,
+    kDagStreamArray = 7,
+    kDagStreamObject = 8
+};
+
+// Decodes a stream into the same values JsonParse() produces. Strings point into
+// `data`, which has to outlive the result. Returns null and fills in the error
+// message if the stream is malformed.
+const JsonValue *DagStreamDecode(
+    const char *data,
+    size_t size,
+    MemAllocLinear *allocator,
+    MemAllocHeap *heap,
+    char (&error_message)[1024]);
+
+// Index of a stream, for freezing it without decoding the whole document at
+// once. Building it is a single pass that checks the stream and notes where
+// every element of the "Nodes" array in the root object starts; the nodes are
+// then decoded one at a time with DagStreamDecodeNode() when they're needed.
+struct DagStreamIndex
+{
+    const char *m_Data;
+    size_t m_Size;
+    Buffer<const char *> m_Strings;
+
+    // One more than there are nodes: where each node starts, then where the last
+    // one ends. Empty if the root object has no "Nodes" array.
+    Buffer<size_t> m_NodeOffsets;
+};
+
+// Indexes a stream and decodes its root object, apart from the nodes, whose
+// array is left empty. Returns null and fills in the error message if the stream
+// is malformed or decodes to more than the allocator can hold.
+const JsonObjectValue *DagStreamIndexInit(
+    DagStreamIndex *index,
+    const char *data,
+    size_t size,
+    MemAllocLinear *allocator,
+    MemAllocHeap *heap,
+    char (&error_message)[1024]);
+
+void DagStreamIndexDestroy(DagStreamIndex *index, MemAllocHeap *heap);
+
+inline size_t DagStreamIndexNodeCount(const DagStreamIndex *index)
+{
+    return index->m_NodeOffsets.m_Size ? index->m_NodeOffsets.m_Size - 1 : 0;
+}
+
+// Decodes one node of an indexed stream into `allocator`. Safe to call from
+// several threads at once, each with an allocator of its own.
+const JsonValue *DagStreamDecodeNode(
+    const DagStreamIndex *index,
+    size_t node,
+    MemAllocLinear *allocator,
+    char (&error_message)[1024]);
+
+// Reference writer. Containers are written by calling DagStreamBeginArray() or
+// DagStreamBeginObject() with their size and then writing that many values (or
+// keys and values). Strings aren't copied and have to stay valid until the writer
+// is destroyed.
+struct DagStreamWriter
+{
+    MemAllocHeap *m_Heap;
+    Buffer<uint8_t> m_Data;
+    HashTable<uint32_t, kFlagCaseSensitive> m_Strings;
+};
+
+void DagStreamWriterInit(DagStreamWriter *writer, MemAllocHeap *heap);
+void DagStreamWriterDestroy(DagStreamWriter *writer);
+
+void DagStreamWriteNull(DagStreamWriter *writer);
+void DagStreamWriteBool(DagStreamWriter *writer, bool value);
+void DagStreamWriteNumber(DagStreamWriter *writer, double value);
+void DagStreamWriteString(DagStreamWriter *writer, const char *value);
+void DagStreamBeginArray(DagStreamWriter *writer, size_t count);
+void DagStreamBeginObject(DagStreamWriter *writer, size_t count);
+
+// Writes a whole document, e.g. one read with JsonParse().
+void DagStreamWriteValue(DagStreamWriter *writer, const JsonValue *value);
@@ -1,21 +1,80 @@
 #include "DigestCache.hpp"
 #include "BinaryWriter.hpp"
 #include "Stats.hpp"
+#include "Buffer.hpp"
 
 #include <algorithm>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "Banned.hpp"
 
 static uint64_t s_cutoff_time;
 
+static int ComparePaths(const char *lhs, const char *rhs)
+{
+    return (kFlagPathStrings & kFlagCaseInsensitive) ? FastCompareNoCase(lhs, rhs) : strcmp(lhs, rhs);
+}
+
+// Map the saved state and use it in place. No per-record work happens here, so
+// this costs the same no matter how many records the file holds.
+static void MapState(DigestCache *self, const char *filename)
+{
+    HeapFree(&self->m_Heap, self->m_FrozenRecordUsed);
+    self->m_FrozenRecordUsed = nullptr;
+    self->m_State = nullptr;
+
+    MmapFileMap(&self->m_StateFile, filename);
+    if (!MmapFileValid(&self->m_StateFile))
+        return;
+
+    const Frozen::DigestCacheState *state = (const Frozen::DigestCacheState *)self->m_StateFile.m_Address;
+    const uint32_t slot_count = state->m_MagicNumber == Frozen::DigestCacheState::MagicNumber ? state->m_Index.GetCount() : 0;
+
+    if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0)
+    {
+        MmapFileUnmap(&self->m_StateFile);
+        return;
+    }
+
+    self->m_State = state;
+    self->m_FrozenRecordUsed = (uint8_t *)HeapAllocate(&self->m_Heap, state->m_Records.GetCount());
+    memset(self->m_FrozenRecordUsed, 0, state->m_Records.GetCount());
+
+    Log(kDebug, "digest cache mapped -- %d entries", state->m_Records.GetCount());
+}
+
+// Returns the index of the frozen record for a file, or -1 if there is none or it has expired.
+static int32_t FindFrozenRecord(const DigestCache *self, uint32_t hash, const char *filename)
+{
+    const Frozen::DigestCacheState *state = self->m_State;
+    if (!state)
+        return -1;
+
+    const uint32_t mask = state->m_Index.GetCount() - 1;
+    const uint32_t *slots = state->m_Index.GetArray();
+    const Frozen::DigestRecord *records = state->m_Records.GetArray();
+
+    for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        const uint32_t entry = slots[slot];
+        if (entry == 0)
+            return -1;
+
+        const Frozen::DigestRecord &record = records[entry - 1];
+        if (record.m_FilenameHash == hash && 0 == ComparePaths(record.m_Filename, filename))
+            return record.m_AccessTime < s_cutoff_time ? -1 : int32_t(entry - 1);
+    }
+}
+
 void DigestCacheInit(DigestCache *self, size_t heap_size, const char *filename)
 {
     ReadWriteLockInit(&self->m_Lock);
 
     self->m_Initialized = true;
     self->m_State = nullptr;
+    self->m_FrozenRecordUsed = nullptr;
 
     // Throw out records that haven't been accessed in a week.
     const uint64_t time_now = time(nullptr);
@@ -28,35 +87,7 @@ void DigestCacheInit(DigestCache *self, size_t heap_size, const char *filename)
 
     self->m_AccessTime = time(nullptr);
 
-    MmapFileMap(&self->m_StateFile, filename);
-    if (MmapFileValid(&self->m_StateFile))
-    {
-        const Frozen::DigestCacheState *state = (const Frozen::DigestCacheState *)self->m_StateFile.m_Address;
-        if (Frozen::DigestCacheState::MagicNumber == state->m_MagicNumber)
-        {
-            self->m_State = state;
-
-            //HashTablePrepareBulkInsert(&self->m_Table, state->m_Records.GetCount());
-
-            for (const Frozen::DigestRecord &record : state->m_Records)
-            {
-                if (record.m_AccessTime < s_cutoff_time)
-                    continue;
-
-                DigestCacheRecord r;
-                r.m_ContentDigest = record.m_ContentDigest;
-                r.m_Timestamp = record.m_Timestamp;
-                r.m_AccessTime = record.m_AccessTime;
-                r.m_Dirty = false;
-                HashTableInsert(&self->m_Table, record.m_FilenameHash, record.m_Filename.Get(), r);
-            }
-            Log(kDebug, "digest cache initialized -- %d entries", state->m_Records.GetCount());
-        }
-        else
-        {
-            MmapFileUnmap(&self->m_StateFile);
-        }
-    }
+    MapState(self, filename);
 }
 
 void DigestCacheDestroy(DigestCache *self)
@@ -64,6 +95,7 @@ void DigestCacheDestroy(DigestCache *self)
     if (!self->m_Initialized)
         return;
     HashTableDestroy(&self->m_Table);
+    HeapFree(&self->m_Heap, self->m_FrozenRecordUsed);
     MmapFileDestroy(&self->m_StateFile);
     LinearAllocDestroy(&self->m_Allocator);
     HeapDestroy(&self->m_Heap);
@@ -79,28 +111,75 @@ bool DigestCacheSave(DigestCache *self, MemAllocHeap *serialization_heap, const
 
     BinarySegment *main_seg = BinaryWriterAddSegment(&writer);
     BinarySegment *array_seg = BinaryWriterAddSegment(&writer);
+    BinarySegment *index_seg = BinaryWriterAddSegment(&writer);
     BinarySegment *string_seg = BinaryWriterAddSegment(&writer);
     BinaryLocator array_ptr = BinarySegmentPosition(array_seg);
+    BinaryLocator index_ptr = BinarySegmentPosition(index_seg);
 
-    auto save_record = [=](size_t index, uint32_t hash, const char *path, const DigestCacheRecord &r) {
-        BinarySegmentWriteUint64(array_seg, r.m_Timestamp);
-        // If entry is marked dirty we set access time to zero to evict it from the cache on the next load
-        BinarySegmentWriteUint64(array_seg, r.m_Dirty ? 0 : r.m_AccessTime);
+    Buffer<uint32_t> record_hashes;
+    BufferInit(&record_hashes);
+
+    auto save_record = [&](uint32_t hash, const char *path, uint64_t timestamp, uint64_t access_time, const HashDigest &digest) {
+        BinarySegmentWriteUint64(array_seg, timestamp);
+        BinarySegmentWriteUint64(array_seg, access_time);
         BinarySegmentWriteUint32(array_seg, hash);
-        BinarySegmentWrite(array_seg, &r.m_ContentDigest, sizeof(r.m_ContentDigest));
+        BinarySegmentWrite(array_seg, &digest, sizeof(digest));
         BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
         BinarySegmentWriteStringData(string_seg, path);
         BinarySegmentWriteUint32(array_seg, 0); // m_Padding
 #if ENABLED(USE_FAST_HASH)
         BinarySegmentWriteUint32(array_seg, 0); // m_Padding
 #endif
+        BufferAppendOne(&record_hashes, serialization_heap, hash);
     };
 
-    HashTableWalk(&self->m_Table, save_record);
+    HashTableWalk(&self->m_Table, [&](size_t index, uint32_t hash, const char *path, const DigestCacheRecord &r) {
+        // If entry is marked dirty we set access time to zero to evict it from the cache on the next load
+        save_record(hash, path, r.m_Timestamp, r.m_Dirty ? 0 : r.m_AccessTime, r.m_ContentDigest);
+    });
+
+    // Carry over the frozen records that weren't replaced during this build.
+    if (const Frozen::DigestCacheState *state = self->m_State)
+    {
+        for (int32_t i = 0, count = state->m_Records.GetCount(); i < count; ++i)
+        {
+            const Frozen::DigestRecord &r = state->m_Records[i];
+            const bool used = self->m_FrozenRecordUsed[i] != 0;
+
+            if (!used && r.m_AccessTime < s_cutoff_time)
+                continue;
+
+            if (HashTableLookup(&self->m_Table, r.m_FilenameHash, r.m_Filename.Get()))
+                continue;
+
+            save_record(r.m_FilenameHash, r.m_Filename, r.m_Timestamp, used ? self->m_AccessTime : r.m_AccessTime, r.m_ContentDigest);
+        }
+    }
+
+    // Keep the table at most half full so probe sequences stay short.
+    const uint32_t record_count = (uint32_t)record_hashes.m_Size;
+    uint32_t slot_count = 16;
+    while (slot_count < record_count * 2)
+        slot_count *= 2;
+
+    uint32_t *slots = HeapAllocateArray<uint32_t>(serialization_heap, slot_count);
+    memset(slots, 0, sizeof(uint32_t) * slot_count);
+    for (uint32_t i = 0; i < record_count; ++i)
+    {
+        uint32_t slot = record_hashes[i] & (slot_count - 1);
+        while (slots[slot] != 0)
+            slot = (slot + 1) & (slot_count - 1);
+        slots[slot] = i + 1;
+    }
+    BinarySegmentWrite(index_seg, slots, sizeof(uint32_t) * slot_count);
+    HeapFree(serialization_heap, slots);
+    BufferDestroy(&record_hashes, serialization_heap);
 
     BinarySegmentWriteUint32(main_seg, Frozen::DigestCacheState::MagicNumber);
-    BinarySegmentWriteInt32(main_seg, (int)self->m_Table.m_RecordCount);
+    BinarySegmentWriteInt32(main_seg, (int)record_count);
     BinarySegmentWritePointer(main_seg, array_ptr);
+    BinarySegmentWriteInt32(main_seg, (int)slot_count);
+    BinarySegmentWritePointer(main_seg, index_ptr);
     BinarySegmentWriteUint32(main_seg, Frozen::DigestCacheState::MagicNumber);
 
     // Unmap old state to avoid sharing conflicts on Windows.
@@ -124,15 +203,21 @@ bool DigestCacheSave(DigestCache *self, MemAllocHeap *serialization_heap, const
 
     BinaryWriterDestroy(&writer);
 
+    // Carry on from what is on disk now. When that is the file just written it has
+    // everything, and the overlay can start over.
+    MapState(self, filename);
+    if (success && self->m_State)
+    {
+        HashTableDestroy(&self->m_Table);
+        HashTableInit(&self->m_Table, &self->m_Heap);
+    }
+
     return success;
 }
 
-bool DigestCacheGet(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, HashDigest *digest_out)
+static bool LookupLocked(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, HashDigest *digest_out)
 {
-    bool result = false;
-
-    ReadWriteLockRead(&self->m_Lock);
-
+    // A record in the overlay replaces the frozen one entirely.
     if (DigestCacheRecord *r = (DigestCacheRecord *)HashTableLookup(&self->m_Table, hash, filename))
     {
         if (r->m_Timestamp == timestamp && !r->m_Dirty)
@@ -140,19 +225,25 @@ bool DigestCacheGet(DigestCache *self, const char *filename, uint32_t hash, uint
             // Technically violates r/w lock - doesn't matter
             r->m_AccessTime = self->m_AccessTime;
             *digest_out = r->m_ContentDigest;
-            result = true;
+            return true;
         }
+        return false;
     }
 
-    ReadWriteUnlockRead(&self->m_Lock);
+    int32_t index = FindFrozenRecord(self, hash, filename);
+    if (index >= 0 && self->m_State->m_Records[index].m_Timestamp == timestamp)
+    {
+        // Same as above
+        self->m_FrozenRecordUsed[index] = 1;
+        *digest_out = self->m_State->m_Records[index].m_ContentDigest;
+        return true;
+    }
 
-    return result;
+    return false;
 }
 
-void DigestCacheSet(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, const HashDigest &digest)
+static void StoreLocked(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, const HashDigest &digest)
 {
-    ReadWriteLockWrite(&self->m_Lock);
-
     DigestCacheRecord *r;
 
     if (nullptr != (r = (DigestCacheRecord *)HashTableLookup(&self->m_Table, hash, filename)))
@@ -171,7 +262,48 @@ void DigestCacheSet(DigestCache *self, const char *filename, uint32_t hash, uint
         r.m_Dirty = false;
         HashTableInsert(&self->m_Table, hash, StrDup(&self->m_Allocator, filename), r);
     }
+}
 
+bool DigestCacheGet(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, HashDigest *digest_out)
+{
+    ReadWriteLockRead(&self->m_Lock);
+    bool result = LookupLocked(self, filename, hash, timestamp, digest_out);
+    ReadWriteUnlockRead(&self->m_Lock);
+
+    return result;
+}
+
+int DigestCacheGetMany(DigestCache *self, int count, const FileAndHash files[], const uint64_t timestamps[], HashDigest digests_out[], bool found_out[])
+{
+    int found_count = 0;
+
+    ReadWriteLockRead(&self->m_Lock);
+    for (int i = 0; i < count; ++i)
+    {
+        found_out[i] = LookupLocked(self, files[i].m_Filename, files[i].m_FilenameHash, timestamps[i], &digests_out[i]);
+        if (found_out[i])
+            ++found_count;
+    }
+    ReadWriteUnlockRead(&self->m_Lock);
+
+    return found_count;
+}
+
+void DigestCacheSet(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, const HashDigest &digest)
+{
+    ReadWriteLockWrite(&self->m_Lock);
+    StoreLocked(self, filename, hash, timestamp, digest);
+    ReadWriteUnlockWrite(&self->m_Lock);
+}
+
+void DigestCacheSetMany(DigestCache *self, int count, const FileAndHash files[], const uint64_t timestamps[], const HashDigest digests[])
+{
+    if (count == 0)
+        return;
+
+    ReadWriteLockWrite(&self->m_Lock);
+    for (int i = 0; i < count; ++i)
+        StoreLocked(self, files[i].m_Filename, files[i].m_FilenameHash, timestamps[i], digests[i]);
     ReadWriteUnlockWrite(&self->m_Lock);
 }
 
@@ -181,7 +313,24 @@ void DigestCacheMarkDirty(DigestCache *self, const char *filename, uint32_t hash
 
     DigestCacheRecord *r = (DigestCacheRecord *)HashTableLookup(&self->m_Table, hash, filename);
     if (r != nullptr)
+    {
         r->m_Dirty = true;
+    }
+    else
+    {
+        // Shadow the frozen record with a dirty copy.
+        int32_t index = FindFrozenRecord(self, hash, filename);
+        if (index >= 0)
+        {
+            const Frozen::DigestRecord &frozen = self->m_State->m_Records[index];
+            DigestCacheRecord r;
+            r.m_ContentDigest = frozen.m_ContentDigest;
+            r.m_Timestamp = frozen.m_Timestamp;
+            r.m_AccessTime = frozen.m_AccessTime;
+            r.m_Dirty = true;
+            HashTableInsert(&self->m_Table, hash, StrDup(&self->m_Allocator, filename), r);
+        }
+    }
 
     ReadWriteUnlockWrite(&self->m_Lock);
 }
@@ -194,38 +343,31 @@ bool DigestCacheHasChanged(DigestCache *self, const char *filename, uint32_t has
         return false;
     }
 
-    const Frozen::DigestRecord *prevDigest = nullptr;
-    for (const Frozen::DigestRecord &frozenRecord : self->m_State->m_Records)
-    {
-        if (frozenRecord.m_FilenameHash != hash)
-            continue;
-
-        if (frozenRecord.m_AccessTime < s_cutoff_time)
-            continue;
-
-        if (strcmp(frozenRecord.m_Filename, filename) != 0)
-            continue;
-
-        prevDigest = &frozenRecord;
-        break;
-    }
+    int32_t prev_index = FindFrozenRecord(self, hash, filename);
+    const Frozen::DigestRecord *prevDigest = prev_index >= 0 ? &self->m_State->m_Records[prev_index] : nullptr;
 
     ReadWriteLockRead(&self->m_Lock);
     DigestCacheRecord *r = (DigestCacheRecord *)HashTableLookup(&self->m_Table, hash, filename);
 
-    if (r != nullptr && r->m_Dirty)
-        r = nullptr;
-
     bool result;
-    if (prevDigest == nullptr && r == nullptr)
+    if (r == nullptr)
+    {
+        // Nothing new has been recorded, so the previous state still stands.
         result = false;
-    else if (prevDigest == nullptr || r == nullptr)
-        result = true;
+    }
     else
-        result = prevDigest->m_ContentDigest != r->m_ContentDigest;
+    {
+        if (r->m_Dirty)
+            r = nullptr;
+
+        if (prevDigest == nullptr && r == nullptr)
+            result = false;
+        else if (prevDigest == nullptr || r == nullptr)
+            result = true;
+        else
+            result = prevDigest->m_ContentDigest != r->m_ContentDigest;
+    }
 
     ReadWriteUnlockRead(&self->m_Lock);
     return result;
 }
-
-
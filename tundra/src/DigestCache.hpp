@@ -33,10 +33,15 @@ namespace Frozen
 
     struct DigestCacheState
     {
-        static const uint32_t MagicNumber = 0x12781fa7 ^ kTundraHashMagic;
+        static const uint32_t MagicNumber = 0x12781fa9 ^ kTundraHashMagic;
 
         uint32_t m_MagicNumber;
         FrozenArray<Frozen::DigestRecord> m_Records;
+
+        // Open addressing table over m_Records, probed linearly from the filename
+        // hash. The slot count is a power of two; each slot holds a record index
+        // plus one, with zero marking an empty slot.
+        FrozenArray<uint32_t> m_Index;
     };
 }
 
@@ -48,11 +53,17 @@ struct DigestCacheRecord
     uint64_t m_AccessTime;
 };
 
+// The digest cache from the previous build is used straight from the mapped
+// file. Only records that are added, updated or marked dirty during this build
+// go into m_Table, which shadows the frozen records of the same name.
 struct DigestCache
 {
     bool m_Initialized;
     ReadWriteLock m_Lock;
     const Frozen::DigestCacheState *m_State;
+    // One flag per frozen record, set when the record was used in this build so
+    // its access time is refreshed on save.
+    uint8_t *m_FrozenRecordUsed;
     MemAllocHeap m_Heap;
     MemAllocLinear m_Allocator;
     MemoryMappedFile m_StateFile;
@@ -68,8 +79,15 @@ bool DigestCacheSave(DigestCache *self, MemAllocHeap *serialization_heap, const
 
 bool DigestCacheGet(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, HashDigest *digest_out);
 
+// Look up a batch of files under a single lock acquisition. found_out[i] tells
+// whether digests_out[i] was filled in. Returns the number of hits.
+int DigestCacheGetMany(DigestCache *self, int count, const FileAndHash files[], const uint64_t timestamps[], HashDigest digests_out[], bool found_out[]);
+
 void DigestCacheSet(DigestCache *self, const char *filename, uint32_t hash, uint64_t timestamp, const HashDigest &digest);
 
+// Store a batch of digests under a single lock acquisition.
+void DigestCacheSetMany(DigestCache *self, int count, const FileAndHash files[], const uint64_t timestamps[], const HashDigest digests[]);
+
 void DigestCacheMarkDirty(DigestCache *self, const char *filename, uint32_t hash);
 
 bool DigestCacheHasChanged(DigestCache *self, const char *filename, uint32_t hash);
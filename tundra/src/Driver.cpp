@@ -22,6 +22,7 @@
 #include "NodeResultPrinting.hpp"
 #include "FileSign.hpp"
 #include "PathUtil.hpp"
+#include "WatchDaemon.hpp"
 #include "CacheClient.hpp"
 #include "LeafInputSignature.hpp"
 #include "LoadFrozenData.hpp"
@@ -29,6 +30,7 @@
 #include "FileSystem.hpp"
 #include "EventLog.hpp"
 #include "StandardInputCanary.hpp"
+#include "Exec.hpp"
 
 #include <time.h>
 #include <stdio.h>
@@ -73,13 +75,20 @@ void DriverOptionsInit(DriverOptions *self)
     self->m_JustPrintLeafInputSignature = nullptr;
     self->m_IdentificationColor = 0;
     self->m_ThreadCount = GetCpuCount();
+    self->m_MaxProcesses = 0;
     self->m_WorkingDir = nullptr;
     self->m_DAGFileName = ".tundra2.dag";
     self->m_ProfileOutput = nullptr;
     self->m_IncludesOutput = nullptr;
     self->m_VisualMaxNodes = 1000;
     self->m_DagFileNameJson = nullptr;
+    self->m_DagFileNameStream = nullptr;
     self->m_BinLog = nullptr;
+    self->m_Scheduler = nullptr;
+    self->m_TrustStatCache = false;
+    self->m_WatchDaemon = false;
+    self->m_LearnMemoryWeights = false;
+    self->m_ResourceReportCount = 0;
 
 #if defined(TUNDRA_WIN32)
     self->m_RunUnprotected = true;
@@ -135,6 +144,39 @@ void DriverReportStartup(Driver *self, const char **targets, int target_count)
     LogStructured(&msg);
 }
 
+static void GetStatCacheFileName(Driver *self, char (&output)[kMaxPathLength], const char *suffix)
+{
+    snprintf(output, kMaxPathLength, "%s.statcache%s", self->m_DagData->m_DigestCacheFileName.Get(), suffix);
+}
+
+static void LoadStatCache(Driver *self)
+{
+    char stat_cache_filename[kMaxPathLength];
+    char socket_filename[kMaxPathLength];
+    GetStatCacheFileName(self, stat_cache_filename, "");
+    GetStatCacheFileName(self, socket_filename, ".watch");
+
+    // If a watch daemon has been keeping an eye on things since the last build, it can tell us exactly which files changed,
+    // which makes it safe to trust all other file records.
+    MemAllocLinearScope allocScope(&self->m_Allocator);
+    WatchDaemonChanges changes;
+    WatchDaemonChangesInit(&changes, &self->m_Heap);
+    bool have_changes = WatchDaemonQueryChanges(socket_filename, &self->m_Heap, &self->m_Allocator, &changes, &self->m_StatCache.m_WatchGeneration);
+
+    StatCacheLoad(&self->m_StatCache, stat_cache_filename, self->m_Options.m_TrustStatCache || have_changes);
+
+    if (have_changes)
+    {
+        Log(kDebug, "watch daemon reported %d changed files and %d changed directories", (int)changes.m_Files.m_RecordCount, (int)changes.m_Directories.m_RecordCount);
+        HashSetWalk(&changes.m_Files, [&](uint32_t index, uint32_t hash, const char *path) {
+            StatCacheMarkDirty(&self->m_StatCache, path, hash);
+        });
+        StatCacheMarkDirtyInDirectories(&self->m_StatCache, &changes.m_Directories);
+    }
+
+    WatchDaemonChangesDestroy(&changes);
+}
+
 bool DriverInitData(Driver *self)
 {
     if (!LoadOrBuildDag(self, s_DagFileName))
@@ -145,7 +187,7 @@ bool DriverInitData(Driver *self)
 
     // do not produce/overwrite structured log output or state file,
     // if we're only reporting something and not doing an actual build
-    if (self->m_Options.m_IncludesOutput == nullptr && !self->m_Options.m_ShowHelp && !self->m_Options.m_ShowTargets)
+    if (self->m_Options.m_IncludesOutput == nullptr && !self->m_Options.m_ShowHelp && !self->m_Options.m_ShowTargets && !self->m_Options.m_WatchDaemon)
     {
         SetStructuredLogFileName(self->m_DagData->m_StructuredLogFileName);
 
@@ -162,11 +204,18 @@ bool DriverInitData(Driver *self)
         LoadFrozenData<Frozen::AllBuiltNodes>(self->m_DagData->m_StateFileName, &self->m_StateFile, &self->m_AllBuiltNodes);
     }
 
+    LoadBuiltNodesJournal(self);
+
     DigestCacheInit(&self->m_DigestCache, MB(128), self->m_DagData->m_DigestCacheFileName);
 
+    if (!self->m_Options.m_WatchDaemon)
+        LoadStatCache(self);
+
     LoadFrozenData<Frozen::ScanData>(self->m_DagData->m_ScanCacheFileName, &self->m_ScanFile, &self->m_ScanData);
 
-    ScanCacheSetCache(&self->m_ScanCache, self->m_ScanData);
+    char scan_log_filename[kMaxPathLength];
+    snprintf(scan_log_filename, sizeof scan_log_filename, "%s.log", self->m_DagData->m_ScanCacheFileName.Get());
+    ScanCacheSetCache(&self->m_ScanCache, self->m_ScanData, scan_log_filename);
 
     return true;
 }
@@ -217,11 +266,11 @@ bool DriverPrepareNodes(Driver *self)
     }
 
     // Find frozen node state from previous build, if present.
-    if (const Frozen::AllBuiltNodes *all_built_nodes = self->m_AllBuiltNodes)
+    if (self->m_StateJournal.m_NodeCount > 0)
     {
-        const Frozen::BuiltNode *built_nodes = all_built_nodes->m_BuiltNodes;
-        const HashDigest *state_guids = all_built_nodes->m_NodeGuids;
-        const int state_guid_count = all_built_nodes->m_NodeCount;
+        const Frozen::BuiltNode **built_nodes = self->m_StateJournal.m_BuiltNodes;
+        const HashDigest *state_guids = self->m_StateJournal.m_NodeGuids;
+        const int state_guid_count = self->m_StateJournal.m_NodeCount;
 
         for (int i = 0; i < node_count; ++i)
         {
@@ -229,7 +278,7 @@ bool DriverPrepareNodes(Driver *self)
             if (const HashDigest *old_guid = BinarySearch(state_guids, state_guid_count, *src_guid))
             {
                 int state_index = int(old_guid - state_guids);
-                out_nodes[i].m_BuiltNode = built_nodes + state_index;
+                out_nodes[i].m_BuiltNode = built_nodes[state_index];
             }
         }
     }
@@ -299,6 +348,8 @@ void DriverDestroy(Driver *self)
 
     BufferDestroy(&self->m_RuntimeNodes, &self->m_Heap);
 
+    DestroyBuiltNodesJournal(self);
+
     MmapFileDestroy(&self->m_ScanFile);
     MmapFileDestroy(&self->m_StateFile);
     MmapFileDestroy(&self->m_DagFile);
@@ -334,6 +385,8 @@ BuildResult::Enum DriverBuild(Driver *self, int* out_finished_node_count, char*
     BufferInit(&queue_config.m_RequestedNodes);
 
     GetCachingBehaviourSettingsFromEnvironment(&queue_config.m_AttemptCacheReads, &queue_config.m_AttemptCacheWrites);
+    if (queue_config.m_AttemptCacheReads || queue_config.m_AttemptCacheWrites)
+        CacheClientInit(&self->m_Heap);
 
     DagRuntimeDataInit(&queue_config.m_DagRuntimeData, self->m_DagData, &self->m_Heap);
 
@@ -342,6 +395,17 @@ BuildResult::Enum DriverBuild(Driver *self, int* out_finished_node_count, char*
         queue_config.m_Flags |= BuildQueueConfig::kFlagEchoCommandLines;
     }
 
+    if (self->m_Options.m_Scheduler != nullptr && 0 == strcmp(self->m_Options.m_Scheduler, "stealing"))
+    {
+        queue_config.m_Flags |= BuildQueueConfig::kFlagWorkStealingScheduler;
+    }
+
+    if (self->m_Options.m_MaxProcesses > 0)
+    {
+        queue_config.m_Flags |= BuildQueueConfig::kFlagAsyncActions;
+        ExecSetMaxProcesses(self->m_Options.m_MaxProcesses);
+    }
+
     if (self->m_Options.m_DebugSigning)
     {
         MutexInit(&debug_signing_mutex);
@@ -406,9 +470,59 @@ leave:
 
     DagRuntimeDataDestroy(&queue_config.m_DagRuntimeData);
 
+    CacheClientDestroy();
+
     return build_result;
 }
 
+static uint64_t ResourceCpuTimeUs(const RuntimeNode *node)
+{
+    return node->m_ResourceUsage.m_UserTimeUs + node->m_ResourceUsage.m_SystemTimeUs;
+}
+
+static uint64_t ResourceBlocks(const RuntimeNode *node)
+{
+    return node->m_ResourceUsage.m_BlocksRead + node->m_ResourceUsage.m_BlocksWritten;
+}
+
+template <typename KeyFunc>
+static void PrintTopResourceUsers(Buffer<const RuntimeNode *> *nodes, int count, const char *title, KeyFunc key)
+{
+    std::sort(nodes->begin(), nodes->end(), [&](const RuntimeNode *l, const RuntimeNode *r) { return key(l) > key(r); });
+
+    printf("%s:\n", title);
+    for (size_t i = 0; i < nodes->m_Size && i < (size_t)count; ++i)
+    {
+        const RuntimeNode *node = (*nodes)[i];
+        const ExecResourceUsage &usage = node->m_ResourceUsage;
+        printf("  %10.2f s cpu %8" PRIu64 " MB %10" PRIu64 " blocks  %s\n",
+               ResourceCpuTimeUs(node) / 1000000.0, (usage.m_MaxRssKB + 1023) / 1024, ResourceBlocks(node),
+               node->m_DagNode->m_Annotation.Get());
+    }
+}
+
+// Lists the actions that ran this build by how much cpu time, memory and I/O they used.
+void DriverReportResourceUsage(Driver *self, int count)
+{
+    Buffer<const RuntimeNode *> nodes;
+    BufferInit(&nodes);
+
+    for (const RuntimeNode &node : self->m_RuntimeNodes)
+    {
+        if (node.m_ExecutionTimeMs != 0)
+            BufferAppendOne(&nodes, &self->m_Heap, &node);
+    }
+
+    if (nodes.m_Size > 0)
+    {
+        PrintTopResourceUsers(&nodes, count, "top actions by cpu time", ResourceCpuTimeUs);
+        PrintTopResourceUsers(&nodes, count, "top actions by peak memory", [](const RuntimeNode *node) { return node->m_ResourceUsage.m_MaxRssKB; });
+        PrintTopResourceUsers(&nodes, count, "top actions by block I/O", ResourceBlocks);
+    }
+
+    BufferDestroy(&nodes, &self->m_Heap);
+}
+
 // Save scan cache
 bool DriverSaveScanCache(Driver *self)
 {
@@ -417,14 +531,6 @@ bool DriverSaveScanCache(Driver *self)
     if (!ScanCacheDirty(scan_cache))
         return true;
 
-    // This will be invalidated.
-    self->m_ScanData = nullptr;
-
-    bool success = ScanCacheSave(scan_cache, self->m_DagData->m_ScanCacheFileNameTmp, &self->m_Heap);
-
-    // Unmap the file so we can overwrite it (on Windows.)
-    MmapFileDestroy(&self->m_ScanFile);
-
     // Ensure that the target directory exists.
     PathBuffer path;
     PathInit(&path, self->m_DagData->m_ScanCacheFileName.Get());
@@ -433,6 +539,19 @@ bool DriverSaveScanCache(Driver *self)
         Log(kWarning, "Failed to create directories for \"%s\"", self->m_DagData->m_ScanCacheFileName.Get());
     }
 
+    // Usually only a few files were scanned, and appending them to the log is much
+    // cheaper than writing the whole cache out again.
+    if (!ScanCacheShouldCompact(scan_cache) && ScanCacheAppendLog(scan_cache))
+        return true;
+
+    // This will be invalidated.
+    self->m_ScanData = nullptr;
+
+    bool success = ScanCacheSave(scan_cache, self->m_DagData->m_ScanCacheFileNameTmp, &self->m_Heap);
+
+    // Unmap the file so we can overwrite it (on Windows.)
+    MmapFileDestroy(&self->m_ScanFile);
+
     if (success)
     {
         success = RenameFile(self->m_DagData->m_ScanCacheFileNameTmp, self->m_DagData->m_ScanCacheFileName);
@@ -442,6 +561,12 @@ bool DriverSaveScanCache(Driver *self)
                 self->m_DagData->m_ScanCacheFileNameTmp.Get(),
                 self->m_DagData->m_ScanCacheFileName.Get());
         }
+        else
+        {
+            // Everything in the log is in the new file now. Were this to fail, the log
+            // would be ignored anyway as it was written against the old file.
+            RemoveFileOrDir(scan_cache->m_LogFileName);
+        }
     }
     else
     {
@@ -471,6 +596,27 @@ bool DriverSaveDigestCache(Driver *self)
     return DigestCacheSave(&self->m_DigestCache, &self->m_Heap, self->m_DagData->m_DigestCacheFileName, self->m_DagData->m_DigestCacheFileNameTmp);
 }
 
+// Save stat cache. It lives next to the digest cache, the directories for it were created when saving that.
+bool DriverSaveStatCache(Driver *self)
+{
+    char filename[kMaxPathLength];
+    char tmp_filename[kMaxPathLength];
+    GetStatCacheFileName(self, filename, "");
+    GetStatCacheFileName(self, tmp_filename, ".tmp");
+
+    return StatCacheSave(&self->m_StatCache, &self->m_Heap, filename, tmp_filename);
+}
+
+bool DriverRunWatchDaemon(Driver *self)
+{
+    char stat_cache_filename[kMaxPathLength];
+    char socket_filename[kMaxPathLength];
+    GetStatCacheFileName(self, stat_cache_filename, "");
+    GetStatCacheFileName(self, socket_filename, ".watch");
+
+    return WatchDaemonRun(socket_filename, stat_cache_filename);
+}
+
 
 
 
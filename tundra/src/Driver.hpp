@@ -9,6 +9,7 @@
 #include "ScanCache.hpp"
 #include "StatCache.hpp"
 #include "DigestCache.hpp"
+#include "AllBuiltNodes.hpp"
 
 
 namespace Frozen {
@@ -40,13 +41,20 @@ struct DriverOptions
     bool m_RunUnprotected;
 #endif
     int m_ThreadCount;
+    int m_MaxProcesses;
+    int m_ResourceReportCount;
     const char *m_WorkingDir;
     const char *m_DAGFileName;
     const char* m_DagFileNameJson;
+    const char* m_DagFileNameStream;
     const char *m_ProfileOutput;
     const char *m_IncludesOutput;
     const char *m_JustPrintLeafInputSignature;
     const char* m_BinLog;
+    const char* m_Scheduler;
+    bool m_TrustStatCache;
+    bool m_WatchDaemon;
+    bool m_LearnMemoryWeights;
 };
 
 void DriverOptionsInit(DriverOptions *self);
@@ -68,6 +76,9 @@ struct Driver
     // Read-only memory mapped data - header scanning cache
     MemoryMappedFile m_ScanFile;
 
+    // Nodes saved since the previous build state was written, and the two merged.
+    BuiltNodesJournal m_StateJournal;
+
     // Stores pointers to mmaped data.
     const Frozen::Dag *m_DagData;
     const Frozen::DagDerived *m_DagDerivedData;
@@ -90,7 +101,7 @@ struct Driver
 
 bool DriverInit(Driver *self, const DriverOptions *options);
 
-bool DriverPrepareNodes(Driver *self, const char **targets, int target_count);
+bool DriverPrepareNodes(Driver *self);
 
 void DriverDestroy(Driver *self);
 
@@ -109,8 +120,13 @@ BuildResult::Enum DriverBuild(Driver *self, int* out_finished_node_count, char*
 
 bool DriverInitData(Driver *self);
 
+void DriverReportResourceUsage(Driver *self, int count);
+
 bool DriverSaveScanCache(Driver *self);
 bool DriverSaveDigestCache(Driver *self);
+bool DriverSaveStatCache(Driver *self);
+
+bool DriverRunWatchDaemon(Driver *self);
 
 void DriverInitializeTundraFilePaths(DriverOptions *driverOptions);
 void DriverSelectNodes(const Frozen::Dag *dag, const char **targets, int target_count, Buffer<int32_t> *out_nodes, MemAllocHeap *heap);
@@ -241,7 +241,7 @@ void EmitNodeStart(RuntimeNode* node, int thread_index)
     });
 }
 
-void EmitNodeFinish(RuntimeNode* node, HashDigest inputSignature, int exitcode, const char* output, int duration_in_ms, int thread_index)
+void EmitNodeFinish(RuntimeNode* node, HashDigest inputSignature, int exitcode, const char* output, int duration_in_ms, const ExecResourceUsage& usage, int thread_index)
 {
     if (!RuntimeNodeHas_SentBinLogNodeInfoMessage(node))
         EmitNodeInfoMessage(node);
@@ -254,6 +254,13 @@ void EmitNodeFinish(RuntimeNode* node, HashDigest inputSignature, int exitcode,
         msg.cmdline = string_payloads.AddString(node->m_DagNode->m_Action.Get());
         msg.output = string_payloads.AddString(output);    
         msg.thread_index = thread_index;
+        msg.user_cpu_ms = (int)(usage.m_UserTimeUs / 1000);
+        msg.system_cpu_ms = (int)(usage.m_SystemTimeUs / 1000);
+        msg.max_rss_kb = (int)usage.m_MaxRssKB;
+        msg.blocks_read = (int)usage.m_BlocksRead;
+        msg.blocks_written = (int)usage.m_BlocksWritten;
+        msg.voluntary_context_switches = (int)usage.m_VoluntaryContextSwitches;
+        msg.involuntary_context_switches = (int)usage.m_InvoluntaryContextSwitches;
     });
 }
 
@@ -4,6 +4,7 @@
 #include "BinLogFormat.hpp"
 
 struct RuntimeNode;
+struct ExecResourceUsage;
 
 namespace EventLog
 {
@@ -15,6 +16,6 @@ namespace EventLog
     void EmitBuildFinish(BuildResult::Enum buildResult);
     void EmitNodeUpToDate(RuntimeNode* node);
     void EmitNodeStart(RuntimeNode* node, int thread_index);
-    void EmitNodeFinish(RuntimeNode* node, HashDigest inputSignature, int exitcode, const char* output, int duration_in_ms, int thread_index);
+    void EmitNodeFinish(RuntimeNode* node, HashDigest inputSignature, int exitcode, const char* output, int duration_in_ms, const ExecResourceUsage& usage, int thread_index);
     void EmitFirstTimeEnqueue(RuntimeNode* queued_node, RuntimeNode* enqueueing_node);
 }
\ No newline at end of file
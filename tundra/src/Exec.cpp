@@ -4,8 +4,15 @@
 #include "BuildQueue.hpp"
 #include "DagData.hpp"
 #include "Atomic.hpp"
+#include "Mutex.hpp"
+#include "ConditionVar.hpp"
 #include "Banned.hpp"
 
+static Mutex s_ProcessSlotLock;
+static ConditionVariable s_ProcessSlotAvailable;
+static int s_MaxProcesses;
+static int s_RunningProcesses;
+
 
 void InitOutputBuffer(OutputBufferData *data, MemAllocHeap *heap)
 {
@@ -64,3 +71,36 @@ void EmitOutputBytesToDestination(ExecResult *execResult, const char *text, size
 }
 
 
+
+void ExecSetMaxProcesses(int max_processes)
+{
+    if (s_MaxProcesses == 0 && max_processes > 0)
+    {
+        MutexInit(&s_ProcessSlotLock);
+        CondInit(&s_ProcessSlotAvailable);
+    }
+    s_MaxProcesses = max_processes;
+}
+
+void ExecAcquireProcessSlot()
+{
+    if (s_MaxProcesses == 0)
+        return;
+
+    MutexLock(&s_ProcessSlotLock);
+    while (s_RunningProcesses >= s_MaxProcesses)
+        CondWait(&s_ProcessSlotAvailable, &s_ProcessSlotLock);
+    ++s_RunningProcesses;
+    MutexUnlock(&s_ProcessSlotLock);
+}
+
+void ExecReleaseProcessSlot()
+{
+    if (s_MaxProcesses == 0)
+        return;
+
+    MutexLock(&s_ProcessSlotLock);
+    --s_RunningProcesses;
+    CondSignal(&s_ProcessSlotAvailable);
+    MutexUnlock(&s_ProcessSlotLock);
+}
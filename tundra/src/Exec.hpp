@@ -1,11 +1,13 @@
 #pragma once
 
 #include "stddef.h"
+#include <stdint.h>
 #include <thread>
 
 namespace Frozen { struct DagNode; };
 struct MemAllocHeap;
 struct BuildQueue;
+struct ExecReactorJob;
 
 struct EnvVariable
 {
@@ -21,14 +23,41 @@ struct OutputBufferData
     MemAllocHeap *heap;
 };
 
+// What a finished process cost, including the children it waited for. Fields
+// the platform doesn't report are left at 0.
+struct ExecResourceUsage
+{
+    uint64_t m_UserTimeUs;
+    uint64_t m_SystemTimeUs;
+    uint64_t m_MaxRssKB;
+    uint64_t m_BlocksRead;
+    uint64_t m_BlocksWritten;
+    uint64_t m_VoluntaryContextSwitches;
+    uint64_t m_InvoluntaryContextSwitches;
+};
+
 struct ExecResult
 {
     int m_ReturnCode;
     bool m_RequiresFrontendRerun;
     const Frozen::DagNode *m_FrozenNodeData;
     OutputBufferData m_OutputBuffer;
+    ExecResourceUsage m_Usage;
 };
 
+enum
+{
+    // Run the command line as a plain argument vector instead of handing it
+    // to the platform shell. Only valid when the command uses no shell syntax
+    // beyond quoting.
+    kExecFlagNoShell = 1 << 0,
+};
+
+#if defined(TUNDRA_UNIX)
+struct rusage;
+void ExecResourceUsageFromRusage(ExecResourceUsage *usage, const struct rusage *ru);
+#endif
+
 void InitOutputBuffer(OutputBufferData *data, MemAllocHeap *heap);
 void ExecResultFreeMemory(ExecResult *result);
 void ExecInit();
@@ -42,4 +71,24 @@ ExecResult ExecuteProcess(
     int job_id,
     int (*callback_on_slow)(void *user_data) = nullptr,
     void *callback_on_slow_userdata = nullptr,
-    int time_until_first_callback = 1);
+    int time_until_first_callback = 1,
+    uint32_t exec_flags = 0);
+
+// Start a process and return without waiting for it. The job's m_Result is
+// initialized here and m_OnComplete is called once the child has exited, which
+// may happen on another thread or, if the child could not be started, before
+// this function returns. Returns false if processes can't be run asynchronously
+// on this platform; use ExecuteProcess() then.
+bool ExecuteProcessAsync(
+    ExecReactorJob *job,
+    const char *cmd_line,
+    int env_count,
+    const EnvVariable *env_vars,
+    MemAllocHeap *heap,
+    uint32_t exec_flags = 0);
+
+// Limit the number of child processes running at the same time, across all
+// threads. Zero, the default, means no limit beyond the number of threads.
+void ExecSetMaxProcesses(int max_processes);
+void ExecAcquireProcessSlot();
+void ExecReleaseProcessSlot();
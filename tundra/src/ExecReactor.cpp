@@ -0,0 +1,263 @@
+#include "ExecReactor.hpp"
+#include "Exec.hpp"
+#include "Thread.hpp"
+
+#if defined(TUNDRA_LINUX)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "Banned.hpp"
+
+#if !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+
+// A single thread multiplexes the output pipes and exit notifications of all
+// running children with epoll, instead of every build thread sitting in its own
+// select() loop. Exit is observed through a pidfd, so a child that leaves its
+// pipes open to a grandchild (a server started as a shared resource, say) is
+// still reported as soon as it exits.
+
+enum
+{
+    kSourceStdout = 0,
+    kSourceStderr = 1,
+    kSourcePidFd = 2
+};
+
+static int s_EpollFd = -1;
+
+static int PidFdOpen(int pid)
+{
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+static void StopWatching(ExecReactorSource *source)
+{
+    epoll_ctl(s_EpollFd, EPOLL_CTL_DEL, source->m_Fd, nullptr);
+}
+
+// Fds are only closed once the job completes, so until then they stay with
+// whoever owns the job.
+static void CloseSources(ExecReactorJob *job)
+{
+    for (ExecReactorSource &source : job->m_Sources)
+    {
+        StopWatching(&source);
+        close(source.m_Fd);
+        source.m_Fd = -1;
+    }
+}
+
+// Read everything currently buffered in the pipe. Returns false once the pipe
+// has been closed by the writer.
+static bool DrainPipe(ExecReactorSource *source)
+{
+    char text[8192];
+
+    for (;;)
+    {
+        ssize_t count = read(source->m_Fd, text, sizeof(text));
+
+        if (count > 0)
+        {
+            EmitOutputBytesToDestination(source->m_Job->m_Result, text, count);
+            continue;
+        }
+
+        if (count == -1 && errno == EINTR)
+            continue;
+
+        if (count == -1 && errno == EAGAIN)
+            return true;
+
+        return false;
+    }
+}
+
+static bool ReapChild(ExecReactorJob *job)
+{
+    int status = 0;
+    struct rusage usage;
+    pid_t p;
+
+    do
+    {
+        p = wait4(job->m_Pid, &status, WNOHANG, &usage);
+    } while (p == -1 && errno == EINTR);
+
+    if (p == 0)
+        return false;
+
+    if (p != job->m_Pid)
+    {
+        perror("wait4 failed");
+        job->m_ExitStatus = 1;
+        return true;
+    }
+
+    ExecResourceUsageFromRusage(&job->m_Result->m_Usage, &usage);
+
+    if (WIFEXITED(status))
+        job->m_ExitStatus = WEXITSTATUS(status);
+    else
+        job->m_ExitStatus = 128 + WTERMSIG(status);
+
+    return true;
+}
+
+static ThreadRoutineReturnType TUNDRA_STDCALL ExecReactorThread(void *)
+{
+    const int kMaxEvents = 64;
+    struct epoll_event events[kMaxEvents];
+    ExecReactorJob *completed[kMaxEvents];
+
+    for (;;)
+    {
+        int count = epoll_wait(s_EpollFd, events, kMaxEvents, -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            CroakErrno("epoll_wait failed");
+        }
+
+        int completed_count = 0;
+
+        for (int i = 0; i < count; ++i)
+        {
+            ExecReactorSource *source = (ExecReactorSource *)events[i].data.ptr;
+            ExecReactorJob *job = source->m_Job;
+
+            // A job that completed earlier in this batch has already dropped its fds.
+            if (source->m_Fd == -1)
+                continue;
+
+            if (source->m_Kind != kSourcePidFd)
+            {
+                if (!DrainPipe(source))
+                    StopWatching(source);
+                continue;
+            }
+
+            if (!ReapChild(job))
+                continue;
+
+            // Everything the child wrote before exiting is already in the pipes. Take it, and
+            // don't wait for the write ends to close as they may be held by a grandchild.
+            DrainPipe(&job->m_Sources[kSourceStdout]);
+            DrainPipe(&job->m_Sources[kSourceStderr]);
+            CloseSources(job);
+
+            job->m_Result->m_ReturnCode = job->m_ExitStatus;
+            if (job->m_HoldsProcessSlot)
+            {
+                job->m_HoldsProcessSlot = false;
+                ExecReleaseProcessSlot();
+            }
+            completed[completed_count++] = job;
+        }
+
+        // Completion hands the job memory back to its owner, so it must happen after the
+        // whole batch has been looked at.
+        for (int i = 0; i < completed_count; ++i)
+            completed[i]->m_OnComplete(completed[i]);
+    }
+
+    return 0;
+}
+
+bool ExecReactorInit()
+{
+    if (s_EpollFd != -1)
+        return true;
+
+    int self = PidFdOpen(getpid());
+    if (self == -1)
+    {
+        Log(kDebug, "pidfd_open unavailable (%s), not starting exec reactor", strerror(errno));
+        return false;
+    }
+    close(self);
+
+    s_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (s_EpollFd == -1)
+    {
+        Log(kDebug, "epoll_create1 failed (%s), not starting exec reactor", strerror(errno));
+        return false;
+    }
+
+    // The thread lives for the remainder of the process.
+    ThreadStart(ExecReactorThread, nullptr, "Exec reactor");
+    return true;
+}
+
+bool ExecReactorIsRunning()
+{
+    return s_EpollFd != -1;
+}
+
+bool ExecReactorAdd(ExecReactorJob *job, int pid, int stdout_fd, int stderr_fd)
+{
+    int pidfd = PidFdOpen(pid);
+    if (pidfd == -1)
+        return false;
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+    job->m_Pid = pid;
+    job->m_ExitStatus = 1;
+
+    const int fds[3] = {stdout_fd, stderr_fd, pidfd};
+    for (int s = 0; s < 3; ++s)
+    {
+        job->m_Sources[s].m_Job = job;
+        job->m_Sources[s].m_Fd = fds[s];
+        job->m_Sources[s].m_Kind = s;
+        if (s != kSourcePidFd)
+            fcntl(fds[s], F_SETFL, fcntl(fds[s], F_GETFL) | O_NONBLOCK);
+    }
+
+    // The pidfd goes in last; the job can complete as soon as it is registered.
+    for (int s = 0; s < 3; ++s)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &job->m_Sources[s];
+        if (-1 == epoll_ctl(s_EpollFd, EPOLL_CTL_ADD, fds[s], &ev))
+        {
+            for (int u = 0; u < s; ++u)
+                epoll_ctl(s_EpollFd, EPOLL_CTL_DEL, fds[u], nullptr);
+            close(pidfd);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#else
+
+bool ExecReactorInit()
+{
+    return false;
+}
+
+bool ExecReactorIsRunning()
+{
+    return false;
+}
+
+bool ExecReactorAdd(ExecReactorJob *job, int pid, int stdout_fd, int stderr_fd)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Common.hpp"
+
+struct ExecResult;
+struct ExecReactorJob;
+
+// One file descriptor the reactor is watching on behalf of a job.
+struct ExecReactorSource
+{
+    ExecReactorJob *m_Job;
+    int m_Fd;
+    int m_Kind;
+};
+
+// A child process handed over to the reactor. The reactor owns the child's
+// output pipes and its pidfd; the job memory belongs to the caller and must
+// stay valid until m_OnComplete has been called.
+struct ExecReactorJob
+{
+    // Filled in by the caller before ExecReactorAdd().
+    ExecResult *m_Result;
+    void (*m_OnComplete)(ExecReactorJob *job);
+    void *m_UserData;
+
+    // Set when the child occupies one of the process slots (see
+    // ExecAcquireProcessSlot); the reactor returns it as soon as the child exits.
+    bool m_HoldsProcessSlot;
+
+    // Owned by the reactor while the job is in flight.
+    int m_Pid;
+    int m_ExitStatus;
+    ExecReactorSource m_Sources[3];
+};
+
+// Start the reactor thread. Returns false if the platform or kernel doesn't
+// support it (no epoll or no pidfd_open), in which case callers wait for their
+// children themselves.
+bool ExecReactorInit();
+
+bool ExecReactorIsRunning();
+
+// Hand a freshly spawned child to the reactor. Output read from the pipes is
+// appended to job->m_Result, and once the child has exited its return code is
+// stored there and m_OnComplete is called on the reactor thread, so it should
+// do no more than signal the waiting party. Returns false, leaving the fds
+// with the caller, if the child could not be registered.
+bool ExecReactorAdd(ExecReactorJob *job, int pid, int stdout_fd, int stderr_fd);
@@ -3,6 +3,8 @@
 #include "Exec.hpp"
 #include "Common.hpp"
 #include "MemAllocHeap.hpp"
+#include "ExecReactor.hpp"
+#include "ConditionVar.hpp"
 
 #if defined(TUNDRA_UNIX)
 
@@ -17,12 +19,14 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include <errno.h>
+#include <spawn.h>
 
 #include "Banned.hpp"
 
@@ -38,8 +42,243 @@ static void SetFdNonBlocking(int fd)
         CroakErrno("couldn't unblock fd %d", fd);
 }
 
+void ExecResourceUsageFromRusage(ExecResourceUsage *usage, const struct rusage *ru)
+{
+    usage->m_UserTimeUs = (uint64_t)ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec;
+    usage->m_SystemTimeUs = (uint64_t)ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+#if defined(TUNDRA_APPLE)
+    // Darwin reports ru_maxrss in bytes, everyone else in kilobytes.
+    usage->m_MaxRssKB = ru->ru_maxrss / 1024;
+#else
+    usage->m_MaxRssKB = ru->ru_maxrss;
+#endif
+    usage->m_BlocksRead = ru->ru_inblock;
+    usage->m_BlocksWritten = ru->ru_oublock;
+    usage->m_VoluntaryContextSwitches = ru->ru_nvcsw;
+    usage->m_InvoluntaryContextSwitches = ru->ru_nivcsw;
+}
+
 void ExecInit()
 {
+    ExecReactorInit();
+}
+
+extern char **environ;
+
+static bool CreatePipe(int fds[2])
+{
+#if defined(TUNDRA_LINUX)
+    return 0 == pipe2(fds, O_CLOEXEC);
+#else
+    if (-1 == pipe(fds))
+        return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+// Build the environment block for a child: the current environment with env_vars
+// replacing or extending it. Strings of the current environment are shared, the
+// overrides are formatted into the same heap block as the pointer array.
+static char **BuildChildEnvironment(MemAllocHeap *heap, int env_count, const EnvVariable *env_vars)
+{
+    int base_count = 0;
+    while (environ[base_count])
+        ++base_count;
+
+    size_t string_bytes = 0;
+    for (int i = 0; i < env_count; ++i)
+        string_bytes += strlen(env_vars[i].m_Name) + strlen(env_vars[i].m_Value) + 2;
+
+    size_t pointer_bytes = sizeof(char *) * (base_count + env_count + 1);
+    char **envp = (char **)HeapAllocate(heap, pointer_bytes + string_bytes);
+    char *strings = (char *)envp + pointer_bytes;
+
+    memcpy(envp, environ, sizeof(char *) * base_count);
+    int count = base_count;
+
+    for (int i = 0; i < env_count; ++i)
+    {
+        size_t name_length = strlen(env_vars[i].m_Name);
+        size_t value_length = strlen(env_vars[i].m_Value);
+        char *entry = strings;
+        memcpy(entry, env_vars[i].m_Name, name_length);
+        entry[name_length] = '=';
+        memcpy(entry + name_length + 1, env_vars[i].m_Value, value_length + 1);
+        strings += name_length + value_length + 2;
+
+        int slot = count;
+        for (int j = 0; j < count; ++j)
+        {
+            if (0 == strncmp(envp[j], entry, name_length + 1))
+            {
+                slot = j;
+                break;
+            }
+        }
+
+        envp[slot] = entry;
+        if (slot == count)
+            ++count;
+    }
+
+    envp[count] = nullptr;
+    return envp;
+}
+
+// Split a command line into an argument vector following the shell's quoting
+// rules (single quotes, double quotes and backslash escapes) but without any
+// expansion, redirection or job control. Returns nullptr for an empty or
+// unterminated command line.
+static char **TokenizeCommandLine(MemAllocHeap *heap, const char *cmd_line)
+{
+    size_t length = strlen(cmd_line);
+    size_t max_args = length / 2 + 2;
+    size_t pointer_bytes = sizeof(char *) * max_args;
+    char **argv = (char **)HeapAllocate(heap, pointer_bytes + length + 1);
+    char *out = (char *)argv + pointer_bytes;
+
+    int argc = 0;
+    const char *p = cmd_line;
+
+    for (;;)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+            ++p;
+
+        if (*p == '\0')
+            break;
+
+        argv[argc++] = out;
+
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n')
+        {
+            if (*p == '\'')
+            {
+                ++p;
+                while (*p != '\0' && *p != '\'')
+                    *out++ = *p++;
+                if (*p == '\0')
+                    goto unterminated;
+                ++p;
+            }
+            else if (*p == '"')
+            {
+                ++p;
+                while (*p != '\0' && *p != '"')
+                {
+                    if (p[0] == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`'))
+                        ++p;
+                    *out++ = *p++;
+                }
+                if (*p == '\0')
+                    goto unterminated;
+                ++p;
+            }
+            else if (*p == '\\' && p[1] != '\0')
+            {
+                ++p;
+                *out++ = *p++;
+            }
+            else
+            {
+                *out++ = *p++;
+            }
+        }
+
+        *out++ = '\0';
+    }
+
+    if (argc == 0)
+        goto unterminated;
+
+    argv[argc] = nullptr;
+    return argv;
+
+unterminated:
+    HeapFree(heap, argv);
+    return nullptr;
+}
+
+static void EmitSpawnError(ExecResult *execResult, const char *what, const char *cmd_line, int error)
+{
+    char text[1024];
+    int count = snprintf(text, sizeof(text), "%s: %s\n  %s\n", what, strerror(error), cmd_line);
+    if (count > (int)sizeof(text) - 1)
+        count = (int)sizeof(text) - 1;
+    EmitOutputBytesToDestination(execResult, text, count);
+}
+
+// Start the child with posix_spawn rather than fork(). Copying the page tables of
+// a build process with large mapped state files and many thread stacks costs a lot
+// more than the child itself; posix_spawn is implemented with vfork semantics on
+// the platforms we care about, and the environment is passed in directly so the
+// child never has to run any code of ours.
+static pid_t SpawnChild(
+    ExecResult *result,
+    const char *cmd_line,
+    int env_count,
+    const EnvVariable *env_vars,
+    MemAllocHeap *heap,
+    uint32_t exec_flags,
+    int stdout_fd,
+    int stderr_fd)
+{
+    char **argv = nullptr;
+    const char *shell_args[] = {"/bin/sh", "-c", cmd_line, NULL};
+
+    if (exec_flags & kExecFlagNoShell)
+    {
+        argv = TokenizeCommandLine(heap, cmd_line);
+        if (argv == nullptr)
+        {
+            EmitSpawnError(result, "Couldn't tokenize command line", cmd_line, EINVAL);
+            return -1;
+        }
+    }
+
+    char **envp = env_count > 0 ? BuildChildEnvironment(heap, env_count, env_vars) : environ;
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+    // The pipes are close-on-exec; dup2 gives the child inheritable copies.
+    posix_spawn_file_actions_adddup2(&file_actions, stdout_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&file_actions, stderr_fd, STDERR_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short spawn_flags = POSIX_SPAWN_SETSIGMASK;
+#if defined(POSIX_SPAWN_USEVFORK)
+    spawn_flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_setflags(&attr, spawn_flags);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&attr, &sigs);
+
+    pid_t child = -1;
+    int error;
+    if (argv != nullptr)
+        error = posix_spawnp(&child, argv[0], &file_actions, &attr, argv, envp);
+    else
+        error = posix_spawn(&child, "/bin/sh", &file_actions, &attr, (char **)shell_args, envp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    if (envp != environ)
+        HeapFree(heap, envp);
+    if (argv != nullptr)
+        HeapFree(heap, argv);
+
+    if (0 != error)
+    {
+        EmitSpawnError(result, argv != nullptr ? "Failed executing" : "Failed executing /bin/sh", cmd_line, error);
+        return -1;
+    }
+
+    return child;
 }
 
 static int
@@ -65,201 +304,320 @@ EmitData(ExecResult *execResult, int fd)
     return 0;
 }
 
-ExecResult
-ExecuteProcess(
-    const char *cmd_line,
-    int env_count,
-    const EnvVariable *env_vars,
-    MemAllocHeap *heap,
-    int job_id,
+struct ReactorWait
+{
+    Mutex m_Lock;
+    ConditionVariable m_Done;
+    bool m_Finished;
+};
+
+static void OnReactorJobComplete(ExecReactorJob *job)
+{
+    ReactorWait *wait = (ReactorWait *)job->m_UserData;
+    MutexLock(&wait->m_Lock);
+    wait->m_Finished = true;
+    CondSignal(&wait->m_Done);
+    MutexUnlock(&wait->m_Lock);
+}
+
+// Hand the child over to the exec reactor and sleep until it has exited, waking
+// up only to run the slow callback. On success the reactor has taken ownership
+// of the pipe fds and closed them.
+static bool WaitForChildOnReactor(
+    ExecResult *result,
+    pid_t child,
+    int stdout_fd,
+    int stderr_fd,
     int (*callback_on_slow)(void *user_data),
     void *callback_on_slow_userdata,
     int time_to_first_slow_callback)
 {
-    ExecResult result;
+    ReactorWait wait;
+    MutexInit(&wait.m_Lock);
+    CondInit(&wait.m_Done);
+    wait.m_Finished = false;
+
+    ExecReactorJob job;
+    job.m_HoldsProcessSlot = false;
+    job.m_Result = result;
+    job.m_OnComplete = OnReactorJobComplete;
+    job.m_UserData = &wait;
+
+    if (!ExecReactorAdd(&job, child, stdout_fd, stderr_fd))
+    {
+        CondDestroy(&wait.m_Done);
+        MutexDestroy(&wait.m_Lock);
+        return false;
+    }
 
-    result.m_ReturnCode = 1;
-    result.m_OutputBuffer.buffer = nullptr;
+    uint64_t next_callback_at = TimerGet() + TimerFromSeconds(time_to_first_slow_callback);
 
-    if (heap == nullptr)
-        CroakAbort("Either pass in a heap so we can allocate buffers to store stdout");
+    MutexLock(&wait.m_Lock);
+    while (!wait.m_Finished)
+    {
+        if (callback_on_slow == nullptr)
+        {
+            CondWait(&wait.m_Done, &wait.m_Lock);
+            continue;
+        }
 
-    InitOutputBuffer(&result.m_OutputBuffer, heap);
+        uint64_t now = TimerGet();
+        if (now >= next_callback_at)
+        {
+            MutexUnlock(&wait.m_Lock);
+            int seconds_until_next = (*callback_on_slow)(callback_on_slow_userdata);
+            next_callback_at = TimerGet() + TimerFromSeconds(seconds_until_next);
+            MutexLock(&wait.m_Lock);
+            continue;
+        }
 
-    pid_t child;
+        CondWait(&wait.m_Done, &wait.m_Lock, 1 + (int)(TimerDiffSeconds(now, next_callback_at) * 1000.0));
+    }
+    MutexUnlock(&wait.m_Lock);
+
+    CondDestroy(&wait.m_Done);
+    MutexDestroy(&wait.m_Lock);
+    return true;
+}
+
+// Create the output pipes and spawn the child. On failure the reason has been
+// written to the result and false is returned.
+static bool StartChild(
+    ExecResult *result,
+    const char *cmd_line,
+    int env_count,
+    const EnvVariable *env_vars,
+    MemAllocHeap *heap,
+    uint32_t exec_flags,
+    pid_t *out_child,
+    int out_fds[2])
+{
     const int pipe_read = 0;
     const int pipe_write = 1;
 
     /* Create a pair of pipes to read back stdout, stderr */
     int stdout_pipe[2], stderr_pipe[2];
 
-    if (-1 == pipe(stdout_pipe))
+    if (!CreatePipe(stdout_pipe))
     {
         perror("pipe failed");
-        return result;
+        return false;
     }
 
-    if (-1 == pipe(stderr_pipe))
+    if (!CreatePipe(stderr_pipe))
     {
         perror("pipe failed");
         close(stdout_pipe[0]);
         close(stdout_pipe[1]);
-        return result;
+        return false;
     }
 
-    if (0 == (child = fork()))
-    {
-        const char *args[] = {"/bin/sh", "-c", cmd_line, NULL};
-
-        close(stdout_pipe[pipe_read]);
-        close(stderr_pipe[pipe_read]);
-
-        if (-1 == dup2(stdout_pipe[pipe_write], STDOUT_FILENO))
-            perror("dup2 failed");
-        if (-1 == dup2(stderr_pipe[pipe_write], STDERR_FILENO))
-            perror("dup2 failed");
+    pid_t child = SpawnChild(result, cmd_line, env_count, env_vars, heap, exec_flags, stdout_pipe[pipe_write], stderr_pipe[pipe_write]);
 
-        close(stdout_pipe[pipe_write]);
-        close(stderr_pipe[pipe_write]);
+    /* Close write end of the pipe, we're just going to be reading */
+    close(stdout_pipe[pipe_write]);
+    close(stderr_pipe[pipe_write]);
 
-        sigset_t sigs;
-        sigfillset(&sigs);
-        if (0 != sigprocmask(SIG_UNBLOCK, &sigs, 0))
-            perror("sigprocmask failed");
-
-        for (int i = 0; i < env_count; ++i)
-        {
-            setenv(env_vars[i].m_Name, env_vars[i].m_Value, /*overwrite:*/ 1);
-        }
-
-        if (-1 == execv("/bin/sh", (char **)args))
-            Croak("Failed executing /bin/sh");
-        /* we never get here */
-        abort();
-    }
-    else if (-1 == child)
+    if (-1 == child)
     {
-        perror("fork failed");
         close(stdout_pipe[pipe_read]);
         close(stderr_pipe[pipe_read]);
-        close(stdout_pipe[pipe_write]);
-        close(stderr_pipe[pipe_write]);
-        return result;
+        return false;
     }
-    else
-    {
-        pid_t p;
-        int return_code = 0;
-        int rfd_count = 2;
-        int rfds[2];
-        fd_set read_fds;
 
-        rfds[0] = stdout_pipe[pipe_read];
-        rfds[1] = stderr_pipe[pipe_read];
+    SetFdNonBlocking(stdout_pipe[pipe_read]);
+    SetFdNonBlocking(stderr_pipe[pipe_read]);
 
-        SetFdNonBlocking(rfds[0]);
-        SetFdNonBlocking(rfds[1]);
+    *out_child = child;
+    out_fds[0] = stdout_pipe[pipe_read];
+    out_fds[1] = stderr_pipe[pipe_read];
+    return true;
+}
 
-        /* Close write end of the pipe, we're just going to be reading */
-        close(stdout_pipe[pipe_write]);
-        close(stderr_pipe[pipe_write]);
+// Wait for the child on the calling thread, reading its output in a select loop.
+// Closes the pipe fds.
+static void WaitForChildWithSelect(
+    ExecResult *result,
+    pid_t child,
+    const int fds[2],
+    int (*callback_on_slow)(void *user_data),
+    void *callback_on_slow_userdata,
+    int time_to_first_slow_callback)
+{
+    pid_t p;
+    int return_code = 0;
+    int rfd_count = 2;
+    int rfds[2] = {fds[0], fds[1]};
+    fd_set read_fds;
 
-        /* Sit in a select loop over the two fds */
+    /* Sit in a select loop over the two fds */
 
-        //		int time_until_next_slow_callback = time_to_first_slow_callback;
+    uint64_t now = TimerGet();
+    uint64_t next_callback_at = now + TimerFromSeconds(time_to_first_slow_callback);
 
-        uint64_t now = TimerGet();
-        uint64_t next_callback_at = now + TimerFromSeconds(time_to_first_slow_callback);
+    for (;;)
+    {
+        int fd;
+        int count;
+        int max_fd = 0;
+        struct timeval timeout;
 
-        for (;;)
+        /* don't select if we know both pipes are closed */
+        if (rfd_count > 0)
         {
-            int fd;
-            int count;
-            int max_fd = 0;
-            struct timeval timeout;
+            FD_ZERO(&read_fds);
 
-            /* don't select if we know both pipes are closed */
-            if (rfd_count > 0)
+            for (fd = 0; fd < 2; ++fd)
             {
-                FD_ZERO(&read_fds);
-
-                for (fd = 0; fd < 2; ++fd)
+                if (rfds[fd])
                 {
-                    if (rfds[fd])
-                    {
-                        if (rfds[fd] > max_fd)
-                            max_fd = rfds[fd];
-                        FD_SET(rfds[fd], &read_fds);
-                    }
+                    if (rfds[fd] > max_fd)
+                        max_fd = rfds[fd];
+                    FD_SET(rfds[fd], &read_fds);
                 }
+            }
 
-                ++max_fd;
+            ++max_fd;
 
-                now = TimerGet();
-                timeout.tv_sec = (int)TimerDiffSeconds(now, next_callback_at);
-                if (timeout.tv_sec < 1)
-                    timeout.tv_sec = 1;
-                timeout.tv_usec = 0;
+            now = TimerGet();
+            timeout.tv_sec = (int)TimerDiffSeconds(now, next_callback_at);
+            if (timeout.tv_sec < 1)
+                timeout.tv_sec = 1;
+            timeout.tv_usec = 0;
 
-                count = select(max_fd, &read_fds, NULL, NULL, &timeout);
+            count = select(max_fd, &read_fds, NULL, NULL, &timeout);
 
-                if (callback_on_slow != nullptr)
-                {
-                    if (TimerGet() > next_callback_at)
-                        next_callback_at = TimerGet() + (*callback_on_slow)(callback_on_slow_userdata);
-                }
-                if (-1 == count) // happens in gdb due to syscall interruption
-                    continue;
+            if (callback_on_slow != nullptr)
+            {
+                if (TimerGet() > next_callback_at)
+                    next_callback_at = TimerGet() + (*callback_on_slow)(callback_on_slow_userdata);
+            }
+            if (-1 == count) // happens in gdb due to syscall interruption
+                continue;
 
-                for (fd = 0; fd < 2; ++fd)
+            for (fd = 0; fd < 2; ++fd)
+            {
+                if (0 != rfds[fd] && FD_ISSET(rfds[fd], &read_fds))
                 {
-                    if (0 != rfds[fd] && FD_ISSET(rfds[fd], &read_fds))
+                    if (0 != EmitData(result, rfds[fd]))
                     {
-                        if (0 != EmitData(&result, rfds[fd]))
-                        {
-                            /* Done with this FD. */
-                            rfds[fd] = 0;
-                            --rfd_count;
-                        }
+                        /* Done with this FD. */
+                        rfds[fd] = 0;
+                        --rfd_count;
                     }
                 }
             }
+        }
 
-            return_code = 0;
-            p = waitpid(child, &return_code, rfd_count > 0 ? WNOHANG : 0);
+        return_code = 0;
+        struct rusage usage;
+        p = wait4(child, &return_code, rfd_count > 0 ? WNOHANG : 0, &usage);
 
-            if (0 == p)
-            {
-                /* child still running */
-                continue;
-            }
-            else if (p != child)
-            {
-                return_code = 1;
-                perror("waitpid failed");
-                break;
-            }
-            else
-            {
-                /* fall out of the loop here - process has exited. */
-                /* FIXME - is there a race between getting the last data out of
-				 * the pipes vs quitting here? Probably there is. But it seems
-				 * to work well in practice. If I put a blocking waitpid()
-				 * after the loop I got deadlocks on Mac OS X in select. */
-                break;
-            }
+        if (0 == p)
+        {
+            /* child still running */
+            continue;
         }
+        else if (p != child)
+        {
+            return_code = 1;
+            perror("wait4 failed");
+            break;
+        }
+        else
+        {
+            ExecResourceUsageFromRusage(&result->m_Usage, &usage);
+            /* fall out of the loop here - process has exited. */
+            /* FIXME - is there a race between getting the last data out of
+             * the pipes vs quitting here? Probably there is. But it seems
+             * to work well in practice. If I put a blocking waitpid()
+             * after the loop I got deadlocks on Mac OS X in select. */
+            break;
+        }
+    }
 
-        close(stdout_pipe[pipe_read]);
-        close(stderr_pipe[pipe_read]);
+    close(fds[0]);
+    close(fds[1]);
 
-        if (WIFEXITED(return_code))
-            result.m_ReturnCode = WEXITSTATUS(return_code);
-        else
-            result.m_ReturnCode = 128 + WTERMSIG(return_code);
-            
-        return result;
+    if (WIFEXITED(return_code))
+        result->m_ReturnCode = WEXITSTATUS(return_code);
+    else
+        result->m_ReturnCode = 128 + WTERMSIG(return_code);
+}
+
+ExecResult
+ExecuteProcess(
+    const char *cmd_line,
+    int env_count,
+    const EnvVariable *env_vars,
+    MemAllocHeap *heap,
+    int job_id,
+    int (*callback_on_slow)(void *user_data),
+    void *callback_on_slow_userdata,
+    int time_to_first_slow_callback,
+    uint32_t exec_flags)
+{
+    ExecResult result;
+    memset(&result, 0, sizeof(result));
+
+    result.m_ReturnCode = 1;
+    result.m_OutputBuffer.buffer = nullptr;
+
+    if (heap == nullptr)
+        CroakAbort("Either pass in a heap so we can allocate buffers to store stdout");
+
+    InitOutputBuffer(&result.m_OutputBuffer, heap);
+
+    pid_t child;
+    int fds[2];
+
+    ExecAcquireProcessSlot();
+
+    if (StartChild(&result, cmd_line, env_count, env_vars, heap, exec_flags, &child, fds))
+    {
+        if (!ExecReactorIsRunning() || !WaitForChildOnReactor(&result, child, fds[0], fds[1], callback_on_slow, callback_on_slow_userdata, time_to_first_slow_callback))
+            WaitForChildWithSelect(&result, child, fds, callback_on_slow, callback_on_slow_userdata, time_to_first_slow_callback);
     }
+
+    ExecReleaseProcessSlot();
+
+    return result;
+}
+
+bool ExecuteProcessAsync(
+    ExecReactorJob *job,
+    const char *cmd_line,
+    int env_count,
+    const EnvVariable *env_vars,
+    MemAllocHeap *heap,
+    uint32_t exec_flags)
+{
+    if (!ExecReactorIsRunning())
+        return false;
+
+    ExecResult *result = job->m_Result;
+    result->m_ReturnCode = 1;
+    result->m_Usage = {};
+    InitOutputBuffer(&result->m_OutputBuffer, heap);
+
+    pid_t child;
+    int fds[2];
+
+    ExecAcquireProcessSlot();
+
+    if (StartChild(result, cmd_line, env_count, env_vars, heap, exec_flags, &child, fds))
+    {
+        job->m_HoldsProcessSlot = true;
+        if (ExecReactorAdd(job, child, fds[0], fds[1]))
+            return true;
+
+        job->m_HoldsProcessSlot = false;
+        WaitForChildWithSelect(result, child, fds, nullptr, nullptr, 0);
+    }
+
+    ExecReleaseProcessSlot();
+    job->m_OnComplete(job);
+    return true;
 }
 
 
@@ -492,6 +492,25 @@ static void CleanupResponseFile(const char *responseFile)
         RemoveFileOrDir(responseFile);
 }
 
+// The job object accounts for the process and everything it spawned. Windows
+// counts I/O operations rather than blocks and has no context switch counts.
+static void GetJobResourceUsage(HANDLE job_object, ExecResourceUsage *usage)
+{
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting;
+    if (QueryInformationJobObject(job_object, JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting), NULL))
+    {
+        // Times are in 100ns units.
+        usage->m_UserTimeUs = accounting.BasicInfo.TotalUserTime.QuadPart / 10;
+        usage->m_SystemTimeUs = accounting.BasicInfo.TotalKernelTime.QuadPart / 10;
+        usage->m_BlocksRead = accounting.IoInfo.ReadOperationCount;
+        usage->m_BlocksWritten = accounting.IoInfo.WriteOperationCount;
+    }
+
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+    if (QueryInformationJobObject(job_object, JobObjectExtendedLimitInformation, &limits, sizeof(limits), NULL))
+        usage->m_MaxRssKB = limits.PeakProcessMemoryUsed / 1024;
+}
+
 static int WaitForFinish(HANDLE processHandle, int (*callback_on_slow)(void *user_data), void *callback_on_slow_userdata, int time_until_first_callback)
 {
     DWORD timeUntilNextSlowCallbackInvoke = callback_on_slow != nullptr ? time_until_first_callback : INFINITE;
@@ -520,7 +539,8 @@ ExecResult ExecuteProcess(
     int job_id,
     int (*callback_on_slow)(void *user_data),
     void *callback_on_slow_userdata,
-    int time_until_first_callback)
+    int time_until_first_callback,
+    uint32_t exec_flags)
 {
     STARTUPINFOEXW sinfo;
     ZeroMemory(&sinfo, sizeof(STARTUPINFOEXW));
@@ -583,7 +603,10 @@ ExecResult ExecuteProcess(
         return result;
 
     const char *cmd_to_use = new_cmd[0] == 0 ? cmd_line : new_cmd;
-    _snprintf(buffer, sizeof(buffer), "cmd.exe /c \"%s\"", cmd_to_use);
+    if (exec_flags & kExecFlagNoShell)
+        _snprintf(buffer, sizeof(buffer), "%s", cmd_to_use);
+    else
+        _snprintf(buffer, sizeof(buffer), "cmd.exe /c \"%s\"", cmd_to_use);
     buffer[sizeof(buffer) - 1] = '\0';
 
     HANDLE job_object = CreateJobObject(NULL, NULL);
@@ -596,6 +619,8 @@ ExecResult ExecuteProcess(
 
     PROCESS_INFORMATION pinfo;
 
+    ExecAcquireProcessSlot();
+
     if (!CreateProcessW(NULL, buffer_wide, NULL, NULL, TRUE, creationFlags, env_block_wide, NULL, &sinfo.StartupInfo, &pinfo))
         CroakErrnoAbort("Couldn't launch process with command line:\n%s", buffer);
 
@@ -608,16 +633,32 @@ ExecResult ExecuteProcess(
 
     result.m_ReturnCode = WaitForFinish(pinfo.hProcess, callback_on_slow, callback_on_slow_userdata, time_until_first_callback);
 
+    ExecReleaseProcessSlot();
+
     CleanupResponseFile(responseFile);
 
     CopyTempFileContentsIntoBufferAndPrepareFileForReuse(job_id, buffer, &result.m_OutputBuffer, heap);
 
+    GetJobResourceUsage(job_object, &result.m_Usage);
+
     CloseHandle(pinfo.hProcess);
     CloseHandle(job_object);
 
     return result;
 }
 
+bool ExecuteProcessAsync(
+    ExecReactorJob *job,
+    const char *cmd_line,
+    int env_count,
+    const EnvVariable *env_vars,
+    MemAllocHeap *heap,
+    uint32_t exec_flags)
+{
+    // Output goes through per-job temp files here, which the build threads read back themselves.
+    return false;
+}
+
 
 
 #endif /* TUNDRA_WIN32 */
@@ -39,6 +39,35 @@ struct StatCache;
 
 const uint64_t kDirectoryTimestamp = 1;
 
+#if defined(TUNDRA_UNIX)
+FileInfo FileInfoFromStat(uint32_t mode, uint64_t mtime_ns, uint64_t size)
+{
+    FileInfo result;
+
+    uint32_t flags = FileInfo::kFlagExists;
+
+    if ((mode & S_IFMT) == S_IFDIR)
+        flags |= FileInfo::kFlagDirectory;
+    else if ((mode & S_IFMT) == S_IFREG)
+        flags |= FileInfo::kFlagFile;
+#ifdef S_IFLNK
+    else if ((mode & S_IFMT) == S_IFLNK)
+        flags |= FileInfo::kFlagSymlink;
+#endif
+
+    if ((mode & S_IWRITE) == 0)
+      flags |= FileInfo::kFlagReadOnly;
+
+    result.m_Flags = flags;
+
+    // Do not allow directories to expose real timestamps, as it's not reliable behaviour across platforms
+    result.m_Timestamp = (flags & FileInfo::kFlagDirectory) ? kDirectoryTimestamp : mtime_ns;
+    result.m_Size = size;
+
+    return result;
+}
+#endif
+
 FileInfo GetFileInfo(const char *path)
 {
     TimingScope timing_scope(&g_Stats.m_StatCount, &g_Stats.m_StatTimeCycles);
@@ -53,33 +82,13 @@ FileInfo GetFileInfo(const char *path)
     if (0 != lstat(path, &stbuf))
         goto Failure;
 
-    flags |= FileInfo::kFlagExists;
-
-    if ((stbuf.st_mode & S_IFMT) == S_IFDIR)
-        flags |= FileInfo::kFlagDirectory;
-    else if ((stbuf.st_mode & S_IFMT) == S_IFREG)
-        flags |= FileInfo::kFlagFile;
-#ifdef S_IFLNK
-    else if ((stbuf.st_mode & S_IFMT) == S_IFLNK)
-        flags |= FileInfo::kFlagSymlink;
-#endif
-
-    if ((stbuf.st_mode & S_IWRITE) == 0)
-      flags |= FileInfo::kFlagReadOnly;
-
-    // Do not allow directories to expose real timestamps, as it's not reliable behaviour across platforms
-    result.m_Timestamp = (flags & FileInfo::kFlagDirectory) ? kDirectoryTimestamp : 
     // high-precision timestaps in stat struct is not standardized. Different system headers 
     // use different conventions - or don't support it at all (windows).
 #if defined(TUNDRA_APPLE)
-        stbuf.st_mtimespec.tv_sec * 1000000000 + stbuf.st_mtimespec.tv_nsec;
-#elif defined(TUNDRA_UNIX)
-        stbuf.st_mtim.tv_sec * 1000000000 + stbuf.st_mtim.tv_nsec;
+    return FileInfoFromStat(stbuf.st_mode, stbuf.st_mtimespec.tv_sec * 1000000000 + stbuf.st_mtimespec.tv_nsec, stbuf.st_size);
 #else
-        stbuf.st_mtime * 1000000000;
-#endif       
-
-    result.m_Size = stbuf.st_size;
+    return FileInfoFromStat(stbuf.st_mode, stbuf.st_mtim.tv_sec * 1000000000 + stbuf.st_mtim.tv_nsec, stbuf.st_size);
+#endif
 
 #elif defined(TUNDRA_WIN32)
 
@@ -122,6 +131,60 @@ Failure:
     return result;
 }
 
+FileInfo GetDirectoryChangeInfo(const char *path)
+{
+    TimingScope timing_scope(&g_Stats.m_StatCount, &g_Stats.m_StatTimeCycles);
+
+    FileInfo result;
+    result.m_Flags = 0;
+    result.m_Size = 0;
+    result.m_Timestamp = 0;
+
+#if defined(TUNDRA_UNIX)
+    struct stat stbuf;
+
+    if (0 != stat(path, &stbuf))
+    {
+        if (errno != ENOENT && errno != ENOTDIR)
+            result.m_Flags = FileInfo::kFlagError;
+        return result;
+    }
+
+    result.m_Flags = FileInfo::kFlagExists | ((stbuf.st_mode & S_IFMT) == S_IFDIR ? FileInfo::kFlagDirectory : FileInfo::kFlagFile);
+
+    // We use the status change time rather than the modification time, as the latter can be set to anything by tools
+    // that restore timestamps. Any change to the directory entries updates both.
+#if defined(TUNDRA_APPLE)
+    result.m_Timestamp = stbuf.st_ctimespec.tv_sec * 1000000000 + stbuf.st_ctimespec.tv_nsec;
+#else
+    result.m_Timestamp = stbuf.st_ctim.tv_sec * 1000000000 + stbuf.st_ctim.tv_nsec;
+#endif
+
+#elif defined(TUNDRA_WIN32)
+
+    std::wstring widePath(ToWideString(path));
+    if (!ConvertToLongPath(&widePath))
+    {
+        result.m_Flags = FileInfo::kFlagError;
+        return result;
+    }
+
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExW(widePath.c_str(), GetFileExInfoStandard, &info))
+    {
+        DWORD error = GetLastError();
+        if (error != ERROR_FILE_NOT_FOUND && error != ERROR_PATH_NOT_FOUND)
+            result.m_Flags = FileInfo::kFlagError;
+        return result;
+    }
+
+    result.m_Flags = FileInfo::kFlagExists | ((info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? FileInfo::kFlagDirectory : FileInfo::kFlagFile);
+    result.m_Timestamp = (((uint64_t)info.ftLastWriteTime.dwHighDateTime) << 32) + info.ftLastWriteTime.dwLowDateTime;
+#endif
+
+    return result;
+}
+
 bool ShouldFilter(const char *name)
 {
     return ShouldFilter(name, strlen(name));
@@ -28,6 +28,16 @@ struct FileInfo
 
 FileInfo GetFileInfo(const char *path);
 
+#if defined(TUNDRA_UNIX)
+// What GetFileInfo() reports for a file with this lstat() mode, modification time and size, for callers that got those
+// some other way.
+FileInfo FileInfoFromStat(uint32_t mode, uint64_t mtime_ns, uint64_t size);
+#endif
+
+// Unlike GetFileInfo(), this follows symlinks and reports a real timestamp for directories, one that changes whenever
+// an entry is added to, removed from or renamed in the directory. Used to validate cached stat results in bulk.
+FileInfo GetDirectoryChangeInfo(const char *path);
+
 bool ShouldFilter(const char *name);
 bool ShouldFilter(const char *name, size_t len);
 
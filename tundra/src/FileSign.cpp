@@ -4,9 +4,233 @@
 #include "Stats.hpp"
 #include "DigestCache.hpp"
 #include "Buffer.hpp"
+#include "ParallelFor.hpp"
+#include "Atomic.hpp"
+#include "IoRing.hpp"
 #include <stdio.h>
+#include <algorithm>
+
+#if defined(TUNDRA_UNIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 #include "Banned.hpp"
 
+enum
+{
+    // Files smaller than this are read into a buffer; larger ones are mapped.
+    kMmapThreshold = 1024 * 1024,
+
+    // Files at least this large are hashed as a tree: every chunk gets a digest of
+    // its own and the file digest is computed over the chunk digests. That lets
+    // several threads share the work on one large file. The digest depends only
+    // on the content and the size, never on how the file was read.
+    kTreeHashThreshold = 16 * 1024 * 1024,
+    kTreeHashChunkSize = 4 * 1024 * 1024,
+    kMaxTreeHashThreads = 8,
+
+    kReadBufferSize = 64 * 1024
+};
+
+// Incrementally hashes file content of a known size, switching to the tree
+// layout for large files.
+struct ContentHasher
+{
+    bool m_Tree;
+    HashState m_Root;
+    HashState m_Chunk;
+    uint64_t m_ChunkBytes;
+
+    void Init(uint64_t size)
+    {
+        m_Tree = size >= kTreeHashThreshold;
+        m_ChunkBytes = 0;
+        HashInit(&m_Root);
+        if (m_Tree)
+        {
+            HashAddInteger(&m_Root, size);
+            HashInit(&m_Chunk);
+        }
+    }
+
+    void Update(const void *data, size_t size)
+    {
+        if (!m_Tree)
+        {
+            HashUpdate(&m_Root, data, size);
+            return;
+        }
+
+        const char *p = (const char *)data;
+        while (size > 0)
+        {
+            size_t n = std::min(size, size_t(kTreeHashChunkSize - m_ChunkBytes));
+            HashUpdate(&m_Chunk, p, n);
+            m_ChunkBytes += n;
+            p += n;
+            size -= n;
+
+            if (m_ChunkBytes == kTreeHashChunkSize)
+                FlushChunk();
+        }
+    }
+
+    void FlushChunk()
+    {
+        HashDigest chunk_digest;
+        HashFinalize(&m_Chunk, &chunk_digest);
+        HashAddHashDigest(&m_Root, chunk_digest);
+        HashInit(&m_Chunk);
+        m_ChunkBytes = 0;
+    }
+
+    void Finalize(HashDigest *digest)
+    {
+        if (m_Tree && m_ChunkBytes > 0)
+            FlushChunk();
+        HashFinalize(&m_Root, digest);
+    }
+};
+
+#if defined(TUNDRA_UNIX)
+// Produces the same digest as ContentHasher, with the chunks spread over a few
+// threads. Chunks are handed out in windows so the digests fit on the stack.
+static void HashMappedTree(const char *data, uint64_t size, HashDigest *digest_out)
+{
+    const int32_t kWindowChunks = 32;
+    HashDigest chunk_digests[kWindowChunks];
+
+    HashState root;
+    HashInit(&root);
+    HashAddInteger(&root, size);
+
+    for (uint64_t window = 0; window < size; window += uint64_t(kWindowChunks) * kTreeHashChunkSize)
+    {
+        const char *window_data = data + window;
+        uint64_t window_size = std::min(size - window, uint64_t(kWindowChunks) * kTreeHashChunkSize);
+        int32_t chunk_count = int32_t((window_size + kTreeHashChunkSize - 1) / kTreeHashChunkSize);
+
+        int thread_count = ParallelForThreadCount(kMaxTreeHashThreads, chunk_count, 1);
+        ParallelFor(thread_count, chunk_count, 1, "Tree Hash", [&](int32_t start, int32_t end, int thread_index) {
+            for (int32_t index = start; index < end; ++index)
+            {
+                uint64_t offset = uint64_t(index) * kTreeHashChunkSize;
+                uint64_t chunk_size = std::min(window_size - offset, uint64_t(kTreeHashChunkSize));
+
+                HashState h;
+                HashInit(&h);
+                HashUpdate(&h, window_data + offset, chunk_size);
+                HashFinalize(&h, &chunk_digests[index]);
+            }
+            return true;
+        });
+
+        for (int32_t i = 0; i < chunk_count; ++i)
+            HashAddHashDigest(&root, chunk_digests[i]);
+    }
+
+    HashFinalize(&root, digest_out);
+}
+
+static bool HashFileContents(const char *filename, HashDigest *digest_out)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+    if (0 != fstat(fd, &st))
+    {
+        close(fd);
+        return false;
+    }
+
+    uint64_t size = (uint64_t)st.st_size;
+
+    if (size >= kMmapThreshold)
+    {
+        void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, size, MADV_SEQUENTIAL);
+            madvise(data, size, MADV_WILLNEED);
+
+            if (size >= kTreeHashThreshold)
+            {
+                HashMappedTree((const char *)data, size, digest_out);
+            }
+            else
+            {
+                HashState h;
+                HashInit(&h);
+                HashUpdate(&h, data, size);
+                HashFinalize(&h, digest_out);
+            }
+
+            munmap(data, size);
+            close(fd);
+            return true;
+        }
+    }
+
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    ContentHasher hasher;
+    hasher.Init(size);
+
+    char buffer[kReadBufferSize];
+    bool ok = true;
+    for (;;)
+    {
+        ssize_t nbytes = read(fd, buffer, sizeof buffer);
+        if (nbytes > 0)
+            hasher.Update(buffer, nbytes);
+        else if (nbytes == -1 && errno == EINTR)
+            continue;
+        else
+        {
+            ok = nbytes == 0;
+            break;
+        }
+    }
+    close(fd);
+
+    if (ok)
+        hasher.Finalize(digest_out);
+    return ok;
+}
+#else
+static bool HashFileContents(const char *filename, HashDigest *digest_out)
+{
+    FILE *f = OpenFile(filename, "rb");
+    if (!f)
+        return false;
+
+    // The tree layout depends on the size, so it has to be known up front.
+    fseek(f, 0, SEEK_END);
+    uint64_t size = (uint64_t)_ftelli64(f);
+    fseek(f, 0, SEEK_SET);
+
+    ContentHasher hasher;
+    hasher.Init(size);
+
+    char buffer[kReadBufferSize];
+    while (size_t nbytes = fread(buffer, 1, sizeof buffer, f))
+    {
+        hasher.Update(buffer, nbytes);
+    }
+    fclose(f);
+
+    hasher.Finalize(digest_out);
+    return true;
+}
+#endif
 
 HashDigest ComputeFileSignatureSha1(StatCache* stat_cache, DigestCache* digest_cache, const char* filename, uint32_t fn_hash)
 {
@@ -23,21 +247,9 @@ HashDigest ComputeFileSignatureSha1(StatCache* stat_cache, DigestCache* digest_c
     {
         TimingScope timing_scope(&g_Stats.m_FileDigestCount, &g_Stats.m_FileDigestTimeCycles);
 
-        FILE *f = OpenFile(filename, "rb");
-        if (!f)
-            return result;
-
-        HashState h;
-        HashInit(&h);
-
-        char buffer[8192];
-        while (size_t nbytes = fread(buffer, 1, sizeof buffer, f))
-        {
-            HashUpdate(&h, buffer, nbytes);
-        }
-        fclose(f);
+        if (!HashFileContents(filename, &result))
+            return HashDigest {};
 
-        HashFinalize(&h, &result);
         DigestCacheSet(digest_cache, filename, fn_hash, file_info.m_Timestamp, result);
     }
     else
@@ -47,6 +259,153 @@ HashDigest ComputeFileSignatureSha1(StatCache* stat_cache, DigestCache* digest_c
     return result;
 }
 
+// Reads the files candidates[reads[0..count)] through the ring in batches and hashes them. Files that can't be read that
+// way, or no longer have the size they were statted with, are hashed the usual way.
+static void HashFilesThroughRing(IoRing *ring, const FileAndHash *candidates, const uint64_t *sizes, const int *reads, int count, HashDigest *digests, bool *hashed, MemAllocHeap *heap)
+{
+    const char *paths[kIoRingEntries];
+    char *buffers[kIoRingEntries];
+    uint64_t batch_sizes[kIoRingEntries];
+    bool ok[kIoRingEntries];
+
+    for (int start = 0; start < count; start += kIoRingEntries)
+    {
+        int batch = std::min(count - start, (int)kIoRingEntries);
+
+        size_t total = 0;
+        for (int i = 0; i < batch; ++i)
+            total += sizes[reads[start + i]] + 1;
+        char *data = (char *)HeapAllocate(heap, total);
+
+        char *p = data;
+        for (int i = 0; i < batch; ++i)
+        {
+            int c = reads[start + i];
+            paths[i] = candidates[c].m_Filename;
+            buffers[i] = p;
+            batch_sizes[i] = sizes[c];
+            p += sizes[c] + 1;
+        }
+
+        IoRingReadMany(ring, paths, batch, buffers, batch_sizes, ok);
+
+        {
+            TimingScope timing_scope(nullptr, &g_Stats.m_FileDigestTimeCycles);
+            AtomicAdd32((int32_t *)&g_Stats.m_FileDigestCount, batch);
+
+            for (int i = 0; i < batch; ++i)
+            {
+                int c = reads[start + i];
+                if (ok[i])
+                {
+                    ContentHasher hasher;
+                    hasher.Init(batch_sizes[i]);
+                    hasher.Update(buffers[i], batch_sizes[i]);
+                    hasher.Finalize(&digests[c]);
+                    hashed[c] = true;
+                }
+                else
+                    hashed[c] = HashFileContents(paths[i], &digests[c]);
+            }
+        }
+
+        HeapFree(heap, data);
+    }
+}
+
+void ComputeFileSignaturesSha1(StatCache *stat_cache, DigestCache *digest_cache, const FileAndHash files[], int count, HashDigest digests_out[], MemAllocHeap *heap, IoRing *ring)
+{
+    if (count == 0)
+        return;
+
+    if (count == 1)
+    {
+        digests_out[0] = ComputeFileSignatureSha1(stat_cache, digest_cache, files[0].m_Filename, files[0].m_FilenameHash);
+        return;
+    }
+
+    if (ring != nullptr)
+        StatCacheStatMany(stat_cache, ring, files, count);
+
+    // Compact the regular files into the front of these arrays, remembering where each came from.
+    FileAndHash *candidates = HeapAllocateArray<FileAndHash>(heap, count);
+    uint64_t *timestamps = HeapAllocateArray<uint64_t>(heap, count);
+    uint64_t *sizes = HeapAllocateArray<uint64_t>(heap, count);
+    int *origin = HeapAllocateArray<int>(heap, count);
+    HashDigest *digests = HeapAllocateArray<HashDigest>(heap, count);
+    bool *found = HeapAllocateArray<bool>(heap, count);
+
+    int candidate_count = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        digests_out[i] = HashDigest {};
+
+        FileInfo file_info = StatCacheStat(stat_cache, files[i].m_Filename, files[i].m_FilenameHash);
+        if (!file_info.Exists() || !file_info.IsFile())
+            continue;
+
+        candidates[candidate_count] = files[i];
+        timestamps[candidate_count] = file_info.m_Timestamp;
+        sizes[candidate_count] = file_info.m_Size;
+        origin[candidate_count] = i;
+        ++candidate_count;
+    }
+
+    int hits = DigestCacheGetMany(digest_cache, candidate_count, candidates, timestamps, digests, found);
+    AtomicAdd32((int32_t *)&g_Stats.m_DigestCacheHits, hits);
+
+    // Hash the misses. With a ring the small ones are read in batches, each read being a round trip on a network drive.
+    bool *hashed = HeapAllocateArray<bool>(heap, count);
+    int *ring_reads = HeapAllocateArray<int>(heap, count);
+    int ring_read_count = 0;
+    for (int c = 0; c < candidate_count; ++c)
+    {
+        hashed[c] = false;
+        if (found[c])
+        {
+            digests_out[origin[c]] = digests[c];
+            continue;
+        }
+
+        if (ring != nullptr && sizes[c] < kReadBufferSize)
+        {
+            ring_reads[ring_read_count++] = c;
+            continue;
+        }
+
+        TimingScope timing_scope(&g_Stats.m_FileDigestCount, &g_Stats.m_FileDigestTimeCycles);
+        hashed[c] = HashFileContents(candidates[c].m_Filename, &digests[c]);
+    }
+
+    if (ring_read_count > 0)
+        HashFilesThroughRing(ring, candidates, sizes, ring_reads, ring_read_count, digests, hashed, heap);
+
+    // Compact the new digests in place for a single cache update.
+    int miss_count = 0;
+    for (int c = 0; c < candidate_count; ++c)
+    {
+        if (!hashed[c])
+            continue;
+
+        digests_out[origin[c]] = digests[c];
+        candidates[miss_count] = candidates[c];
+        timestamps[miss_count] = timestamps[c];
+        digests[miss_count] = digests[c];
+        ++miss_count;
+    }
+
+    DigestCacheSetMany(digest_cache, miss_count, candidates, timestamps, digests);
+
+    HeapFree(heap, ring_reads);
+    HeapFree(heap, hashed);
+    HeapFree(heap, found);
+    HeapFree(heap, digests);
+    HeapFree(heap, origin);
+    HeapFree(heap, sizes);
+    HeapFree(heap, timestamps);
+    HeapFree(heap, candidates);
+}
+
 static void ComputeFileSignatureSha1(HashState *state, StatCache *stat_cache, DigestCache *digest_cache, const char *filename, uint32_t fn_hash)
 {
     HashDigest digest = ComputeFileSignatureSha1(stat_cache, digest_cache, filename, fn_hash);
@@ -97,6 +456,56 @@ void ComputeFileSignature(
         ComputeFileSignatureTimestamp(out, stat_cache, filename, fn_hash);
 }
 
+void ComputeFileSignatures(
+    HashState *out,
+    StatCache *stat_cache,
+    DigestCache *digest_cache,
+    const FileAndHash files[],
+    int count,
+    const uint32_t sha_extension_hashes[],
+    int sha_extension_hash_count,
+    bool force_use_timestamp,
+    MemAllocHeap *heap,
+    IoRing *ring)
+{
+    if (ring != nullptr)
+        StatCacheStatMany(stat_cache, ring, files, count);
+
+    // Content digests are looked up and computed for the whole batch first, so the
+    // digest cache is locked once rather than once per file.
+    FileAndHash *sha_files = HeapAllocateArray<FileAndHash>(heap, count);
+    HashDigest *sha_digests = HeapAllocateArray<HashDigest>(heap, count);
+    int sha_count = 0;
+
+    if (!force_use_timestamp)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (ShouldUseSHA1SignatureFor(files[i].m_Filename, sha_extension_hashes, sha_extension_hash_count))
+                sha_files[sha_count++] = files[i];
+        }
+    }
+
+    ComputeFileSignaturesSha1(stat_cache, digest_cache, sha_files, sha_count, sha_digests, heap, ring);
+
+    int sha_index = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        HashAddPath(out, files[i].m_Filename);
+
+        if (sha_index < sha_count && sha_files[sha_index].m_Filename == files[i].m_Filename)
+        {
+            HashUpdate(out, &sha_digests[sha_index], sizeof(HashDigest));
+            ++sha_index;
+        }
+        else
+            ComputeFileSignatureTimestamp(out, stat_cache, files[i].m_Filename, files[i].m_FilenameHash);
+    }
+
+    HeapFree(heap, sha_digests);
+    HeapFree(heap, sha_files);
+}
+
 HashDigest CalculateGlobSignatureFor(const char *path, const char *filter, bool recurse, MemAllocHeap *heap, MemAllocLinear *scratch)
 {
     // Helper for directory iteration + memory allocation of strings.  We need to
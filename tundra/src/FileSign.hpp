@@ -8,6 +8,7 @@ struct StatCache;
 struct DigestCache;
 struct MemAllocHeap;
 struct MemAllocLinear;
+struct IoRing;
 
 void ComputeFileSignature(
     HashState *out, // out
@@ -19,7 +20,28 @@ void ComputeFileSignature(
     int sha_extension_hash_count,
     bool force_use_timestamp);
 
+// Add path and signature of each file to 'out', in order. Same result as calling
+// HashAddPath() and ComputeFileSignature() for every file, but content digests
+// are resolved as one batch. ring may be null; with one, the files are statted
+// and small ones read through it in batches.
+void ComputeFileSignatures(
+    HashState *out, // out
+    StatCache *stat_cache,
+    DigestCache *digest_cache,
+    const FileAndHash files[],
+    int count,
+    const uint32_t sha_extension_hashes[],
+    int sha_extension_hash_count,
+    bool force_use_timestamp,
+    MemAllocHeap *heap,
+    IoRing *ring);
+
 HashDigest ComputeFileSignatureSha1(StatCache* stat_cache, DigestCache* digest_cache, const char* filename, uint32_t fn_hash);
+
+// Content digests for a batch of files. Cache lookups and updates for the whole
+// batch each take the digest cache lock once. Missing files get a zero digest.
+// ring may be null, as above.
+void ComputeFileSignaturesSha1(StatCache *stat_cache, DigestCache *digest_cache, const FileAndHash files[], int count, HashDigest digests_out[], MemAllocHeap *heap, IoRing *ring);
 HashDigest CalculateGlobSignatureFor(const char *path, const char *filter, bool recurse, MemAllocHeap *heap, MemAllocLinear *scratch);
 
 bool ShouldUseSHA1SignatureFor(const char *filename, const uint32_t sha_extension_hashes[], int sha_extension_hash_count);
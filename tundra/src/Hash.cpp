@@ -9,6 +9,7 @@
 
 void HashInitImpl(HashStateImpl *impl);
 void HashBlock(const uint8_t *data, HashStateImpl *state, void *debug_file);
+void HashBlocks(const uint8_t *data, size_t count, HashStateImpl *state, void *debug_file);
 void HashFinalizeImpl(HashStateImpl *self, HashDigest *digest);
 
 void HashUpdate(HashState *self, const void *data_in, size_t size)
@@ -39,9 +40,11 @@ void HashUpdate(HashState *self, const void *data_in, size_t size)
         }
         else
         {
-            HashBlock(data, state, self->m_DebugFile);
-            data += sizeof self->m_Buffer;
-            remain -= sizeof self->m_Buffer;
+            // Hand all whole blocks over at once so the implementation can stay in its inner loop.
+            const size_t block_count = remain / sizeof self->m_Buffer;
+            HashBlocks(data, block_count, state, self->m_DebugFile);
+            data += block_count * sizeof self->m_Buffer;
+            remain -= block_count * sizeof self->m_Buffer;
         }
     }
 
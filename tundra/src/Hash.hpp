@@ -89,10 +89,17 @@ struct ALIGN(16) HashStateImpl
 
 #if ENABLED(USE_FAST_HASH)
 
+#if ENABLED(USE_FAST_HASH_XXH3)
+enum
+{
+    kTundraHashMagic = 0x7810221f
+};
+#else
 enum
 {
     kTundraHashMagic = 0x7810221e
 };
+#endif
 
 #pragma pack(push, 4)
 union HashDigest {
@@ -140,12 +147,39 @@ inline bool operator<(const HashDigest &lhs, const HashDigest &rhs)
     return CompareHashDigests(lhs, rhs) < 0;
 }
 
+#if ENABLED(USE_FAST_HASH_XXH3)
+// xxh3-style hashing state: eight 64-bit accumulators
+struct ALIGN(16) HashStateImpl
+{
+    uint64_t m_Acc[8];
+    uint64_t m_StripeCount;
+};
+
+// SIMD kernels for the accumulator loop. The best one the CPU supports is
+// selected at startup; all of them produce identical digests.
+enum HashKernel
+{
+    kHashKernelScalar,
+    kHashKernelSse2,
+    kHashKernelAvx2,
+    kHashKernelAvx512,
+    kHashKernelCount
+};
+
+// Switch to a particular kernel. Returns false if the CPU can't run it.
+bool HashSelectKernel(int kernel);
+
+int HashSelectedKernel();
+
+const char *HashKernelName(int kernel);
+#else
 // 4*xxhash hashing state
 struct ALIGN(16) HashStateImpl
 {
     uint32_t m_V[4][4];
 };
 #endif
+#endif
 
 struct ALIGN(16) HashState
 {
@@ -2,6 +2,15 @@
 
 #include <cstdio>
 #include <cctype>
+#include <cstring>
+
+#if ENABLED(USE_FAST_HASH) && ENABLED(USE_FAST_HASH_XXH3) && (defined(__x86_64__) || defined(_M_X64))
+#define TUNDRA_HASH_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
 
 #include "Banned.hpp"
 
@@ -13,6 +22,37 @@
 
 
 #if ENABLED(USE_FAST_HASH)
+static void DumpBlock(const uint8_t *block, size_t buffer_size, FILE *debug_file)
+{
+    const size_t line_size = 16;
+
+    for (size_t i = 0; i < buffer_size; i += line_size)
+    {
+        for (size_t x = 0; x < line_size; ++x)
+        {
+            int ch = block[x + i];
+            static const char hex[] = "0123456789ABCDEF";
+            fputc(hex[(ch & 0xf0) >> 4], debug_file);
+            fputc(hex[(ch & 0x0f)], debug_file);
+            fputc(' ', debug_file);
+        }
+
+        fputs(" | ", debug_file);
+
+        for (size_t x = 0; x < line_size; ++x)
+        {
+            int ch = block[x + i];
+            if (isalnum(ch) || ispunct(ch) || ' ' == ch)
+                fputc(ch, debug_file);
+            else
+                fputc('.', debug_file);
+        }
+        fputc('\n', debug_file);
+    }
+}
+#endif
+
+#if ENABLED(USE_FAST_HASH) && DISABLED(USE_FAST_HASH_XXH3)
 static const uint32_t kPrime32_1 = 2654435761U;
 static const uint32_t kPrime32_2 = 2246822519U;
 static const uint32_t kPrime32_3 = 3266489917U;
@@ -28,33 +68,7 @@ void HashBlock(const uint8_t *block, HashStateImpl *state, void *debug_file_)
     const size_t buffer_size = sizeof(HashState().m_Buffer);
 
     if (FILE *debug_file = (FILE *)debug_file_)
-    {
-        const size_t line_size = 16;
-
-        for (size_t i = 0; i < buffer_size; i += line_size)
-        {
-            for (size_t x = 0; x < line_size; ++x)
-            {
-                int ch = block[x + i];
-                static const char hex[] = "0123456789ABCDEF";
-                fputc(hex[(ch & 0xf0) >> 4], debug_file);
-                fputc(hex[(ch & 0x0f)], debug_file);
-                fputc(' ', debug_file);
-            }
-
-            fputs(" | ", debug_file);
-
-            for (size_t x = 0; x < line_size; ++x)
-            {
-                int ch = block[x + i];
-                if (isalnum(ch) || ispunct(ch) || ' ' == ch)
-                    fputc(ch, debug_file);
-                else
-                    fputc('.', debug_file);
-            }
-            fputc('\n', debug_file);
-        }
-    }
+        DumpBlock(block, buffer_size, debug_file);
 
     static_assert((buffer_size & 63) == 0, "buffer must be multiple of 64 bytes");
 
@@ -88,6 +102,12 @@ void HashBlock(const uint8_t *block, HashStateImpl *state, void *debug_file_)
     }
 }
 
+void HashBlocks(const uint8_t *data, size_t count, HashStateImpl *state, void *debug_file)
+{
+    for (size_t i = 0; i < count; ++i)
+        HashBlock(data + i * sizeof(HashState().m_Buffer), state, debug_file);
+}
+
 void HashInitImpl(HashStateImpl *self)
 {
     uint32_t seeds[4] = {0x89caf13a, 0x179fa534, 0x5199afcc, 0xef901315};
@@ -125,4 +145,381 @@ void HashFinalizeImpl(HashStateImpl *state, HashDigest *digest)
 
 #endif
 
+#if ENABLED(USE_FAST_HASH) && ENABLED(USE_FAST_HASH_XXH3)
+
+// This is a 128-bit hash in the style of XXH3 from the same project - https://github.com/Cyan4973/xxHash
+//
+// Every 64-byte block is one stripe that is mixed into eight 64-bit accumulators together with a
+// slice of a fixed secret, and every 16 stripes the accumulators are scrambled. It borrows the
+// structure of XXH3 but is not bit-compatible with it. The accumulator loop maps directly onto
+// SIMD lanes, so it comes in scalar, SSE2, AVX2 and AVX-512 flavours that give identical results.
+
+static const uint64_t kPrime32_1 = 0x9E3779B1U;
+static const uint64_t kPrime32_2 = 0x85EBCA77U;
+static const uint64_t kPrime32_3 = 0xC2B2AE3DU;
+static const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t kPrime64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t kPrime64_5 = 0x27D4EB2F165667C5ULL;
+
+enum
+{
+    kStripesPerScramble = 16,
+    kScrambleKeyOffset = 16
+};
+
+// Stripe n is keyed with words n..n+7, scrambling uses the last eight words.
+static const uint64_t ALIGN(64) kSecret[24] = {
+    0xa7bfdf70597b9ee9ull, 0x689e34371c94a691ull, 0xec41099001fa47f6ull, 0xead79cb2b00afaf3ull,
+    0x47b5740255677facull, 0x9649a28d3e326a00ull, 0x8302dd1a4cc84421ull, 0x94dbdda88b724c53ull,
+    0x489e1bbf5c2ef6fcull, 0x80b1c5630143fc8eull, 0xba05686a86767ae4ull, 0xdb3ead06d7b2e83cull,
+    0xfc2476ee427af88eull, 0x55c3fddf7ea1325full, 0x5112046e9b2f37a2ull, 0x9affb9885f2ae8b7ull,
+    0x77b31e6c9eeb8d6bull, 0x37f6681e9bfc86f9ull, 0xfee6a7a82672b68aull, 0x0680c69741cd850dull,
+    0x003dec94d8c63b7cull, 0x8418a940105c2044ull, 0xfd4451029fe77e98ull, 0x5f1be89d8140d642ull,
+};
+
+static inline uint64_t ReadLittleEndian64(const uint8_t *p)
+{
+#if ENABLED(USE_LITTLE_ENDIAN)
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+#else
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+#endif
+}
+
+static void AccumulateScalar(uint64_t *acc, const uint8_t *data, size_t stripe_count, uint64_t stripe_index)
+{
+    for (size_t s = 0; s < stripe_count; ++s, data += 64)
+    {
+        const uint64_t *key = kSecret + stripe_index % kStripesPerScramble;
+
+        for (int i = 0; i < 8; ++i)
+        {
+            uint64_t value = ReadLittleEndian64(data + i * 8);
+            uint64_t keyed = value ^ key[i];
+            acc[i ^ 1] += value;
+            acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+        }
+
+        if (++stripe_index % kStripesPerScramble == 0)
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                uint64_t a = acc[i];
+                a ^= a >> 47;
+                a ^= kSecret[kScrambleKeyOffset + i];
+                a *= kPrime32_1;
+                acc[i] = a;
+            }
+        }
+    }
+}
+
+#if defined(TUNDRA_HASH_SIMD)
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+static void AccumulateSse2(uint64_t *acc_out, const uint8_t *data, size_t stripe_count, uint64_t stripe_index)
+{
+    const __m128i prime = _mm_set1_epi32((int)kPrime32_1);
+    __m128i acc[4];
+
+    for (int i = 0; i < 4; ++i)
+        acc[i] = _mm_loadu_si128((const __m128i *)acc_out + i);
+
+    for (size_t s = 0; s < stripe_count; ++s, data += 64)
+    {
+        const __m128i *key = (const __m128i *)(kSecret + stripe_index % kStripesPerScramble);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            __m128i value = _mm_loadu_si128((const __m128i *)data + i);
+            __m128i keyed = _mm_xor_si128(value, _mm_loadu_si128(key + i));
+            __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+        }
+
+        if (++stripe_index % kStripesPerScramble == 0)
+        {
+            const __m128i *scramble_key = (const __m128i *)(kSecret + kScrambleKeyOffset);
+
+            for (int i = 0; i < 4; ++i)
+            {
+                __m128i a = acc[i];
+                a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+                a = _mm_xor_si128(a, _mm_loadu_si128(scramble_key + i));
+                __m128i lo = _mm_mul_epu32(a, prime);
+                __m128i hi = _mm_mul_epu32(_mm_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+                acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+            }
+        }
+    }
+
+    for (int i = 0; i < 4; ++i)
+        _mm_storeu_si128((__m128i *)acc_out + i, acc[i]);
+}
+
+TARGET_AVX2 static void AccumulateAvx2(uint64_t *acc_out, const uint8_t *data, size_t stripe_count, uint64_t stripe_index)
+{
+    const __m256i prime = _mm256_set1_epi32((int)kPrime32_1);
+    __m256i acc[2];
+
+    for (int i = 0; i < 2; ++i)
+        acc[i] = _mm256_loadu_si256((const __m256i *)acc_out + i);
+
+    for (size_t s = 0; s < stripe_count; ++s, data += 64)
+    {
+        const __m256i *key = (const __m256i *)(kSecret + stripe_index % kStripesPerScramble);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            __m256i value = _mm256_loadu_si256((const __m256i *)data + i);
+            __m256i keyed = _mm256_xor_si256(value, _mm256_loadu_si256(key + i));
+            __m256i product = _mm256_mul_epu32(keyed, _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+            acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(product, swapped));
+        }
+
+        if (++stripe_index % kStripesPerScramble == 0)
+        {
+            const __m256i *scramble_key = (const __m256i *)(kSecret + kScrambleKeyOffset);
+
+            for (int i = 0; i < 2; ++i)
+            {
+                __m256i a = acc[i];
+                a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+                a = _mm256_xor_si256(a, _mm256_loadu_si256(scramble_key + i));
+                __m256i lo = _mm256_mul_epu32(a, prime);
+                __m256i hi = _mm256_mul_epu32(_mm256_shuffle_epi32(a, _MM_SHUFFLE(0, 3, 0, 1)), prime);
+                acc[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+            }
+        }
+    }
+
+    for (int i = 0; i < 2; ++i)
+        _mm256_storeu_si256((__m256i *)acc_out + i, acc[i]);
+}
+
+// GCC's unmasked forms of these start from an undefined register, which -Wmaybe-uninitialized reports once inlined. With
+// every lane selected, the zero masked forms are the same instructions.
+static const __mmask16 kAllLanes32 = 0xffff;
+static const __mmask8 kAllLanes64 = 0xff;
+
+TARGET_AVX512 static void AccumulateAvx512(uint64_t *acc_out, const uint8_t *data, size_t stripe_count, uint64_t stripe_index)
+{
+    const __m512i prime = _mm512_set1_epi32((int)kPrime32_1);
+    __m512i acc = _mm512_loadu_si512(acc_out);
+
+    for (size_t s = 0; s < stripe_count; ++s, data += 64)
+    {
+        const uint64_t *key = kSecret + stripe_index % kStripesPerScramble;
+
+        __m512i value = _mm512_loadu_si512(data);
+        __m512i keyed = _mm512_xor_si512(value, _mm512_loadu_si512(key));
+        __m512i keyed_high = _mm512_maskz_shuffle_epi32(kAllLanes32, keyed, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 3, 0, 1));
+        __m512i product = _mm512_maskz_mul_epu32(kAllLanes64, keyed, keyed_high);
+        __m512i swapped = _mm512_maskz_shuffle_epi32(kAllLanes32, value, (_MM_PERM_ENUM)_MM_SHUFFLE(1, 0, 3, 2));
+        acc = _mm512_add_epi64(acc, _mm512_add_epi64(product, swapped));
+
+        if (++stripe_index % kStripesPerScramble == 0)
+        {
+            acc = _mm512_xor_si512(acc, _mm512_maskz_srli_epi64(kAllLanes64, acc, 47));
+            acc = _mm512_xor_si512(acc, _mm512_loadu_si512(kSecret + kScrambleKeyOffset));
+            __m512i lo = _mm512_maskz_mul_epu32(kAllLanes64, acc, prime);
+            __m512i acc_high = _mm512_maskz_shuffle_epi32(kAllLanes32, acc, (_MM_PERM_ENUM)_MM_SHUFFLE(0, 3, 0, 1));
+            __m512i hi = _mm512_maskz_mul_epu32(kAllLanes64, acc_high, prime);
+            acc = _mm512_add_epi64(lo, _mm512_maskz_slli_epi64(kAllLanes64, hi, 32));
+        }
+    }
+
+    _mm512_storeu_si512(acc_out, acc);
+}
+
+#endif
+
+static bool CpuSupportsKernel(int kernel)
+{
+    switch (kernel)
+    {
+    case kHashKernelScalar:
+        return true;
+#if defined(TUNDRA_HASH_SIMD)
+    case kHashKernelSse2:
+        return true;
+#if defined(_MSC_VER)
+    case kHashKernelAvx2:
+    case kHashKernelAvx512:
+    {
+        int regs[4];
+        __cpuid(regs, 0);
+        if (regs[0] < 7)
+            return false;
+        __cpuid(regs, 1);
+        const bool os_saves_ymm = 0 != (regs[2] & (1 << 27));
+        if (!os_saves_ymm)
+            return false;
+        const uint64_t xcr0 = _xgetbv(0);
+        __cpuidex(regs, 7, 0);
+        if (kernel == kHashKernelAvx2)
+            return (xcr0 & 0x6) == 0x6 && 0 != (regs[1] & (1 << 5));
+        return (xcr0 & 0xe6) == 0xe6 && 0 != (regs[1] & (1 << 16));
+    }
+#else
+    case kHashKernelAvx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    case kHashKernelAvx512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f");
+#endif
+#endif
+    default:
+        return false;
+    }
+}
+
+typedef void (*AccumulateFunc)(uint64_t *acc, const uint8_t *data, size_t stripe_count, uint64_t stripe_index);
 
+static const struct
+{
+    const char *m_Name;
+    AccumulateFunc m_Accumulate;
+} s_Kernels[kHashKernelCount] = {
+    {"scalar", AccumulateScalar},
+#if defined(TUNDRA_HASH_SIMD)
+    {"sse2", AccumulateSse2},
+    {"avx2", AccumulateAvx2},
+    {"avx512", AccumulateAvx512},
+#else
+    {"sse2", AccumulateScalar},
+    {"avx2", AccumulateScalar},
+    {"avx512", AccumulateScalar},
+#endif
+};
+
+static int SelectBestKernel()
+{
+    for (int kernel = kHashKernelCount - 1; kernel > kHashKernelScalar; --kernel)
+    {
+        if (CpuSupportsKernel(kernel))
+            return kernel;
+    }
+    return kHashKernelScalar;
+}
+
+// Picked during static initialization, before any hashing happens.
+static int s_Kernel = SelectBestKernel();
+static AccumulateFunc s_Accumulate = s_Kernels[s_Kernel].m_Accumulate;
+
+bool HashSelectKernel(int kernel)
+{
+    if (kernel < 0 || kernel >= kHashKernelCount || !CpuSupportsKernel(kernel))
+        return false;
+
+    s_Kernel = kernel;
+    s_Accumulate = s_Kernels[kernel].m_Accumulate;
+    return true;
+}
+
+int HashSelectedKernel()
+{
+    return s_Kernel;
+}
+
+const char *HashKernelName(int kernel)
+{
+    if (kernel < 0 || kernel >= kHashKernelCount)
+        return "unknown";
+    return s_Kernels[kernel].m_Name;
+}
+
+void HashBlock(const uint8_t *block, HashStateImpl *state, void *debug_file_)
+{
+    if (FILE *debug_file = (FILE *)debug_file_)
+        DumpBlock(block, sizeof(HashState().m_Buffer), debug_file);
+
+    static_assert(sizeof(HashState().m_Buffer) == 64, "one block must be one stripe");
+
+    s_Accumulate(state->m_Acc, block, 1, state->m_StripeCount);
+    state->m_StripeCount += 1;
+}
+
+void HashBlocks(const uint8_t *data, size_t count, HashStateImpl *state, void *debug_file_)
+{
+    if (FILE *debug_file = (FILE *)debug_file_)
+    {
+        for (size_t i = 0; i < count; ++i)
+            DumpBlock(data + i * 64, 64, debug_file);
+    }
+
+    s_Accumulate(state->m_Acc, data, count, state->m_StripeCount);
+    state->m_StripeCount += count;
+}
+
+void HashInitImpl(HashStateImpl *self)
+{
+    const uint64_t init[8] = {kPrime32_3, kPrime64_1, kPrime64_2, kPrime64_3, kPrime64_4, kPrime32_2, kPrime64_5, kPrime32_1};
+
+    for (int i = 0; i < 8; ++i)
+        self->m_Acc[i] = init[i];
+    self->m_StripeCount = 0;
+}
+
+// 64x64->128 bit multiply, folded back to 64 bits.
+static inline uint64_t MultiplyFold64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t hi;
+    uint64_t lo = _umul128(a, b, &hi);
+    return lo ^ hi;
+#else
+    const uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+    const uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+    const uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+    const uint64_t hi_hi = (a >> 32) * (b >> 32);
+    const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+    const uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    const uint64_t lower = (cross << 32) | (lo_lo & 0xffffffff);
+    return lower ^ upper;
+#endif
+}
+
+static uint64_t MergeAccumulators(const uint64_t *acc, const uint64_t *key, uint64_t start)
+{
+    uint64_t result = start;
+
+    for (int i = 0; i < 4; ++i)
+        result += MultiplyFold64(acc[2 * i] ^ key[2 * i], acc[2 * i + 1] ^ key[2 * i + 1]);
+
+    // Final avalanche
+    result ^= result >> 37;
+    result *= 0x165667919E3779F9ULL;
+    result ^= result >> 32;
+    return result;
+}
+
+void HashFinalizeImpl(HashStateImpl *state, HashDigest *digest)
+{
+    const uint64_t length = state->m_StripeCount * 64;
+
+    digest->m_Words64[0] = MergeAccumulators(state->m_Acc, kSecret + 1, length * kPrime64_1);
+    digest->m_Words64[1] = MergeAccumulators(state->m_Acc, kSecret + 9, ~(length * kPrime64_2));
+}
+
+#endif
@@ -63,6 +63,12 @@ void HashBlock(const uint8_t *block, HashStateImpl *state, void *debug_file_)
     state->m_State[4] += e;
 }
 
+void HashBlocks(const uint8_t *data, size_t count, HashStateImpl *state, void *debug_file)
+{
+    for (size_t i = 0; i < count; ++i)
+        HashBlock(data + i * 64, state, debug_file);
+}
+
 void HashInitImpl(HashStateImpl *self)
 {
     self->m_State[0] = 0x67452301;
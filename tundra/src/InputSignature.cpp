@@ -337,20 +337,31 @@ static bool CalculateInputSignature(BuildQueue* queue, ThreadState* thread_state
     // Roll back scratch allocator after all file scans
     MemAllocLinearScope alloc_scope(&thread_state->m_ScratchAlloc);
 
-    for (const FrozenFileAndHash &input : dagnode->m_InputFiles)
+    MemAllocHeap *heap = &thread_state->m_LocalHeap;
+
+    // Add path and timestamp of every direct input file.
+    int input_count = dagnode->m_InputFiles.GetCount();
+    FileAndHash *inputs = HeapAllocateArray<FileAndHash>(heap, input_count);
+    for (int i = 0; i < input_count; ++i)
     {
-        // Add path and timestamp of every direct input file.
-        HashAddPath(&sighash, input.m_Filename);
-        ComputeFileSignature(
-            &sighash,
-            stat_cache,
-            digest_cache,
-            input.m_Filename,
-            input.m_FilenameHash,
-            config.m_ShaDigestExtensions,
-            config.m_ShaDigestExtensionCount,
-            force_use_timestamp);
+        inputs[i].m_Filename = dagnode->m_InputFiles[i].m_Filename;
+        inputs[i].m_FilenameHash = dagnode->m_InputFiles[i].m_FilenameHash;
+    }
+    ComputeFileSignatures(
+        &sighash,
+        stat_cache,
+        digest_cache,
+        inputs,
+        input_count,
+        config.m_ShaDigestExtensions,
+        config.m_ShaDigestExtensionCount,
+        force_use_timestamp,
+        heap,
+        thread_state->m_IoRing);
+    HeapFree(heap, inputs);
 
+    for (const FrozenFileAndHash &input : dagnode->m_InputFiles)
+    {
         if (scanner)
         {
             ScanInput scan_input;
@@ -379,18 +390,26 @@ static bool CalculateInputSignature(BuildQueue* queue, ThreadState* thread_state
     {
         // Add path and timestamp of every indirect input file (#includes).
         // This will walk all the implicit dependencies in hash order.
+        int implicit_count = (int)node->m_ImplicitInputs.m_RecordCount;
+        FileAndHash *implicit_inputs = HeapAllocateArray<FileAndHash>(heap, implicit_count);
+        int next = 0;
         HashSetWalk(&node->m_ImplicitInputs, [&](uint32_t, uint32_t hash, const char *filename) {
-            HashAddPath(&sighash, filename);
-            ComputeFileSignature(
-                &sighash,
-                stat_cache,
-                digest_cache,
-                filename,
-                hash,
-                config.m_ShaDigestExtensions,
-                config.m_ShaDigestExtensionCount,
-                force_use_timestamp);
+            implicit_inputs[next].m_Filename = filename;
+            implicit_inputs[next].m_FilenameHash = hash;
+            ++next;
         });
+        ComputeFileSignatures(
+            &sighash,
+            stat_cache,
+            digest_cache,
+            implicit_inputs,
+            implicit_count,
+            config.m_ShaDigestExtensions,
+            config.m_ShaDigestExtensionCount,
+            force_use_timestamp,
+            heap,
+            thread_state->m_IoRing);
+        HeapFree(heap, implicit_inputs);
     }
 
     HashAddInteger(&sighash, (uint8_t)dagnode->m_FlagsAndActionType & Frozen::DagNode::kFlagActionTypeMask);
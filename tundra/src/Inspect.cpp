@@ -6,6 +6,7 @@
 #include "MemoryMappedFile.hpp"
 #include "Inspect.hpp"
 #include "Actions.hpp"
+#include "MemAllocHeap.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -161,6 +162,8 @@ static void DumpDag(const Frozen::Dag *data)
             printf("    %s = %" PRId64 "\n", fileSig.m_Path.Get(),  fileSig.m_Timestamp);
         }
 
+        printf("  cpu weight: %u\n", node.m_CpuWeight);
+        printf("  memory weight: %u MB\n", node.m_MemoryWeightMB);
         printf("  scannerIndex: %d\n", node.m_ScannerIndex);
         if (node.m_ScannerIndex != -1)
         {
@@ -249,21 +252,33 @@ static void DumpDag(const Frozen::Dag *data)
     printf("Magic number at end: 0x%08x\n", data->m_MagicNumberEnd);
 }
 
-static void DumpState(const Frozen::AllBuiltNodes *data)
+// Shows the state as the next build would see it, with the journal of later builds applied.
+static void DumpState(const Frozen::AllBuiltNodes *data, const char *filename)
 {
-    int node_count = data->m_NodeCount;
+    MemAllocHeap heap;
+    HeapInit(&heap);
+
+    char journal_fn[kMaxPathLength];
+    snprintf(journal_fn, sizeof journal_fn, "%s.journal", filename);
+    BuiltNodesJournal journal;
+    BuiltNodesJournalLoad(&journal, data, journal_fn, &heap);
+
+    int node_count = journal.m_NodeCount;
     printf("magic number: 0x%08x\n", data->m_MagicNumber);
     printf("node count: %u\n", node_count);
+    printf("journal node records: %d\n", journal.m_RecordCount);
     for (int i = 0; i < node_count; ++i)
     {
         printf("node %d:\n", i);
         char digest_str[kDigestStringSize];
 
-        const Frozen::BuiltNode &node = data->m_BuiltNodes[i];
+        const Frozen::BuiltNode &node = *journal.m_BuiltNodes[i];
 
-        DigestToString(digest_str, data->m_NodeGuids[i]);
+        DigestToString(digest_str, journal.m_NodeGuids[i]);
         printf("  guid: %s\n", digest_str);
         printf("  m_Result: %d\n", node.m_Result);
+        printf("  execution time: %u ms\n", node.m_ExecutionTimeMs);
+        printf("  peak memory: %u MB\n", node.m_PeakMemoryMB);
         DigestToString(digest_str, node.m_InputSignature);
         printf("  input_signature: %s\n", digest_str);
         DigestToString(digest_str, node.m_LeafInputSignature);
@@ -288,6 +303,9 @@ static void DumpState(const Frozen::AllBuiltNodes *data)
 
         printf("\n");
     }
+
+    BuiltNodesJournalDestroy(&journal, &heap);
+    HeapDestroy(&heap);
 }
 
 static void DumpScanCache(const Frozen::ScanData *data)
@@ -375,7 +393,7 @@ int inspect(int num_files, char *files[])
                 const Frozen::AllBuiltNodes *data = (const Frozen::AllBuiltNodes *)f.m_Address;
                 if (data->m_MagicNumber == Frozen::AllBuiltNodes::MagicNumber)
                 {
-                    DumpState(data);
+                    DumpState(data, fn);
                 }
                 else
                 {
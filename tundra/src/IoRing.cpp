@@ -0,0 +1,334 @@
+#include "IoRing.hpp"
+#include "FileInfo.hpp"
+#include "MemAllocHeap.hpp"
+#include "Stats.hpp"
+
+#if defined(TUNDRA_LINUX)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#endif
+
+#include <algorithm>
+
+#include "Banned.hpp"
+
+#if defined(TUNDRA_LINUX) && defined(__NR_io_uring_setup)
+
+// There is no liburing here, the ring is driven with the raw system calls. Every batch is submitted from the front of
+// the submission queue and waited for completely, so the rings never hold more than one batch.
+struct IoRing
+{
+    MemAllocHeap *m_Heap;
+    int m_Fd;
+    uint32_t m_Entries;
+
+    // Set when the kernel stopped taking submissions. The ring is out of step then and isn't used again.
+    bool m_Failed;
+
+    void *m_SqMap;
+    size_t m_SqMapSize;
+    void *m_CqMap;
+    size_t m_CqMapSize;
+    io_uring_sqe *m_Sqes;
+    size_t m_SqesSize;
+
+    uint32_t *m_SqTail;
+    uint32_t m_SqMask;
+    uint32_t *m_SqArray;
+    uint32_t *m_CqHead;
+    uint32_t *m_CqTail;
+    uint32_t m_CqMask;
+    io_uring_cqe *m_Cqes;
+
+    int32_t *m_Results;
+    struct statx *m_StatBuffers;
+};
+
+static bool SupportsOperations(int fd, MemAllocHeap *heap)
+{
+    const uint8_t required[] = { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+
+    size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    io_uring_probe *probe = (io_uring_probe *)HeapAllocate(heap, probe_size);
+    memset(probe, 0, probe_size);
+
+    // Kernels that can't be probed predate all of these.
+    bool supported = 0 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256);
+    for (uint8_t op : required)
+        supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+
+    HeapFree(heap, probe);
+    return supported;
+}
+
+IoRing *IoRingCreate(MemAllocHeap *heap)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, kIoRingEntries, &params);
+    if (fd < 0)
+        return nullptr;
+
+    if (!SupportsOperations(fd, heap))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    IoRing *ring = (IoRing *)HeapAllocate(heap, sizeof(IoRing));
+    memset(ring, 0, sizeof(IoRing));
+    ring->m_Heap = heap;
+    ring->m_Fd = fd;
+    ring->m_Entries = params.sq_entries;
+
+    ring->m_SqMapSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->m_CqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_map = 0 != (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (single_map)
+        ring->m_SqMapSize = ring->m_CqMapSize = std::max(ring->m_SqMapSize, ring->m_CqMapSize);
+    ring->m_SqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->m_SqMap = mmap(nullptr, ring->m_SqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->m_CqMap = single_map ? ring->m_SqMap : mmap(nullptr, ring->m_CqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(nullptr, ring->m_SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (ring->m_SqMap == MAP_FAILED || ring->m_CqMap == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, ring->m_SqesSize);
+        if (!single_map && ring->m_CqMap != MAP_FAILED)
+            munmap(ring->m_CqMap, ring->m_CqMapSize);
+        if (ring->m_SqMap != MAP_FAILED)
+            munmap(ring->m_SqMap, ring->m_SqMapSize);
+        close(fd);
+        HeapFree(heap, ring);
+        return nullptr;
+    }
+
+    char *sq = (char *)ring->m_SqMap;
+    char *cq = (char *)ring->m_CqMap;
+    ring->m_Sqes = (io_uring_sqe *)sqes;
+    ring->m_SqTail = (uint32_t *)(sq + params.sq_off.tail);
+    ring->m_SqMask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->m_SqArray = (uint32_t *)(sq + params.sq_off.array);
+    ring->m_CqHead = (uint32_t *)(cq + params.cq_off.head);
+    ring->m_CqTail = (uint32_t *)(cq + params.cq_off.tail);
+    ring->m_CqMask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->m_Cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->m_Results = HeapAllocateArray<int32_t>(heap, ring->m_Entries);
+    ring->m_StatBuffers = HeapAllocateArray<struct statx>(heap, ring->m_Entries);
+    return ring;
+}
+
+void IoRingDestroy(IoRing *ring)
+{
+    if (ring == nullptr)
+        return;
+
+    MemAllocHeap *heap = ring->m_Heap;
+    munmap(ring->m_Sqes, ring->m_SqesSize);
+    if (ring->m_CqMap != ring->m_SqMap)
+        munmap(ring->m_CqMap, ring->m_CqMapSize);
+    munmap(ring->m_SqMap, ring->m_SqMapSize);
+    close(ring->m_Fd);
+    HeapFree(heap, ring->m_StatBuffers);
+    HeapFree(heap, ring->m_Results);
+    HeapFree(heap, ring);
+}
+
+static io_uring_sqe *PrepareEntry(IoRing *ring, int index, uint8_t opcode, int fd, const void *addr, uint32_t len, uint64_t offset)
+{
+    io_uring_sqe *sqe = &ring->m_Sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t)index;
+    return sqe;
+}
+
+// Moves whatever is in the completion queue into m_Results. Returns how many entries that was.
+static int ReapCompletions(IoRing *ring)
+{
+    uint32_t head = *ring->m_CqHead;
+    uint32_t cq_tail = __atomic_load_n(ring->m_CqTail, __ATOMIC_ACQUIRE);
+    int reaped = 0;
+    for (; head != cq_tail; ++head, ++reaped)
+    {
+        const io_uring_cqe &cqe = ring->m_Cqes[head & ring->m_CqMask];
+        ring->m_Results[cqe.user_data] = cqe.res;
+    }
+    __atomic_store_n(ring->m_CqHead, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+// Submits the entries m_Sqes[0..count) and waits for all of them. Their results, or -errno, end up in m_Results.
+// Returns false if the kernel didn't take them all; those it didn't take are -ECANCELED then.
+static bool SubmitAndWait(IoRing *ring, int count)
+{
+    TimingScope timing_scope(&g_Stats.m_IoRingBatchCount, &g_Stats.m_IoRingTimeCycles);
+
+    for (int i = 0; i < count; ++i)
+        ring->m_Results[i] = -ECANCELED;
+
+    if (ring->m_Failed)
+        return false;
+
+    uint32_t tail = *ring->m_SqTail;
+    for (int i = 0; i < count; ++i)
+        ring->m_SqArray[(tail + i) & ring->m_SqMask] = (uint32_t)i;
+    __atomic_store_n(ring->m_SqTail, tail + count, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    int completed = 0;
+    while (completed < count)
+    {
+        long rc = syscall(__NR_io_uring_enter, ring->m_Fd, count - submitted, count - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (rc < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+
+            // What the kernel already took is still in flight and writes into the caller's buffers, so it has to
+            // finish before they're handed back. Completions are posted to the shared ring without entering the
+            // kernel; yielding runs any work the kernel queued for this thread.
+            ring->m_Failed = true;
+            completed += ReapCompletions(ring);
+            while (completed < submitted)
+            {
+                sched_yield();
+                completed += ReapCompletions(ring);
+            }
+            return false;
+        }
+        submitted += (int)rc;
+        completed += ReapCompletions(ring);
+    }
+    return true;
+}
+
+void IoRingStatMany(IoRing *ring, const char *const *paths, int count, FileInfo *out)
+{
+    for (int start = 0; start < count; start += ring->m_Entries)
+    {
+        int batch = std::min(count - start, (int)ring->m_Entries);
+        for (int i = 0; i < batch; ++i)
+        {
+            io_uring_sqe *sqe = PrepareEntry(ring, i, IORING_OP_STATX, AT_FDCWD, paths[start + i], STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_SIZE, (uint64_t)(uintptr_t)&ring->m_StatBuffers[i]);
+            sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        }
+        SubmitAndWait(ring, batch);
+        AtomicAdd32((int32_t *)&g_Stats.m_IoRingStatCount, batch);
+
+        for (int i = 0; i < batch; ++i)
+        {
+            const struct statx &st = ring->m_StatBuffers[i];
+            FileInfo &info = out[start + i];
+            if (ring->m_Results[i] == 0)
+            {
+                info = FileInfoFromStat(st.stx_mode, st.stx_mtime.tv_sec * 1000000000ull + st.stx_mtime.tv_nsec, st.stx_size);
+            }
+            else if (ring->m_Results[i] == -ENOENT)
+            {
+                info.m_Flags = 0;
+                info.m_Size = 0;
+                info.m_Timestamp = 0;
+            }
+            else
+            {
+                // Let the usual path decide what to make of anything unexpected.
+                info = GetFileInfo(paths[start + i]);
+            }
+        }
+    }
+}
+
+void IoRingReadMany(IoRing *ring, const char *const *paths, int count, char *const *buffers, const uint64_t *sizes, bool *out_ok)
+{
+    int fds[kIoRingEntries];
+    int slot_files[kIoRingEntries];
+
+    for (int start = 0; start < count; start += ring->m_Entries)
+    {
+        int batch = std::min(count - start, std::min((int)ring->m_Entries, (int)kIoRingEntries));
+
+        for (int i = 0; i < batch; ++i)
+        {
+            io_uring_sqe *sqe = PrepareEntry(ring, i, IORING_OP_OPENAT, AT_FDCWD, paths[start + i], 0, 0);
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+        SubmitAndWait(ring, batch);
+
+        // Only the files that opened are read and closed, slot_files maps the entries back to them.
+        int open_count = 0;
+        for (int i = 0; i < batch; ++i)
+        {
+            fds[i] = ring->m_Results[i];
+            out_ok[start + i] = false;
+            if (fds[i] < 0)
+                continue;
+            PrepareEntry(ring, open_count, IORING_OP_READ, fds[i], buffers[start + i], (uint32_t)(sizes[start + i] + 1), 0);
+            slot_files[open_count++] = i;
+        }
+        if (open_count == 0)
+            continue;
+
+        SubmitAndWait(ring, open_count);
+        AtomicAdd32((int32_t *)&g_Stats.m_IoRingReadCount, open_count);
+        for (int slot = 0; slot < open_count; ++slot)
+        {
+            int i = slot_files[slot];
+            out_ok[start + i] = ring->m_Results[slot] >= 0 && (uint64_t)ring->m_Results[slot] == sizes[start + i];
+        }
+
+        for (int slot = 0; slot < open_count; ++slot)
+            PrepareEntry(ring, slot, IORING_OP_CLOSE, fds[slot_files[slot]], nullptr, 0, 0);
+        SubmitAndWait(ring, open_count);
+        for (int slot = 0; slot < open_count; ++slot)
+        {
+            // A close that didn't happen is done the usual way; a failed one still released the descriptor.
+            if (ring->m_Results[slot] == -ECANCELED || ring->m_Results[slot] == -EINVAL)
+                close(fds[slot_files[slot]]);
+        }
+    }
+}
+
+#else
+
+struct IoRing
+{
+};
+
+IoRing *IoRingCreate(MemAllocHeap *heap)
+{
+    return nullptr;
+}
+
+void IoRingDestroy(IoRing *ring)
+{
+}
+
+void IoRingStatMany(IoRing *ring, const char *const *paths, int count, FileInfo *out)
+{
+    for (int i = 0; i < count; ++i)
+        out[i] = GetFileInfo(paths[i]);
+}
+
+void IoRingReadMany(IoRing *ring, const char *const *paths, int count, char *const *buffers, const uint64_t *sizes, bool *out_ok)
+{
+    for (int i = 0; i < count; ++i)
+        out_ok[i] = false;
+}
+
+#endif
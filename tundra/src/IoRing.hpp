@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Common.hpp"
+
+struct FileInfo;
+struct MemAllocHeap;
+
+// Submits file system calls to the kernel in batches through io_uring, so that hundreds of stats or reads are in flight
+// at once instead of one per thread. On a network file system the round trips are what a no-op build spends its time
+// on. A ring is used by one thread at a time.
+struct IoRing;
+
+enum
+{
+    // Calls submitted in one go.
+    kIoRingEntries = 256
+};
+
+// Returns null where io_uring is not available: on other platforms, on kernels without it, or when it is disabled by
+// policy. Callers then make the calls one at a time.
+IoRing *IoRingCreate(MemAllocHeap *heap);
+
+void IoRingDestroy(IoRing *ring);
+
+// Same as calling GetFileInfo() for each of paths[0..count).
+void IoRingStatMany(IoRing *ring, const char *const *paths, int count, FileInfo *out);
+
+// Reads the files paths[0..count), which are expected to be sizes[i] bytes, into buffers[i]. Those must have room for
+// sizes[i] + 1 bytes, so a file that grew is noticed. Sets out_ok[i] if the file could be read and was the expected size.
+void IoRingReadMany(IoRing *ring, const char *const *paths, int count, char *const *buffers, const uint64_t *sizes, bool *out_ok);
@@ -1,11 +1,23 @@
 #include "JsonParse.hpp"
 #include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include "Buffer.hpp"
+#include "ParallelFor.hpp"
 #include "Stats.hpp"
 
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TUNDRA_JSON_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
 
 #include "Banned.hpp"
 
@@ -58,85 +70,718 @@ static const JsonLexeme s_ErrorLexeme = {kJsonLexError, {0}};
 static const JsonLexeme s_TrueLexeme = {kJsonLexBoolean, {true}};
 static const JsonLexeme s_FalseLexeme = {kJsonLexBoolean, {false}};
 
+// Structural scan.
+//
+// Rather than looking at the document a character at a time, the lexer works
+// off an index of the positions it has to look at, in the style of simdjson.
+// The buffer is classified 64 bytes at a time into bit masks (quotes,
+// backslashes, whitespace, brackets and separators), from which branch-free
+// bit arithmetic works out which quotes are escaped and which bytes are inside
+// strings. What remains is every unescaped quote, every structural character
+// outside of strings, and the first character of every number or literal.
+// Whitespace and string contents are never visited by the lexer. Newlines are
+// only kept as a mask per window, and counted when a line number is needed.
+//
+// The classification has scalar, SSE2 and AVX2 kernels which produce identical
+// masks; the best one the CPU supports is picked at startup. The scalar kernel
+// is slower than just looking at every character, so with it the lexer walks
+// the buffer directly, and the masks are only used to build the index for
+// JsonParseParallel().
+
+enum
+{
+    kJsonScanBlockSize = 64,
+    kJsonScanWindowBlocks = 64,
+    kJsonScanWindowSize = kJsonScanBlockSize * kJsonScanWindowBlocks
+};
+
+struct JsonScanMasks
+{
+    uint64_t m_Backslash;
+    uint64_t m_Quote;
+    uint64_t m_Whitespace;
+    uint64_t m_Newline;
+    uint64_t m_Open;
+    uint64_t m_Close;
+    uint64_t m_Separator;
+};
+
+// Carried from one block to the next.
+struct JsonScanState
+{
+    uint64_t m_PrevEscaped;  // 1 if the first byte of the next block is escaped
+    uint64_t m_PrevInString; // all ones if the next block starts inside a string
+    uint64_t m_PrevScalar;   // 1 if the last byte was part of a number or literal
+};
+
+static void JsonScanStateInit(JsonScanState *state, uint64_t escaped)
+{
+    state->m_PrevEscaped = escaped;
+    state->m_PrevInString = 0;
+    state->m_PrevScalar = 0;
+}
+
+#if defined(_MSC_VER)
+static inline int JsonTrailingZeroes(uint64_t v)
+{
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (int)index;
+}
+
+static inline int JsonPopCount(uint64_t v)
+{
+    return (int)__popcnt64(v);
+}
+#else
+static inline int JsonTrailingZeroes(uint64_t v)
+{
+    return __builtin_ctzll(v);
+}
+
+static inline int JsonPopCount(uint64_t v)
+{
+    return __builtin_popcountll(v);
+}
+#endif
+
+// Set bits from every quote up to, but not including, the next one.
+static inline uint64_t JsonPrefixXor(uint64_t bits)
+{
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// Bytes preceded by an odd-length run of backslashes.
+static inline uint64_t JsonFindEscaped(uint64_t backslash, uint64_t *prev_escaped)
+{
+    const uint64_t even_bits = 0x5555555555555555ull;
+
+    backslash &= ~*prev_escaped;
+    uint64_t follows_escape = (backslash << 1) | *prev_escaped;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t sequences_on_even_bits = odd_starts + backslash;
+    *prev_escaped = sequences_on_even_bits < odd_starts ? 1 : 0;
+    uint64_t invert_mask = sequences_on_even_bits << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+// Returns the bits the lexer wants to look at, and the bytes that are inside
+// strings (opening quotes included, closing quotes not).
+static inline uint64_t JsonScanBlock(JsonScanState *state, const JsonScanMasks &block, uint64_t *in_string_out)
+{
+    uint64_t escaped = JsonFindEscaped(block.m_Backslash, &state->m_PrevEscaped);
+    uint64_t quote = block.m_Quote & ~escaped;
+    uint64_t in_string = JsonPrefixXor(quote) ^ state->m_PrevInString;
+    state->m_PrevInString = uint64_t(int64_t(in_string) >> 63);
+
+    uint64_t op = block.m_Open | block.m_Close | block.m_Separator;
+    uint64_t scalar = ~(op | block.m_Whitespace);
+    uint64_t nonquote_scalar = scalar & ~quote;
+    uint64_t follows_scalar = (nonquote_scalar << 1) | state->m_PrevScalar;
+    state->m_PrevScalar = nonquote_scalar >> 63;
+
+    *in_string_out = in_string;
+    return ((op | (scalar & ~follows_scalar)) & ~in_string) | quote;
+}
+
+enum
+{
+    kJsonClassBackslash = 1 << 0,
+    kJsonClassQuote = 1 << 1,
+    kJsonClassWhitespace = 1 << 2,
+    kJsonClassNewline = 1 << 3,
+    kJsonClassOpen = 1 << 4,
+    kJsonClassClose = 1 << 5,
+    kJsonClassSeparator = 1 << 6
+};
+
+struct JsonClassTable
+{
+    uint8_t m_Class[256];
+
+    JsonClassTable()
+    {
+        memset(m_Class, 0, sizeof m_Class);
+        m_Class[uint8_t('\\')] = kJsonClassBackslash;
+        m_Class[uint8_t('"')] = kJsonClassQuote;
+        m_Class[uint8_t(' ')] = kJsonClassWhitespace;
+        m_Class[uint8_t('\t')] = kJsonClassWhitespace;
+        m_Class[uint8_t('\r')] = kJsonClassWhitespace;
+        m_Class[uint8_t('\v')] = kJsonClassWhitespace;
+        m_Class[uint8_t('\f')] = kJsonClassWhitespace;
+        m_Class[uint8_t('\n')] = kJsonClassWhitespace | kJsonClassNewline;
+        m_Class[uint8_t('{')] = kJsonClassOpen;
+        m_Class[uint8_t('[')] = kJsonClassOpen;
+        m_Class[uint8_t('}')] = kJsonClassClose;
+        m_Class[uint8_t(']')] = kJsonClassClose;
+        m_Class[uint8_t(',')] = kJsonClassSeparator;
+        m_Class[uint8_t(':')] = kJsonClassSeparator;
+    }
+};
+
+static const JsonClassTable s_JsonClassTable;
+
+// One bit per byte of `v` that equals the byte repeated in `pattern`, gathered
+// into the low eight bits like a SIMD movemask.
+static inline uint64_t JsonSwarMatch(uint64_t v, uint64_t pattern)
+{
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    uint64_t x = v ^ pattern;
+    uint64_t zero = ~(((x & low7) + low7) | x | low7);
+    return ((zero >> 7) * 0x0102040810204080ull) >> 56;
+}
+
+// Eight bytes at a time in general purpose registers, for CPUs without a SIMD
+// kernel. Like the SIMD kernels, it relies on '[' and '{' differing only in bit
+// 5, as do ']' and '}', so setting it lets one comparison find both.
+static void JsonClassifyScalar(const char *data, size_t block_count, JsonScanMasks *out)
+{
+    const uint64_t ones = 0x0101010101010101ull;
+
+    for (size_t b = 0; b < block_count; ++b, data += kJsonScanBlockSize)
+    {
+        JsonScanMasks block = {0, 0, 0, 0, 0, 0, 0};
+
+        for (int i = 0; i < kJsonScanBlockSize / 8; ++i)
+        {
+            uint64_t v;
+            memcpy(&v, data + 8 * i, 8);
+            const uint64_t folded = v | (ones * 0x20);
+            const int shift = 8 * i;
+
+            const uint64_t nl = JsonSwarMatch(v, ones * '\n');
+            const uint64_t ws = JsonSwarMatch(v, ones * ' ') | JsonSwarMatch(v, ones * '\t') | JsonSwarMatch(v, ones * '\r') |
+                                JsonSwarMatch(v, ones * '\v') | JsonSwarMatch(v, ones * '\f') | nl;
+
+            block.m_Backslash |= JsonSwarMatch(v, ones * '\\') << shift;
+            block.m_Quote |= JsonSwarMatch(v, ones * '"') << shift;
+            block.m_Whitespace |= ws << shift;
+            block.m_Newline |= nl << shift;
+            block.m_Open |= JsonSwarMatch(folded, ones * '{') << shift;
+            block.m_Close |= JsonSwarMatch(folded, ones * '}') << shift;
+            block.m_Separator |= (JsonSwarMatch(v, ones * ',') | JsonSwarMatch(v, ones * ':')) << shift;
+        }
+
+        out[b] = block;
+    }
+}
+
+#if defined(TUNDRA_JSON_SIMD)
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static void JsonClassifySse2(const char *data, size_t block_count, JsonScanMasks *out)
+{
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i space = _mm_set1_epi8(' ');
+    // '\t', '\n', '\v', '\f' and '\r' are the bytes 9 to 13.
+    const __m128i tab_minus_one = _mm_set1_epi8('\t' - 1);
+    const __m128i cr_plus_one = _mm_set1_epi8('\r' + 1);
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i bit5 = _mm_set1_epi8(0x20);
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i colon = _mm_set1_epi8(':');
+
+    for (size_t b = 0; b < block_count; ++b, data += kJsonScanBlockSize)
+    {
+        JsonScanMasks block = {0, 0, 0, 0, 0, 0, 0};
+
+        for (int i = 0; i < 4; ++i)
+        {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(data + 16 * i));
+            const __m128i folded = _mm_or_si128(v, bit5);
+            const int shift = 16 * i;
+
+            const __m128i nl = _mm_cmpeq_epi8(v, newline);
+            const __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, tab_minus_one), _mm_cmplt_epi8(v, cr_plus_one));
+            const __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), ctrl);
+            const __m128i sep = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, colon));
+
+            block.m_Backslash |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)))) << shift;
+            block.m_Quote |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))) << shift;
+            block.m_Whitespace |= uint64_t(uint16_t(_mm_movemask_epi8(ws))) << shift;
+            block.m_Newline |= uint64_t(uint16_t(_mm_movemask_epi8(nl))) << shift;
+            block.m_Open |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(folded, open)))) << shift;
+            block.m_Close |= uint64_t(uint16_t(_mm_movemask_epi8(_mm_cmpeq_epi8(folded, close)))) << shift;
+            block.m_Separator |= uint64_t(uint16_t(_mm_movemask_epi8(sep))) << shift;
+        }
+
+        out[b] = block;
+    }
+}
+
+TARGET_AVX2 static void JsonClassifyAvx2(const char *data, size_t block_count, JsonScanMasks *out)
+{
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab_minus_one = _mm256_set1_epi8('\t' - 1);
+    const __m256i cr_plus_one = _mm256_set1_epi8('\r' + 1);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i bit5 = _mm256_set1_epi8(0x20);
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i colon = _mm256_set1_epi8(':');
+
+    for (size_t b = 0; b < block_count; ++b, data += kJsonScanBlockSize)
+    {
+        JsonScanMasks block = {0, 0, 0, 0, 0, 0, 0};
+
+        for (int i = 0; i < 2; ++i)
+        {
+            const __m256i v = _mm256_loadu_si256((const __m256i *)(data + 32 * i));
+            const __m256i folded = _mm256_or_si256(v, bit5);
+            const int shift = 32 * i;
+
+            const __m256i nl = _mm256_cmpeq_epi8(v, newline);
+            const __m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(v, tab_minus_one), _mm256_cmpgt_epi8(cr_plus_one, v));
+            const __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), ctrl);
+            const __m256i sep = _mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, colon));
+
+            block.m_Backslash |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, backslash)))) << shift;
+            block.m_Quote |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, quote)))) << shift;
+            block.m_Whitespace |= uint64_t(uint32_t(_mm256_movemask_epi8(ws))) << shift;
+            block.m_Newline |= uint64_t(uint32_t(_mm256_movemask_epi8(nl))) << shift;
+            block.m_Open |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(folded, open)))) << shift;
+            block.m_Close |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(folded, close)))) << shift;
+            block.m_Separator |= uint64_t(uint32_t(_mm256_movemask_epi8(sep))) << shift;
+        }
+
+        out[b] = block;
+    }
+}
+
+#endif
+
+typedef void (*JsonClassifyFunc)(const char *data, size_t block_count, JsonScanMasks *out);
+
+static bool JsonCpuSupportsKernel(int kernel)
+{
+    switch (kernel)
+    {
+    case kJsonScanKernelScalar:
+        return true;
+#if defined(TUNDRA_JSON_SIMD)
+    case kJsonScanKernelSse2:
+        return true;
+    case kJsonScanKernelAvx2:
+#if defined(_MSC_VER)
+    {
+        int regs[4];
+        __cpuid(regs, 0);
+        if (regs[0] < 7)
+            return false;
+        __cpuid(regs, 1);
+        if (0 == (regs[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6)
+            return false;
+        __cpuidex(regs, 7, 0);
+        return 0 != (regs[1] & (1 << 5));
+    }
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+#endif
+    default:
+        return false;
+    }
+}
+
+static const struct
+{
+    const char *m_Name;
+    JsonClassifyFunc m_Classify;
+} s_JsonScanKernels[kJsonScanKernelCount] = {
+    {"scalar", JsonClassifyScalar},
+#if defined(TUNDRA_JSON_SIMD)
+    {"sse2", JsonClassifySse2},
+    {"avx2", JsonClassifyAvx2},
+#else
+    {"sse2", JsonClassifyScalar},
+    {"avx2", JsonClassifyScalar},
+#endif
+};
+
+static int JsonSelectBestKernel()
+{
+    for (int kernel = kJsonScanKernelCount - 1; kernel > kJsonScanKernelScalar; --kernel)
+    {
+        if (JsonCpuSupportsKernel(kernel))
+            return kernel;
+    }
+    return kJsonScanKernelScalar;
+}
+
+static int s_JsonScanKernel = JsonSelectBestKernel();
+static JsonClassifyFunc s_JsonClassify = s_JsonScanKernels[s_JsonScanKernel].m_Classify;
+
+bool JsonSelectScanKernel(int kernel)
+{
+    if (kernel < 0 || kernel >= kJsonScanKernelCount || !JsonCpuSupportsKernel(kernel))
+        return false;
+
+    s_JsonScanKernel = kernel;
+    s_JsonClassify = s_JsonScanKernels[kernel].m_Classify;
+    return true;
+}
+
+int JsonSelectedScanKernel()
+{
+    return s_JsonScanKernel;
+}
+
+const char *JsonScanKernelName(int kernel)
+{
+    if (kernel < 0 || kernel >= kJsonScanKernelCount)
+        return "unknown";
+    return s_JsonScanKernels[kernel].m_Name;
+}
+
+// Classifies up to a window's worth of [p, end), padding a trailing partial block
+// with spaces so nothing past the end is read. Returns the number of bytes covered.
+static size_t JsonClassifyWindow(const char *p, const char *end, JsonScanMasks *blocks, size_t *block_count_out)
+{
+    size_t remaining = size_t(end - p);
+    size_t full_blocks = std::min(remaining / kJsonScanBlockSize, size_t(kJsonScanWindowBlocks));
+
+    if (full_blocks > 0)
+    {
+        s_JsonClassify(p, full_blocks, blocks);
+        *block_count_out = full_blocks;
+        return full_blocks * kJsonScanBlockSize;
+    }
+
+    char padded[kJsonScanBlockSize];
+    memset(padded, ' ', sizeof padded);
+    memcpy(padded, p, remaining);
+    s_JsonClassify(padded, 1, blocks);
+    *block_count_out = 1;
+    return remaining;
+}
+
+// Feeds the lexer with positions from [begin, end), a window at a time.
+struct JsonScanner
+{
+    const char *m_Pos;
+    const char *m_End;
+    JsonScanState m_State;
+    const char *m_WindowBase;
+    uint32_t m_Count;
+    uint32_t m_Next;
+    uint16_t m_Offsets[kJsonScanWindowSize];
+
+    // Line number at the start of the window, and the newlines outside of
+    // strings in each of its blocks.
+    int m_WindowLine;
+    int m_WindowLineCount;
+    size_t m_BlockCount;
+    uint64_t m_Newlines[kJsonScanWindowBlocks];
+
+    uint64_t m_Backslashes[kJsonScanWindowBlocks];
+};
+
+static void JsonScannerInit(JsonScanner *self, const char *begin, const char *end, int line_number)
+{
+    self->m_Pos = begin;
+    self->m_End = end;
+    JsonScanStateInit(&self->m_State, 0);
+    self->m_WindowBase = begin;
+    self->m_Count = 0;
+    self->m_Next = 0;
+    self->m_WindowLine = line_number;
+    self->m_WindowLineCount = 0;
+    self->m_BlockCount = 0;
+}
+
+static void JsonScannerRefill(JsonScanner *self)
+{
+    JsonScanMasks blocks[kJsonScanWindowBlocks];
+    size_t block_count;
+    const char *base = self->m_Pos;
+
+    self->m_Pos += JsonClassifyWindow(base, self->m_End, blocks, &block_count);
+    self->m_WindowBase = base;
+    self->m_Next = 0;
+    self->m_WindowLine += self->m_WindowLineCount;
+    self->m_BlockCount = block_count;
+
+    uint32_t count = 0;
+    int line_count = 0;
+    for (size_t b = 0; b < block_count; ++b)
+    {
+        uint64_t in_string;
+        uint64_t bits = JsonScanBlock(&self->m_State, blocks[b], &in_string);
+        const uint16_t block_offset = uint16_t(b * kJsonScanBlockSize);
+
+        self->m_Newlines[b] = blocks[b].m_Newline & ~in_string;
+        self->m_Backslashes[b] = blocks[b].m_Backslash;
+        line_count += JsonPopCount(self->m_Newlines[b]);
+
+        while (bits)
+        {
+            self->m_Offsets[count++] = uint16_t(block_offset + JsonTrailingZeroes(bits));
+            bits &= bits - 1;
+        }
+    }
+    self->m_Count = count;
+    self->m_WindowLineCount = line_count;
+}
+
+// Whether there are backslashes in [begin, end), where `end` must be the last
+// position handed out.
+static bool JsonScannerHasBackslash(const JsonScanner *self, const char *begin, const char *end)
+{
+    if (begin < self->m_WindowBase)
+        return nullptr != memchr(begin, '\\', size_t(end - begin));
+
+    size_t first = size_t(begin - self->m_WindowBase);
+    size_t last = size_t(end - self->m_WindowBase);
+    uint64_t bits = self->m_Backslashes[first / kJsonScanBlockSize] & (~uint64_t(0) << (first % kJsonScanBlockSize));
+
+    for (size_t b = first / kJsonScanBlockSize; b < last / kJsonScanBlockSize; ++b)
+    {
+        if (bits)
+            return true;
+        bits = self->m_Backslashes[b + 1];
+    }
+
+    return 0 != (bits & ((uint64_t(1) << (last % kJsonScanBlockSize)) - 1));
+}
+
+// Line number at `pos`, which must be the last position handed out or lie in a
+// stretch of string or literal characters around it.
+static int JsonScannerLineNumber(const JsonScanner *self, const char *pos)
+{
+    if (pos <= self->m_WindowBase)
+        return self->m_WindowLine;
+
+    size_t offset = size_t(pos - self->m_WindowBase);
+    if (offset >= self->m_BlockCount * kJsonScanBlockSize)
+        return self->m_WindowLine + self->m_WindowLineCount;
+
+    int line = self->m_WindowLine;
+    size_t block = offset / kJsonScanBlockSize;
+    for (size_t b = 0; b < block; ++b)
+        line += JsonPopCount(self->m_Newlines[b]);
+
+    uint64_t before = (uint64_t(1) << (offset % kJsonScanBlockSize)) - 1;
+    return line + JsonPopCount(self->m_Newlines[block] & before);
+}
+
+// Returns the next position of interest, or null at the end of the range.
+static inline char *JsonScannerNext(JsonScanner *self)
+{
+    while (self->m_Next == self->m_Count)
+    {
+        if (self->m_Pos >= self->m_End)
+            return nullptr;
+        JsonScannerRefill(self);
+    }
+
+    return const_cast<char *>(self->m_WindowBase) + self->m_Offsets[self->m_Next++];
+}
+
 struct JsonLexerState
 {
     char *m_Cursor;
-    int m_LineNumber;
+    char *m_End;
+    char *m_Pending; // start of a token glued to the end of the previous one
+    char *m_LexemeStart;
     JsonLexeme m_Lexeme;
+    JsonScanner m_Scanner;
     char m_Error[1024];
+
+    // Set when the scalar kernel is selected; the lexer then walks the buffer a
+    // character at a time and counts lines as it goes.
+    bool m_Direct;
+    int m_LineNumber;
 };
 
-static void JsonLexerStateInit(JsonLexerState *self, char *buffer)
+static void JsonLexerStateInit(JsonLexerState *self, char *begin, char *end)
 {
-    self->m_Cursor = buffer;
-    self->m_LineNumber = 1;
+    self->m_Cursor = begin;
+    self->m_End = end;
+    self->m_Pending = nullptr;
+    self->m_LexemeStart = begin;
     self->m_Lexeme.m_Type = kJsonLexInvalid;
     self->m_Error[0] = '\0';
+    self->m_Direct = kJsonScanKernelScalar == s_JsonScanKernel;
+    self->m_LineNumber = 1;
+    JsonScannerInit(&self->m_Scanner, begin, end, 1);
+}
+
+// Continue lexing at `pos`, which must be outside of any string.
+static void JsonLexerSeek(JsonLexerState *self, char *pos, int line_number)
+{
+    self->m_Cursor = pos;
+    self->m_Pending = nullptr;
+    self->m_LexemeStart = pos;
+    self->m_Lexeme.m_Type = kJsonLexInvalid;
+    self->m_LineNumber = line_number;
+    JsonScannerInit(&self->m_Scanner, pos, self->m_End, line_number);
 }
 
-static char *SkipWhitespace(JsonLexerState *state)
+// The line the most recently fetched lexeme starts on.
+static int JsonLexerLineNumber(const JsonLexerState *self)
 {
-    char *ptr = state->m_Cursor;
+    if (self->m_Direct)
+        return self->m_LineNumber;
+    return JsonScannerLineNumber(&self->m_Scanner, self->m_LexemeStart);
+}
 
-    while (char ch = *ptr)
+// Skips whitespace at the cursor, for the direct lexer. Returns null at the end
+// of the range.
+static char *JsonLexerSkipWhitespace(JsonLexerState *state)
+{
+    char *p = state->m_Cursor;
+    while (p < state->m_End && (s_JsonClassTable.m_Class[uint8_t(*p)] & kJsonClassWhitespace))
     {
-        if ('\n' == ch)
-        {
+        if ('\n' == *p)
             ++state->m_LineNumber;
+        ++p;
+    }
+
+    return p < state->m_End ? p : nullptr;
+}
+
+// Finds the closing quote of the string starting after `p`, for the direct
+// lexer.
+static char *JsonFindStringEnd(char *p, const char *end, bool *has_backslash_out)
+{
+    bool has_backslash = false;
+    for (; p < end && *p; ++p)
+    {
+        if ('"' == *p)
+        {
+            *has_backslash_out = has_backslash;
+            return p;
         }
 
-        if (isspace(ch))
-            ++ptr;
-        else
-            break;
+        if ('\\' == *p)
+        {
+            has_backslash = true;
+            if (++p == end || !*p)
+                break;
+        }
     }
 
-    state->m_Cursor = ptr;
-    return ptr;
+    return nullptr;
 }
 
 static JsonLexeme JsonLexerError(JsonLexerState *state, const char *error)
 {
-    snprintf(state->m_Error, sizeof state->m_Error, "%d: %s", state->m_LineNumber, error);
+    snprintf(state->m_Error, sizeof state->m_Error, "%d: %s", JsonLexerLineNumber(state), error);
     return s_ErrorLexeme;
 }
 
-static JsonLexeme GetNumberLexeme(JsonLexerState *state)
+// The scanner only reports the first character of a run of number and literal
+// characters. If something other than whitespace, a quote or a structural
+// character follows a token ("1true"), it is lexed separately next time, like a
+// character-at-a-time lexer would. That includes a terminating nul.
+static void CheckAtomEnd(JsonLexerState *state, char *end)
+{
+    if (s_JsonClassTable.m_Class[uint8_t(*end)] <= kJsonClassBackslash)
+        state->m_Pending = end;
+}
+
+// Most numbers in DAG files are small integers, which are converted exactly
+// without going through strtod().
+static bool GetIntegerFast(char *start, double *out, char **end_out)
+{
+    char *p = start + ('-' == *start);
+    uint64_t value = 0;
+    int digits = 0;
+
+    while (unsigned(*p - '0') < 10 && digits < 16)
+    {
+        value = value * 10 + unsigned(*p++ - '0');
+        ++digits;
+    }
+
+    switch (*p)
+    {
+    case '.':
+    case 'e':
+    case 'E':
+    case 'x':
+    case 'X':
+        return false;
+    }
+
+    if (0 == digits || unsigned(*p - '0') < 10)
+        return false;
+
+    *out = '-' == *start ? -double(value) : double(value);
+    *end_out = p;
+    return true;
+}
+
+static JsonLexeme GetNumberLexeme(JsonLexerState *state, char *start)
 {
-    char *start = state->m_Cursor;
     char *end = nullptr;
 
     JsonLexeme result;
 
     result.m_Type = kJsonLexNumber;
-    result.m_Number = strtod(start, &end);
+    if (!GetIntegerFast(start, &result.m_Number, &end))
+        result.m_Number = strtod(start, &end);
     state->m_Cursor = end;
-    return start != end ? result : JsonLexerError(state, "bad number");
+
+    if (start == end)
+        return JsonLexerError(state, "bad number");
+
+    CheckAtomEnd(state, end);
+    return result;
 }
 
-static JsonLexeme GetStringLexeme(JsonLexerState *state)
+// The closing quote is the next position the scanner reports. Strings without
+// escapes are terminated in place; others are unescaped in place first.
+static JsonLexeme GetStringLexeme(JsonLexerState *state, char *open)
 {
     JsonLexeme result;
 
-    char *rptr = state->m_Cursor;
+    bool has_backslash = false;
+    char *close;
+    if (state->m_Direct)
+        close = JsonFindStringEnd(open + 1, state->m_End, &has_backslash);
+    else
+        close = JsonScannerNext(&state->m_Scanner);
+
+    if (!close)
+        return JsonLexerError(state, "end of file inside string");
+
+    char *rptr = open + 1;
     char *wptr = rptr;
-    ++rptr; // skip quote
 
     result.m_Type = kJsonLexString;
     result.m_String = wptr;
 
-    for (;;)
+    if (state->m_Direct ? !has_backslash : !JsonScannerHasBackslash(&state->m_Scanner, rptr, close))
+    {
+        *close = '\0';
+        state->m_Cursor = close + 1;
+        return result;
+    }
+
+    while (rptr < close)
     {
         char ch = *rptr++;
-        if (0 == ch)
-            return JsonLexerError(state, "end of file inside string");
 
-        if ('"' == ch)
-        {
-            *wptr = '\0';
-            break;
-        }
-        else if ('\\' == ch)
+        if ('\\' == ch)
         {
             char next = *rptr++;
             switch (next)
@@ -170,7 +815,7 @@ static JsonLexeme GetStringLexeme(JsonLexerState *state)
                 uint32_t hex_code = 0;
                 for (int i = 0; i < 4; ++i)
                 {
-                    char code = *rptr++;
+                    char code = rptr < close ? *rptr++ : 0;
                     if (0 == code)
                     {
                         return JsonLexerError(state, "end of file inside escape");
@@ -207,13 +852,13 @@ static JsonLexeme GetStringLexeme(JsonLexerState *state)
         }
     }
 
-    state->m_Cursor = rptr;
+    *wptr = '\0';
+    state->m_Cursor = close + 1;
     return result;
 }
 
-static JsonLexeme GetLiteralLexeme(JsonLexerState *state)
+static JsonLexeme GetLiteralLexeme(JsonLexerState *state, char *rptr)
 {
-    char *rptr = state->m_Cursor;
     char *eptr = rptr;
     while (isalnum(*eptr))
     {
@@ -227,12 +872,14 @@ static JsonLexeme GetLiteralLexeme(JsonLexerState *state)
         if (0 == strncmp("true", rptr, 4))
         {
             state->m_Cursor = eptr;
+            CheckAtomEnd(state, eptr);
             return s_TrueLexeme;
         }
 
         else if (0 == strncmp("null", rptr, 4))
         {
             state->m_Cursor = eptr;
+            CheckAtomEnd(state, eptr);
             return s_NullLexeme;
         }
     }
@@ -242,6 +889,7 @@ static JsonLexeme GetLiteralLexeme(JsonLexerState *state)
         if (0 == strncmp("false", rptr, 5))
         {
             state->m_Cursor = eptr;
+            CheckAtomEnd(state, eptr);
             return s_FalseLexeme;
         }
     }
@@ -251,10 +899,24 @@ static JsonLexeme GetLiteralLexeme(JsonLexerState *state)
 
 static JsonLexeme JsonLexerFetchNext(JsonLexerState *state)
 {
-    char *p = SkipWhitespace(state);
-    char ch = *p;
+    char *p = state->m_Pending;
+    if (state->m_Direct)
+        p = JsonLexerSkipWhitespace(state);
+    else if (p)
+        state->m_Pending = nullptr;
+    else
+        p = JsonScannerNext(&state->m_Scanner);
+
+    if (!p)
+    {
+        state->m_Cursor = state->m_End;
+        state->m_LexemeStart = state->m_End;
+        return s_EofLexeme;
+    }
+
+    state->m_LexemeStart = p;
 
-    switch (ch)
+    switch (*p)
     {
     case '-':
     case '0':
@@ -267,10 +929,10 @@ static JsonLexeme JsonLexerFetchNext(JsonLexerState *state)
     case '7':
     case '8':
     case '9':
-        return GetNumberLexeme(state);
+        return GetNumberLexeme(state, p);
 
     case '"':
-        return GetStringLexeme(state);
+        return GetStringLexeme(state, p);
 
     case '{':
         state->m_Cursor = p + 1;
@@ -297,10 +959,11 @@ static JsonLexeme JsonLexerFetchNext(JsonLexerState *state)
         return s_NameSeparatorLexeme;
 
     case '\0':
+        state->m_Cursor = p;
         return s_EofLexeme;
 
     default:
-        return GetLiteralLexeme(state);
+        return GetLiteralLexeme(state, p);
     }
 }
 
@@ -350,30 +1013,367 @@ static bool JsonLexerExpect(JsonLexerState *state, JsonLexemeType type, JsonLexe
     return false;
 }
 
+// Structural index of a document, used to split it up for JsonParseParallel().
+//
+// A mark is recorded for every bracket that opens or closes a value one level
+// below the root, and for every comma directly inside such a value. The
+// elements of an array in the root object therefore lie between consecutive
+// marks and can be parsed independently of each other.
+//
+// The index is built in two passes over chunks of the buffer, both of which run
+// on all worker threads and use the block masks of the structural scan. Whether
+// a chunk starts inside a string isn't known up front, so the first pass counts
+// brackets separately for the parts of the chunk that are on either side of its
+// unescaped quotes. Once the chunk totals are
+// summed up in order, the string state and nesting depth at the start of every
+// chunk are known, and the second pass records the marks.
+struct JsonIndexMark
+{
+    size_t m_Offset;
+    int m_LineNumber;
+};
+
+struct JsonIndexChunk
+{
+    const char *m_Begin;
+    const char *m_End;
+
+    // First pass. Region 0 is the text with the same string state as the start of
+    // the chunk, region 1 the text on the other side of an odd number of quotes.
+    int m_QuoteParity;
+    int64_t m_DepthDelta[2];
+    int m_LineCount[2];
+
+    // Second pass.
+    bool m_StartsInString;
+    int64_t m_StartDepth;
+    int m_StartLine;
+    Buffer<JsonIndexMark> m_Marks;
+};
+
+struct JsonIndex
+{
+    const JsonIndexMark *m_Marks;
+    size_t m_Count;
+};
+
+enum
+{
+    kJsonIndexDepth = 2,
+    kJsonParallelMinSize = 4 * 1024 * 1024,
+    kJsonParallelMinElements = 1024,
+    kJsonParallelBatchSize = 64
+};
+
+// Backslashes only occur inside strings, so a run of them that ends right before
+// the chunk escapes its first character if the run has odd length.
+static uint64_t ChunkStartsEscaped(const char *buffer, const char *begin)
+{
+    const char *p = begin;
+    while (p > buffer && '\\' == p[-1])
+        --p;
+
+    return uint64_t(begin - p) & 1;
+}
+
+static void JsonIndexCount(const char *buffer, JsonIndexChunk *chunk)
+{
+    JsonScanState state;
+    JsonScanStateInit(&state, ChunkStartsEscaped(buffer, chunk->m_Begin));
+
+    int64_t depth[2] = {0, 0};
+    int lines[2] = {0, 0};
+
+    for (const char *p = chunk->m_Begin, *end = chunk->m_End; p < end;)
+    {
+        JsonScanMasks blocks[kJsonScanWindowBlocks];
+        size_t block_count;
+        p += JsonClassifyWindow(p, end, blocks, &block_count);
+
+        for (size_t b = 0; b < block_count; ++b)
+        {
+            const JsonScanMasks &block = blocks[b];
+            uint64_t region;
+            JsonScanBlock(&state, block, &region);
+
+            depth[0] += JsonPopCount(block.m_Open & ~region) - JsonPopCount(block.m_Close & ~region);
+            depth[1] += JsonPopCount(block.m_Open & region) - JsonPopCount(block.m_Close & region);
+            lines[0] += JsonPopCount(block.m_Newline & ~region);
+            lines[1] += JsonPopCount(block.m_Newline & region);
+        }
+    }
+
+    chunk->m_QuoteParity = int(state.m_PrevInString & 1);
+    chunk->m_DepthDelta[0] = depth[0];
+    chunk->m_DepthDelta[1] = depth[1];
+    chunk->m_LineCount[0] = lines[0];
+    chunk->m_LineCount[1] = lines[1];
+}
+
+static void JsonIndexMarkChunk(const char *buffer, MemAllocHeap *heap, JsonIndexChunk *chunk)
+{
+    JsonScanState state;
+    JsonScanStateInit(&state, ChunkStartsEscaped(buffer, chunk->m_Begin));
+    state.m_PrevInString = chunk->m_StartsInString ? ~uint64_t(0) : 0;
+
+    int64_t depth = chunk->m_StartDepth;
+    int line = chunk->m_StartLine;
+
+    for (const char *p = chunk->m_Begin, *end = chunk->m_End; p < end;)
+    {
+        JsonScanMasks blocks[kJsonScanWindowBlocks];
+        size_t block_count;
+        const char *window = p;
+        p += JsonClassifyWindow(p, end, blocks, &block_count);
+
+        for (size_t b = 0; b < block_count; ++b)
+        {
+            const JsonScanMasks &block = blocks[b];
+            uint64_t in_string;
+            JsonScanBlock(&state, block, &in_string);
+
+            const char *block_base = window + b * kJsonScanBlockSize;
+            uint64_t bits = (block.m_Open | block.m_Close | block.m_Separator | block.m_Newline) & ~in_string;
+
+            for (; bits; bits &= bits - 1)
+            {
+                const char *pos = block_base + JsonTrailingZeroes(bits);
+                bool mark = false;
+
+                switch (*pos)
+                {
+                case '[':
+                case '{':
+                    mark = ++depth == kJsonIndexDepth;
+                    break;
+                case ']':
+                case '}':
+                    mark = depth-- == kJsonIndexDepth;
+                    break;
+                case ',':
+                    mark = depth == kJsonIndexDepth;
+                    break;
+                case '\n':
+                    ++line;
+                    break;
+                }
+
+                if (mark)
+                {
+                    JsonIndexMark *m = BufferAlloc(&chunk->m_Marks, heap, 1);
+                    m->m_Offset = size_t(pos - buffer);
+                    m->m_LineNumber = line;
+                }
+            }
+        }
+    }
+}
+
+static void JsonIndexRunPass(const char *buffer, MemAllocHeap *heap, JsonIndexChunk *chunks, int32_t chunk_count, int pass, int thread_count)
+{
+    ParallelFor(thread_count, chunk_count, 1, "Json Index", [=](int32_t start, int32_t end, int thread_index) {
+        for (int32_t i = start; i < end; ++i)
+        {
+            if (0 == pass)
+                JsonIndexCount(buffer, &chunks[i]);
+            else
+                JsonIndexMarkChunk(buffer, heap, &chunks[i]);
+        }
+        return true;
+    });
+}
+
+// Returns false if the document is malformed in a way that makes the index
+// useless (unterminated string, unbalanced brackets); the serial parser will
+// then produce a proper error message.
+static bool JsonIndexBuild(Buffer<JsonIndexMark> *marks_out, const char *buffer, size_t size, MemAllocHeap *heap, int thread_count)
+{
+    const int32_t chunk_count = thread_count * 4;
+    const size_t chunk_size = (size + chunk_count - 1) / chunk_count;
+
+    JsonIndexChunk *chunks = HeapAllocateArray<JsonIndexChunk>(heap, chunk_count);
+    for (int32_t i = 0; i < chunk_count; ++i)
+    {
+        chunks[i].m_Begin = buffer + std::min(size, i * chunk_size);
+        chunks[i].m_End = buffer + std::min(size, (i + 1) * chunk_size);
+        BufferInit(&chunks[i].m_Marks);
+    }
+
+    JsonIndexRunPass(buffer, heap, chunks, chunk_count, 0, thread_count);
+
+    bool in_string = false;
+    int64_t depth = 0;
+    int line = 1;
+    for (int32_t i = 0; i < chunk_count; ++i)
+    {
+        chunks[i].m_StartsInString = in_string;
+        chunks[i].m_StartDepth = depth;
+        chunks[i].m_StartLine = line;
+
+        depth += chunks[i].m_DepthDelta[in_string ? 1 : 0];
+        line += chunks[i].m_LineCount[in_string ? 1 : 0];
+        in_string ^= chunks[i].m_QuoteParity != 0;
+    }
+
+    bool valid = !in_string && 0 == depth;
+
+    if (valid)
+    {
+        JsonIndexRunPass(buffer, heap, chunks, chunk_count, 1, thread_count);
+
+        for (int32_t i = 0; i < chunk_count; ++i)
+            BufferAppend(marks_out, heap, chunks[i].m_Marks.m_Storage, chunks[i].m_Marks.m_Size);
+    }
+
+    for (int32_t i = 0; i < chunk_count; ++i)
+        BufferDestroy(&chunks[i].m_Marks, heap);
+    HeapFree(heap, chunks);
+
+    return valid;
+}
+
 struct JsonState
 {
     JsonLexerState m_Lexer;
     char m_ErrorMessage[1024];
     MemAllocLinear *m_Allocator;
     MemAllocLinear *m_Scratch;
+
+    // Only set up by JsonParseParallel().
+    char *m_Buffer;
+    int m_Depth;
+    const JsonIndex *m_Index;
+    JsonParseWorkers *m_Workers;
 };
 
-static void JsonStateInit(JsonState *state, MemAllocLinear *alloc, MemAllocLinear *scratch, char *buffer)
+static void JsonStateInit(JsonState *state, MemAllocLinear *alloc, MemAllocLinear *scratch, char *buffer, char *end)
 {
-    JsonLexerStateInit(&state->m_Lexer, buffer);
+    JsonLexerStateInit(&state->m_Lexer, buffer, end);
     state->m_ErrorMessage[0] = '\0';
     state->m_Allocator = alloc;
     state->m_Scratch = scratch;
+    state->m_Buffer = buffer;
+    state->m_Depth = 0;
+    state->m_Index = nullptr;
+    state->m_Workers = nullptr;
 }
 
 static JsonValue *JsonError(JsonState *state, const char *error)
 {
-    snprintf(state->m_ErrorMessage, sizeof state->m_ErrorMessage, "line %d: %s", state->m_Lexer.m_LineNumber, error);
+    snprintf(state->m_ErrorMessage, sizeof state->m_ErrorMessage, "line %d: %s", JsonLexerLineNumber(&state->m_Lexer), error);
     return nullptr;
 }
 
 static const JsonValue *JsonParseValue(JsonState *json_state);
 
+struct JsonArrayWorker
+{
+    int32_t m_ErrorIndex;
+    JsonState m_State;
+};
+
+// Parses the elements of an array directly inside the root object on the worker
+// threads, using the structural index to find where each of them starts.
+// Returns false without consuming anything if the array is too small to be worth
+// it.
+static bool JsonParseArrayParallel(JsonState *json_state, const JsonValue **result)
+{
+    const JsonIndex *index = json_state->m_Index;
+    JsonLexerState *lexer = &json_state->m_Lexer;
+    char *buffer = json_state->m_Buffer;
+
+    size_t open_offset = size_t(lexer->m_Cursor - 1 - buffer);
+    const JsonIndexMark *marks_end = index->m_Marks + index->m_Count;
+    const JsonIndexMark *first = std::lower_bound(index->m_Marks, marks_end, open_offset, [](const JsonIndexMark &m, size_t offset) {
+        return m.m_Offset < offset;
+    });
+
+    if (first == marks_end || first->m_Offset != open_offset)
+        return false;
+
+    const JsonIndexMark *last = first + 1;
+    while (last != marks_end && ',' == buffer[last->m_Offset])
+        ++last;
+
+    if (last == marks_end || ']' != buffer[last->m_Offset] || last - first < kJsonParallelMinElements)
+        return false;
+
+    MemAllocLinear *alloc = json_state->m_Allocator;
+    JsonParseWorkers *workers = json_state->m_Workers;
+
+    int32_t count = int32_t(last - first);
+    const JsonValue **values = LinearAllocateArray<const JsonValue *>(alloc, count);
+
+    const int thread_count = workers->m_Count;
+    JsonArrayWorker *worker_state = HeapAllocateArray<JsonArrayWorker>(workers->m_Heap, thread_count);
+    for (int i = 0; i < thread_count; ++i)
+        worker_state[i].m_ErrorIndex = count;
+
+    // A failing element stops any further batches from being handed out, but the
+    // batches before it are always finished, so the first error is still found.
+    ParallelFor(thread_count, count, kJsonParallelBatchSize, "Json Parse", [&](int32_t start, int32_t end, int thread_index) {
+        JsonArrayWorker *worker = &worker_state[thread_index];
+        for (int32_t i = start; i < end; ++i)
+        {
+            const JsonIndexMark &before = first[i];
+            const JsonIndexMark &after = first[i + 1];
+
+            // The range includes the separator after the element, so running into
+            // anything else before it is an error.
+            char *separator = buffer + after.m_Offset;
+
+            JsonState *state = &worker->m_State;
+            JsonStateInit(state, &workers->m_Allocators[thread_index], &workers->m_Scratch[thread_index], buffer + before.m_Offset + 1, separator + 1);
+            JsonLexerSeek(&state->m_Lexer, buffer + before.m_Offset + 1, before.m_LineNumber);
+            state->m_Depth = kJsonIndexDepth;
+
+            const JsonValue *value = JsonParseValue(state);
+            if (value)
+            {
+                JsonLexeme l = JsonLexerNext(&state->m_Lexer);
+                if ((kJsonLexValueSeparator != l.m_Type && kJsonLexEndArray != l.m_Type) || state->m_Lexer.m_Cursor != separator + 1)
+                    value = JsonError(state, "expected ','");
+            }
+
+            if (!value)
+            {
+                worker->m_ErrorIndex = i;
+                return false;
+            }
+
+            values[i] = value;
+        }
+        return true;
+    });
+
+    // Report the first failing element, like the serial parser would.
+    const JsonArrayWorker *failed = nullptr;
+    for (int i = 0; i < thread_count; ++i)
+    {
+        if (worker_state[i].m_ErrorIndex != count && (!failed || worker_state[i].m_ErrorIndex < failed->m_ErrorIndex))
+            failed = &worker_state[i];
+    }
+
+    if (failed)
+    {
+        memcpy(json_state->m_ErrorMessage, failed->m_State.m_ErrorMessage, sizeof json_state->m_ErrorMessage);
+        *result = nullptr;
+    }
+    else
+    {
+        JsonArrayValue *array = LinearAllocate<JsonArrayValue>(alloc);
+        array->m_Type = JsonValue::kArray;
+        array->m_Count = count;
+        array->m_Values = values;
+        *result = array;
+
+        JsonLexerSeek(lexer, buffer + last->m_Offset + 1, last->m_LineNumber);
+    }
+
+    HeapFree(workers->m_Heap, worker_state);
+    return true;
+}
+
 static const JsonValue *JsonParseObject(JsonState *json_state)
 {
     JsonLexerState *lexer = &json_state->m_Lexer;
@@ -511,6 +1511,13 @@ static const JsonValue *JsonParseArray(JsonState *json_state)
     if (!JsonLexerExpect(lexer, kJsonLexBeginArray))
         return JsonError(json_state, "expected '['");
 
+    if (json_state->m_Index && kJsonIndexDepth == json_state->m_Depth)
+    {
+        const JsonValue *result;
+        if (JsonParseArrayParallel(json_state, &result))
+            return result;
+    }
+
     MemAllocLinearScope scratch_scope(json_state->m_Scratch);
 
     struct ListElem
@@ -614,11 +1621,15 @@ static const JsonValue *JsonParseValue(JsonState *json_state)
     switch (l.m_Type)
     {
     case kJsonLexBeginObject:
+        ++json_state->m_Depth;
         result = JsonParseObject(json_state);
+        --json_state->m_Depth;
         break;
 
     case kJsonLexBeginArray:
+        ++json_state->m_Depth;
         result = JsonParseArray(json_state);
+        --json_state->m_Depth;
         break;
 
     case kJsonLexString:
@@ -659,28 +1670,22 @@ static const JsonValue *JsonParseValue(JsonState *json_state)
     return result;
 }
 
-const JsonValue *JsonParse(
-    char *buffer,
-    MemAllocLinear *allocator,
-    MemAllocLinear *scratch,
-    char (&error_message)[1024])
+static void JsonSetupStatics()
 {
-    TimingScope timing_scope(nullptr, &g_Stats.m_JsonParseTimeCycles);
-
-    // Setup statics. Harmless to do multiple times.
+    // Harmless to do multiple times.
     s_TrueValue.m_Type = JsonValue::kBoolean;
     s_TrueValue.m_Boolean = true;
     s_FalseValue.m_Type = JsonValue::kBoolean;
     s_FalseValue.m_Boolean = false;
+}
 
-    JsonState json_state;
-    JsonStateInit(&json_state, allocator, scratch, buffer);
-
-    const JsonValue *root = JsonParseValue(&json_state);
+static const JsonValue *JsonParseDocument(JsonState *json_state, char (&error_message)[1024])
+{
+    const JsonValue *root = JsonParseValue(json_state);
 
-    if (root && !JsonLexerExpect(&json_state.m_Lexer, kJsonLexEof))
+    if (root && !JsonLexerExpect(&json_state->m_Lexer, kJsonLexEof))
     {
-        root = JsonError(&json_state, "data after document");
+        root = JsonError(json_state, "data after document");
     }
 
     if (root)
@@ -689,11 +1694,95 @@ const JsonValue *JsonParse(
     }
     else
     {
-        strncpy(error_message, json_state.m_ErrorMessage, sizeof error_message);
+        strncpy(error_message, json_state->m_ErrorMessage, sizeof error_message);
         error_message[sizeof(error_message) - 1] = '\0';
     }
 
     return root;
 }
 
+const JsonValue *JsonParse(
+    char *buffer,
+    MemAllocLinear *allocator,
+    MemAllocLinear *scratch,
+    char (&error_message)[1024])
+{
+    TimingScope timing_scope(nullptr, &g_Stats.m_JsonParseTimeCycles);
+
+    JsonSetupStatics();
+
+    JsonState json_state;
+    JsonStateInit(&json_state, allocator, scratch, buffer, buffer + strlen(buffer));
+
+    return JsonParseDocument(&json_state, error_message);
+}
+
+void JsonParseWorkersInit(JsonParseWorkers *workers, MemAllocHeap *heap)
+{
+    workers->m_Heap = heap;
+    workers->m_Count = 0;
+}
+
+void JsonParseWorkersDestroy(JsonParseWorkers *workers)
+{
+    for (int i = 0; i < workers->m_Count; ++i)
+    {
+        LinearAllocDestroy(&workers->m_Scratch[i]);
+        LinearAllocDestroy(&workers->m_Allocators[i]);
+    }
+
+    workers->m_Count = 0;
+}
+
+const JsonValue *JsonParseParallel(
+    char *buffer,
+    size_t size,
+    MemAllocLinear *allocator,
+    MemAllocLinear *scratch,
+    JsonParseWorkers *workers,
+    char (&error_message)[1024])
+{
+    int thread_count = std::min(GetCpuCount(), (int)kMaxJsonParseThreads);
+
+    // As for JsonParse(), the document ends at the first nul.
+    size = strnlen(buffer, size);
+
+    if (size < kJsonParallelMinSize || thread_count < 2)
+        return JsonParse(buffer, allocator, scratch, error_message);
+
+    TimingScope timing_scope(nullptr, &g_Stats.m_JsonParseTimeCycles);
+
+    JsonSetupStatics();
+
+    MemAllocHeap *heap = workers->m_Heap;
 
+    Buffer<JsonIndexMark> marks;
+    BufferInit(&marks);
+
+    JsonState json_state;
+    JsonStateInit(&json_state, allocator, scratch, buffer, buffer + size);
+
+    JsonIndex index;
+    if (JsonIndexBuild(&marks, buffer, size, heap, thread_count))
+    {
+        index.m_Marks = marks.m_Storage;
+        index.m_Count = marks.m_Size;
+        json_state.m_Index = &index;
+        json_state.m_Workers = workers;
+
+        // Work is handed out in batches, so allow for some imbalance between threads.
+        size_t worker_size = std::max(size_t(MB(64)), 2 * size / thread_count);
+        for (int i = workers->m_Count; i < thread_count; ++i)
+        {
+            LinearAllocInit(&workers->m_Allocators[i], heap, worker_size, "json worker alloc");
+            LinearAllocInit(&workers->m_Scratch[i], heap, MB(16), "json worker scratch");
+        }
+        workers->m_Count = std::max(workers->m_Count, thread_count);
+    }
+
+    const JsonValue *root = JsonParseDocument(&json_state, error_message);
+
+    BufferDestroy(&marks, heap);
+
+    return root;
+}
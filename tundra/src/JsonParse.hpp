@@ -1,11 +1,12 @@
 #pragma once
 
 #include "Common.hpp"
+#include "MemAllocLinear.hpp"
 #include <string.h>
 
 
 
-struct MemAllocLinear;
+struct MemAllocHeap;
 
 struct JsonValue
 {
@@ -143,8 +144,53 @@ inline bool JsonValue::GetBoolean() const
     return b->m_Boolean;
 }
 
+// Kernels for the structural scan that finds quotes, escapes and structural
+// characters. The best one the CPU supports is used by default; selecting one is
+// for tests and benchmarks.
+enum JsonScanKernel
+{
+    kJsonScanKernelScalar,
+    kJsonScanKernelSse2,
+    kJsonScanKernelAvx2,
+    kJsonScanKernelCount
+};
+
+bool JsonSelectScanKernel(int kernel);
+int JsonSelectedScanKernel();
+const char *JsonScanKernelName(int kernel);
+
 const JsonValue *JsonParse(
     char *buffer,
     MemAllocLinear *allocator,
     MemAllocLinear *scratch,
     char (&error_message)[1024]);
+
+enum
+{
+    kMaxJsonParseThreads = 32
+};
+
+// Allocators for the worker threads of JsonParseParallel(). Values parsed on a
+// worker live in its allocator, so these must outlive the parsed document.
+struct JsonParseWorkers
+{
+    MemAllocHeap *m_Heap;
+    int m_Count;
+    MemAllocLinear m_Allocators[kMaxJsonParseThreads];
+    MemAllocLinear m_Scratch[kMaxJsonParseThreads];
+};
+
+void JsonParseWorkersInit(JsonParseWorkers *workers, MemAllocHeap *heap);
+void JsonParseWorkersDestroy(JsonParseWorkers *workers);
+
+// Like JsonParse(), but for large documents a structural index is built first
+// (on several threads), and the elements of big arrays in the root object are
+// then parsed in parallel. `size` is the length of the buffer, excluding the
+// terminating nul.
+const JsonValue *JsonParseParallel(
+    char *buffer,
+    size_t size,
+    MemAllocLinear *allocator,
+    MemAllocLinear *scratch,
+    JsonParseWorkers *workers,
+    char (&error_message)[1024]);
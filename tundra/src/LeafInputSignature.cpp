@@ -12,6 +12,7 @@
 #include "AllBuiltNodes.hpp"
 #include "Atomic.hpp"
 #include <time.h>
+#include <string.h>
 
 #if !TUNDRA_WIN32
 #include <unistd.h>
@@ -30,6 +31,7 @@ void CalculateLeafInputSignature(
     const Frozen::DagNode* dagNode,
     RuntimeNode* runtimeNode,
     MemAllocLinear* scratch,
+    IoRing* ioRing,
     int profilerThreadId,
     FILE* ingredient_stream)
 {
@@ -83,7 +85,7 @@ void CalculateLeafInputSignature(
 
         if (childRuntimeNode.m_CurrentLeafInputSignature == nullptr)
         {
-            CalculateLeafInputSignature(buildQueue, &childDagNode, &childRuntimeNode, scratch, profilerThreadId, nullptr);
+            CalculateLeafInputSignature(buildQueue, &childDagNode, &childRuntimeNode, scratch, ioRing, profilerThreadId, nullptr);
             CHECK(childRuntimeNode.m_CurrentLeafInputSignature != nullptr);
         }
 
@@ -166,10 +168,23 @@ void CalculateLeafInputSignature(
 
     auto digest_cache = buildQueue->m_Config.m_DigestCache;
 
-    auto addFileContentsToHash = [&](const char* filename, uint32_t filename_hash, const char* label)
-    {
-        HashDigest digest = ComputeFileSignatureSha1(stat_cache, digest_cache, filename, filename_hash);
+    // Digest all leaf inputs as one batch, explicit ones first, in the order they are hashed below.
+    int explicitCount = (int)explicitLeafInputs.m_RecordCount;
+    int leafInputCount = explicitCount + (int)implicitLeafInputs.m_RecordCount;
+    FileAndHash* leafInputFiles = HeapAllocateArray<FileAndHash>(heap, leafInputCount);
+    HashDigest* leafInputDigests = HeapAllocateArray<HashDigest>(heap, leafInputCount);
+    int leafInputIndex = 0;
+    auto collectLeafInput = [&](uint32_t index, uint32_t hash, const char *filename) {
+        leafInputFiles[leafInputIndex].m_Filename = filename;
+        leafInputFiles[leafInputIndex].m_FilenameHash = hash;
+        leafInputIndex++;
+    };
+    HashSetWalk(&explicitLeafInputs, collectLeafInput);
+    HashSetWalk(&implicitLeafInputs, collectLeafInput);
+    ComputeFileSignaturesSha1(stat_cache, digest_cache, leafInputFiles, leafInputCount, leafInputDigests, heap, ioRing);
 
+    auto addFileContentsToHash = [&](const char* filename, const HashDigest& digest, const char* label)
+    {
         if (ingredient_stream)
         {
             char digestString[kDigestStringSize];
@@ -184,12 +199,11 @@ void CalculateLeafInputSignature(
         HashUpdate(&hashState, &digest, sizeof(digest));
     };
 
-    HashSetWalk(&explicitLeafInputs, [&](uint32_t index, uint32_t hash, const char *filename) {
-        addFileContentsToHash(filename, hash, "explicitLeafInput");
-    });
-    HashSetWalk(&implicitLeafInputs, [&](uint32_t index, uint32_t hash, const char *filename) {
-        addFileContentsToHash(filename, hash, "implicitLeafInput");
-    });
+    for (int i = 0; i < leafInputCount; i++)
+        addFileContentsToHash(leafInputFiles[i].m_Filename, leafInputDigests[i], i < explicitCount ? "explicitLeafInput" : "implicitLeafInput");
+
+    HeapFree(heap, leafInputDigests);
+    HeapFree(heap, leafInputFiles);
 
     HashFinalize(&hashState, &result->digest);
 
@@ -237,6 +251,7 @@ void PrintLeafInputSignature(BuildQueue* buildQueue, const char* outputFile)
         &dagNode,
         nullptr,
         &scratch,
+        nullptr,
         0,
         output_signature);
     fclose(output_signature);
@@ -326,7 +341,8 @@ bool VerifyAllVersionedFilesIncludedByGeneratedHeaderFilesWereAlreadyPartOfTheLe
     {
         auto error = illegalIncludesToReport[0];
 
-        ExecResult result = {0, false};
+        ExecResult result;
+        memset(&result, 0, sizeof(result));
         result.m_ReturnCode = 1;
 
         InitOutputBuffer(&result.m_OutputBuffer, &thread_state->m_LocalHeap);
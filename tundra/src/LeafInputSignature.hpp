@@ -13,6 +13,7 @@ struct RuntimeNode;
 struct ThreadState;
 struct MemAllocHeap;
 struct BuildQueue;
+struct IoRing;
 
 struct LeafInputSignatureData
 {
@@ -28,6 +29,7 @@ void CalculateLeafInputSignature(
     const Frozen::DagNode* dagNode,
     RuntimeNode* runtimeNode,
     MemAllocLinear* scratch,
+    IoRing* ioRing,
     int profilerThreadId,
     FILE* ingredient_stream);
 
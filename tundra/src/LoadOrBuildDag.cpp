@@ -42,7 +42,14 @@ bool LoadOrBuildDag(Driver *self, const char *dag_fn)
 
     FileInfo dagderived_info = GetFileInfo(dagderived_filename);
 
-    if (self->m_Options.m_DagFileNameJson != nullptr)
+    const bool fresh_dag = self->m_Options.m_DagFileNameJson != nullptr || self->m_Options.m_DagFileNameStream != nullptr;
+
+    if (self->m_Options.m_DagFileNameStream != nullptr)
+    {
+        if (!FreezeDagStream(self->m_Options.m_DagFileNameStream, dag_fn))
+            return ExitRequestingFrontendRun("%s failed to freeze", self->m_Options.m_DagFileNameStream);
+    }
+    else if (self->m_Options.m_DagFileNameJson != nullptr)
     {
         if (!FreezeDagJson(self->m_Options.m_DagFileNameJson, dag_fn))
             return ExitRequestingFrontendRun("%s failed to freeze", self->m_Options.m_DagFileNameJson);
@@ -56,7 +63,7 @@ bool LoadOrBuildDag(Driver *self, const char *dag_fn)
     }
 
     //only check for cycles when the dag is fresh
-    if (self->m_Options.m_DagFileNameJson != nullptr)
+    if (fresh_dag)
     {
         if (DetectCyclicDependencies(self->m_DagData, &self->m_Heap))
         {
@@ -68,7 +75,7 @@ bool LoadOrBuildDag(Driver *self, const char *dag_fn)
         }
     }
 
-    if (!dagderived_info.Exists() || self->m_Options.m_DagFileNameJson != nullptr)
+    if (!dagderived_info.Exists() || fresh_dag)
     {
         if (!CompileDagDerived(self->m_DagData, &self->m_Heap, &self->m_Allocator, &self->m_StatCache, dagderived_filename))
             return ExitRequestingFrontendRun("failed to create derived dag file %s", dagderived_filename);
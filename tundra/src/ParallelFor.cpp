@@ -0,0 +1,85 @@
+#include "ParallelFor.hpp"
+#include "Thread.hpp"
+#include "Atomic.hpp"
+
+#include <algorithm>
+
+#include "Banned.hpp"
+
+struct ParallelForJob
+{
+    ParallelForBody m_Body;
+    void *m_UserData;
+    int32_t m_Count;
+    int32_t m_BatchSize;
+    int32_t m_NextBatch;
+    int32_t m_Failed;
+};
+
+struct ParallelForThread
+{
+    ParallelForJob *m_Job;
+    int m_ThreadIndex;
+};
+
+static ThreadRoutineReturnType TUNDRA_STDCALL ParallelForThreadRoutine(void *param)
+{
+    ParallelForThread *thread = (ParallelForThread *)param;
+    ParallelForJob *job = thread->m_Job;
+
+    while (0 == AtomicLoad(&job->m_Failed))
+    {
+        int32_t batch = AtomicAdd32(&job->m_NextBatch, 1) - 1;
+        if (batch >= (job->m_Count + job->m_BatchSize - 1) / job->m_BatchSize)
+            break;
+
+        int32_t start = batch * job->m_BatchSize;
+        int32_t end = std::min(start + job->m_BatchSize, job->m_Count);
+        if (!job->m_Body(job->m_UserData, start, end, thread->m_ThreadIndex))
+        {
+            AtomicAdd32(&job->m_Failed, 1);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int ParallelForThreadCount(int max_threads, int32_t count, int32_t batch_size)
+{
+    int32_t batch_count = (count + batch_size - 1) / batch_size;
+    int thread_count = std::min(std::min(GetCpuCount(), max_threads), int(kMaxParallelForThreads));
+    return std::max(1, std::min(thread_count, int(batch_count)));
+}
+
+bool ParallelFor(int thread_count, int32_t count, int32_t batch_size, ParallelForBody body, void *user_data, const char *thread_name)
+{
+    CHECK(thread_count >= 1 && thread_count <= kMaxParallelForThreads);
+
+    ParallelForJob job;
+    job.m_Body = body;
+    job.m_UserData = user_data;
+    job.m_Count = count;
+    job.m_BatchSize = batch_size;
+    job.m_NextBatch = 0;
+    job.m_Failed = 0;
+
+    ParallelForThread threads[kMaxParallelForThreads];
+    ThreadId thread_ids[kMaxParallelForThreads];
+    for (int i = 0; i < thread_count; ++i)
+    {
+        threads[i].m_Job = &job;
+        threads[i].m_ThreadIndex = i;
+    }
+
+    for (int i = 1; i < thread_count; ++i)
+        thread_ids[i] = ThreadStart(ParallelForThreadRoutine, &threads[i], thread_name);
+
+    // The calling thread does its share too.
+    ParallelForThreadRoutine(&threads[0]);
+
+    for (int i = 1; i < thread_count; ++i)
+        ThreadJoin(thread_ids[i]);
+
+    return 0 == job.m_Failed;
+}
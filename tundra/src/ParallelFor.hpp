@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Common.hpp"
+
+enum
+{
+    kMaxParallelForThreads = 32
+};
+
+// Called for the items [start, end) of one batch, on the thread with the given index. The calling thread has index 0.
+// Returning false stops any further batches from being handed out.
+typedef bool (*ParallelForBody)(void *user_data, int32_t start, int32_t end, int thread_index);
+
+// How many threads ParallelFor() should use for count items: no more than max_threads, the cpu count, or the number of
+// batches. Callers with per-thread state size it with this.
+int ParallelForThreadCount(int max_threads, int32_t count, int32_t batch_size);
+
+// Hands out the items [0, count) in batches of batch_size, in order, to thread_count threads. The calling thread works
+// through batches too, and all threads are joined before this returns. Returns false if any body returned false.
+bool ParallelFor(int thread_count, int32_t count, int32_t batch_size, ParallelForBody body, void *user_data, const char *thread_name);
+
+// Same, with a callable bool body(int32_t start, int32_t end, int thread_index).
+template <typename Body>
+bool ParallelFor(int thread_count, int32_t count, int32_t batch_size, const char *thread_name, const Body &body)
+{
+    auto call = [](void *user_data, int32_t start, int32_t end, int thread_index) -> bool {
+        return (*static_cast<const Body *>(user_data))(start, end, thread_index);
+    };
+    return ParallelFor(thread_count, count, batch_size, call, const_cast<Body *>(&body), thread_name);
+}
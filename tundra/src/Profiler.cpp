@@ -17,6 +17,7 @@ struct ProfilerEvent
     const char *m_Name;
     const char *m_Info;
     const char *m_Color;
+    const char *m_Args;
 };
 
 struct ProfilerThread
@@ -145,7 +146,7 @@ void ProfilerWriteOutput()
                 cnameEntry = buffer;
             }
 
-            fprintf(f, ",{ \"pid\":12345, \"tid\":%d, \"ts\":%" PRIu64 ", \"dur\":%" PRIu64 ", \"ph\":\"X\", \"name\": \"%s\", %s \"args\": { \"detail\":\"%s\" }}\n", i, evt.m_Time, evt.m_Duration, name, cnameEntry, info);
+            fprintf(f, ",{ \"pid\":12345, \"tid\":%d, \"ts\":%" PRIu64 ", \"dur\":%" PRIu64 ", \"ph\":\"X\", \"name\": \"%s\", %s \"args\": { \"detail\":\"%s\"%s%s }}\n", i, evt.m_Time, evt.m_Duration, name, cnameEntry, info, evt.m_Args ? ", " : "", evt.m_Args ? evt.m_Args : "");
         }
     }
 
@@ -205,6 +206,7 @@ void ProfilerBeginImpl(const char *name, int threadIndex, const char *info, cons
     ProfilerEvent &evt = thread.m_Events[thread.m_EventCount++];
     evt.m_Time = TimerGet();
     evt.m_Color = color;
+    evt.m_Args = nullptr;
 
     // split input name by first space
     const char *nextWord = strchr(name, ' ');
@@ -234,3 +236,14 @@ void ProfilerEndImpl(int threadIndex)
     evt.m_Duration = TimerGet() - evt.m_Time;
 }
 
+void ProfilerSetArgsImpl(int threadIndex, const char *args)
+{
+    CHECK(g_ProfilerEnabled);
+    CHECK(threadIndex >= 0 && threadIndex < s_ProfilerState.m_ThreadCount);
+    ProfilerThread &thread = s_ProfilerState.m_Threads[threadIndex];
+    // Once the buffer is full the open event may not have been recorded, so its args are dropped.
+    if (!thread.m_IsBegin || thread.m_EventCount >= (int)kProfilerThreadMaxEvents)
+        return;
+    ProfilerEvent &evt = thread.m_Events[thread.m_EventCount - 1];
+    evt.m_Args = StrDup(&thread.m_ScratchStrings, args);
+}
@@ -15,6 +15,7 @@ void ProfilerDestroy();
 
 void ProfilerBeginImpl(const char *name, int threadIndex, const char *info, const char *color = nullptr);
 void ProfilerEndImpl(int threadIndex);
+void ProfilerSetArgsImpl(int threadIndex, const char *args);
 
 inline void ProfilerBegin(const char *name, int threadIndex, const char *info = nullptr, const char *color = nullptr)
 {
@@ -28,6 +29,14 @@ inline void ProfilerEnd(int threadIndex)
         ProfilerEndImpl(threadIndex);
 }
 
+// Attach extra "args" members to the event that is open on the thread, as preformatted
+// JSON like "\"a\":1, \"b\":2". Does nothing when no event is open.
+inline void ProfilerSetArgs(int threadIndex, const char *args)
+{
+    if (g_ProfilerEnabled)
+        ProfilerSetArgsImpl(threadIndex, args);
+}
+
 struct ProfilerScope
 {
     int m_ThreadId;
@@ -139,9 +139,9 @@ void RemoveStaleOutputs(Driver *self)
     HashSet<kFlagPathStrings> outputdir_nuke_table;
     HashSetInit(&outputdir_nuke_table, &self->m_Heap);
 
-    for (int i = 0, state_count = all_built_nodes->m_NodeCount; i < state_count; ++i)
+    for (int i = 0, state_count = self->m_StateJournal.m_NodeCount; i < state_count; ++i)
     {
-        const Frozen::BuiltNode *built_node = all_built_nodes->m_BuiltNodes + i;
+        const Frozen::BuiltNode *built_node = self->m_StateJournal.m_BuiltNodes[i];
 
         if (!NodeWasUsedByThisDagPreviously(built_node, dag->m_HashedIdentifier))
             continue;
@@ -51,6 +51,9 @@ static bool IsRunShellCommandAction(RuntimeNode* node)
 
 static bool AllowUnwrittenOutputFiles(RuntimeNode* node)
 {
+    // CopyFiles leaves targets that are already up to date alone.
+    if ((node->m_DagNode->m_FlagsAndActionType & Frozen::DagNode::kFlagActionTypeMask) == ActionType::kCopyFiles)
+        return true;
     return node->m_DagNode->m_FlagsAndActionType & Frozen::DagNode::kFlagAllowUnwrittenOutputFiles;
 }
 
@@ -78,7 +81,8 @@ static ExecResult RunActualAction(RuntimeNode* node, ThreadState* thread_state,
 
             // thread index 0 is reserved for the main thread, job ids are starting with the first worker at 1
             int job_id = thread_state->m_ThreadIndex - 1;
-            auto result = ExecuteProcess(node_data->m_Action, env_count, env_vars, thread_state->m_Queue->m_Config.m_Heap, job_id, SlowCallback, &slowCallbackData);
+            uint32_t exec_flags = (node_data->m_FlagsAndActionType & Frozen::DagNode::kFlagDirectExec) ? kExecFlagNoShell : 0;
+            auto result = ExecuteProcess(node_data->m_Action, env_count, env_vars, thread_state->m_Queue->m_Config.m_Heap, job_id, SlowCallback, &slowCallbackData, 1, exec_flags);
             *out_validationresult = ValidateExecResultAgainstAllowedOutput(&result, node_data);
             return result;
         }
@@ -90,7 +94,8 @@ static ExecResult RunActualAction(RuntimeNode* node, ThreadState* thread_state,
         case ActionType::kCopyFiles:
         {
             *out_validationresult = ValidationResult::Pass;
-            return CopyFiles(node_data->m_InputFiles.GetArray(), node_data->m_OutputFiles.GetArray(), node_data->m_InputFiles.GetCount(), thread_state->m_Queue->m_Config.m_StatCache, thread_state->m_Queue->m_Config.m_Heap);
+            bool use_hardlinks = 0 != (node_data->m_FlagsAndActionType & Frozen::DagNode::kFlagCopyAsHardlinks);
+            return CopyFiles(node_data->m_InputFiles.GetArray(), node_data->m_OutputFiles.GetArray(), node_data->m_InputFiles.GetCount(), thread_state->m_Queue->m_Config.m_StatCache, thread_state->m_Queue->m_Config.m_Heap, use_hardlinks);
         }
         case ActionType::kUnknown:
         default:
@@ -99,6 +104,7 @@ static ExecResult RunActualAction(RuntimeNode* node, ThreadState* thread_state,
             *out_validationresult = ValidationResult::Pass;
 
             ExecResult result;
+            memset(&result, 0, sizeof(result));
             char tmpBuffer[1024];
             InitOutputBuffer(&result.m_OutputBuffer, thread_state->m_Queue->m_Config.m_Heap);
             snprintf(tmpBuffer, sizeof(tmpBuffer), "Unknown action type %d (%s)", actionType, ActionType::ToString(actionType));
@@ -132,28 +138,17 @@ void PostRunActionBookkeeping(RuntimeNode* node, ThreadState* thread_state)
     }
 };
 
-NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, Mutex *queue_lock)
+// Everything that has to happen before the action of a node can run. Fills in pre_timestamps for the output files.
+// Returns false, after reporting the problem, if the node has failed already.
+static bool PrepareToRunAction(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, uint64_t *pre_timestamps)
 {
-    CheckDoesNotHaveLock(&queue->m_Lock);
-
-    MemAllocLinearScope allocScope(&thread_state->m_ScratchAlloc);
-
     const Frozen::DagNode *node_data = node->m_DagNode;
-
-    const char *cmd_line = node_data->m_Action;
-
-    if (IsRunShellCommandAction(node) && (!cmd_line || cmd_line[0] == '\0'))
-        return NodeBuildResult::kRanSuccesfully;
-
     StatCache *stat_cache = queue->m_Config.m_StatCache;
-    const char *annotation = node_data->m_Annotation;
-
-    int profiler_thread_id = thread_state->m_ThreadIndex;
-    bool echo_cmdline = 0 != (queue->m_Config.m_Flags & BuildQueueConfig::kFlagEchoCommandLines);
 
-    auto FailWithPreparationError = [thread_state,node_data](const char* formatString, ...) -> NodeBuildResult::Enum
+    auto FailWithPreparationError = [thread_state,node_data](const char* formatString, ...) -> bool
     {
-        ExecResult result = {0, false};
+        ExecResult result;
+        memset(&result, 0, sizeof(result));
         char buffer[2000];
         va_list args;
         va_start(args, formatString);
@@ -171,7 +166,7 @@ NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, Ru
 
         ExecResultFreeMemory(&result);
 
-        return NodeBuildResult::kRanFailed;
+        return false;
     };
 
     EventLog::EmitNodeStart(node, thread_state->m_ThreadIndex);
@@ -214,28 +209,19 @@ NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, Ru
 
     for (const FrozenFileAndHash &output_file : node_data->m_AuxOutputFiles)
         if (!EnsureParentDirExistsFor(output_file))
-            return NodeBuildResult::kRanFailed;
+            return false;
 
     for (const FrozenFileAndHash &output_dir : node_data->m_OutputDirectories)
     {
         PathBuffer path;
         PathInit(&path, output_dir.m_Filename);
         if (!MakeDirectoriesRecursive(stat_cache, path))
-            return NodeBuildResult::kRanFailed;
+            return false;
     }
 
     for (const FrozenFileAndHash &output_file : node_data->m_OutputFiles)
         if (!EnsureParentDirExistsFor(output_file))
-            return NodeBuildResult::kRanFailed;
-
-
-
-    size_t n_outputs = (size_t)node_data->m_OutputFiles.GetCount();
-
-    bool *untouched_outputs = (bool *)LinearAllocate(&thread_state->m_ScratchAlloc, n_outputs, (size_t)sizeof(bool));
-    memset(untouched_outputs, 0, n_outputs * sizeof(bool));
-
-    auto passedOutputValidation = ValidationResult::Pass;
+            return false;
 
     for (int i = 0; i < node_data->m_SharedResources.GetCount(); ++i)
     {
@@ -245,17 +231,11 @@ NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, Ru
         }
     }
 
-    Log(kSpam, "Launching process");
-    TimingScope timing_scope(&g_Stats.m_ExecCount, &g_Stats.m_ExecTimeCycles);
-    ProfilerScope prof_scope(annotation, profiler_thread_id);
-
-    uint64_t *pre_timestamps = (uint64_t *)LinearAllocate(&thread_state->m_ScratchAlloc, n_outputs, (size_t)sizeof(uint64_t));
-
     if (!AllowUnwrittenOutputFiles(node))
     {
         uint64_t current_time = time(NULL);
 
-        for (int i = 0; i < n_outputs; i++)
+        for (int i = 0; i < node_data->m_OutputFiles.GetCount(); i++)
         {
             FileInfo info = GetFileInfo(node_data->m_OutputFiles[i].m_Filename);
             pre_timestamps[i] = info.m_Timestamp;
@@ -273,12 +253,19 @@ NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, Ru
         }
     }
 
-    uint64_t time_of_start = TimerGet();
-    ExecResult result = RunActualAction(node, thread_state, queue_lock, &passedOutputValidation);
+    return true;
+}
+
+// Everything that happens after the action of a node has run: checking the outputs, bookkeeping and reporting.
+// Frees the result.
+static NodeBuildResult::Enum CompleteAction(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, ExecResult *result, ValidationResult::Enum passedOutputValidation, const uint64_t *pre_timestamps, bool *untouched_outputs, uint64_t time_of_start, uint64_t time_of_exit)
+{
+    const Frozen::DagNode *node_data = node->m_DagNode;
+    bool echo_cmdline = 0 != (queue->m_Config.m_Flags & BuildQueueConfig::kFlagEchoCommandLines);
 
     if (passedOutputValidation == ValidationResult::Pass && !AllowUnwrittenOutputFiles(node))
     {
-        for (int i = 0; i < n_outputs; i++)
+        for (int i = 0; i < node_data->m_OutputFiles.GetCount(); i++)
         {
             FileInfo info = GetFileInfo(node_data->m_OutputFiles[i].m_Filename);
             bool untouched = pre_timestamps[i] == info.m_Timestamp;
@@ -290,21 +277,168 @@ NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, Ru
 
     PostRunActionBookkeeping(node, thread_state);
 
-    
+    int duration_in_ms = TimerDiffSeconds(time_of_start, time_of_exit) * 1000;
+    node->m_ExecutionTimeMs = duration_in_ms > 0 ? (uint32_t)duration_in_ms : 1;
+    node->m_PeakMemoryMB = (uint32_t)((result->m_Usage.m_MaxRssKB + 1023) / 1024);
+    node->m_ResourceUsage = result->m_Usage;
+
     //maybe consider changing this to use a dedicated lock for printing, instead of using the queuelock.
     if (EventLog::IsEnabled())
     {
-        int duration_in_ms = TimerDiffSeconds(TimerGet(), time_of_start) * 1000;
-        EventLog::EmitNodeFinish(node, node->m_CurrentInputSignature, result.m_ReturnCode, result.m_OutputBuffer.buffer, duration_in_ms, thread_state->m_ThreadIndex);    
+        EventLog::EmitNodeFinish(node, node->m_CurrentInputSignature, result->m_ReturnCode, result->m_OutputBuffer.buffer, duration_in_ms, result->m_Usage, thread_state->m_ThreadIndex);    
     } 
     
-    PrintNodeResult(&result, node_data, cmd_line, thread_state->m_Queue, thread_state, echo_cmdline, time_of_start, passedOutputValidation, untouched_outputs, false);
+    PrintNodeResult(result, node_data, node_data->m_Action, thread_state->m_Queue, thread_state, echo_cmdline, time_of_start, passedOutputValidation, untouched_outputs, false);
     
-    ExecResultFreeMemory(&result);
+    ExecResultFreeMemory(result);
 
-    if (0 == result.m_ReturnCode && passedOutputValidation < ValidationResult::UnexpectedConsoleOutputFail)
+    if (0 == result->m_ReturnCode && passedOutputValidation < ValidationResult::UnexpectedConsoleOutputFail)
         return NodeBuildResult::kRanSuccesfully;
 
     return NodeBuildResult::kRanFailed;
 }
 
+NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, Mutex *queue_lock)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    MemAllocLinearScope allocScope(&thread_state->m_ScratchAlloc);
+
+    const Frozen::DagNode *node_data = node->m_DagNode;
+
+    const char *cmd_line = node_data->m_Action;
+
+    if (IsRunShellCommandAction(node) && (!cmd_line || cmd_line[0] == '\0'))
+        return NodeBuildResult::kRanSuccesfully;
+
+    const char *annotation = node_data->m_Annotation;
+
+    int profiler_thread_id = thread_state->m_ThreadIndex;
+
+    size_t n_outputs = (size_t)node_data->m_OutputFiles.GetCount();
+
+    bool *untouched_outputs = (bool *)LinearAllocate(&thread_state->m_ScratchAlloc, n_outputs, (size_t)sizeof(bool));
+    memset(untouched_outputs, 0, n_outputs * sizeof(bool));
+
+    uint64_t *pre_timestamps = (uint64_t *)LinearAllocate(&thread_state->m_ScratchAlloc, n_outputs, (size_t)sizeof(uint64_t));
+
+    if (!PrepareToRunAction(queue, thread_state, node, pre_timestamps))
+        return NodeBuildResult::kRanFailed;
+
+    auto passedOutputValidation = ValidationResult::Pass;
+
+    Log(kSpam, "Launching process");
+    TimingScope timing_scope(&g_Stats.m_ExecCount, &g_Stats.m_ExecTimeCycles);
+    ProfilerScope prof_scope(annotation, profiler_thread_id);
+
+    uint64_t time_of_start = TimerGet();
+    ExecResult result = RunActualAction(node, thread_state, queue_lock, &passedOutputValidation);
+    uint64_t time_of_exit = TimerGet();
+
+    NodeBuildResult::Enum build_result = CompleteAction(queue, thread_state, node, &result, passedOutputValidation, pre_timestamps, untouched_outputs, time_of_start, time_of_exit);
+
+    if (g_ProfilerEnabled)
+    {
+        const ExecResourceUsage &usage = node->m_ResourceUsage;
+        char args[256];
+        snprintf(args, sizeof(args), "\"user_ms\":%" PRIu64 ", \"system_ms\":%" PRIu64 ", \"max_rss_kb\":%" PRIu64 ", \"blocks_read\":%" PRIu64 ", \"blocks_written\":%" PRIu64 ", \"voluntary_cs\":%" PRIu64 ", \"involuntary_cs\":%" PRIu64,
+                 usage.m_UserTimeUs / 1000, usage.m_SystemTimeUs / 1000, usage.m_MaxRssKB, usage.m_BlocksRead, usage.m_BlocksWritten,
+                 usage.m_VoluntaryContextSwitches, usage.m_InvoluntaryContextSwitches);
+        ProfilerSetArgs(profiler_thread_id, args);
+    }
+
+    return build_result;
+}
+
+bool CanRunActionAsync(BuildQueue *queue, RuntimeNode *node)
+{
+    return (queue->m_Config.m_Flags & BuildQueueConfig::kFlagAsyncActions) && IsRunShellCommandAction(node);
+}
+
+static void FreeRunningActionOutputState(MemAllocHeap *heap, RunningAction *running)
+{
+    HeapFree(heap, running->m_PreTimestamps);
+    HeapFree(heap, running->m_UntouchedOutputs);
+    running->m_PreTimestamps = nullptr;
+    running->m_UntouchedOutputs = nullptr;
+}
+
+// Start the action of running->m_Node without waiting for the child to exit; running->m_Job.m_OnComplete is called
+// once it has. Returns false, with the result of the node in out_result, if the node is done without that happening,
+// because there was nothing to run, preparation failed, or the process had to be run synchronously after all.
+bool RunActionAsync(BuildQueue *queue, ThreadState *thread_state, RunningAction *running, NodeBuildResult::Enum *out_result)
+{
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    RuntimeNode *node = running->m_Node;
+    const Frozen::DagNode *node_data = node->m_DagNode;
+    MemAllocHeap *heap = queue->m_Config.m_Heap;
+
+    const char *cmd_line = node_data->m_Action;
+    if (!cmd_line || cmd_line[0] == '\0')
+    {
+        *out_result = NodeBuildResult::kRanSuccesfully;
+        return false;
+    }
+
+    // These outlive this thread's scratch allocator scope, so they go on the heap.
+    size_t n_outputs = (size_t)node_data->m_OutputFiles.GetCount();
+    running->m_PreTimestamps = HeapAllocateArray<uint64_t>(heap, n_outputs + 1);
+    running->m_UntouchedOutputs = HeapAllocateArray<bool>(heap, n_outputs + 1);
+    memset(running->m_UntouchedOutputs, 0, (n_outputs + 1) * sizeof(bool));
+
+    if (!PrepareToRunAction(queue, thread_state, node, running->m_PreTimestamps))
+    {
+        FreeRunningActionOutputState(heap, running);
+        *out_result = NodeBuildResult::kRanFailed;
+        return false;
+    }
+
+    int env_count = node_data->m_EnvVars.GetCount();
+    EnvVariable *env_vars = (EnvVariable *)alloca(env_count * sizeof(EnvVariable));
+    for (int i = 0; i < env_count; ++i)
+    {
+        env_vars[i].m_Name = node_data->m_EnvVars[i].m_Name;
+        env_vars[i].m_Value = node_data->m_EnvVars[i].m_Value;
+    }
+
+    Log(kSpam, "Launching process without waiting for it");
+    running->m_Job.m_Result = &running->m_Result;
+    uint32_t exec_flags = (node_data->m_FlagsAndActionType & Frozen::DagNode::kFlagDirectExec) ? kExecFlagNoShell : 0;
+
+    // Once this succeeds, running belongs to whoever picks it up after the child exits.
+    running->m_TimeOfSpawn = TimerGet();
+    if (ExecuteProcessAsync(&running->m_Job, cmd_line, env_count, env_vars, heap, exec_flags))
+        return true;
+
+    {
+        TimingScope timing_scope(&g_Stats.m_ExecCount, &g_Stats.m_ExecTimeCycles);
+        ProfilerScope prof_scope(node_data->m_Annotation, thread_state->m_ThreadIndex);
+
+        ValidationResult::Enum passedOutputValidation;
+        uint64_t time_of_start = TimerGet();
+        ExecResult result = RunActualAction(node, thread_state, &queue->m_Lock, &passedOutputValidation);
+        uint64_t time_of_exit = TimerGet();
+        *out_result = CompleteAction(queue, thread_state, node, &result, passedOutputValidation, running->m_PreTimestamps, running->m_UntouchedOutputs, time_of_start, time_of_exit);
+    }
+    FreeRunningActionOutputState(heap, running);
+    return false;
+}
+
+// The second half of RunActionAsync(), done by the thread that picked up the node after its child exited.
+NodeBuildResult::Enum CompleteRunningAction(ThreadState *thread_state, RunningAction *running)
+{
+    BuildQueue *queue = running->m_Queue;
+    RuntimeNode *node = running->m_Node;
+
+    CheckDoesNotHaveLock(&queue->m_Lock);
+
+    AtomicIncrement(&g_Stats.m_ExecCount);
+    AtomicAdd(&g_Stats.m_ExecTimeCycles, running->m_TimeOfExit - running->m_TimeOfSpawn);
+
+    ValidationResult::Enum passedOutputValidation = ValidateExecResultAgainstAllowedOutput(&running->m_Result, node->m_DagNode);
+
+    NodeBuildResult::Enum result = CompleteAction(queue, thread_state, node, &running->m_Result, passedOutputValidation, running->m_PreTimestamps, running->m_UntouchedOutputs, running->m_TimeOfSpawn, running->m_TimeOfExit);
+    FreeRunningActionOutputState(queue->m_Config.m_Heap, running);
+    return result;
+}
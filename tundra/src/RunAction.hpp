@@ -1,17 +1,49 @@
 #pragma once
 #include "RuntimeNode.hpp"
+#include "Exec.hpp"
+#include "ExecReactor.hpp"
+#include "Buffer.hpp"
 
 struct BuildQueue;
 struct ThreadState;
 struct Mutex;
 
+// A node whose action was started with RunActionAsync(). It stays active while the child runs, and once the child
+// has exited any build thread can pick it up again to do the post-processing and finish the node.
+struct RunningAction
+{
+    RuntimeNode *m_Node;
+    BuildQueue *m_Queue;
+    ExecReactorJob m_Job;
+    ExecResult m_Result;
+    uint64_t m_TimeOfStart;
+    // When the child was spawned and when the reactor saw it exit, so the recorded execution time leaves out
+    // preparation and the wait for a build thread to pick the node up again.
+    uint64_t m_TimeOfSpawn;
+    uint64_t m_TimeOfExit;
+    uint64_t *m_PreTimestamps;
+    bool *m_UntouchedOutputs;
+
+    // ExecuteNode() state, carried over to the thread that resumes the node.
+    Buffer<uint64_t> m_InputTimestamps;
+    bool m_InputFileDatedInTheFuture;
+
+    // Links in the queue's list of running actions and in its list of actions whose child has exited.
+    RunningAction *m_PrevRunning;
+    RunningAction *m_NextRunning;
+    RunningAction *m_NextExited;
+};
+
 void PostRunActionBookkeeping(RuntimeNode* node, ThreadState* thread_state);
 NodeBuildResult::Enum RunAction(BuildQueue *queue, ThreadState *thread_state, RuntimeNode *node, Mutex *queue_lock);
 
+bool CanRunActionAsync(BuildQueue *queue, RuntimeNode *node);
+bool RunActionAsync(BuildQueue *queue, ThreadState *thread_state, RunningAction *running, NodeBuildResult::Enum *out_result);
+NodeBuildResult::Enum CompleteRunningAction(ThreadState *thread_state, RunningAction *running);
+
 struct SlowCallbackData
 {
     const Frozen::DagNode *node_data;
     uint64_t time_of_start;
     const BuildQueue *build_queue;
 };
-
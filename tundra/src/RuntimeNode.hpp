@@ -5,6 +5,8 @@
 #include "Buffer.hpp"
 #include "HashTable.hpp"
 #include "DynamicallyGrowingCollectionOfPaths.hpp"
+#include "Atomic.hpp"
+#include "Exec.hpp"
 
 namespace NodeBuildResult
 {
@@ -53,96 +55,149 @@ struct RuntimeNode
 
     NodeBuildResult::Enum m_BuildResult;
     bool m_Finished;
+
+    // Number of dependencies that have not finished yet. Every finishing dependency decrements it, also before this node
+    // is queued, and queueing adds the total dependency count. The operation that brings it to exactly zero makes the node ready.
+    int32_t m_PendingDependencyCount;
     HashDigest m_CurrentInputSignature;
 
+    // Wall time of the action if it ran this build, at least 1ms, otherwise 0.
+    uint32_t m_ExecutionTimeMs;
+    uint32_t m_PeakMemoryMB;
+    ExecResourceUsage m_ResourceUsage;
+
     DynamicallyGrowingCollectionOfPaths* m_DynamicallyDiscoveredOutputFiles;
     LeafInputSignatureData* m_CurrentLeafInputSignature;
+    // Hand over of cache lookups between the prefetch threads and the build thread, see CachePrefetch.cpp.
+    uint16_t m_CachePrefetchState;
     HashSet<kFlagPathStrings> m_ImplicitInputs;
 };
 
 inline bool RuntimeNodeIsQueued(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kQueued);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kQueued);
 }
 
 inline bool RuntimeNodeHasEverBeenQueued(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kHasEverBeenQueued);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kHasEverBeenQueued);
 }
 
 inline void RuntimeNodeFlagQueued(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kQueued;
-    runtime_node->m_Flags |= RuntimeNodeFlags::kHasEverBeenQueued;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kQueued | RuntimeNodeFlags::kHasEverBeenQueued);
 }
 
 inline void RuntimeNodeFlagUnqueued(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags &= ~RuntimeNodeFlags::kQueued;
+    AtomicAnd16(&runtime_node->m_Flags, (uint16_t)~RuntimeNodeFlags::kQueued);
 }
 
 inline bool RuntimeNodeIsActive(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kActive);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kActive);
 }
 
 inline void RuntimeNodeFlagActive(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kActive;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kActive);
 }
 
 inline void RuntimeNodeSetAttemptedCacheLookup(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kAttemptedCacheLookup;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kAttemptedCacheLookup);
 }
 
 inline bool RuntimeNodeHasAttemptedCacheLookup(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kAttemptedCacheLookup);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kAttemptedCacheLookup);
 }
 
 inline void RuntimeNodeSet_SentBinLogNodeInfoMessage(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kSentBinLogNodeInfoMessage;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kSentBinLogNodeInfoMessage);
 }
 
 inline bool RuntimeNodeHas_SentBinLogNodeInfoMessage(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kSentBinLogNodeInfoMessage);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kSentBinLogNodeInfoMessage);
 }
 
 inline void RuntimeNodeFlagInactive(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags &= ~RuntimeNodeFlags::kActive;
+    AtomicAnd16(&runtime_node->m_Flags, (uint16_t)~RuntimeNodeFlags::kActive);
+}
+
+inline bool RuntimeNodeIsFinished(const RuntimeNode *runtime_node)
+{
+    return AtomicLoad(&runtime_node->m_Finished);
+}
+
+inline bool RuntimeNodeAllDependenciesAreFinished(const RuntimeNode *runtime_node)
+{
+    return 0 == AtomicLoad(&runtime_node->m_PendingDependencyCount);
+}
+
+// Returns true if this was the last dependency the node was waiting for.
+inline bool RuntimeNodeDependencyFinished(RuntimeNode *runtime_node)
+{
+    return 0 == AtomicAdd32(&runtime_node->m_PendingDependencyCount, -1);
+}
+
+// Called once, when the node is first queued. Returns true if all its dependencies have already finished.
+inline bool RuntimeNodeAddPendingDependencies(RuntimeNode *runtime_node, int32_t dependency_count)
+{
+    return 0 == AtomicAdd32(&runtime_node->m_PendingDependencyCount, dependency_count);
+}
+
+inline void RuntimeNodeSetFinished(RuntimeNode *runtime_node)
+{
+    AtomicStore(&runtime_node->m_Finished, true);
+}
+
+// Atomically moves a node from queued to active. Fails if the node is already active or finished, which is how
+// the work stealing scheduler makes sure that a node that got handed out more than once is only processed by one thread.
+inline bool RuntimeNodeTryFlagActive(RuntimeNode *runtime_node)
+{
+    while (true)
+    {
+        uint16_t flags = AtomicLoad(&runtime_node->m_Flags);
+        if ((flags & RuntimeNodeFlags::kActive) || RuntimeNodeIsFinished(runtime_node))
+            return false;
+
+        uint16_t new_flags = (uint16_t)((flags | RuntimeNodeFlags::kActive) & ~RuntimeNodeFlags::kQueued);
+        if (AtomicCompareExchange16(&runtime_node->m_Flags, new_flags, flags))
+            return true;
+    }
 }
 
 inline bool RuntimeNodeIsExplicitlyRequested(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kExplicitlyRequested);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kExplicitlyRequested);
 }
 
 inline void RuntimeNodeSetExplicitlyRequested(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kExplicitlyRequested;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kExplicitlyRequested);
 }
 
 
 inline bool RuntimeNodeIsExplicitlyRequestedThroughUseDependency(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kExplicitlyRequestedThroughUseDependency);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kExplicitlyRequestedThroughUseDependency);
 }
 
 inline void RuntimeNodeSetExplicitlyRequestedThroughUseDependency(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kExplicitlyRequestedThroughUseDependency;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kExplicitlyRequestedThroughUseDependency);
 }
 
 inline void RuntimeNodeSetInputSignatureMightBeIncorrect(RuntimeNode *runtime_node)
 {
-    runtime_node->m_Flags |= RuntimeNodeFlags::kInputSignatureMightBeIncorrect;
+    AtomicOr16(&runtime_node->m_Flags, RuntimeNodeFlags::kInputSignatureMightBeIncorrect);
 }
 
 inline bool RuntimeNodeGetInputSignatureMightBeIncorrect(const RuntimeNode *runtime_node)
 {
-    return 0 != (runtime_node->m_Flags & RuntimeNodeFlags::kInputSignatureMightBeIncorrect);
+    return 0 != (AtomicLoad(&runtime_node->m_Flags) & RuntimeNodeFlags::kInputSignatureMightBeIncorrect);
 }
@@ -7,11 +7,13 @@
 #include "Atomic.hpp"
 #include "Stats.hpp"
 #include "MemoryMappedFile.hpp"
-#include "SortedArrayUtil.hpp"
 #include "HashTable.hpp"
 #include "Profiler.hpp"
+#include "Buffer.hpp"
 
 #include <algorithm>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 #include "Banned.hpp"
@@ -24,8 +26,66 @@ struct ScanCache::Record
     int m_IncludeCount;
     FileAndHash *m_Includes;
     Record *m_Next;
+    // Set once the record is in the log.
+    bool m_Logged;
 };
 
+enum
+{
+    // The log is folded into new frozen data once it holds this many records, or
+    // a quarter as many as the frozen data, whichever is more.
+    kLogCompactMinRecords = 4096,
+    kLogCompactRatio = 4,
+
+    // Keep old entries for a week.
+    kEntryLifetimeSeconds = 60 * 60 * 24 * 7,
+
+    // Accesses to frozen records are logged once their saved access time is older
+    // than this, so that they don't expire while the same frozen file stays in use.
+    kAccessRefreshSeconds = 60 * 60 * 24
+};
+
+static const uint32_t kLogMagic = 0x5ca10901 ^ kTundraHashMagic;
+
+enum
+{
+    // Key, file timestamp, include count and that many null-terminated include paths.
+    kLogRecordInsert = 1,
+    // Key of a frozen record that was used.
+    kLogRecordAccess = 2
+};
+
+struct ScanCacheLogHeader
+{
+    uint32_t m_MagicNumber;
+    uint32_t m_Padding;
+    uint64_t m_Generation;
+};
+
+struct ScanCacheLogRecord
+{
+    uint32_t m_Kind;
+    uint32_t m_PayloadSize;
+};
+
+// Values in m_FrozenAccess.
+enum
+{
+    kFrozenUnused = 0,
+    kFrozenAccessed = 1,
+    // Accessed, and the access is in the log already.
+    kFrozenAccessLogged = 2
+};
+
+static inline uint32_t KeyHash(const HashDigest &key)
+{
+#if ENABLED(USE_SHA1_HASH)
+    return key.m_Words.m_C;
+#elif ENABLED(USE_FAST_HASH)
+    return key.m_Words32[0];
+#endif
+}
+
 void ComputeScanCacheKey(
     HashDigest *key_out,
     const char *filename,
@@ -70,6 +130,11 @@ void ScanCacheInit(ScanCache *self, MemAllocHeap *heap, MemAllocLinear *allocato
     self->m_TableSize = 0;
     self->m_Table = nullptr;
     self->m_FrozenAccess = nullptr;
+    self->m_LogFileName = nullptr;
+    self->m_LogValidSize = 0;
+    self->m_LogRecordCount = 0;
+    self->m_UnloggedCount = 0;
+    self->m_StaleAccessCount = 0;
 
     ReadWriteLockInit(&self->m_Lock);
 }
@@ -83,39 +148,13 @@ void ScanCacheDestroy(ScanCache *self)
     ReadWriteLockDestroy(&self->m_Lock);
 }
 
-void ScanCacheSetCache(ScanCache *self, const Frozen::ScanData *frozen_data)
-{
-    self->m_FrozenData = frozen_data;
-
-    if (frozen_data)
-    {
-        self->m_FrozenAccess = HeapAllocateArrayZeroed<uint8_t>(self->m_Heap, frozen_data->m_EntryCount);
-
-        Log(kDebug, "Scan cache initialized from frozen data - %u entries", frozen_data->m_EntryCount);
-
-#if ENABLED(CHECKED_BUILD)
-        // Paranoia - make sure the cache is sorted.
-        for (int i = 1, count = frozen_data->m_EntryCount; i < count; ++i)
-        {
-            if (frozen_data->m_Keys[i] < frozen_data->m_Keys[i - 1])
-                Croak("Header scanning cache is not sorted");
-        }
-#endif
-    }
-}
-
 static ScanCache::Record *LookupDynamic(ScanCache *self, const HashDigest &key)
 {
     uint32_t table_size = self->m_TableSize;
 
     if (table_size > 0)
     {
-#if ENABLED(USE_SHA1_HASH)
-        const uint32_t hash = key.m_Words.m_C;
-#elif ENABLED(USE_FAST_HASH)
-        const uint32_t hash = key.m_Words32[0];
-#endif
-        uint32_t index = hash & (table_size - 1);
+        uint32_t index = KeyHash(key) & (table_size - 1);
 
         ScanCache::Record *chain = self->m_Table[index];
         while (chain)
@@ -132,6 +171,32 @@ static ScanCache::Record *LookupDynamic(ScanCache *self, const HashDigest &key)
     return nullptr;
 }
 
+// Returns the index of the frozen entry with the given key, or -1.
+static int32_t LookupFrozen(const Frozen::ScanData *scan_data, const HashDigest &key)
+{
+    const uint32_t mask = uint32_t(scan_data->m_IndexSize) - 1;
+    const uint32_t *index = scan_data->m_Index.Get();
+    const HashDigest *keys = scan_data->m_Keys.Get();
+
+    uint32_t slot = KeyHash(key) & mask;
+
+    for (uint32_t distance = 0;; ++distance, slot = (slot + 1) & mask)
+    {
+        uint32_t entry = index[slot];
+        if (0 == entry)
+            return -1;
+
+        const HashDigest &candidate = keys[entry - 1];
+        if (candidate == key)
+            return int32_t(entry - 1);
+
+        // Entries are kept in Robin Hood order, so once we are further from home
+        // than the entry in this slot the key can't be further along.
+        if (((slot - KeyHash(candidate)) & mask) < distance)
+            return -1;
+    }
+}
+
 bool ScanCacheLookup(ScanCache *self, const HashDigest &key, uint64_t timestamp, ScanCacheLookupResult *result_out, MemAllocLinear *scratch)
 {
     bool success = false;
@@ -143,11 +208,10 @@ bool ScanCacheLookup(ScanCache *self, const HashDigest &key, uint64_t timestamp,
 
     if (scan_data)
     {
-        const int32_t count = scan_data->m_EntryCount;
+        int32_t index = LookupFrozen(scan_data, key);
 
-        if (const HashDigest *ptr = BinarySearch(scan_data->m_Keys.Get(), count, key))
+        if (index >= 0)
         {
-            int index = int(ptr - scan_data->m_Keys.Get());
             const Frozen::ScanCacheEntry *entry = scan_data->m_Data.Get() + index;
 
             if (entry->m_FileTimestamp == timestamp)
@@ -169,7 +233,14 @@ bool ScanCacheLookup(ScanCache *self, const HashDigest &key, uint64_t timestamp,
                 // Flag this frozen record as having being accesses, so we don't throw it
                 // away due to timing out. This is technically a race, but we trust CPUs
                 // to sort out the cache line sharing via their cache coherency model.
-                self->m_FrozenAccess[index] = 1;
+                // The worst outcome is that an access is logged twice.
+                if (kFrozenUnused == self->m_FrozenAccess[index])
+                {
+                    self->m_FrozenAccess[index] = kFrozenAccessed;
+
+                    if (scan_data->m_AccessTimes[index] + kAccessRefreshSeconds < uint64_t(time(nullptr)))
+                        AtomicIncrement(&self->m_StaleAccessCount);
+                }
 
                 AtomicIncrement(&g_Stats.m_OldScanCacheHits);
             }
@@ -237,12 +308,7 @@ static void ScanCachePrepareInsert(ScanCache *self)
         while (r)
         {
             ScanCache::Record *next = r->m_Next;
-#if ENABLED(USE_SHA1_HASH)
-            uint32_t hash = r->m_Key.m_Words.m_C;
-#elif ENABLED(USE_FAST_HASH)
-            uint32_t hash = r->m_Key.m_Words32[0];
-#endif
-            uint32_t index = hash & (new_size - 1);
+            uint32_t index = KeyHash(r->m_Key) & (new_size - 1);
 
             r->m_Next = new_table[index];
             new_table[index] = r;
@@ -257,6 +323,63 @@ static void ScanCachePrepareInsert(ScanCache *self)
     HeapFree(heap, old_table);
 }
 
+// Caller holds the write lock, or is the only thread around.
+static void ScanCacheInsertLocked(
+    ScanCache *self,
+    const HashDigest &key,
+    uint64_t timestamp,
+    const char **included_files,
+    int count,
+    bool logged)
+{
+    ScanCache::Record *record = LookupDynamic(self, key);
+
+    // See if we have this record already (races to insert same include set are possible)
+    if (nullptr != record && record->m_FileTimestamp == timestamp)
+        return;
+
+    // Make sure we have room to insert.
+    ScanCachePrepareInsert(self);
+
+    uint32_t table_size = self->m_TableSize;
+    uint32_t index = KeyHash(key) & (table_size - 1);
+
+    // Allocate a new record if needed
+    const bool is_fresh = record == nullptr;
+
+    if (is_fresh)
+    {
+        record = LinearAllocate<ScanCache::Record>(self->m_Allocator);
+        record->m_Key = key;
+    }
+    else if (!record->m_Logged)
+    {
+        // Replacing a record that wasn't logged yet.
+        self->m_UnloggedCount--;
+    }
+
+    record->m_FileTimestamp = timestamp;
+    record->m_IncludeCount = count;
+    record->m_Includes = LinearAllocateArray<FileAndHash>(self->m_Allocator, count);
+    record->m_Logged = logged;
+
+    for (int i = 0; i < count; ++i)
+    {
+        record->m_Includes[i].m_Filename = StrDup(self->m_Allocator, included_files[i]);
+        record->m_Includes[i].m_FilenameHash = Djb2HashPath(included_files[i]);
+    }
+
+    if (is_fresh)
+    {
+        record->m_Next = self->m_Table[index];
+        self->m_Table[index] = record;
+        self->m_RecordCount++;
+    }
+
+    if (!logged)
+        self->m_UnloggedCount++;
+}
+
 void ScanCacheInsert(
     ScanCache *self,
     const HashDigest &key,
@@ -268,50 +391,158 @@ void ScanCacheInsert(
 
     ReadWriteLockWrite(&self->m_Lock);
 
-    ScanCache::Record *record = LookupDynamic(self, key);
+    ScanCacheInsertLocked(self, key, timestamp, included_files, count, false);
 
-    // See if we have this record already (races to insert same include set are possible)
-    if (nullptr == record || record->m_FileTimestamp != timestamp)
+    ReadWriteUnlockWrite(&self->m_Lock);
+}
+
+// Replay the log written on top of the current frozen data into the dynamic table.
+static void ScanCacheLoadLog(ScanCache *self)
+{
+    FILE *f = OpenFile(self->m_LogFileName, "rb");
+    if (!f)
+        return;
+
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (file_size < (long)sizeof(ScanCacheLogHeader))
     {
-        // Make sure we have room to insert.
-        ScanCachePrepareInsert(self);
+        fclose(f);
+        return;
+    }
 
-        uint32_t table_size = self->m_TableSize;
-#if ENABLED(USE_SHA1_HASH)
-        uint32_t hash = key.m_Words.m_C;
-#elif ENABLED(USE_FAST_HASH)
-        uint32_t hash = key.m_Words32[0];
-#endif
-        uint32_t index = hash & (table_size - 1);
+    MemAllocHeap *heap = self->m_Heap;
+    size_t size = (size_t)file_size;
+    char *data = (char *)HeapAllocate(heap, size);
+    size_t bytes_read = fread(data, 1, size, f);
+    fclose(f);
+
+    ScanCacheLogHeader header;
+    memcpy(&header, data, sizeof header);
+
+    if (bytes_read != size || header.m_MagicNumber != kLogMagic || header.m_Generation != self->m_FrozenData->m_Generation)
+    {
+        // Written against some other frozen file; everything in it was either saved there or is lost.
+        Log(kDebug, "Ignoring stale scan cache log %s", self->m_LogFileName);
+        HeapFree(heap, data);
+        return;
+    }
+
+    Buffer<const char *> paths;
+    BufferInit(&paths);
+
+    size_t offset = sizeof header;
+    uint32_t record_count = 0;
+    uint32_t access_count = 0;
+
+    while (size - offset >= sizeof(ScanCacheLogRecord))
+    {
+        ScanCacheLogRecord record;
+        memcpy(&record, data + offset, sizeof record);
+
+        const char *payload = data + offset + sizeof record;
+        const size_t payload_size = record.m_PayloadSize;
+
+        if (payload_size > size - offset - sizeof record || payload_size < sizeof(HashDigest))
+            break;
+
+        HashDigest key;
+        memcpy(&key, payload, sizeof key);
+
+        if (kLogRecordInsert == record.m_Kind)
+        {
+            uint64_t file_timestamp;
+            uint32_t include_count;
+            const size_t fixed_size = sizeof key + sizeof file_timestamp + sizeof include_count;
 
-        // Allocate a new record if needed
-        const bool is_fresh = record == nullptr;
+            if (payload_size < fixed_size)
+                break;
 
-        if (is_fresh)
+            memcpy(&file_timestamp, payload + sizeof key, sizeof file_timestamp);
+            memcpy(&include_count, payload + sizeof key + sizeof file_timestamp, sizeof include_count);
+
+            BufferClear(&paths);
+
+            const char *p = payload + fixed_size;
+            const char *payload_end = payload + payload_size;
+            while (paths.m_Size < include_count && p < payload_end)
+            {
+                const char *terminator = (const char *)memchr(p, 0, payload_end - p);
+                if (!terminator)
+                    break;
+                BufferAppendOne(&paths, heap, p);
+                p = terminator + 1;
+            }
+
+            if (paths.m_Size != include_count)
+                break;
+
+            ScanCacheInsertLocked(self, key, file_timestamp, paths.m_Storage, int(include_count), true);
+        }
+        else if (kLogRecordAccess == record.m_Kind)
+        {
+            int32_t index = LookupFrozen(self->m_FrozenData, key);
+            if (index >= 0)
+                self->m_FrozenAccess[index] = kFrozenAccessLogged;
+            ++access_count;
+        }
+        else
         {
-            record = LinearAllocate<ScanCache::Record>(self->m_Allocator);
-            record->m_Key = key;
+            break;
         }
 
-        record->m_FileTimestamp = timestamp;
-        record->m_IncludeCount = count;
-        record->m_Includes = LinearAllocateArray<FileAndHash>(self->m_Allocator, count);
+        offset += sizeof record + payload_size;
+        ++record_count;
+    }
+
+    BufferDestroy(&paths, heap);
+    HeapFree(heap, data);
+
+    if (offset == size)
+    {
+        self->m_LogValidSize = size;
+        self->m_LogRecordCount = record_count;
+    }
+    else
+    {
+        // Most likely a save that was interrupted. Keep what we could read and write all
+        // of it to a fresh log next time around, rather than appending after the damage.
+        Log(kWarning, "Scan cache log %s is damaged after %u records", self->m_LogFileName, record_count);
 
-        for (int i = 0; i < count; ++i)
+        for (uint32_t ti = 0, tsize = self->m_TableSize; ti < tsize; ++ti)
         {
-            record->m_Includes[i].m_Filename = StrDup(self->m_Allocator, included_files[i]);
-            record->m_Includes[i].m_FilenameHash = Djb2HashPath(included_files[i]);
+            for (ScanCache::Record *r = self->m_Table[ti]; r; r = r->m_Next)
+                r->m_Logged = false;
         }
 
-        if (is_fresh)
+        for (int32_t i = 0, count = self->m_FrozenData->m_EntryCount; i < count; ++i)
         {
-            record->m_Next = self->m_Table[index];
-            self->m_Table[index] = record;
-            self->m_RecordCount++;
+            if (kFrozenAccessLogged == self->m_FrozenAccess[i])
+                self->m_FrozenAccess[i] = kFrozenAccessed;
         }
+
+        self->m_UnloggedCount = self->m_RecordCount;
+        self->m_StaleAccessCount = access_count;
     }
 
-    ReadWriteUnlockWrite(&self->m_Lock);
+    Log(kDebug, "Scan cache log loaded - %u records", record_count);
+}
+
+void ScanCacheSetCache(ScanCache *self, const Frozen::ScanData *frozen_data, const char *log_filename)
+{
+    self->m_FrozenData = frozen_data;
+    self->m_LogFileName = StrDup(self->m_Allocator, log_filename);
+
+    if (frozen_data)
+    {
+        self->m_FrozenAccess = HeapAllocateArrayZeroed<uint8_t>(self->m_Heap, frozen_data->m_EntryCount);
+
+        Log(kDebug, "Scan cache initialized from frozen data - %u entries", frozen_data->m_EntryCount);
+
+        ScanCacheLoadLog(self);
+    }
 }
 
 bool ScanCacheDirty(ScanCache *self)
@@ -320,16 +551,153 @@ bool ScanCacheDirty(ScanCache *self)
 
     ReadWriteLockRead(&self->m_Lock);
 
-    result = self->m_RecordCount > 0;
+    result = self->m_UnloggedCount > 0 || self->m_StaleAccessCount > 0;
 
     ReadWriteUnlockRead(&self->m_Lock);
 
     return result;
 }
 
-static bool SortRecordsByHash(const ScanCache::Record *l, const ScanCache::Record *r)
+bool ScanCacheShouldCompact(ScanCache *self)
+{
+    const Frozen::ScanData *scan_data = self->m_FrozenData;
+
+    if (!scan_data)
+        return true;
+
+    uint32_t threshold = std::max(uint32_t(kLogCompactMinRecords), uint32_t(scan_data->m_EntryCount) / kLogCompactRatio);
+    uint32_t log_records = self->m_LogRecordCount + self->m_UnloggedCount + self->m_StaleAccessCount;
+
+    return log_records >= threshold;
+}
+
+static void WriteLogRecord(Buffer<char> *out, MemAllocHeap *heap, uint32_t kind, const void *payload, size_t payload_size)
+{
+    ScanCacheLogRecord record;
+    record.m_Kind = kind;
+    record.m_PayloadSize = uint32_t(payload_size);
+    BufferAppend(out, heap, (const char *)&record, sizeof record);
+    BufferAppend(out, heap, (const char *)payload, payload_size);
+}
+
+bool ScanCacheAppendLog(ScanCache *self)
 {
-    return l->m_Key < r->m_Key;
+    TimingScope timing_scope(nullptr, &g_Stats.m_ScanCacheSaveTime);
+    ProfilerScope prof_scope("Tundra AppendScanCacheLog", 0);
+
+    const Frozen::ScanData *scan_data = self->m_FrozenData;
+    MemAllocHeap *heap = self->m_Heap;
+
+    CHECK(scan_data);
+
+    Buffer<char> out;
+    BufferInit(&out);
+
+    if (0 == self->m_LogValidSize)
+    {
+        ScanCacheLogHeader header;
+        header.m_MagicNumber = kLogMagic;
+        header.m_Padding = 0;
+        header.m_Generation = scan_data->m_Generation;
+        BufferAppend(&out, heap, (const char *)&header, sizeof header);
+    }
+
+    uint32_t records_out = 0;
+
+    Buffer<char> payload;
+    BufferInit(&payload);
+
+    for (uint32_t ti = 0, tsize = self->m_TableSize; ti < tsize; ++ti)
+    {
+        for (const ScanCache::Record *r = self->m_Table[ti]; r; r = r->m_Next)
+        {
+            if (r->m_Logged)
+                continue;
+
+            uint32_t include_count = uint32_t(r->m_IncludeCount);
+
+            BufferClear(&payload);
+            BufferAppend(&payload, heap, (const char *)&r->m_Key, sizeof r->m_Key);
+            BufferAppend(&payload, heap, (const char *)&r->m_FileTimestamp, sizeof r->m_FileTimestamp);
+            BufferAppend(&payload, heap, (const char *)&include_count, sizeof include_count);
+            for (int i = 0; i < r->m_IncludeCount; ++i)
+                BufferAppend(&payload, heap, r->m_Includes[i].m_Filename, strlen(r->m_Includes[i].m_Filename) + 1);
+
+            WriteLogRecord(&out, heap, kLogRecordInsert, payload.m_Storage, payload.m_Size);
+            ++records_out;
+        }
+    }
+
+    BufferDestroy(&payload, heap);
+
+    // Log the frozen records we used whose access time would otherwise run out.
+    if (self->m_StaleAccessCount > 0)
+    {
+        const uint64_t refresh_cutoff = uint64_t(time(nullptr)) - kAccessRefreshSeconds;
+
+        for (int32_t i = 0, count = scan_data->m_EntryCount; i < count; ++i)
+        {
+            if (kFrozenAccessed == self->m_FrozenAccess[i] && scan_data->m_AccessTimes[i] < refresh_cutoff)
+            {
+                WriteLogRecord(&out, heap, kLogRecordAccess, &scan_data->m_Keys[i], sizeof(HashDigest));
+                ++records_out;
+            }
+        }
+    }
+
+    bool success = false;
+
+    FILE *f = nullptr;
+    if (self->m_LogValidSize > 0)
+    {
+        f = OpenFile(self->m_LogFileName, "r+b");
+        if (f && 0 != fseek(f, long(self->m_LogValidSize), SEEK_SET))
+        {
+            fclose(f);
+            f = nullptr;
+        }
+    }
+    else
+    {
+        f = OpenFile(self->m_LogFileName, "wb");
+    }
+
+    if (f)
+    {
+        success = out.m_Size == fwrite(out.m_Storage, 1, out.m_Size, f);
+        success = 0 == fclose(f) && success;
+    }
+
+    if (success)
+    {
+        // Everything is on disk now, so a second call doesn't write it again.
+        for (uint32_t ti = 0, tsize = self->m_TableSize; ti < tsize; ++ti)
+        {
+            for (ScanCache::Record *r = self->m_Table[ti]; r; r = r->m_Next)
+                r->m_Logged = true;
+        }
+
+        for (int32_t i = 0, count = scan_data->m_EntryCount; i < count && self->m_StaleAccessCount > 0; ++i)
+        {
+            if (kFrozenAccessed == self->m_FrozenAccess[i])
+                self->m_FrozenAccess[i] = kFrozenAccessLogged;
+        }
+
+        self->m_LogValidSize += out.m_Size;
+        self->m_LogRecordCount += records_out;
+        self->m_UnloggedCount = 0;
+        self->m_StaleAccessCount = 0;
+
+        Log(kDebug, "Appended %u records to scan cache log", records_out);
+    }
+    else
+    {
+        Log(kWarning, "Failed to append to scan cache log %s", self->m_LogFileName);
+    }
+
+    BufferDestroy(&out, heap);
+
+    return success;
 }
 
 struct ScanCacheWriter
@@ -339,12 +707,17 @@ struct ScanCacheWriter
     BinarySegment *m_DigestSeg;
     BinarySegment *m_DataSeg;
     BinarySegment *m_TimestampSeg;
+    BinarySegment *m_IndexSeg;
     BinarySegment *m_ArraySeg;
     BinarySegment *m_StringSeg;
     BinaryLocator m_DigestPtr;
     BinaryLocator m_EntryPtr;
     BinaryLocator m_TimestampPtr;
+    BinaryLocator m_IndexPtr;
     uint32_t m_RecordsOut;
+    // Key hash of every record written, in order, for building the index.
+    Buffer<uint32_t> m_KeyHashes;
+    MemAllocHeap *m_Heap;
 };
 
 static void ScanCacheWriterInit(ScanCacheWriter *self, MemAllocHeap *heap)
@@ -355,28 +728,88 @@ static void ScanCacheWriterInit(ScanCacheWriter *self, MemAllocHeap *heap)
     self->m_DigestSeg = BinaryWriterAddSegment(&self->m_Writer);
     self->m_DataSeg = BinaryWriterAddSegment(&self->m_Writer);
     self->m_TimestampSeg = BinaryWriterAddSegment(&self->m_Writer);
+    self->m_IndexSeg = BinaryWriterAddSegment(&self->m_Writer);
     self->m_ArraySeg = BinaryWriterAddSegment(&self->m_Writer);
     self->m_StringSeg = BinaryWriterAddSegment(&self->m_Writer);
 
     self->m_DigestPtr = BinarySegmentPosition(self->m_DigestSeg);
     self->m_EntryPtr = BinarySegmentPosition(self->m_DataSeg);
     self->m_TimestampPtr = BinarySegmentPosition(self->m_TimestampSeg);
+    self->m_IndexPtr = BinarySegmentPosition(self->m_IndexSeg);
 
     self->m_RecordsOut = 0;
+    BufferInit(&self->m_KeyHashes);
+    self->m_Heap = heap;
 }
 
 static void ScanCacheWriterDestroy(ScanCacheWriter *self)
 {
+    BufferDestroy(&self->m_KeyHashes, self->m_Heap);
     BinaryWriterDestroy(&self->m_Writer);
 }
 
+// Lay out the Robin Hood index over all records written. Returns the slot count.
+static uint32_t ScanCacheWriterBuildIndex(ScanCacheWriter *self)
+{
+    const uint32_t record_count = self->m_RecordsOut;
+    const uint32_t *key_hashes = self->m_KeyHashes.m_Storage;
+
+    // Keep the load at or below 2/3 so probe sequences stay short.
+    uint32_t index_size = NextPowerOfTwo(record_count + record_count / 2 + 1);
+    if (index_size < 16)
+        index_size = 16;
+
+    const uint32_t mask = index_size - 1;
+    uint32_t *slots = (uint32_t *)BinarySegmentAlloc(self->m_IndexSeg, sizeof(uint32_t) * index_size);
+    memset(slots, 0, sizeof(uint32_t) * index_size);
+
+    for (uint32_t i = 0; i < record_count; ++i)
+    {
+        uint32_t entry = i + 1;
+        uint32_t slot = key_hashes[i] & mask;
+        uint32_t distance = 0;
+
+        for (;;)
+        {
+            uint32_t resident = slots[slot];
+            if (0 == resident)
+            {
+                slots[slot] = entry;
+                break;
+            }
+
+            // Steal the slot from entries closer to their home than we are, and carry on placing them instead.
+            uint32_t resident_distance = (slot - key_hashes[resident - 1]) & mask;
+            if (resident_distance < distance)
+            {
+                slots[slot] = entry;
+                entry = resident;
+                distance = resident_distance;
+            }
+
+            slot = (slot + 1) & mask;
+            ++distance;
+        }
+    }
+
+    return index_size;
+}
+
 static bool ScanCacheWriterFlush(ScanCacheWriter *self, const char *filename)
 {
+    uint32_t index_size = ScanCacheWriterBuildIndex(self);
+
+    // Tell this file apart from its predecessors, so logs written against them are ignored.
+    uint64_t generation = (uint64_t(time(nullptr)) << 32) ^ TimerGet();
+
     BinarySegmentWriteUint32(self->m_MainSeg, Frozen::ScanData::MagicNumber);
     BinarySegmentWriteUint32(self->m_MainSeg, self->m_RecordsOut);
+    BinarySegmentWriteUint64(self->m_MainSeg, generation);
     BinarySegmentWritePointer(self->m_MainSeg, self->m_DigestPtr);
     BinarySegmentWritePointer(self->m_MainSeg, self->m_EntryPtr);
     BinarySegmentWritePointer(self->m_MainSeg, self->m_TimestampPtr);
+    BinarySegmentWriteUint32(self->m_MainSeg, index_size);
+    BinarySegmentWritePointer(self->m_MainSeg, self->m_IndexPtr);
     BinarySegmentWriteUint32(self->m_MainSeg, Frozen::ScanData::MagicNumber);
 
     // BinaryWriterFlush logs its own errors, don't bother doing to here.
@@ -398,7 +831,6 @@ static void WriteUniqueStringPointer(HashTable<BinaryLocator, kFlagPathStrings>
     BinarySegmentWriteStringData(string_segment, filename);
 }
 
-// Save frozen record unless timestamp is too old
 template <typename T>
 static void SaveRecord(
     ScanCacheWriter *self,
@@ -409,7 +841,6 @@ static void SaveRecord(
     uint64_t file_timestamp,
     uint64_t access_time)
 {
-    // TODO: Check access time to see if we should discard.
     BinarySegment *digest_seg = self->m_DigestSeg;
     BinarySegment *data_seg = self->m_DataSeg;
     BinarySegment *timestamp_seg = self->m_TimestampSeg;
@@ -432,6 +863,8 @@ static void SaveRecord(
 
     BinarySegmentWriteUint64(timestamp_seg, access_time);
 
+    BufferAppendOne(&self->m_KeyHashes, self->m_Heap, KeyHash(*digest));
+
     self->m_RecordsOut++;
 }
 
@@ -440,10 +873,6 @@ bool ScanCacheSave(ScanCache *self, const char *fn, MemAllocHeap *heap)
     TimingScope timing_scope(nullptr, &g_Stats.m_ScanCacheSaveTime);
     ProfilerScope prof_scope("Tundra SaveScanCache", 0);
 
-    MemAllocLinear *scratch = self->m_Allocator;
-
-    MemAllocLinearScope scratch_scope(scratch);
-
     HashTable<BinaryLocator, kFlagPathStrings> string_pool;
     HashTableInit(&string_pool, heap);
 
@@ -452,75 +881,49 @@ bool ScanCacheSave(ScanCache *self, const char *fn, MemAllocHeap *heap)
 
     // Save new view of the scan cache
     //
-    // Algorithm:
+    // The index is a hash table, so records can go out in any order:
     //
-    // - Get all records from the dynamic table (stuff we put in this session)
-    const uint32_t record_count = self->m_RecordCount;
-    ScanCache::Record **dyn_records = LinearAllocateArray<ScanCache::Record *>(scratch, record_count);
-
-    {
-        uint32_t records_out = 0;
-        for (uint32_t ti = 0, tsize = self->m_TableSize; ti < tsize; ++ti)
-        {
-            ScanCache::Record *chain = self->m_Table[ti];
-            while (chain)
-            {
-                dyn_records[records_out++] = chain;
-                chain = chain->m_Next;
-            }
-        }
-
-        CHECK(records_out == record_count);
-    }
-
-    // - Sort these records in key order (by SHA-1 hash)
-    std::sort(dyn_records, dyn_records + record_count, SortRecordsByHash);
-
+    // - Frozen records that haven't expired and weren't replaced in the dynamic table
+    // - Then everything in the dynamic table (from this session and the log)
     const Frozen::ScanData *scan_data = self->m_FrozenData;
-    uint32_t frozen_count = scan_data ? scan_data->m_EntryCount : 0;
-    const HashDigest *frozen_digests = scan_data ? scan_data->m_Keys.Get() : nullptr;
-    const Frozen::ScanCacheEntry *frozen_entries = scan_data ? scan_data->m_Data.Get() : nullptr;
-    const uint64_t *frozen_times = scan_data ? scan_data->m_AccessTimes.Get() : nullptr;
     const uint8_t *frozen_access = self->m_FrozenAccess;
 
     const uint64_t now = time(nullptr);
+    const uint64_t timestamp_cutoff = now - kEntryLifetimeSeconds;
 
-    // Keep old entries for a week.
-    const uint64_t timestamp_cutoff = now - 60 * 60 * 24 * 7;
-
-    auto key_dynamic = [=](size_t index) -> const HashDigest * { return &dyn_records[index]->m_Key; };
-    auto key_frozen = [=](size_t index) { return frozen_digests + index; };
-
-    auto save_dynamic = [&writer, dyn_records, now, &string_pool](size_t index) {
-        SaveRecord(
-            &writer,
-            &string_pool,
-            &dyn_records[index]->m_Key,
-            dyn_records[index]->m_Includes,
-            dyn_records[index]->m_IncludeCount,
-            dyn_records[index]->m_FileTimestamp,
-            now);
-    };
-
-    auto save_frozen = [&](size_t index) {
-        uint64_t timestamp = frozen_times[index];
-        if (frozen_access[index])
-            timestamp = now;
-
-        if (timestamp > timestamp_cutoff)
+    if (scan_data)
+    {
+        const HashDigest *frozen_digests = scan_data->m_Keys.Get();
+        const Frozen::ScanCacheEntry *frozen_entries = scan_data->m_Data.Get();
+        const uint64_t *frozen_times = scan_data->m_AccessTimes.Get();
+
+        for (int32_t i = 0, count = scan_data->m_EntryCount; i < count; ++i)
         {
+            uint64_t timestamp = frozen_times[i];
+            if (frozen_access[i])
+                timestamp = now;
+
+            if (timestamp <= timestamp_cutoff || LookupDynamic(self, frozen_digests[i]))
+                continue;
+
             SaveRecord(
                 &writer,
                 &string_pool,
-                frozen_digests + index,
-                frozen_entries[index].m_IncludedFiles.GetArray(),
-                frozen_entries[index].m_IncludedFiles.GetCount(),
-                frozen_entries[index].m_FileTimestamp,
+                frozen_digests + i,
+                frozen_entries[i].m_IncludedFiles.GetArray(),
+                frozen_entries[i].m_IncludedFiles.GetCount(),
+                frozen_entries[i].m_FileTimestamp,
                 timestamp);
         }
-    };
+    }
 
-    TraverseSortedArrays(record_count, save_dynamic, key_dynamic, frozen_count, save_frozen, key_frozen);
+    for (uint32_t ti = 0, tsize = self->m_TableSize; ti < tsize; ++ti)
+    {
+        for (const ScanCache::Record *r = self->m_Table[ti]; r; r = r->m_Next)
+        {
+            SaveRecord(&writer, &string_pool, &r->m_Key, r->m_Includes, r->m_IncludeCount, r->m_FileTimestamp, now);
+        }
+    }
 
     self->m_FrozenData = nullptr;
 
@@ -533,5 +936,3 @@ bool ScanCacheSave(ScanCache *self, const char *fn, MemAllocHeap *heap)
 
     return result;
 }
-
-
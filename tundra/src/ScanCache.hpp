@@ -34,13 +34,25 @@ struct ScanCache
     uint32_t m_TableSize;
     Record **m_Table;
     bool m_Initialized;
-    // Table of bits to track whether frozen records have been accessed.
+    // Per frozen record, whether it has been accessed (and whether that access is logged).
     uint8_t *m_FrozenAccess;
+
+    // Append-only log of records added since the frozen data was written. Its
+    // records are loaded into the dynamic table on startup.
+    const char *m_LogFileName;
+    // Number of bytes at the start of the log that parsed, 0 if there is no usable log.
+    uint64_t m_LogValidSize;
+    uint32_t m_LogRecordCount;
+    // Records added in this session that are not in the log yet.
+    uint32_t m_UnloggedCount;
+    // Frozen records accessed in this session whose saved access time is getting old.
+    uint32_t m_StaleAccessCount;
 };
 
 void ScanCacheInit(ScanCache *self, MemAllocHeap *heap, MemAllocLinear *allocator);
 
-void ScanCacheSetCache(ScanCache *self, const Frozen::ScanData *frozen_data);
+// Start from frozen data (which may be null) and the log of changes made on top of it.
+void ScanCacheSetCache(ScanCache *self, const Frozen::ScanData *frozen_data, const char *log_filename);
 
 void ScanCacheDestroy(ScanCache *self);
 
@@ -50,4 +62,13 @@ void ScanCacheInsert(ScanCache *self, const HashDigest &key, uint64_t timestamp,
 
 bool ScanCacheDirty(ScanCache *self);
 
+// True when the log has grown large enough relative to the frozen data that it
+// should be folded into a fresh frozen file with ScanCacheSave().
+bool ScanCacheShouldCompact(ScanCache *self);
+
+// Append this session's changes to the log. Costs time proportional to the
+// changes only.
+bool ScanCacheAppendLog(ScanCache *self);
+
+// Write everything out as new frozen data. The log is obsolete afterwards.
 bool ScanCacheSave(ScanCache *self, const char *fn, MemAllocHeap *heap);
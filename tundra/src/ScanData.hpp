@@ -12,15 +12,27 @@ struct ScanCacheEntry
 
 struct ScanData
 {
-    static const uint32_t MagicNumber = 0x1517000f ^ kTundraHashMagic;
+    static const uint32_t MagicNumber = 0x15170010 ^ kTundraHashMagic;
 
     uint32_t m_MagicNumber;
 
     int32_t m_EntryCount;
 
+    // Changes made since this file was written are appended to a log that is
+    // only valid for the same generation.
+    uint64_t m_Generation;
+
     FrozenPtr<HashDigest> m_Keys;
     FrozenPtr<ScanCacheEntry> m_Data;
     FrozenPtr<uint64_t> m_AccessTimes;
+
+    // Robin Hood hash index over the entries, keyed on the first word of the key.
+    // The slot count is a power of two; each slot holds an entry index plus one,
+    // with zero marking an empty slot.
+    int32_t m_IndexSize;
+    FrozenPtr<uint32_t> m_Index;
+
     uint32_t m_MagicNumberEnd;
 };
+static_assert(sizeof(ScanData) == 40, "struct size");
 }
@@ -5,6 +5,11 @@
 #include "Mutex.hpp"
 #include "Atomic.hpp"
 #include "BuildQueue.hpp"
+#include "RuntimeNode.hpp"
+#include "AllBuiltNodes.hpp"
+#include "Driver.hpp"
+#include "Stats.hpp"
+#include <algorithm>
 #include "Banned.hpp"
 
 
@@ -65,3 +70,249 @@ void SharedResourceDestroy(BuildQueue *queue, MemAllocHeap *heap, uint32_t share
     queue->m_SharedResourcesCreated[sharedResourceIndex] = 0;
 }
 
+
+struct ActionWeights
+{
+    int64_t m_Cpu;
+    int64_t m_MemoryMB;
+    bool m_UsesLimitedSharedResource;
+};
+
+static ActionWeights GetActionWeights(const BuildQueue *queue, const RuntimeNode *node)
+{
+    const Frozen::DagNode *dag_node = node->m_DagNode;
+
+    ActionWeights weights;
+    weights.m_Cpu = queue->m_CpuCapacity > 0 ? std::min<int64_t>(dag_node->m_CpuWeight, queue->m_CpuCapacity) : 0;
+
+    int64_t memory = dag_node->m_MemoryWeightMB;
+    if (memory == 0 && queue->m_Config.m_DriverOptions->m_LearnMemoryWeights && node->m_BuiltNode != nullptr)
+        memory = node->m_BuiltNode->m_PeakMemoryMB;
+    weights.m_MemoryMB = std::min(memory, queue->m_MemoryCapacityMB);
+
+    weights.m_UsesLimitedSharedResource = false;
+    for (int32_t resource : dag_node->m_SharedResources)
+        if (queue->m_Config.m_SharedResources[resource].m_Capacity > 0)
+            weights.m_UsesLimitedSharedResource = true;
+
+    return weights;
+}
+
+static bool IsLimited(const ActionWeights &weights)
+{
+    return weights.m_Cpu > 0 || weights.m_MemoryMB > 0 || weights.m_UsesLimitedSharedResource;
+}
+
+// The resources that deferred actions ahead in line are waiting for.
+struct HeldUpResources
+{
+    bool m_Cpu;
+    bool m_Memory;
+    bool *m_Shared;
+};
+
+static void HeldUpResourcesInit(BuildQueue *queue, HeldUpResources *held_up)
+{
+    held_up->m_Cpu = false;
+    held_up->m_Memory = false;
+    held_up->m_Shared = queue->m_SharedResourceHeldUp;
+    memset(held_up->m_Shared, 0, queue->m_Config.m_SharedResourcesCount * sizeof(bool));
+}
+
+// Whether the action of the node has to wait, because a resource it needs is short or an action ahead of it is
+// waiting for that resource. Marks the resources it waits for, so the actions behind it don't get ahead on those.
+static bool MustWait(const BuildQueue *queue, const RuntimeNode *node, const ActionWeights &weights, HeldUpResources *held_up)
+{
+    bool wait = false;
+    if (weights.m_Cpu > 0 && (held_up->m_Cpu || queue->m_CpuInUse + weights.m_Cpu > queue->m_CpuCapacity))
+        wait = held_up->m_Cpu = true;
+    if (weights.m_MemoryMB > 0 && (held_up->m_Memory || queue->m_MemoryInUseMB + weights.m_MemoryMB > queue->m_MemoryCapacityMB))
+        wait = held_up->m_Memory = true;
+    for (int32_t resource : node->m_DagNode->m_SharedResources)
+    {
+        int32_t capacity = queue->m_Config.m_SharedResources[resource].m_Capacity;
+        if (capacity > 0 && (held_up->m_Shared[resource] || queue->m_SharedResourceUsers[resource] >= capacity))
+            wait = held_up->m_Shared[resource] = true;
+    }
+    return wait;
+}
+
+static void Take(BuildQueue *queue, const RuntimeNode *node, const ActionWeights &weights)
+{
+    queue->m_CpuInUse += weights.m_Cpu;
+    queue->m_MemoryInUseMB += weights.m_MemoryMB;
+    for (int32_t resource : node->m_DagNode->m_SharedResources)
+        queue->m_SharedResourceUsers[resource]++;
+}
+
+static void DestroyDeferredAction(BuildQueue *queue, DeferredAction *deferred)
+{
+    BufferDestroy(&deferred->m_InputTimestamps, queue->m_Config.m_Heap);
+    HeapFree(queue->m_Config.m_Heap, deferred);
+}
+
+void ActionResourcesInit(BuildQueue *queue)
+{
+    const Frozen::Dag *dag = queue->m_Config.m_Dag;
+
+    MutexInit(&queue->m_ActionResourcesLock);
+    BufferInit(&queue->m_DeferredActions);
+
+    queue->m_CpuCapacity = dag->m_CpuCapacity;
+    queue->m_MemoryCapacityMB = dag->m_MemoryCapacityMB > 0 ? dag->m_MemoryCapacityMB : (int64_t)GetPhysicalMemoryMB();
+    queue->m_CpuInUse = 0;
+    queue->m_MemoryInUseMB = 0;
+    queue->m_SharedResourceUsers = HeapAllocateArrayZeroed<int32_t>(queue->m_Config.m_Heap, queue->m_Config.m_SharedResourcesCount);
+    queue->m_SharedResourceHeldUp = HeapAllocateArrayZeroed<bool>(queue->m_Config.m_Heap, queue->m_Config.m_SharedResourcesCount);
+    queue->m_DeferredActionCount = 0;
+    queue->m_ActionResourcesVersion = 0;
+    queue->m_ActionResourcesVersionWithoutAdmissions = 0;
+}
+
+void ActionResourcesDestroy(BuildQueue *queue)
+{
+    // Left over when the build stopped before they fit.
+    for (DeferredAction *deferred : queue->m_DeferredActions)
+        DestroyDeferredAction(queue, deferred);
+
+    BufferDestroy(&queue->m_DeferredActions, queue->m_Config.m_Heap);
+    HeapFree(queue->m_Config.m_Heap, queue->m_SharedResourceHeldUp);
+    HeapFree(queue->m_Config.m_Heap, queue->m_SharedResourceUsers);
+    MutexDestroy(&queue->m_ActionResourcesLock);
+}
+
+bool ActionResourcesTryAcquire(BuildQueue *queue, const RuntimeNode *node)
+{
+    ActionWeights weights = GetActionWeights(queue, node);
+    if (!IsLimited(weights))
+        return true;
+
+    const uint32_t *priorities = queue->m_NodePriorities;
+    uint32_t priority = priorities[node->m_DagNodeIndex];
+
+    MutexLock(&queue->m_ActionResourcesLock);
+
+    // Deferred actions with a higher priority go first on the resources they are waiting for.
+    HeldUpResources held_up;
+    HeldUpResourcesInit(queue, &held_up);
+    for (const DeferredAction *deferred : queue->m_DeferredActions)
+    {
+        if (priorities[deferred->m_Node->m_DagNodeIndex] < priority)
+            break;
+        MustWait(queue, deferred->m_Node, GetActionWeights(queue, deferred->m_Node), &held_up);
+    }
+
+    bool acquired = !MustWait(queue, node, weights, &held_up);
+    if (acquired)
+        Take(queue, node, weights);
+
+    MutexUnlock(&queue->m_ActionResourcesLock);
+    return acquired;
+}
+
+void ActionResourcesDefer(BuildQueue *queue, DeferredAction *deferred)
+{
+    const uint32_t *priorities = queue->m_NodePriorities;
+    uint32_t priority = priorities[deferred->m_Node->m_DagNodeIndex];
+    deferred->m_TimeDeferred = TimerGet();
+
+    MutexLock(&queue->m_ActionResourcesLock);
+
+    // Behind those with the same priority, so they are let in in the order they came.
+    Buffer<DeferredAction*> &deferred_actions = queue->m_DeferredActions;
+    BufferAppendOne(&deferred_actions, queue->m_Config.m_Heap, deferred);
+    size_t index = deferred_actions.m_Size - 1;
+    for (; index > 0 && priorities[deferred_actions[index - 1]->m_Node->m_DagNodeIndex] < priority; --index)
+        deferred_actions[index] = deferred_actions[index - 1];
+    deferred_actions[index] = deferred;
+
+    queue->m_ActionResourcesVersion++;
+    AtomicAdd32(&queue->m_DeferredActionCount, 1);
+
+    MutexUnlock(&queue->m_ActionResourcesLock);
+}
+
+DeferredAction *ActionResourcesAdmitDeferred(BuildQueue *queue)
+{
+    if (AtomicLoad(&queue->m_DeferredActionCount) == 0)
+        return nullptr;
+
+    DeferredAction *admitted = nullptr;
+
+    MutexLock(&queue->m_ActionResourcesLock);
+
+    if (queue->m_ActionResourcesVersion != queue->m_ActionResourcesVersionWithoutAdmissions)
+    {
+        HeldUpResources held_up;
+        HeldUpResourcesInit(queue, &held_up);
+
+        // Past the one that is let in, only look for whether another one would fit as well.
+        Buffer<DeferredAction*> &deferred_actions = queue->m_DeferredActions;
+        size_t admitted_index = 0;
+        bool another_fits = false;
+        for (size_t i = 0; i < deferred_actions.m_Size; ++i)
+        {
+            const RuntimeNode *node = deferred_actions[i]->m_Node;
+            ActionWeights weights = GetActionWeights(queue, node);
+            if (MustWait(queue, node, weights, &held_up))
+                continue;
+
+            if (admitted != nullptr)
+            {
+                another_fits = true;
+                break;
+            }
+
+            Take(queue, node, weights);
+            admitted = deferred_actions[i];
+            admitted_index = i;
+        }
+
+        if (admitted != nullptr)
+        {
+            memmove(deferred_actions.m_Storage + admitted_index, deferred_actions.m_Storage + admitted_index + 1, (deferred_actions.m_Size - admitted_index - 1) * sizeof(DeferredAction*));
+            BufferPopOne(&deferred_actions);
+            AtomicAdd32(&queue->m_DeferredActionCount, -1);
+        }
+
+        if (!another_fits)
+            queue->m_ActionResourcesVersionWithoutAdmissions = queue->m_ActionResourcesVersion;
+    }
+
+    MutexUnlock(&queue->m_ActionResourcesLock);
+
+    if (admitted != nullptr)
+    {
+        AtomicIncrement(&g_Stats.m_ActionResourceWaitCount);
+        AtomicAdd(&g_Stats.m_ActionResourceWaitTimeCycles, TimerGet() - admitted->m_TimeDeferred);
+    }
+    return admitted;
+}
+
+bool ActionResourcesMightAdmitDeferred(BuildQueue *queue)
+{
+    if (AtomicLoad(&queue->m_DeferredActionCount) == 0)
+        return false;
+
+    MutexLock(&queue->m_ActionResourcesLock);
+    bool might_admit = queue->m_ActionResourcesVersion != queue->m_ActionResourcesVersionWithoutAdmissions;
+    MutexUnlock(&queue->m_ActionResourcesLock);
+    return might_admit;
+}
+
+void ActionResourcesRelease(BuildQueue *queue, const RuntimeNode *node)
+{
+    ActionWeights weights = GetActionWeights(queue, node);
+    if (!IsLimited(weights))
+        return;
+
+    MutexLock(&queue->m_ActionResourcesLock);
+
+    queue->m_CpuInUse -= weights.m_Cpu;
+    queue->m_MemoryInUseMB -= weights.m_MemoryMB;
+    for (int32_t resource : node->m_DagNode->m_SharedResources)
+        queue->m_SharedResourceUsers[resource]--;
+    queue->m_ActionResourcesVersion++;
+
+    MutexUnlock(&queue->m_ActionResourcesLock);
+}
@@ -1,10 +1,42 @@
 #pragma once
 #include <cstdint>
+#include "Buffer.hpp"
 
 struct MemAllocHeap;
 struct SharedResourceData;
 struct BuildQueue;
+struct RuntimeNode;
 
 bool SharedResourceAcquire(BuildQueue *queue, MemAllocHeap *heap, uint32_t sharedResourceIndex);
 void SharedResourceDestroy(BuildQueue *queue, MemAllocHeap *heap, uint32_t sharedResourceIndex);
 
+
+// A node whose action didn't fit in the limits when it was ready to run. It waits in the queue without holding on to
+// a build thread, until a thread looking for work finds that it fits. Carries the ExecuteNode() state needed to run it.
+struct DeferredAction
+{
+    RuntimeNode *m_Node;
+    Buffer<uint64_t> m_InputTimestamps;
+    bool m_InputFileDatedInTheFuture;
+    uint64_t m_TimeDeferred;
+};
+
+// Capacity limits on the actions running at the same time: cpu and memory from the dag's ResourceLimits, and the
+// Capacity of shared resources. Actions that don't fit are deferred. Priority only orders actions that compete for
+// the same resource: a deferred action holds back the ones behind it on the resources it waits for, not on the others.
+void ActionResourcesInit(BuildQueue *queue);
+void ActionResourcesDestroy(BuildQueue *queue);
+
+// Takes the capacity for the action of the node. Returns false, taking nothing, if it has to wait; the caller then
+// hands it to ActionResourcesDefer().
+bool ActionResourcesTryAcquire(BuildQueue *queue, const RuntimeNode *node);
+void ActionResourcesDefer(BuildQueue *queue, DeferredAction *deferred);
+
+// Returns a deferred action that fits now, with its capacity taken, or null if there is none.
+DeferredAction *ActionResourcesAdmitDeferred(BuildQueue *queue);
+
+// Whether ActionResourcesAdmitDeferred() might return an action: there are deferred actions, and capacity was released
+// or actions deferred since it last found none that fit.
+bool ActionResourcesMightAdmitDeferred(BuildQueue *queue);
+
+void ActionResourcesRelease(BuildQueue *queue, const RuntimeNode *node);
@@ -1,7 +1,13 @@
 #include "StatCache.hpp"
 #include "MemAllocHeap.hpp"
 #include "MemAllocLinear.hpp"
+#include "BinaryWriter.hpp"
+#include "PathUtil.hpp"
+#include "ParallelFor.hpp"
+#include "Atomic.hpp"
+#include "Buffer.hpp"
 #include "Stats.hpp"
+#include "IoRing.hpp"
 
 #include <algorithm>
 
@@ -14,12 +20,250 @@ void StatCacheInit(StatCache *self, MemAllocLinear *allocator, MemAllocHeap *hea
   self->m_Heap = heap;
   HashTableInit(&self->m_Files, heap);
   ReadWriteLockInit(&self->m_HashLock);
+  MmapFileInit(&self->m_StateFile);
+  self->m_State = nullptr;
+  self->m_StateDirectoryInfos = nullptr;
+  self->m_WatchGeneration = 0;
 }
 
 void StatCacheDestroy(StatCache *self)
 {
   HashTableDestroy(&self->m_Files);
   ReadWriteLockDestroy(&self->m_HashLock);
+  HeapFree(self->m_Heap, self->m_StateDirectoryInfos);
+  MmapFileDestroy(&self->m_StateFile);
+}
+
+// Directories are checked in batches, spread over a few threads. On a large tree that is tens of thousands of stat() calls,
+// and doing them in parallel keeps the filesystem busy rather than waiting for one call at a time.
+static const int kDirectorySweepBatchSize = 64;
+static const int kMaxDirectorySweepThreads = 16;
+
+static void SweepDirectories(const char **paths, FileInfo *results, int32_t count)
+{
+  int thread_count = ParallelForThreadCount(kMaxDirectorySweepThreads, count, kDirectorySweepBatchSize);
+  ParallelFor(thread_count, count, kDirectorySweepBatchSize, "Stat Cache Sweep", [=](int32_t start, int32_t end, int thread_index) {
+    for (int32_t i = start; i < end; ++i)
+      results[i] = GetDirectoryChangeInfo(paths[i]);
+    return true;
+  });
+}
+
+static bool DirectoryIsUnchanged(const Frozen::StatCacheDirectory &directory, const FileInfo &info)
+{
+  return directory.m_Flags == info.m_Flags && directory.m_Timestamp == info.m_Timestamp;
+}
+
+void StatCacheLoad(StatCache *self, const char *filename, bool trust_file_records)
+{
+  TimingScope timing_scope(nullptr, &g_Stats.m_StatCacheLoadTimeCycles);
+
+  MmapFileMap(&self->m_StateFile, filename);
+  if (!MmapFileValid(&self->m_StateFile))
+    return;
+
+  const Frozen::StatCacheState *state = (const Frozen::StatCacheState *)self->m_StateFile.m_Address;
+  if (Frozen::StatCacheState::MagicNumber != state->m_MagicNumber)
+  {
+    MmapFileUnmap(&self->m_StateFile);
+    return;
+  }
+
+  int32_t directory_count = state->m_Directories.GetCount();
+  const char **directory_paths = HeapAllocateArray<const char *>(self->m_Heap, directory_count);
+  for (int32_t i = 0; i < directory_count; ++i)
+    directory_paths[i] = state->m_Directories[i].m_Path.Get();
+
+  self->m_StateDirectoryInfos = HeapAllocateArray<FileInfo>(self->m_Heap, directory_count);
+  SweepDirectories(directory_paths, self->m_StateDirectoryInfos, directory_count);
+  HeapFree(self->m_Heap, directory_paths);
+
+  g_Stats.m_StatCacheDirectoriesChecked = directory_count;
+  for (int32_t i = 0; i < directory_count; ++i)
+  {
+    if (!DirectoryIsUnchanged(state->m_Directories[i], self->m_StateDirectoryInfos[i]))
+      g_Stats.m_StatCacheDirectoriesChanged++;
+  }
+
+  for (const Frozen::StatCacheRecord &record : state->m_Records)
+  {
+    if (!DirectoryIsUnchanged(state->m_Directories[record.m_DirectoryIndex], self->m_StateDirectoryInfos[record.m_DirectoryIndex]))
+      continue;
+
+    // An unchanged directory tells us which of its entries exist and what they are, but not whether a file was written to.
+    bool implied_by_directory = 0 == (record.m_Flags & FileInfo::kFlagExists) || 0 != (record.m_Flags & FileInfo::kFlagDirectory);
+    if (!implied_by_directory && !trust_file_records)
+      continue;
+
+    const char *path = record.m_Filename.Get();
+    if (HashTableLookup(&self->m_Files, record.m_FilenameHash, path))
+      continue;
+
+    FileInfo info;
+    info.m_Flags = record.m_Flags;
+    info.m_Size = record.m_Size;
+    info.m_Timestamp = record.m_Timestamp;
+    HashTableInsert(&self->m_Files, record.m_FilenameHash, path, info);
+    g_Stats.m_StatCacheFrozenRecords++;
+  }
+
+  self->m_State = state;
+  Log(kDebug, "stat cache initialized -- %d records in %d directories, %d directories changed", state->m_Records.GetCount(), directory_count, g_Stats.m_StatCacheDirectoriesChanged);
+}
+
+static void GetParentDirectory(char (&output)[kMaxPathLength], const char *path)
+{
+  const char *last_slash = strrchr(path, '/');
+#if defined(TUNDRA_WIN32)
+  const char *last_backslash = strrchr(path, '\\');
+  if (last_backslash != nullptr && (last_slash == nullptr || last_backslash > last_slash))
+    last_slash = last_backslash;
+#endif
+
+  if (last_slash == nullptr)
+  {
+    strcpy(output, ".");
+    return;
+  }
+
+  // Keep the slash for the root directory.
+  size_t length = std::min<size_t>(std::max<size_t>(last_slash - path, 1), kMaxPathLength - 1);
+  memcpy(output, path, length);
+  output[length] = '\0';
+}
+
+bool StatCacheSave(StatCache *self, MemAllocHeap *serialization_heap, const char *filename, const char *tmp_filename)
+{
+  TimingScope timing_scope(nullptr, &g_Stats.m_StatCacheSaveTimeCycles);
+
+  MemAllocHeap *heap = self->m_Heap;
+
+  // Collect the directories of all records worth saving.
+  HashTable<int32_t, kFlagPathStrings> directory_table;
+  HashTableInit(&directory_table, heap);
+  Buffer<const char *> directory_paths;
+  BufferInit(&directory_paths);
+
+  int32_t *record_directories = HeapAllocateArray<int32_t>(heap, self->m_Files.m_RecordCount);
+
+  HashTableWalk(&self->m_Files, [&](size_t index, uint32_t hash, const char *path, const FileInfo &info) {
+    record_directories[index] = -1;
+    if (info.m_Flags & (FileInfo::kFlagDirty | FileInfo::kFlagError))
+      return;
+
+    char directory[kMaxPathLength];
+    GetParentDirectory(directory, path);
+
+    uint32_t directory_hash = Djb2HashPath(directory);
+    if (int32_t *existing = HashTableLookup(&directory_table, directory_hash, directory))
+    {
+      record_directories[index] = *existing;
+      return;
+    }
+
+    int32_t directory_index = (int32_t)directory_paths.m_Size;
+    const char *directory_copy = StrDup(self->m_Allocator, directory);
+    HashTableInsert(&directory_table, directory_hash, directory_copy, directory_index);
+    BufferAppendOne(&directory_paths, heap, directory_copy);
+    record_directories[index] = directory_index;
+  });
+
+  int32_t directory_count = (int32_t)directory_paths.m_Size;
+  FileInfo *directory_infos = HeapAllocateArray<FileInfo>(heap, directory_count);
+  SweepDirectories(directory_paths.m_Storage, directory_infos, directory_count);
+
+  // Records can only be trusted if their directory did not change since we looked at it when loading the previous snapshot.
+  // Directories we see for the first time are saved without their records, so the next build has something to compare against.
+  bool *directory_is_stable = HeapAllocateArray<bool>(heap, directory_count);
+  for (int32_t i = 0; i < directory_count; ++i)
+    directory_is_stable[i] = false;
+
+  if (self->m_State != nullptr)
+  {
+    const FrozenArray<Frozen::StatCacheDirectory> &old_directories = self->m_State->m_Directories;
+    for (int32_t i = 0, count = old_directories.GetCount(); i < count; ++i)
+    {
+      const char *path = old_directories[i].m_Path.Get();
+      if (int32_t *directory_index = HashTableLookup(&directory_table, Djb2HashPath(path), path))
+      {
+        const FileInfo &then = self->m_StateDirectoryInfos[i];
+        const FileInfo &now = directory_infos[*directory_index];
+        directory_is_stable[*directory_index] = then.m_Flags == now.m_Flags && then.m_Timestamp == now.m_Timestamp;
+      }
+    }
+  }
+
+  BinaryWriter writer;
+  BinaryWriterInit(&writer, serialization_heap);
+
+  BinarySegment *main_seg = BinaryWriterAddSegment(&writer);
+  BinarySegment *directory_seg = BinaryWriterAddSegment(&writer);
+  BinarySegment *record_seg = BinaryWriterAddSegment(&writer);
+  BinarySegment *string_seg = BinaryWriterAddSegment(&writer);
+  BinaryLocator directory_ptr = BinarySegmentPosition(directory_seg);
+  BinaryLocator record_ptr = BinarySegmentPosition(record_seg);
+
+  for (int32_t i = 0; i < directory_count; ++i)
+  {
+    BinarySegmentWriteUint64(directory_seg, directory_infos[i].m_Timestamp);
+    BinarySegmentWriteUint32(directory_seg, directory_infos[i].m_Flags);
+    BinarySegmentWritePointer(directory_seg, BinarySegmentPosition(string_seg));
+    BinarySegmentWriteStringData(string_seg, directory_paths[i]);
+  }
+
+  int32_t record_count = 0;
+  HashTableWalk(&self->m_Files, [&](size_t index, uint32_t hash, const char *path, const FileInfo &info) {
+    int32_t directory_index = record_directories[index];
+    if (directory_index < 0 || !directory_is_stable[directory_index])
+      return;
+
+    BinarySegmentWriteUint64(record_seg, info.m_Timestamp);
+    BinarySegmentWriteUint64(record_seg, info.m_Size);
+    BinarySegmentWriteUint32(record_seg, info.m_Flags);
+    BinarySegmentWriteUint32(record_seg, hash);
+    BinarySegmentWritePointer(record_seg, BinarySegmentPosition(string_seg));
+    BinarySegmentWriteStringData(string_seg, path);
+    BinarySegmentWriteInt32(record_seg, directory_index);
+    record_count++;
+  });
+
+  BinarySegmentWriteUint32(main_seg, Frozen::StatCacheState::MagicNumber);
+  BinarySegmentWriteUint32(main_seg, self->m_WatchGeneration);
+  BinarySegmentWriteInt32(main_seg, directory_count);
+  BinarySegmentWritePointer(main_seg, directory_ptr);
+  BinarySegmentWriteInt32(main_seg, record_count);
+  BinarySegmentWritePointer(main_seg, record_ptr);
+  BinarySegmentWriteUint32(main_seg, Frozen::StatCacheState::MagicNumber);
+
+  HeapFree(heap, directory_is_stable);
+  HeapFree(heap, directory_infos);
+  HeapFree(heap, record_directories);
+  BufferDestroy(&directory_paths, heap);
+  HashTableDestroy(&directory_table);
+
+  // Unmap old state to avoid sharing conflicts on Windows. Records loaded from it point into the mapping,
+  // so the stat cache can't be used after this.
+  MmapFileUnmap(&self->m_StateFile);
+  self->m_State = nullptr;
+
+  bool success = BinaryWriterFlush(&writer, tmp_filename);
+
+  if (success)
+  {
+    success = RenameFile(tmp_filename, filename);
+    if (!success)
+    {
+      Log(kError, "Failed to rename \"%s\" to \"%s\"", tmp_filename, filename);
+    }
+  }
+  else
+  {
+    RemoveFileOrDir(tmp_filename);
+  }
+
+  BinaryWriterDestroy(&writer);
+
+  return success;
 }
 
 static void StatCacheInsert(StatCache *self, uint32_t hash, const char *path, const FileInfo &info)
@@ -28,7 +272,6 @@ static void StatCacheInsert(StatCache *self, uint32_t hash, const char *path, co
   HashTableInsert(&self->m_Files, hash, StrDup(self->m_Allocator, path), info);
   ReadWriteUnlockWrite(&self->m_HashLock);
 }
-
 static void StatCacheUpdate(StatCache *self, uint32_t hash, const char *path, const FileInfo &info)
 {
   ReadWriteLockWrite(&self->m_HashLock);
@@ -56,6 +299,27 @@ void StatCacheMarkDirty(StatCache *self, const char *path, uint32_t hash)
   ReadWriteUnlockWrite(&self->m_HashLock);
 }
 
+void StatCacheMarkDirtyInDirectories(StatCache *self, const HashSet<kFlagPathStrings> *directories)
+{
+  if (directories->m_RecordCount == 0)
+    return;
+
+  ReadWriteLockWrite(&self->m_HashLock);
+
+  for (uint32_t i = 0, count = self->m_Files.m_TableSize; i < count; ++i)
+  {
+    if (0 == self->m_Files.m_Hashes[i])
+      continue;
+
+    char directory[kMaxPathLength];
+    GetParentDirectory(directory, self->m_Files.m_Strings[i]);
+    if (HashSetLookup(directories, Djb2HashPath(directory), directory))
+      self->m_Files.m_Payloads[i].m_Flags = FileInfo::kFlagDirty;
+  }
+
+  ReadWriteUnlockWrite(&self->m_HashLock);
+}
+
 FileInfo StatCacheStat(StatCache *self, const char *path, uint32_t hash)
 {
   ReadWriteLockRead(&self->m_HashLock);
@@ -89,4 +353,53 @@ FileInfo StatCacheStat(StatCache *self, const char *path, uint32_t hash)
   return file_info;
 }
 
+void StatCacheStatMany(StatCache *self, IoRing *ring, const FileAndHash files[], int count)
+{
+  if (ring == nullptr)
+  {
+    for (int i = 0; i < count; ++i)
+      StatCacheStat(self, files[i].m_Filename, files[i].m_FilenameHash);
+    return;
+  }
+
+  const char *paths[kIoRingEntries];
+  int indices[kIoRingEntries];
+  FileInfo infos[kIoRingEntries];
 
+  for (int start = 0; start < count; start += kIoRingEntries)
+  {
+    int end = std::min(count, start + (int)kIoRingEntries);
+    int miss_count = 0;
+
+    ReadWriteLockRead(&self->m_HashLock);
+    for (int i = start; i < end; ++i)
+    {
+      const FileInfo *existing = HashTableLookup(&self->m_Files, files[i].m_FilenameHash, files[i].m_Filename);
+      if (existing != nullptr && 0 == (existing->m_Flags & FileInfo::kFlagDirty))
+        continue;
+      paths[miss_count] = files[i].m_Filename;
+      indices[miss_count] = i;
+      ++miss_count;
+    }
+    ReadWriteUnlockRead(&self->m_HashLock);
+
+    AtomicAdd32((int32_t *)&g_Stats.m_StatCacheHits, (end - start) - miss_count);
+    AtomicAdd32((int32_t *)&g_Stats.m_StatCacheMisses, miss_count);
+    if (miss_count == 0)
+      continue;
+
+    IoRingStatMany(ring, paths, miss_count, infos);
+
+    // Same benign race as in StatCacheStat(), whoever stats a file last wins.
+    ReadWriteLockWrite(&self->m_HashLock);
+    for (int m = 0; m < miss_count; ++m)
+    {
+      const FileAndHash &file = files[indices[m]];
+      if (FileInfo *fi = HashTableLookup(&self->m_Files, file.m_FilenameHash, file.m_Filename))
+        *fi = infos[m];
+      else
+        HashTableInsert(&self->m_Files, file.m_FilenameHash, StrDup(self->m_Allocator, file.m_Filename), infos[m]);
+    }
+    ReadWriteUnlockWrite(&self->m_HashLock);
+  }
+}
@@ -1,12 +1,50 @@
 #pragma once
 
 #include "Common.hpp"
+#include "BinaryData.hpp"
 #include "FileInfo.hpp"
+#include "MemoryMappedFile.hpp"
 #include "ReadWriteLock.hpp"
 #include "HashTable.hpp"
 
 struct MemAllocHeap;
 struct MemAllocLinear;
+struct IoRing;
+
+namespace Frozen
+{
+    // A directory that contains at least one of the stat cache records, together with what GetDirectoryChangeInfo()
+    // returned for it. As long as that doesn't change, no entries were added to, removed from or renamed in the directory.
+    struct StatCacheDirectory
+    {
+        uint64_t m_Timestamp;
+        uint32_t m_Flags;
+        FrozenString m_Path;
+    };
+    static_assert(sizeof(Frozen::StatCacheDirectory) == 16, "struct size");
+
+    struct StatCacheRecord
+    {
+        uint64_t m_Timestamp;
+        uint64_t m_Size;
+        uint32_t m_Flags;
+        uint32_t m_FilenameHash;
+        FrozenString m_Filename;
+        int32_t m_DirectoryIndex;
+    };
+    static_assert(sizeof(Frozen::StatCacheRecord) == 32, "struct size");
+
+    struct StatCacheState
+    {
+        static const uint32_t MagicNumber = 0x5a7cac4f;
+
+        uint32_t m_MagicNumber;
+        // What the watch daemon handed out to the build that saved this, see WatchDaemonQueryChanges().
+        uint32_t m_WatchGeneration;
+        FrozenArray<Frozen::StatCacheDirectory> m_Directories;
+        FrozenArray<Frozen::StatCacheRecord> m_Records;
+    };
+}
 
 struct StatCache
 {
@@ -14,16 +52,38 @@ struct StatCache
     MemAllocHeap *m_Heap;
     ReadWriteLock m_HashLock;
     HashTable<FileInfo, kFlagPathStrings> m_Files;
+
+    // Snapshot of the previous build, and the state of its directories as we found them when loading it.
+    MemoryMappedFile m_StateFile;
+    const Frozen::StatCacheState *m_State;
+    FileInfo *m_StateDirectoryInfos;
+
+    // Saved with the next snapshot.
+    uint32_t m_WatchGeneration;
 };
 
 void StatCacheInit(StatCache *stat_cache, MemAllocLinear *allocator, MemAllocHeap *heap);
 
 void StatCacheDestroy(StatCache *stat_cache);
 
+// Seeds the cache with the records of the previous build whose directory did not change since. Only records that are
+// implied by the directory entries (missing files and directories) are used, unless trust_file_records is set, in which
+// case file timestamps and sizes are trusted as well. Those can be stale for files that were modified in place.
+void StatCacheLoad(StatCache *stat_cache, const char *filename, bool trust_file_records);
+
+bool StatCacheSave(StatCache *stat_cache, MemAllocHeap *serialization_heap, const char *filename, const char *tmp_filename);
+
 void StatCacheMarkDirty(StatCache *stat_cache, const char *path, uint32_t hash);
 
+// Marks every cached entry that lives directly in one of the given directories as dirty.
+void StatCacheMarkDirtyInDirectories(StatCache *stat_cache, const HashSet<kFlagPathStrings> *directories);
+
 FileInfo StatCacheStat(StatCache *stat_cache, const char *path, uint32_t hash);
 
+// Makes sure there is an up to date entry for each of files[0..count), statting the ones that need it as one batch through
+// ring. Without a ring this is the same as calling StatCacheStat() for each.
+void StatCacheStatMany(StatCache *stat_cache, IoRing *ring, const FileAndHash files[], int count);
+
 inline FileInfo StatCacheStat(StatCache *stat_cache, const char *path)
 {
     return StatCacheStat(stat_cache, path, Djb2HashPath(path));
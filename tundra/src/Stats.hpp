@@ -30,6 +30,16 @@ struct TundraStats
     uint32_t m_StatCacheHits;
     uint32_t m_StatCacheMisses;
     uint32_t m_StatCacheDirty;
+    uint32_t m_StatCacheFrozenRecords;
+    uint32_t m_StatCacheDirectoriesChecked;
+    uint32_t m_StatCacheDirectoriesChanged;
+    uint64_t m_StatCacheLoadTimeCycles;
+    uint64_t m_StatCacheSaveTimeCycles;
+
+    uint32_t m_IoRingBatchCount;
+    uint64_t m_IoRingTimeCycles;
+    uint32_t m_IoRingStatCount;
+    uint32_t m_IoRingReadCount;
 
     uint64_t m_StaleCheckTimeCycles;
 
@@ -37,6 +47,7 @@ struct TundraStats
     uint64_t m_ExecTimeCycles;
 
     uint64_t m_JsonParseTimeCycles;
+    uint64_t m_DagStreamDecodeTimeCycles;
 
     uint64_t m_DigestCacheSaveTimeCycles;
     uint64_t m_DigestCacheGetTimeCycles;
@@ -46,10 +57,22 @@ struct TundraStats
 
     uint64_t m_CompileDagTime;
     uint64_t m_CompileDagDerivedTime;
+    uint32_t m_CompileDagDerivedNodesReused;
     uint64_t m_CalculateNonGeneratedIndicesTime;
     uint64_t m_CumulativePointsTime;
 
+    uint32_t m_ActionResourceWaitCount;
+    uint64_t m_ActionResourceWaitTimeCycles;
+
+    uint64_t m_CachePrefetchLookups;
+    uint64_t m_CachePrefetchHits;
+    uint32_t m_CachePrefetchDownloadsUsed;
+
+    uint64_t m_BuildTimeCycles;
+    uint64_t m_CriticalPathTimeMs;
+
     uint32_t m_PointlessThreadWakeup;
+    uint32_t m_StolenNodeCount;
 };
 
 struct TimingScope
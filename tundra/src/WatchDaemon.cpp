@@ -0,0 +1,552 @@
+#include "WatchDaemon.hpp"
+#include "StatCache.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemoryMappedFile.hpp"
+#include "SignalHandler.hpp"
+#include "Buffer.hpp"
+#include "PathUtil.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(TUNDRA_LINUX)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "Banned.hpp"
+
+void WatchDaemonChangesInit(WatchDaemonChanges *changes, MemAllocHeap *heap)
+{
+    HashSetInit(&changes->m_Files, heap);
+    HashSetInit(&changes->m_Directories, heap);
+}
+
+void WatchDaemonChangesDestroy(WatchDaemonChanges *changes)
+{
+    HashSetDestroy(&changes->m_Files);
+    HashSetDestroy(&changes->m_Directories);
+}
+
+#if defined(TUNDRA_LINUX)
+
+// Beyond this many changed paths, a build is better off validating everything itself.
+static const uint32_t kMaxReportedChanges = 100000;
+
+static const uint32_t kWatchMask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// The same directory can be known under several paths, e.g. relative and absolute. inotify hands out one watch per
+// directory, so each watch keeps a list of all the paths it stands for.
+struct WatchedPath
+{
+    const char *m_Path;
+    WatchedPath *m_Next;
+};
+
+struct WatchDaemon
+{
+    MemAllocHeap m_Heap;
+    MemAllocLinear m_PathAllocator;
+    MemAllocLinear m_ChangeAllocator;
+
+    int m_InotifyFd;
+    int m_ListenFd;
+
+    const char *m_StatCacheFilename;
+    const char *m_StatCacheBasename;
+    int m_StatCacheDirectoryWatch;
+
+    // Indexed by watch descriptor.
+    Buffer<WatchedPath *> m_WatchedPaths;
+    // Watch descriptor of every directory we know about, or -1 if we couldn't watch it. Those are reported as changed
+    // on every request.
+    HashTable<int, kFlagPathStrings> m_Directories;
+
+    // Changes since the last request. Until the first request, and after the event queue overflowed, we don't know
+    // what happened in between, so the next request gets told that.
+    WatchDaemonChanges m_Changes;
+    uint32_t m_ChangeCount;
+    bool m_ChangesAreComplete;
+
+    // Changes already reported to a build that hasn't saved its snapshot yet. They are reported again until it does, as
+    // a build that stops early leaves the next one with the older snapshot, from before these changes.
+    MemAllocLinear m_UnconfirmedAllocator;
+    WatchDaemonChanges m_UnconfirmedChanges;
+    uint32_t m_UnconfirmedCount;
+    bool m_UnconfirmedAreComplete;
+
+    // Handed out with every request. The build that asked writes it into the snapshot it saves.
+    uint32_t m_Generation;
+};
+
+static void WatchDaemonResetChanges(WatchDaemon *self, bool complete)
+{
+    WatchDaemonChangesDestroy(&self->m_Changes);
+    WatchDaemonChangesInit(&self->m_Changes, &self->m_Heap);
+    LinearAllocReset(&self->m_ChangeAllocator);
+    self->m_ChangeCount = 0;
+    self->m_ChangesAreComplete = complete;
+}
+
+static void WatchDaemonResetUnconfirmedChanges(WatchDaemon *self, bool complete)
+{
+    WatchDaemonChangesDestroy(&self->m_UnconfirmedChanges);
+    WatchDaemonChangesInit(&self->m_UnconfirmedChanges, &self->m_Heap);
+    LinearAllocReset(&self->m_UnconfirmedAllocator);
+    self->m_UnconfirmedCount = 0;
+    self->m_UnconfirmedAreComplete = complete;
+}
+
+// Moves the changes since the last request over to the unconfirmed ones.
+static void WatchDaemonKeepUnconfirmedChanges(WatchDaemon *self)
+{
+    if (!self->m_ChangesAreComplete || self->m_UnconfirmedCount + self->m_ChangeCount >= kMaxReportedChanges)
+        WatchDaemonResetUnconfirmedChanges(self, false);
+
+    if (!self->m_UnconfirmedAreComplete)
+        return;
+
+    auto keep = [&](const HashSet<kFlagPathStrings> *from, HashSet<kFlagPathStrings> *to) {
+        HashSetWalk(from, [&](uint32_t index, uint32_t hash, const char *path) {
+            if (HashSetLookup(to, hash, path))
+                return;
+            HashSetInsert(to, hash, StrDup(&self->m_UnconfirmedAllocator, path));
+            self->m_UnconfirmedCount++;
+        });
+    };
+    keep(&self->m_Changes.m_Files, &self->m_UnconfirmedChanges.m_Files);
+    keep(&self->m_Changes.m_Directories, &self->m_UnconfirmedChanges.m_Directories);
+}
+
+static void WatchDaemonAddChange(WatchDaemon *self, HashSet<kFlagPathStrings> *set, const char *path)
+{
+    if (!self->m_ChangesAreComplete)
+        return;
+
+    if (self->m_ChangeCount >= kMaxReportedChanges)
+    {
+        WatchDaemonResetChanges(self, false);
+        return;
+    }
+
+    uint32_t hash = Djb2HashPath(path);
+    if (HashSetLookup(set, hash, path))
+        return;
+
+    HashSetInsert(set, hash, StrDup(&self->m_ChangeAllocator, path));
+    self->m_ChangeCount++;
+}
+
+static void WatchDaemonWatchDirectory(WatchDaemon *self, const char *path)
+{
+    uint32_t hash = Djb2HashPath(path);
+    int *existing_wd = HashTableLookup(&self->m_Directories, hash, path);
+    if (existing_wd != nullptr && *existing_wd >= 0)
+        return;
+
+    const char *path_copy;
+    if (existing_wd == nullptr)
+    {
+        path_copy = StrDup(&self->m_PathAllocator, path);
+        HashTableInsert(&self->m_Directories, hash, path_copy, -1);
+        existing_wd = HashTableLookup(&self->m_Directories, hash, path);
+    }
+    else
+    {
+        path_copy = self->m_Directories.m_Strings[existing_wd - self->m_Directories.m_Payloads];
+    }
+
+    int wd = inotify_add_watch(self->m_InotifyFd, path, kWatchMask | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd < 0)
+    {
+        // Most likely the directory doesn't exist (yet), or we ran out of watches. Either way we can't vouch for it.
+        if (errno == ENOSPC)
+            Log(kWarning, "watch daemon: out of inotify watches at %s, consider raising fs.inotify.max_user_watches", path);
+        return;
+    }
+    *existing_wd = wd;
+
+    while (self->m_WatchedPaths.m_Size <= (size_t)wd)
+        BufferAppendOne(&self->m_WatchedPaths, &self->m_Heap, (WatchedPath *)nullptr);
+
+    WatchedPath *watched_path = LinearAllocate<WatchedPath>(&self->m_PathAllocator);
+    watched_path->m_Path = path_copy;
+    watched_path->m_Next = self->m_WatchedPaths[wd];
+    self->m_WatchedPaths[wd] = watched_path;
+
+    // Anything that happened in this directory before we started watching it went unnoticed.
+    WatchDaemonAddChange(self, &self->m_Changes.m_Directories, path);
+}
+
+static void WatchDaemonForgetWatch(WatchDaemon *self, int wd)
+{
+    for (WatchedPath *watched_path = self->m_WatchedPaths[wd]; watched_path; watched_path = watched_path->m_Next)
+    {
+        *HashTableLookup(&self->m_Directories, Djb2HashPath(watched_path->m_Path), watched_path->m_Path) = -1;
+        WatchDaemonAddChange(self, &self->m_Changes.m_Directories, watched_path->m_Path);
+    }
+    self->m_WatchedPaths[wd] = nullptr;
+}
+
+static void WatchDaemonLoadStatCacheSnapshot(WatchDaemon *self)
+{
+    MemoryMappedFile file;
+    MmapFileInit(&file);
+    MmapFileMap(&file, self->m_StatCacheFilename);
+
+    if (MmapFileValid(&file))
+    {
+        const Frozen::StatCacheState *state = (const Frozen::StatCacheState *)file.m_Address;
+        if (state->m_MagicNumber == Frozen::StatCacheState::MagicNumber)
+        {
+            for (const Frozen::StatCacheDirectory &directory : state->m_Directories)
+                WatchDaemonWatchDirectory(self, directory.m_Path.Get());
+            Log(kDebug, "watch daemon: watching %d directories", (int)self->m_Directories.m_RecordCount);
+
+            // Saved by the build that asked last, so it accounts for everything that build was told about.
+            if (state->m_WatchGeneration == self->m_Generation)
+                WatchDaemonResetUnconfirmedChanges(self, true);
+        }
+    }
+
+    MmapFileDestroy(&file);
+}
+
+static void WatchDaemonProcessEvents(WatchDaemon *self)
+{
+    alignas(struct inotify_event) char buffer[64 * 1024];
+
+    while (true)
+    {
+        ssize_t length = read(self->m_InotifyFd, buffer, sizeof buffer);
+        if (length <= 0)
+            return;
+
+        bool snapshot_changed = false;
+
+        for (char *ptr = buffer; ptr < buffer + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                Log(kDebug, "watch daemon: event queue overflowed");
+                WatchDaemonResetChanges(self, false);
+                continue;
+            }
+
+            if (event->wd == self->m_StatCacheDirectoryWatch && event->len > 0 && 0 == strcmp(event->name, self->m_StatCacheBasename))
+                snapshot_changed = true;
+
+            if (event->wd < 0 || (size_t)event->wd >= self->m_WatchedPaths.m_Size || self->m_WatchedPaths[event->wd] == nullptr)
+                continue;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                // The directory is gone, and the watch with it. We try again when the next snapshot mentions it.
+                if (event->mask & IN_IGNORED)
+                    WatchDaemonForgetWatch(self, event->wd);
+                else
+                    for (WatchedPath *watched_path = self->m_WatchedPaths[event->wd]; watched_path; watched_path = watched_path->m_Next)
+                        WatchDaemonAddChange(self, &self->m_Changes.m_Directories, watched_path->m_Path);
+                continue;
+            }
+
+            if (event->len == 0)
+                continue;
+
+            for (WatchedPath *watched_path = self->m_WatchedPaths[event->wd]; watched_path; watched_path = watched_path->m_Next)
+            {
+                // Build the path the same way the stat cache splits it into a directory and a name.
+                const char *directory = watched_path->m_Path;
+                char path[kMaxPathLength];
+                if (0 == strcmp(directory, "."))
+                    snprintf(path, sizeof path, "%s", event->name);
+                else if (0 == strcmp(directory, "/"))
+                    snprintf(path, sizeof path, "/%s", event->name);
+                else
+                    snprintf(path, sizeof path, "%s/%s", directory, event->name);
+
+                WatchDaemonAddChange(self, (event->mask & IN_ISDIR) ? &self->m_Changes.m_Directories : &self->m_Changes.m_Files, path);
+            }
+        }
+
+        if (snapshot_changed)
+            WatchDaemonLoadStatCacheSnapshot(self);
+    }
+}
+
+static void WriteAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        data += written;
+        length -= written;
+    }
+}
+
+static void WatchDaemonServeRequest(WatchDaemon *self, int fd)
+{
+    // Make sure we've seen every change that happened before the build asked.
+    WatchDaemonProcessEvents(self);
+    WatchDaemonKeepUnconfirmedChanges(self);
+    self->m_Generation++;
+
+    Buffer<char> response;
+    BufferInit(&response);
+
+    auto append = [&](const char *prefix, const char *path) {
+        BufferAppend(&response, &self->m_Heap, prefix, strlen(prefix));
+        BufferAppend(&response, &self->m_Heap, path, strlen(path));
+        BufferAppendOne(&response, &self->m_Heap, '\n');
+    };
+
+    char generation[16];
+    snprintf(generation, sizeof generation, "%u", self->m_Generation);
+
+    if (self->m_UnconfirmedAreComplete)
+    {
+        append("ok ", generation);
+        HashSetWalk(&self->m_UnconfirmedChanges.m_Files, [&](uint32_t index, uint32_t hash, const char *path) { append("F ", path); });
+        HashSetWalk(&self->m_UnconfirmedChanges.m_Directories, [&](uint32_t index, uint32_t hash, const char *path) { append("D ", path); });
+        HashTableWalk(&self->m_Directories, [&](size_t index, uint32_t hash, const char *path, int wd) {
+            if (wd < 0)
+                append("D ", path);
+        });
+    }
+    else
+    {
+        append("unknown ", generation);
+    }
+
+    WriteAll(fd, response.m_Storage, response.m_Size);
+    BufferDestroy(&response, &self->m_Heap);
+
+    Log(kDebug, "watch daemon: reported %u changes for generation %u", self->m_UnconfirmedCount, self->m_Generation);
+
+    // From here on, we have seen everything that happens.
+    WatchDaemonResetChanges(self, true);
+}
+
+bool WatchDaemonRun(const char *socket_filename, const char *stat_cache_filename)
+{
+    WatchDaemon self;
+    HeapInit(&self.m_Heap);
+    LinearAllocInit(&self.m_PathAllocator, &self.m_Heap, MB(64), "watch daemon paths");
+    LinearAllocInit(&self.m_ChangeAllocator, &self.m_Heap, MB(64), "watch daemon changes");
+    LinearAllocInit(&self.m_UnconfirmedAllocator, &self.m_Heap, MB(64), "watch daemon unconfirmed changes");
+    BufferInit(&self.m_WatchedPaths);
+    HashTableInit(&self.m_Directories, &self.m_Heap);
+    WatchDaemonChangesInit(&self.m_Changes, &self.m_Heap);
+    self.m_ChangeCount = 0;
+    self.m_ChangesAreComplete = false;
+    WatchDaemonChangesInit(&self.m_UnconfirmedChanges, &self.m_Heap);
+    self.m_UnconfirmedCount = 0;
+    self.m_UnconfirmedAreComplete = false;
+    // Not starting from zero, so a snapshot saved while an earlier daemon was running is never mistaken for one of ours.
+    self.m_Generation = (uint32_t)time(nullptr);
+    self.m_StatCacheFilename = stat_cache_filename;
+
+    const char *last_slash = strrchr(stat_cache_filename, '/');
+    self.m_StatCacheBasename = last_slash ? last_slash + 1 : stat_cache_filename;
+
+    bool success = false;
+
+    self.m_InotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (self.m_InotifyFd < 0)
+        CroakErrno("inotify_init1 failed");
+
+    self.m_ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (self.m_ListenFd < 0)
+        CroakErrno("socket failed");
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_filename) >= sizeof address.sun_path)
+        Croak("watch daemon socket path too long: %s", socket_filename);
+    strcpy(address.sun_path, socket_filename);
+
+    // A socket left behind by a daemon that didn't exit cleanly.
+    unlink(socket_filename);
+
+    if (0 != bind(self.m_ListenFd, (struct sockaddr *)&address, sizeof address) || 0 != listen(self.m_ListenFd, 8))
+    {
+        Log(kError, "watch daemon: couldn't listen on %s: %s", socket_filename, strerror(errno));
+    }
+    else
+    {
+        // Watch the directory of the snapshot itself, so we pick up new snapshots saved by builds.
+        char snapshot_directory[kMaxPathLength];
+        if (last_slash)
+            snprintf(snapshot_directory, sizeof snapshot_directory, "%.*s", (int)(last_slash - stat_cache_filename), stat_cache_filename);
+        else
+            strcpy(snapshot_directory, ".");
+        self.m_StatCacheDirectoryWatch = inotify_add_watch(self.m_InotifyFd, snapshot_directory, IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR | IN_MASK_ADD);
+
+        WatchDaemonLoadStatCacheSnapshot(&self);
+        Log(kInfo, "watch daemon: listening on %s", socket_filename);
+
+        while (SignalGetReason() == nullptr)
+        {
+            struct pollfd fds[2];
+            fds[0].fd = self.m_InotifyFd;
+            fds[0].events = POLLIN;
+            fds[1].fd = self.m_ListenFd;
+            fds[1].events = POLLIN;
+
+            // Wake up regularly to check for signals.
+            int result = poll(fds, 2, 500);
+            if (result < 0 && errno != EINTR)
+                CroakErrno("poll failed");
+            if (result <= 0)
+                continue;
+
+            if (fds[0].revents & POLLIN)
+                WatchDaemonProcessEvents(&self);
+
+            if (fds[1].revents & POLLIN)
+            {
+                int client = accept4(self.m_ListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client >= 0)
+                {
+                    WatchDaemonServeRequest(&self, client);
+                    close(client);
+                }
+            }
+        }
+
+        success = true;
+        unlink(socket_filename);
+    }
+
+    close(self.m_ListenFd);
+    close(self.m_InotifyFd);
+
+    WatchDaemonChangesDestroy(&self.m_Changes);
+    WatchDaemonChangesDestroy(&self.m_UnconfirmedChanges);
+    HashTableDestroy(&self.m_Directories);
+    BufferDestroy(&self.m_WatchedPaths, &self.m_Heap);
+    LinearAllocDestroy(&self.m_UnconfirmedAllocator);
+    LinearAllocDestroy(&self.m_ChangeAllocator);
+    LinearAllocDestroy(&self.m_PathAllocator);
+    HeapDestroy(&self.m_Heap);
+
+    return success;
+}
+
+bool WatchDaemonQueryChanges(const char *socket_filename, MemAllocHeap *heap, MemAllocLinear *allocator, WatchDaemonChanges *out_changes, uint32_t *out_generation)
+{
+    *out_generation = 0;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_filename) >= sizeof address.sun_path)
+        return false;
+    strcpy(address.sun_path, socket_filename);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    if (0 != connect(fd, (struct sockaddr *)&address, sizeof address))
+    {
+        close(fd);
+        return false;
+    }
+
+    // Never let a stuck daemon hold up the build, we can always do without it.
+    struct timeval timeout;
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+    Buffer<char> response;
+    BufferInit(&response);
+
+    bool complete = true;
+    while (true)
+    {
+        char chunk[16 * 1024];
+        ssize_t length = read(fd, chunk, sizeof chunk);
+        if (length < 0 && errno == EINTR)
+            continue;
+        if (length < 0)
+            complete = false;
+        if (length <= 0)
+            break;
+        BufferAppend(&response, heap, chunk, length);
+    }
+    close(fd);
+
+    // The first line is "ok <generation>" or "unknown <generation>". We still need the generation when the daemon can't
+    // vouch for the changes, so the snapshot we save lets it start over from there.
+    const char *first_line_end = (const char *)memchr(response.m_Storage, '\n', response.m_Size);
+    char status[16];
+    unsigned int generation;
+    if (!complete || first_line_end == nullptr || 2 != sscanf(response.m_Storage, "%15s %u", status, &generation))
+    {
+        BufferDestroy(&response, heap);
+        return false;
+    }
+
+    *out_generation = generation;
+    if (0 != strcmp(status, "ok"))
+    {
+        BufferDestroy(&response, heap);
+        return false;
+    }
+
+    for (size_t pos = first_line_end - response.m_Storage + 1; pos < response.m_Size;)
+    {
+        const char *line = response.m_Storage + pos;
+        const char *end = (const char *)memchr(line, '\n', response.m_Size - pos);
+        if (end == nullptr)
+        {
+            // The daemon went away halfway through.
+            complete = false;
+            break;
+        }
+        pos = end - response.m_Storage + 1;
+
+        if (end - line < 3 || line[1] != ' ')
+            continue;
+
+        const char *path = StrDupN(allocator, line + 2, end - line - 2);
+        HashSet<kFlagPathStrings> *set = line[0] == 'D' ? &out_changes->m_Directories : &out_changes->m_Files;
+        HashSetInsertIfNotPresent(set, Djb2HashPath(path), path);
+    }
+
+    BufferDestroy(&response, heap);
+    return complete;
+}
+
+#else
+
+bool WatchDaemonRun(const char *socket_filename, const char *stat_cache_filename)
+{
+    Log(kError, "--watch-daemon is only supported on Linux");
+    return false;
+}
+
+bool WatchDaemonQueryChanges(const char *socket_filename, MemAllocHeap *heap, MemAllocLinear *allocator, WatchDaemonChanges *out_changes, uint32_t *out_generation)
+{
+    *out_generation = 0;
+    return false;
+}
+
+#endif
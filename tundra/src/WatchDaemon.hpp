@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Common.hpp"
+#include "HashTable.hpp"
+
+struct MemAllocHeap;
+struct MemAllocLinear;
+
+// Paths that changed since the previous build, as reported by a watch daemon. Files were written to or had their
+// attributes changed, directories have to be treated as changed as a whole.
+struct WatchDaemonChanges
+{
+    HashSet<kFlagPathStrings> m_Files;
+    HashSet<kFlagPathStrings> m_Directories;
+};
+
+void WatchDaemonChangesInit(WatchDaemonChanges *changes, MemAllocHeap *heap);
+void WatchDaemonChangesDestroy(WatchDaemonChanges *changes);
+
+// Runs until interrupted. Watches every directory in the stat cache snapshot for changes, and serves them on the socket.
+// The snapshot is reloaded whenever a build saves a new one.
+bool WatchDaemonRun(const char *socket_filename, const char *stat_cache_filename);
+
+// Asks a running watch daemon what changed since the stat cache snapshot was saved. Returns false if there is no daemon,
+// or if it can't vouch for everything that happened since then. Strings are allocated from the given allocator.
+// The daemon keeps reporting the same changes until a snapshot carrying out_generation is saved, which is 0 if there is
+// no daemon.
+bool WatchDaemonQueryChanges(const char *socket_filename, MemAllocHeap *heap, MemAllocLinear *allocator, WatchDaemonChanges *out_changes, uint32_t *out_generation);
@@ -0,0 +1,50 @@
+#include "WorkStealingQueue.hpp"
+#include "Atomic.hpp"
+#include <algorithm>
+#include "Banned.hpp"
+
+void WorkStealingQueueInit(WorkStealingQueue *queue, MemAllocHeap *heap)
+{
+    MutexInit(&queue->m_Lock);
+    BufferInitWithCapacity(&queue->m_Nodes, heap, 256);
+    queue->m_Count = 0;
+}
+
+void WorkStealingQueueDestroy(WorkStealingQueue *queue, MemAllocHeap *heap)
+{
+    BufferDestroy(&queue->m_Nodes, heap);
+    MutexDestroy(&queue->m_Lock);
+}
+
+void WorkStealingQueuePush(WorkStealingQueue *queue, MemAllocHeap *heap, const uint32_t *node_points, const int32_t *node_indices, int count)
+{
+    auto lessPoints = [=](int32_t nodeIndexA, int32_t nodeIndexB) { return node_points[nodeIndexA] < node_points[nodeIndexB]; };
+
+    MutexLock(&queue->m_Lock);
+    for (int i = 0; i < count; ++i)
+    {
+        BufferAppendOne(&queue->m_Nodes, heap, node_indices[i]);
+        std::push_heap(queue->m_Nodes.begin(), queue->m_Nodes.end(), lessPoints);
+    }
+    AtomicStore(&queue->m_Count, (uint32_t)queue->m_Nodes.m_Size);
+    MutexUnlock(&queue->m_Lock);
+}
+
+bool WorkStealingQueuePop(WorkStealingQueue *queue, const uint32_t *node_points, int32_t *out_node_index)
+{
+    if (AtomicLoad(&queue->m_Count) == 0)
+        return false;
+
+    auto lessPoints = [=](int32_t nodeIndexA, int32_t nodeIndexB) { return node_points[nodeIndexA] < node_points[nodeIndexB]; };
+
+    MutexLock(&queue->m_Lock);
+    bool result = queue->m_Nodes.m_Size > 0;
+    if (result)
+    {
+        std::pop_heap(queue->m_Nodes.begin(), queue->m_Nodes.end(), lessPoints);
+        *out_node_index = BufferPopOne(&queue->m_Nodes);
+        AtomicStore(&queue->m_Count, (uint32_t)queue->m_Nodes.m_Size);
+    }
+    MutexUnlock(&queue->m_Lock);
+    return result;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "Common.hpp"
+#include "Mutex.hpp"
+#include "Buffer.hpp"
+
+struct MemAllocHeap;
+
+// A queue of runnable node indices owned by a single build thread, used by the work stealing scheduler.
+// Every queue has its own lock, so a thread handing out work to itself never contends with threads that
+// are busy with other queues. Threads that run out of work steal from the queues of other threads.
+// Entries are kept as a max-heap on node points, so both the owner and thieves take the node that
+// unblocks the most other work first.
+struct WorkStealingQueue
+{
+    Mutex m_Lock;
+    Buffer<int32_t> m_Nodes;
+
+    // Mirrors m_Nodes.m_Size so other threads can skip empty queues without taking the lock.
+    uint32_t m_Count;
+};
+
+void WorkStealingQueueInit(WorkStealingQueue *queue, MemAllocHeap *heap);
+void WorkStealingQueueDestroy(WorkStealingQueue *queue, MemAllocHeap *heap);
+
+void WorkStealingQueuePush(WorkStealingQueue *queue, MemAllocHeap *heap, const uint32_t *node_points, const int32_t *node_indices, int count);
+bool WorkStealingQueuePop(WorkStealingQueue *queue, const uint32_t *node_points, int32_t *out_node_index);
@@ -0,0 +1,243 @@
+#include "TestHarness.hpp"
+#include "AllBuiltNodes.hpp"
+#include "DagData.hpp"
+#include "DagGenerator.hpp"
+#include "Driver.hpp"
+#include "LoadFrozenData.hpp"
+#include "FileInfo.hpp"
+#include "Thread.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "Banned.hpp"
+
+// A node that ran in a test build, and a value to tell the saves of it apart.
+struct TestBuiltNode
+{
+  int m_Id;
+  uint32_t m_Tag;
+};
+
+class BuiltNodesJournalTest : public ::testing::Test
+{
+protected:
+  static const int kNodeCount = 16;
+
+  Driver driver;
+  bool driver_open = false;
+  const char* json_filename = "built_nodes_journal_test.json";
+  const char* dag_filename = "built_nodes_journal_test.dag";
+  const char* state_filename = "built_nodes_journal_test.state";
+  const char* state_tmp_filename = "built_nodes_journal_test.state.tmp";
+  const char* state_mapped_filename = "built_nodes_journal_test.state.mapped";
+  const char* journal_filename = "built_nodes_journal_test.state.journal";
+  const char* journal_saved_filename = "built_nodes_journal_test.state.journal.saved";
+
+protected:
+  void SetUp() override
+  {
+    RemoveFiles();
+
+    std::string json = "{ \"Nodes\": [";
+    for (int id = 0; id < kNodeCount; ++id)
+    {
+      if (id > 0)
+        json += ", ";
+      json += "{ \"Annotation\": \"node " + std::to_string(id) + "\", \"Action\": \"true\", \"Inputs\": [], \"Outputs\": [\"built_nodes_journal_test/" + std::to_string(id) + "\"] }";
+    }
+    // Bee's "why" data lives in the state file only, and would make every save a full rewrite.
+    json += "], \"DefaultNodes\": [], \"Identifier\": \"test\", \"EmitDataForBeeWhy\": 0";
+    json += std::string(", \"StateFileName\": \"") + state_filename + "\"";
+    json += std::string(", \"StateFileNameTmp\": \"") + state_tmp_filename + "\"";
+    json += std::string(", \"StateFileNameMapped\": \"") + state_mapped_filename + "\" }";
+
+    FILE* f = OpenFile(json_filename, "wb");
+    ASSERT_NE(nullptr, f);
+    fwrite(json.data(), 1, json.size(), f);
+    fclose(f);
+
+    ASSERT_TRUE(FreezeDagJson(json_filename, dag_filename));
+  }
+
+  void TearDown() override
+  {
+    if (driver_open)
+      Close();
+    RemoveFiles();
+  }
+
+  void RemoveFiles()
+  {
+    for (const char* filename : { json_filename, dag_filename, state_filename, state_tmp_filename, state_mapped_filename, journal_filename, journal_saved_filename })
+      RemoveFileOrDir(filename);
+  }
+
+  // Starts a build from what is on disk, the way DriverInitData() and DriverPrepareNodes() do.
+  void Open()
+  {
+    memset(&driver, 0, sizeof driver);
+    HeapInit(&driver.m_Heap);
+    LinearAllocInit(&driver.m_Allocator, &driver.m_Heap, MB(1), "journal test");
+    LinearAllocSetOwner(&driver.m_Allocator, ThreadCurrent());
+    LinearAllocInit(&driver.m_StatCacheAllocator, &driver.m_Heap, MB(1), "journal test stat cache");
+    StatCacheInit(&driver.m_StatCache, &driver.m_StatCacheAllocator, &driver.m_Heap);
+    MmapFileInit(&driver.m_DagFile);
+    MmapFileInit(&driver.m_StateFile);
+    BufferInit(&driver.m_RuntimeNodes);
+    driver_open = true;
+
+    ASSERT_TRUE(LoadFrozenData<Frozen::Dag>(dag_filename, &driver.m_DagFile, &driver.m_DagData));
+    if (GetFileInfo(state_filename).Exists())
+    {
+      ASSERT_TRUE(RenameFile(state_filename, state_mapped_filename));
+    }
+    LoadFrozenData<Frozen::AllBuiltNodes>(state_mapped_filename, &driver.m_StateFile, &driver.m_AllBuiltNodes);
+    LoadBuiltNodesJournal(&driver);
+    ASSERT_TRUE(DriverPrepareNodes(&driver));
+  }
+
+  void Close()
+  {
+    BufferDestroy(&driver.m_RuntimeNodes, &driver.m_Heap);
+    DestroyBuiltNodesJournal(&driver);
+    StatCacheDestroy(&driver.m_StatCache);
+    MmapFileDestroy(&driver.m_StateFile);
+    MmapFileDestroy(&driver.m_DagFile);
+    LinearAllocDestroy(&driver.m_StatCacheAllocator);
+    LinearAllocDestroy(&driver.m_Allocator, true);
+    HeapDestroy(&driver.m_Heap);
+    driver_open = false;
+  }
+
+  // The DAG sorts its nodes by guid, so they are found by annotation.
+  RuntimeNode* NodeFor(int id)
+  {
+    std::string annotation = "node " + std::to_string(id);
+    for (RuntimeNode& node : driver.m_RuntimeNodes)
+    {
+      if (annotation == node.m_DagNode->m_Annotation.Get())
+        return &node;
+    }
+    ADD_FAILURE() << "no " << annotation;
+    return nullptr;
+  }
+
+  // A build in which the given nodes ran, with their tag as execution time, saved like any other.
+  void Build(const std::vector<TestBuiltNode>& ran)
+  {
+    Open();
+    for (const TestBuiltNode& built : ran)
+    {
+      RuntimeNode* node = NodeFor(built.m_Id);
+      node->m_BuildResult = NodeBuildResult::kRanSuccesfully;
+      node->m_ExecutionTimeMs = built.m_Tag;
+    }
+    ASSERT_TRUE(SaveAllBuiltNodes(&driver));
+    Close();
+  }
+
+  void AppendToJournal(const void* data, size_t size)
+  {
+    FILE* f = OpenFile(journal_filename, "ab");
+    ASSERT_NE(nullptr, f);
+    fwrite(data, 1, size, f);
+    fclose(f);
+  }
+
+  // The tag of the node in the previous build state, or -1 if it has none.
+  int64_t TagOf(int id)
+  {
+    const Frozen::BuiltNode* built_node = NodeFor(id)->m_BuiltNode;
+    return built_node ? int64_t(built_node->m_ExecutionTimeMs) : -1;
+  }
+
+  void ExpectSortedByGuid()
+  {
+    const BuiltNodesJournal& journal = driver.m_StateJournal;
+    for (int32_t i = 1; i < journal.m_NodeCount; ++i)
+      EXPECT_TRUE(journal.m_NodeGuids[i - 1] < journal.m_NodeGuids[i]) << i;
+  }
+};
+
+TEST_F(BuiltNodesJournalTest, LaterBuildsWin)
+{
+  std::vector<TestBuiltNode> nodes;
+  for (int id = 0; id < 10; ++id)
+    nodes.push_back({id, 1});
+  Build(nodes);
+  Build({ {3, 2}, {12, 2} });
+  Build({ {3, 3}, {5, 3} });
+
+  Open();
+  const BuiltNodesJournal& journal = driver.m_StateJournal;
+  ASSERT_EQ(10, driver.m_AllBuiltNodes->m_NodeCount);
+  ASSERT_FALSE(journal.m_Damaged);
+  ASSERT_EQ(4, journal.m_RecordCount);
+  ASSERT_EQ((uint64_t)GetFileInfo(journal_filename).m_Size, journal.m_ValidSize);
+  ASSERT_EQ(11, journal.m_NodeCount);
+  ExpectSortedByGuid();
+
+  ASSERT_EQ(1, TagOf(0));
+  ASSERT_EQ(3, TagOf(3));
+  ASSERT_EQ(3, TagOf(5));
+  ASSERT_EQ(1, TagOf(9));
+  ASSERT_EQ(-1, TagOf(10));
+  ASSERT_EQ(2, TagOf(12));
+}
+
+TEST_F(BuiltNodesJournalTest, IgnoresAJournalForAnotherStateFile)
+{
+  Build({ {0, 1}, {1, 1} });
+  Build({ {0, 2}, {7, 2} });
+  ASSERT_TRUE(RenameFile(journal_filename, journal_saved_filename));
+
+  // A build without a previous state writes a state file of its own.
+  RemoveFileOrDir(state_filename);
+  Build({ {0, 1}, {1, 1} });
+  ASSERT_TRUE(RenameFile(journal_saved_filename, journal_filename));
+
+  Open();
+  const BuiltNodesJournal& journal = driver.m_StateJournal;
+  ASSERT_EQ(0u, journal.m_ValidSize);
+  ASSERT_EQ(0, journal.m_RecordCount);
+  ASSERT_EQ(2, journal.m_NodeCount);
+  ASSERT_EQ(1, TagOf(0));
+  ASSERT_EQ(-1, TagOf(7));
+}
+
+TEST_F(BuiltNodesJournalTest, KeepsTheBatchesBeforeADamagedTail)
+{
+  Build({ {0, 1}, {1, 1} });
+  Build({ {1, 2} });
+  uint64_t valid_size = GetFileInfo(journal_filename).m_Size;
+
+  // A batch that claims more than was written, as if the build was killed while saving.
+  Frozen::AllBuiltNodesJournalBatch batch;
+  batch.m_Size = 4096;
+  batch.m_Padding = 0;
+  AppendToJournal(&batch, sizeof batch);
+
+  Open();
+  ASSERT_TRUE(driver.m_StateJournal.m_Damaged);
+  ASSERT_EQ(valid_size, driver.m_StateJournal.m_ValidSize);
+  ASSERT_EQ(2, driver.m_StateJournal.m_NodeCount);
+  ASSERT_EQ(1, TagOf(0));
+  ASSERT_EQ(2, TagOf(1));
+
+  // The next save rewrites the state file instead of appending to the damaged journal.
+  NodeFor(2)->m_BuildResult = NodeBuildResult::kRanSuccesfully;
+  NodeFor(2)->m_ExecutionTimeMs = 3;
+  ASSERT_TRUE(SaveAllBuiltNodes(&driver));
+  Close();
+  ASSERT_FALSE(GetFileInfo(journal_filename).Exists());
+
+  Open();
+  ASSERT_EQ(3, driver.m_AllBuiltNodes->m_NodeCount);
+  ASSERT_EQ(0u, driver.m_StateJournal.m_ValidSize);
+  ASSERT_EQ(1, TagOf(0));
+  ASSERT_EQ(2, TagOf(1));
+  ASSERT_EQ(3, TagOf(2));
+}
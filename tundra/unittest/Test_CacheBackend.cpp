@@ -0,0 +1,414 @@
+#include "TestHarness.hpp"
+#include "CacheBackend.hpp"
+#include "MemAllocHeap.hpp"
+#include "Common.hpp"
+#include "FileInfo.hpp"
+
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mutex>
+
+#if defined(TUNDRA_UNIX)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "Banned.hpp"
+
+static void WriteTestFile(const char *path, const std::string &contents)
+{
+    FILE *f = OpenFile(path, "wb");
+    ASSERT_NE(nullptr, f);
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+}
+
+static std::string ReadTestFile(const char *path)
+{
+    std::string contents;
+    FILE *f = OpenFile(path, "rb");
+    if (!f)
+        return "<missing>";
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        contents.append(buffer, n);
+    fclose(f);
+    return contents;
+}
+
+static HashDigest TestKey(const char *name)
+{
+    HashDigest digest;
+    HashSingleString(&digest, name);
+    return digest;
+}
+
+class CacheBackendTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  const char *files[2] = { "cache_backend_test_a.o", "cache_backend_test_b.o" };
+  const char *cache_dir = "cache_backend_test_dir";
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    MakeDirectory(cache_dir);
+  }
+
+  void TearDown() override
+  {
+    for (const char *file : files)
+      RemoveFileOrDir(file);
+    HeapDestroy(&heap);
+  }
+
+  // Stores the two files under key, changes them, then reads the entry back over them.
+  void RoundTrip(CacheBackend *backend)
+  {
+    // Big enough that the entry doesn't fit any single buffer on the way.
+    std::string big(300 * 1024, 'x');
+    WriteTestFile(files[0], "first output");
+    WriteTestFile(files[1], big);
+
+    ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("present"), files, 2, nullptr));
+
+    WriteTestFile(files[0], "changed");
+    RemoveFileOrDir(files[1]);
+
+    ASSERT_EQ(CacheResult::Success, backend->m_Read(backend, TestKey("present"), files, 2));
+    ASSERT_EQ("first output", ReadTestFile(files[0]));
+    ASSERT_EQ(big, ReadTestFile(files[1]));
+
+    ASSERT_EQ(CacheResult::CacheMiss, backend->m_Read(backend, TestKey("absent"), files, 2));
+    ASSERT_EQ(CacheResult::CacheMiss, backend->m_Read(backend, TestKey("present"), files, 1));
+    ASSERT_EQ("first output", ReadTestFile(files[0]));
+
+    HashDigest keys[3] = { TestKey("absent"), TestKey("present"), TestKey("other") };
+    bool present[3] = { true, false, true };
+    ASSERT_TRUE(backend->m_Contains(backend, keys, 3, present));
+    ASSERT_FALSE(present[0]);
+    ASSERT_TRUE(present[1]);
+    ASSERT_FALSE(present[2]);
+  }
+};
+
+TEST_F(CacheBackendTest, FileSystemRoundTrip)
+{
+  CacheBackend *backend = CacheBackendCreateFileSystem(&heap, cache_dir);
+  ASSERT_NE(nullptr, backend);
+  RoundTrip(backend);
+  backend->m_Destroy(backend);
+}
+
+TEST_F(CacheBackendTest, FileSystemWriteFailsForMissingFile)
+{
+  CacheBackend *backend = CacheBackendCreateFileSystem(&heap, cache_dir);
+  ASSERT_NE(nullptr, backend);
+  WriteTestFile(files[0], "first output");
+  RemoveFileOrDir(files[1]);
+
+  ASSERT_EQ(CacheResult::Failure, backend->m_Write(backend, TestKey("incomplete"), files, 2, nullptr));
+  ASSERT_EQ(CacheResult::CacheMiss, backend->m_Read(backend, TestKey("incomplete"), files, 2));
+  backend->m_Destroy(backend);
+}
+
+TEST_F(CacheBackendTest, FileSystemRejectsMissingRoot)
+{
+  ASSERT_EQ(nullptr, CacheBackendCreateFileSystem(&heap, "cache_backend_test_no_such_dir"));
+}
+
+TEST_F(CacheBackendTest, LocalRoundTrip)
+{
+  CacheBackend *backend = CacheBackendCreateLocal(&heap, "cache_backend_test_dir/local", 1024 * 1024 * 1024, false);
+  ASSERT_NE(nullptr, backend);
+  RoundTrip(backend);
+  backend->m_Destroy(backend);
+}
+
+TEST_F(CacheBackendTest, LocalEvictsWhenOverSize)
+{
+  const char *root = "cache_backend_test_dir/local_evict";
+  CacheBackend *backend = CacheBackendCreateLocal(&heap, root, 0, false);
+  ASSERT_NE(nullptr, backend);
+  WriteTestFile(files[0], "output");
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("evicted"), files, 1, nullptr));
+  backend->m_Destroy(backend);
+
+  backend = CacheBackendCreateLocal(&heap, root, 0, false);
+  ASSERT_EQ(CacheResult::CacheMiss, backend->m_Read(backend, TestKey("evicted"), files, 1));
+  backend->m_Destroy(backend);
+}
+
+#if defined(TUNDRA_UNIX)
+
+TEST_F(CacheBackendTest, LocalHardlinksKeepTheMode)
+{
+  CacheBackend *backend = CacheBackendCreateLocal(&heap, "cache_backend_test_dir/local_links", 1024 * 1024 * 1024, true);
+  ASSERT_NE(nullptr, backend);
+
+  // The same contents as a plain file and as an executable, so both outputs share one stored file.
+  WriteTestFile(files[0], "same contents");
+  WriteTestFile(files[1], "same contents");
+  chmod(files[0], 0644);
+  chmod(files[1], 0755);
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("modes"), files, 2, nullptr));
+
+  ASSERT_EQ(CacheResult::Success, backend->m_Read(backend, TestKey("modes"), files, 2));
+  struct stat st[2];
+  ASSERT_EQ(0, stat(files[0], &st[0]));
+  ASSERT_EQ(0, stat(files[1], &st[1]));
+  ASSERT_EQ(0644u, st[0].st_mode & 07777);
+  ASSERT_EQ(0755u, st[1].st_mode & 07777);
+  ASSERT_EQ("same contents", ReadTestFile(files[1]));
+  backend->m_Destroy(backend);
+}
+
+static void MakeAnHourOld(void *, const FileInfo &info, const char *path)
+{
+  if (!info.IsFile())
+    return;
+  struct timeval times[2];
+  times[0].tv_sec = times[1].tv_sec = time(nullptr) - 3600;
+  times[0].tv_usec = times[1].tv_usec = 0;
+  utimes(path, times);
+}
+
+static const char *FreshLocalRoot(const char *root)
+{
+  if (GetFileInfo(root).IsDirectory())
+    DeleteDirectory(root);
+  return root;
+}
+
+TEST_F(CacheBackendTest, LocalHardlinksKeepTheirTimestamp)
+{
+  CacheBackend *backend = CacheBackendCreateLocal(&heap, FreshLocalRoot("cache_backend_test_dir/local_link_times"), 1024 * 1024 * 1024, true);
+  ASSERT_NE(nullptr, backend);
+
+  WriteTestFile(files[0], "linked contents");
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("first"), files, 1, nullptr));
+  ASSERT_EQ(CacheResult::Success, backend->m_Read(backend, TestKey("first"), files, 1));
+  MakeAnHourOld(nullptr, GetFileInfo(files[0]), files[0]);
+  struct stat before;
+  ASSERT_EQ(0, stat(files[0], &before));
+
+  // Storing and restoring the same contents again uses the same stored file, which files[0] links to.
+  WriteTestFile(files[1], "linked contents");
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("second"), files + 1, 1, nullptr));
+  ASSERT_EQ(CacheResult::Success, backend->m_Read(backend, TestKey("second"), files + 1, 1));
+
+  struct stat after;
+  ASSERT_EQ(0, stat(files[0], &after));
+  ASSERT_EQ(before.st_ino, after.st_ino);
+  ASSERT_EQ(before.st_mtime, after.st_mtime);
+  backend->m_Destroy(backend);
+}
+
+TEST_F(CacheBackendTest, LocalEvictionKeepsObjectsOfRecentEntries)
+{
+  const char *root = FreshLocalRoot("cache_backend_test_dir/local_evict_shared");
+  std::string shared(600 * 1024, 's');
+  std::string unused(600 * 1024, 'u');
+
+  CacheBackend *backend = CacheBackendCreateLocal(&heap, root, 1024 * 1024 * 1024, false);
+  ASSERT_NE(nullptr, backend);
+  WriteTestFile(files[0], shared);
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("stale"), files, 1, nullptr));
+  WriteTestFile(files[0], unused);
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("unused"), files, 1, nullptr));
+  backend->m_Destroy(backend);
+  ListDirectory(root, nullptr, true, nullptr, MakeAnHourOld);
+
+  // The stored file of the shared contents stays as old as when it was first stored, but a new entry uses it.
+  backend = CacheBackendCreateLocal(&heap, root, 1024 * 1024, false);
+  WriteTestFile(files[0], shared);
+  WriteTestFile(files[1], "new contents");
+  ASSERT_EQ(CacheResult::Success, backend->m_Write(backend, TestKey("fresh"), files, 2, nullptr));
+  backend->m_Destroy(backend);
+
+  backend = CacheBackendCreateLocal(&heap, root, 1024 * 1024, false);
+  ASSERT_EQ(CacheResult::CacheMiss, backend->m_Read(backend, TestKey("unused"), files, 1));
+  ASSERT_EQ(CacheResult::Success, backend->m_Read(backend, TestKey("fresh"), files, 2));
+  ASSERT_EQ(shared, ReadTestFile(files[0]));
+  backend->m_Destroy(backend);
+}
+
+// Stand-in for a cache server, keeping the entries in memory. Speaks just enough http for CacheBackendHttp.
+class StandInCacheServer
+{
+public:
+  int m_Port = 0;
+  int m_AcceptedConnections = 0;
+
+  StandInCacheServer()
+  {
+    m_ListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(m_ListenFd, (sockaddr *)&addr, sizeof(addr));
+    listen(m_ListenFd, 16);
+    socklen_t len = sizeof(addr);
+    getsockname(m_ListenFd, (sockaddr *)&addr, &len);
+    m_Port = ntohs(addr.sin_port);
+    m_AcceptThread = std::thread([this] { AcceptLoop(); });
+  }
+
+  ~StandInCacheServer()
+  {
+    shutdown(m_ListenFd, SHUT_RDWR);
+    close(m_ListenFd);
+    m_AcceptThread.join();
+    for (std::thread &t : m_ConnectionThreads)
+      t.join();
+  }
+
+private:
+  int m_ListenFd;
+  std::thread m_AcceptThread;
+  std::vector<std::thread> m_ConnectionThreads;
+  std::mutex m_Lock;
+  std::map<std::string, std::string> m_Entries;
+
+  void AcceptLoop()
+  {
+    for (;;)
+    {
+      int fd = accept(m_ListenFd, nullptr, nullptr);
+      if (fd < 0)
+        return;
+      std::lock_guard<std::mutex> lock(m_Lock);
+      ++m_AcceptedConnections;
+      m_ConnectionThreads.emplace_back([this, fd] { Serve(fd); close(fd); });
+    }
+  }
+
+  static bool ReadExactly(int fd, std::string &pending, std::string *out, size_t size)
+  {
+    while (pending.size() < size)
+    {
+      char buffer[65536];
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n <= 0)
+        return false;
+      pending.append(buffer, n);
+    }
+    out->assign(pending, 0, size);
+    pending.erase(0, size);
+    return true;
+  }
+
+  static void Respond(int fd, int status, const std::string &body)
+  {
+    std::string response = "HTTP/1.1 " + std::to_string(status) + " X\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+      ssize_t n = write(fd, response.data() + sent, response.size() - sent);
+      if (n <= 0)
+        return;
+      sent += n;
+    }
+  }
+
+  void Serve(int fd)
+  {
+    std::string pending;
+    for (;;)
+    {
+      size_t end;
+      while ((end = pending.find("\r\n\r\n")) == std::string::npos)
+      {
+        char buffer[4096];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0)
+          return;
+        pending.append(buffer, n);
+      }
+
+      std::string head = pending.substr(0, end);
+      pending.erase(0, end + 4);
+
+      char method[16], path[256];
+      sscanf(head.c_str(), "%15s %255s", method, path);
+      size_t length_at = head.find("Content-Length: ");
+      size_t length = length_at == std::string::npos ? 0 : strtoul(head.c_str() + length_at + 16, nullptr, 10);
+
+      std::string body;
+      if (!ReadExactly(fd, pending, &body, length))
+        return;
+
+      std::string method_s = method, path_s = path;
+      std::lock_guard<std::mutex> lock(m_Lock);
+      if (method_s == "POST" && path_s == "/contains")
+      {
+        std::string answer;
+        for (size_t at = 0; at + 1 < body.size(); at += kDigestStringSize)
+          answer += m_Entries.count("/entries/" + body.substr(at, kDigestStringSize - 1)) ? '1' : '0';
+        Respond(fd, 200, answer);
+      }
+      else if (method_s == "GET")
+      {
+        auto it = m_Entries.find(path_s);
+        if (it == m_Entries.end())
+          Respond(fd, 404, "no such entry");
+        else
+          Respond(fd, 200, it->second);
+      }
+      else if (method_s == "PUT")
+      {
+        m_Entries[path_s] = body;
+        Respond(fd, 204, "");
+      }
+      else
+      {
+        Respond(fd, 400, "");
+      }
+    }
+  }
+};
+
+TEST_F(CacheBackendTest, HttpRoundTrip)
+{
+  StandInCacheServer server;
+  char address[64];
+  snprintf(address, sizeof(address), "127.0.0.1:%d", server.m_Port);
+
+  CacheBackend *backend = CacheBackendCreateHttp(&heap, address);
+  ASSERT_NE(nullptr, backend);
+  RoundTrip(backend);
+  backend->m_Destroy(backend);
+
+  // All the requests went over one connection.
+  ASSERT_EQ(1, server.m_AcceptedConnections);
+}
+
+TEST_F(CacheBackendTest, HttpUnreachableServerFails)
+{
+  CacheBackend *backend;
+  {
+    StandInCacheServer server;
+    char address[64];
+    snprintf(address, sizeof(address), "127.0.0.1:%d", server.m_Port);
+    backend = CacheBackendCreateHttp(&heap, address);
+  }
+  ASSERT_NE(nullptr, backend);
+
+  WriteTestFile(files[0], "output");
+  HashDigest key = TestKey("present");
+  bool present;
+  ASSERT_FALSE(backend->m_Contains(backend, &key, 1, &present));
+  ASSERT_EQ(CacheResult::Failure, backend->m_Read(backend, key, files, 1));
+  backend->m_Destroy(backend);
+}
+
+#endif
@@ -0,0 +1,179 @@
+#include "TestHarness.hpp"
+#include "DagStream.hpp"
+#include "JsonParse.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include <string.h>
+#include "Banned.hpp"
+
+class DagStreamTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  MemAllocLinear alloc;
+  MemAllocLinear scratch;
+  DagStreamWriter writer;
+  char error_msg[1024];
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    LinearAllocInit(&alloc, &heap, MB(1), "dag stream alloc");
+    LinearAllocInit(&scratch, &heap, MB(1), "dag stream scratch");
+    DagStreamWriterInit(&writer, &heap);
+  }
+
+  void TearDown() override
+  {
+    DagStreamWriterDestroy(&writer);
+    LinearAllocDestroy(&scratch);
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+  }
+
+  const JsonValue* Decode()
+  {
+    return DagStreamDecode((const char*) writer.m_Data.m_Storage, writer.m_Data.m_Size, &alloc, &heap, error_msg);
+  }
+};
+
+TEST_F(DagStreamTest, RoundTripsJson)
+{
+  char input[] = "{ \"Nodes\": [ { \"Action\": \"cc\", \"Deps\": [1, -2], \"Weight\": 0.5, \"Flag\": true }, { \"Action\": \"cc\", \"Env\": null, \"Flag\": false } ], \"Count\": 12345678901 }";
+  const JsonValue* json = JsonParse(input, &alloc, &scratch, error_msg);
+  ASSERT_NE(nullptr, json);
+
+  DagStreamWriteValue(&writer, json);
+  const JsonValue* v = Decode();
+
+  ASSERT_STREQ("", error_msg);
+  ASSERT_NE(nullptr, v);
+
+  const JsonObjectValue* root = v->AsObject();
+  ASSERT_NE(nullptr, root);
+  ASSERT_EQ(2, root->m_Count);
+  ASSERT_STREQ("Count", root->m_Names[1]);
+  ASSERT_EQ(12345678901.0, root->m_Values[1]->GetNumber());
+
+  const JsonArrayValue* nodes = root->m_Values[0]->AsArray();
+  ASSERT_NE(nullptr, nodes);
+  ASSERT_EQ(2, nodes->m_Count);
+
+  const JsonObjectValue* first = nodes->m_Values[0]->AsObject();
+  const JsonObjectValue* second = nodes->m_Values[1]->AsObject();
+  ASSERT_EQ(4, first->m_Count);
+  ASSERT_EQ(3, second->m_Count);
+
+  ASSERT_STREQ("cc", first->m_Values[0]->GetString());
+  ASSERT_EQ(first->m_Values[0]->GetString(), second->m_Values[0]->GetString());
+  ASSERT_EQ(first->m_Names[3], second->m_Names[2]);
+
+  const JsonArrayValue* deps = first->m_Values[1]->AsArray();
+  ASSERT_EQ(2, deps->m_Count);
+  ASSERT_EQ(1.0, deps->m_Values[0]->GetNumber());
+  ASSERT_EQ(-2.0, deps->m_Values[1]->GetNumber());
+  ASSERT_EQ(0.5, first->m_Values[2]->GetNumber());
+  ASSERT_TRUE(first->m_Values[3]->GetBoolean());
+
+  ASSERT_EQ(JsonValue::kNull, second->m_Values[1]->m_Type);
+  ASSERT_FALSE(second->m_Values[2]->GetBoolean());
+}
+
+TEST_F(DagStreamTest, StoresRepeatedStringsOnce)
+{
+  DagStreamBeginArray(&writer, 3);
+  DagStreamWriteString(&writer, "artifacts/some/long/output/path.o");
+  DagStreamWriteString(&writer, "artifacts/some/long/output/path.o");
+  DagStreamWriteString(&writer, "artifacts/some/long/output/path.o");
+
+  ASSERT_LT(writer.m_Data.m_Size, 2 * strlen("artifacts/some/long/output/path.o"));
+
+  const JsonValue* v = Decode();
+  ASSERT_NE(nullptr, v);
+  const JsonArrayValue* array = v->AsArray();
+  ASSERT_EQ(3, array->m_Count);
+  ASSERT_STREQ("artifacts/some/long/output/path.o", array->m_Values[2]->GetString());
+}
+
+TEST_F(DagStreamTest, RejectsBadMagic)
+{
+  char input[] = "{}  ";
+  ASSERT_EQ(nullptr, DagStreamDecode(input, 4, &alloc, &heap, error_msg));
+  ASSERT_NE(nullptr, strstr(error_msg, "not a dag stream"));
+}
+
+TEST_F(DagStreamTest, RejectsTruncatedStream)
+{
+  DagStreamBeginObject(&writer, 2);
+  DagStreamWriteString(&writer, "Nodes");
+  DagStreamWriteNull(&writer);
+
+  ASSERT_EQ(nullptr, Decode());
+  ASSERT_STRNE("", error_msg);
+}
+
+TEST_F(DagStreamTest, RejectsOutOfRangeStringRef)
+{
+  uint8_t ref[] = { kDagStreamStringRef, 3 };
+  BufferAppend(&writer.m_Data, &heap, ref, sizeof ref);
+
+  ASSERT_EQ(nullptr, Decode());
+  ASSERT_NE(nullptr, strstr(error_msg, "out of range"));
+}
+
+TEST_F(DagStreamTest, IndexesNodes)
+{
+  char input[] = "{ \"Passes\": [\"a\"], \"Nodes\": [ { \"Action\": \"cc\", \"Deps\": [1] }, { \"Action\": \"cc\", \"Deps\": [] } ], \"Count\": 3 }";
+  const JsonValue* json = JsonParse(input, &alloc, &scratch, error_msg);
+  ASSERT_NE(nullptr, json);
+  DagStreamWriteValue(&writer, json);
+
+  DagStreamIndex index;
+  const JsonObjectValue* root = DagStreamIndexInit(&index, (const char*) writer.m_Data.m_Storage, writer.m_Data.m_Size, &alloc, &heap, error_msg);
+  ASSERT_STREQ("", error_msg);
+  ASSERT_NE(nullptr, root);
+  ASSERT_EQ(3, root->m_Count);
+  ASSERT_EQ(0, root->m_Values[1]->AsArray()->m_Count);
+  ASSERT_EQ(3.0, root->m_Values[2]->GetNumber());
+  ASSERT_EQ(2, DagStreamIndexNodeCount(&index));
+
+  // The second node only refers back to strings written by the first.
+  const JsonObjectValue* second = DagStreamDecodeNode(&index, 1, &scratch, error_msg)->AsObject();
+  ASSERT_NE(nullptr, second);
+  ASSERT_STREQ("cc", second->m_Values[0]->GetString());
+  ASSERT_STREQ("Deps", second->m_Names[1]);
+  ASSERT_EQ(0, second->m_Values[1]->AsArray()->m_Count);
+
+  const JsonObjectValue* first = DagStreamDecodeNode(&index, 0, &scratch, error_msg)->AsObject();
+  ASSERT_NE(nullptr, first);
+  ASSERT_EQ(1.0, first->m_Values[1]->AsArray()->m_Values[0]->GetNumber());
+
+  DagStreamIndexDestroy(&index, &heap);
+}
+
+TEST_F(DagStreamTest, RejectsCountsLargerThanTheAllocator)
+{
+  // Every element is a single byte in the stream but a pointer once decoded, so
+  // this fits in the stream and not in the 1 MB allocator.
+  const size_t count = 200000;
+  DagStreamBeginArray(&writer, count);
+  for (size_t i = 0; i < count; ++i)
+    DagStreamWriteNull(&writer);
+
+  ASSERT_EQ(nullptr, Decode());
+  ASSERT_NE(nullptr, strstr(error_msg, "too large"));
+}
+
+TEST_F(DagStreamTest, RejectsNodeCountsPastTheEnd)
+{
+  DagStreamBeginObject(&writer, 1);
+  DagStreamWriteString(&writer, "Nodes");
+  DagStreamBeginArray(&writer, size_t(1) << 40);
+  DagStreamWriteNull(&writer);
+
+  DagStreamIndex index;
+  ASSERT_EQ(nullptr, DagStreamIndexInit(&index, (const char*) writer.m_Data.m_Storage, writer.m_Data.m_Size, &alloc, &heap, error_msg));
+  ASSERT_STRNE("", error_msg);
+  DagStreamIndexDestroy(&index, &heap);
+}
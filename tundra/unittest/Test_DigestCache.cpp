@@ -0,0 +1,118 @@
+#include "TestHarness.hpp"
+#include "DigestCache.hpp"
+#include "FileInfo.hpp"
+
+#include <stdio.h>
+
+#include "Banned.hpp"
+
+class DigestCacheTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  DigestCache cache;
+  const char *filename = "digest_cache_test";
+  const char *tmp_filename = "digest_cache_test.tmp";
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    RemoveFileOrDir(filename);
+    DigestCacheInit(&cache, MB(1), filename);
+  }
+
+  void TearDown() override
+  {
+    DigestCacheDestroy(&cache);
+    RemoveFileOrDir(filename);
+    HeapDestroy(&heap);
+  }
+
+  void SaveAndReload()
+  {
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, filename, tmp_filename));
+    DigestCacheDestroy(&cache);
+    DigestCacheInit(&cache, MB(1), filename);
+    ASSERT_NE(nullptr, cache.m_State);
+  }
+
+  static HashDigest DigestFor(int i)
+  {
+    char name[64];
+    snprintf(name, sizeof name, "contents %d", i);
+    HashDigest digest;
+    HashSingleString(&digest, name);
+    return digest;
+  }
+
+  static void NameFor(int i, char (&name)[64])
+  {
+    snprintf(name, sizeof name, "dir/file%d.c", i);
+  }
+
+  // The first hundred names share one hash, so the saved index has a long probe sequence.
+  static uint32_t HashFor(int i)
+  {
+    return i < 100 ? 7 : uint32_t(i) * 2654435761u;
+  }
+};
+
+TEST_F(DigestCacheTest, RoundTripsThroughTheSavedIndex)
+{
+  const int count = 1000;
+  for (int i = 0; i < count; ++i)
+  {
+    char name[64];
+    NameFor(i, name);
+    DigestCacheSet(&cache, name, HashFor(i), 1000 + i, DigestFor(i));
+  }
+
+  SaveAndReload();
+  ASSERT_EQ(count, cache.m_State->m_Records.GetCount());
+
+  for (int i = 0; i < count; ++i)
+  {
+    char name[64];
+    NameFor(i, name);
+    HashDigest digest;
+    ASSERT_TRUE(DigestCacheGet(&cache, name, HashFor(i), 1000 + i, &digest)) << name;
+    ASSERT_EQ(DigestFor(i), digest) << name;
+
+    // A file that changed since isn't a hit.
+    ASSERT_FALSE(DigestCacheGet(&cache, name, HashFor(i), 2000 + i, &digest)) << name;
+  }
+
+  HashDigest digest;
+  ASSERT_FALSE(DigestCacheGet(&cache, "dir/missing.c", 7, 1000, &digest));
+}
+
+TEST_F(DigestCacheTest, ChangesOnTopOfTheSavedStateAreKept)
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    char name[64];
+    NameFor(i, name);
+    DigestCacheSet(&cache, name, HashFor(i), 1000, DigestFor(i));
+  }
+  SaveAndReload();
+
+  char name0[64], name1[64], name2[64];
+  NameFor(0, name0);
+  NameFor(1, name1);
+  NameFor(2, name2);
+  DigestCacheSet(&cache, name0, HashFor(0), 1001, DigestFor(10));
+  DigestCacheMarkDirty(&cache, name1, HashFor(1));
+  SaveAndReload();
+
+  HashDigest digest;
+  ASSERT_TRUE(DigestCacheGet(&cache, name0, HashFor(0), 1001, &digest));
+  ASSERT_EQ(DigestFor(10), digest);
+  ASSERT_FALSE(DigestCacheGet(&cache, name0, HashFor(0), 1000, &digest));
+
+  // Dirty records are dropped on the next load.
+  ASSERT_FALSE(DigestCacheGet(&cache, name1, HashFor(1), 1000, &digest));
+
+  ASSERT_TRUE(DigestCacheGet(&cache, name2, HashFor(2), 1000, &digest));
+  ASSERT_EQ(DigestFor(2), digest);
+}
@@ -104,3 +104,93 @@ TEST(HashTest, CompareLess)
 #endif
 }
 
+
+#if ENABLED(USE_FAST_HASH) && ENABLED(USE_FAST_HASH_XXH3)
+
+static void FillPseudoRandom(uint8_t *data, size_t size)
+{
+  uint32_t x = 0x12345678;
+  for (size_t i = 0; i < size; ++i)
+  {
+    x = x * 1664525 + 1013904223;
+    data[i] = uint8_t(x >> 24);
+  }
+}
+
+static HashDigest HashInPieces(const uint8_t *data, size_t size, size_t piece_size)
+{
+  HashState h;
+  HashInit(&h);
+  for (size_t offset = 0; offset < size; offset += piece_size)
+    HashUpdate(&h, data + offset, size - offset < piece_size ? size - offset : piece_size);
+  HashDigest digest;
+  HashFinalize(&h, &digest);
+  return digest;
+}
+
+TEST(HashTest, KernelsAgree)
+{
+  const size_t sizes[] = {0, 1, 63, 64, 65, 1000, 1024, 4096 + 17, 100000};
+  static uint8_t data[100000];
+  FillPseudoRandom(data, sizeof data);
+
+  const int original_kernel = HashSelectedKernel();
+  ASSERT_TRUE(HashSelectKernel(kHashKernelScalar));
+
+  HashDigest expected[sizeof(sizes) / sizeof(sizes[0])];
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    expected[i] = HashInPieces(data, sizes[i], sizes[i] + 1);
+
+  for (int kernel = 0; kernel < kHashKernelCount; ++kernel)
+  {
+    if (!HashSelectKernel(kernel))
+      continue;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+      EXPECT_TRUE(expected[i] == HashInPieces(data, sizes[i], sizes[i] + 1)) << HashKernelName(kernel) << " size " << sizes[i];
+      EXPECT_TRUE(expected[i] == HashInPieces(data, sizes[i], 7)) << HashKernelName(kernel) << " size " << sizes[i];
+    }
+  }
+
+  HashSelectKernel(original_kernel);
+}
+
+TEST(HashTest, DifferentInputsDiffer)
+{
+  HashDigest a, b;
+  HashSingleString(&a, "foo");
+  HashSingleString(&b, "fop");
+  EXPECT_TRUE(a != b);
+}
+
+// Not a correctness test; reports HashUpdate/HashFinalize throughput per kernel,
+// both for bulk file data and for the small updates signature computation does.
+TEST(HashTest, DISABLED_Throughput)
+{
+  const size_t kSize = 64 * 1024 * 1024;
+  uint8_t *data = new uint8_t[kSize];
+  FillPseudoRandom(data, kSize);
+
+  const int original_kernel = HashSelectedKernel();
+
+  for (int kernel = 0; kernel < kHashKernelCount; ++kernel)
+  {
+    if (!HashSelectKernel(kernel))
+      continue;
+
+    const size_t piece_sizes[] = {kSize, 64 * 1024, 32};
+    for (size_t piece_size : piece_sizes)
+    {
+      uint64_t start = TimerGet();
+      HashInPieces(data, kSize, piece_size);
+      double seconds = TimerDiffSeconds(start, TimerGet());
+      printf("[ hash     ] %-7s %8zu-byte updates: %8.1f MB/s\n", HashKernelName(kernel), piece_size, kSize / seconds / (1024 * 1024));
+    }
+  }
+
+  HashSelectKernel(original_kernel);
+  delete[] data;
+}
+
+#endif
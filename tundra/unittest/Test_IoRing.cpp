@@ -0,0 +1,109 @@
+#include "TestHarness.hpp"
+#include "IoRing.hpp"
+#include "FileInfo.hpp"
+#include "MemAllocHeap.hpp"
+#include "Common.hpp"
+
+#include <string>
+#include <vector>
+
+#if defined(TUNDRA_UNIX)
+#include <unistd.h>
+#endif
+
+#include "Banned.hpp"
+
+class IoRingTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  IoRing *ring;
+  const char *dir = "io_ring_test_dir";
+  std::vector<std::string> files;
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    ring = IoRingCreate(&heap);
+    MakeDirectory(dir);
+
+    // More files than fit in one batch.
+    for (int i = 0; i < kIoRingEntries + 10; ++i)
+    {
+      files.push_back(std::string(dir) + "/f" + std::to_string(i));
+      FILE *f = OpenFile(files.back().c_str(), "wb");
+      std::string contents(i * 7, 'a' + i % 26);
+      fwrite(contents.data(), 1, contents.size(), f);
+      fclose(f);
+    }
+  }
+
+  void TearDown() override
+  {
+    for (const std::string &file : files)
+      RemoveFileOrDir(file.c_str());
+    RemoveFileOrDir(dir);
+    IoRingDestroy(ring);
+    HeapDestroy(&heap);
+  }
+};
+
+TEST_F(IoRingTest, StatMatchesGetFileInfo)
+{
+  if (ring == nullptr)
+    GTEST_SKIP() << "io_uring is not available";
+
+  std::vector<const char *> paths;
+  for (const std::string &file : files)
+    paths.push_back(file.c_str());
+  paths.push_back(dir);
+  paths.push_back("io_ring_test_dir/missing");
+  paths.push_back("io_ring_test_dir/f1/not_a_directory");
+
+  std::vector<FileInfo> infos(paths.size());
+  IoRingStatMany(ring, paths.data(), (int)paths.size(), infos.data());
+
+  for (size_t i = 0; i < paths.size(); ++i)
+  {
+    FileInfo expected = GetFileInfo(paths[i]);
+    ASSERT_EQ(expected.m_Flags, infos[i].m_Flags) << paths[i];
+    ASSERT_EQ(expected.m_Size, infos[i].m_Size) << paths[i];
+    ASSERT_EQ(expected.m_Timestamp, infos[i].m_Timestamp) << paths[i];
+  }
+}
+
+TEST_F(IoRingTest, ReadsFilesOfTheExpectedSize)
+{
+  if (ring == nullptr)
+    GTEST_SKIP() << "io_uring is not available";
+
+  int count = (int)files.size();
+  std::vector<const char *> paths;
+  std::vector<std::string> storage(count);
+  std::vector<char *> buffers;
+  std::vector<uint64_t> sizes;
+  for (int i = 0; i < count; ++i)
+  {
+    paths.push_back(files[i].c_str());
+    // Expect the last file to be a byte shorter than it is.
+    sizes.push_back(i * 7 - (i == count - 1 ? 1 : 0));
+    storage[i].resize(sizes.back() + 1);
+    buffers.push_back(&storage[i][0]);
+  }
+  paths[1] = "io_ring_test_dir/missing";
+
+  bool *ok = new bool[count];
+  IoRingReadMany(ring, paths.data(), count, buffers.data(), sizes.data(), ok);
+
+  for (int i = 0; i < count; ++i)
+  {
+    bool expected = i != 1 && i != count - 1;
+    ASSERT_EQ(expected, ok[i]) << i;
+    if (expected)
+    {
+      ASSERT_EQ(std::string(i * 7, 'a' + i % 26), storage[i].substr(0, sizes[i]));
+    }
+  }
+  delete[] ok;
+}
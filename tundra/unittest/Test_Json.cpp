@@ -2,6 +2,10 @@
 #include "JsonParse.hpp"
 #include "MemAllocLinear.hpp"
 #include "MemAllocHeap.hpp"
+#include "Buffer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
 #include "Banned.hpp"
 
 
@@ -50,6 +54,16 @@ TEST_F(JsonTest, Simple)
   ASSERT_EQ(1, int(obj->m_Values[1]->AsBoolean()->m_Boolean));
 }
 
+TEST_F(JsonTest, AllWhitespace)
+{
+  char input[] = "\v{\f\"foo\"\t:\r\n8\v}\f";
+  const JsonValue* v = JsonParse(input, &alloc, &scratch, error_msg);
+
+  ASSERT_STREQ("", error_msg);
+  ASSERT_NE(nullptr, v);
+  ASSERT_EQ(8, int(v->Find("foo")->GetNumber()));
+}
+
 TEST_F(JsonTest, EmptyObject)
 {
   char input[] = "{}";
@@ -151,3 +165,263 @@ TEST_F(JsonTest, Doubles)
   ASSERT_DOUBLE_EQ(array->m_Values[2]->AsNumber()->m_Number, -1.0e10);
   ASSERT_DOUBLE_EQ(array->m_Values[3]->AsNumber()->m_Number, 5e7);
 }
+
+static bool JsonValuesEqual(const JsonValue* a, const JsonValue* b)
+{
+  if (a->m_Type != b->m_Type)
+    return false;
+
+  switch (a->m_Type)
+  {
+  case JsonValue::kNull:
+    return true;
+  case JsonValue::kBoolean:
+    return a->AsBoolean()->m_Boolean == b->AsBoolean()->m_Boolean;
+  case JsonValue::kNumber:
+    return a->AsNumber()->m_Number == b->AsNumber()->m_Number;
+  case JsonValue::kString:
+    return 0 == strcmp(a->AsString()->m_String, b->AsString()->m_String);
+  case JsonValue::kArray:
+    if (a->AsArray()->m_Count != b->AsArray()->m_Count)
+      return false;
+    for (size_t i = 0; i < a->AsArray()->m_Count; ++i)
+      if (!JsonValuesEqual(a->AsArray()->m_Values[i], b->AsArray()->m_Values[i]))
+        return false;
+    return true;
+  case JsonValue::kObject:
+    if (a->AsObject()->m_Count != b->AsObject()->m_Count)
+      return false;
+    for (size_t i = 0; i < a->AsObject()->m_Count; ++i)
+      if (0 != strcmp(a->AsObject()->m_Names[i], b->AsObject()->m_Names[i]) || !JsonValuesEqual(a->AsObject()->m_Values[i], b->AsObject()->m_Values[i]))
+        return false;
+    return true;
+  }
+
+  return false;
+}
+
+TEST(JsonParallelTest, MatchesSerial)
+{
+  // Big enough to take the parallel path, with strings full of escapes and
+  // brackets to trip up the structural index.
+  Buffer<char> doc;
+  BufferInit(&doc);
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  const char* head = "{ \"Small\": [1, 2],\n  \"Nodes\": [\n";
+  BufferAppend(&doc, &heap, head, strlen(head));
+  for (int i = 0; i < 60000; ++i)
+  {
+    char node[256];
+    snprintf(node, sizeof node, "%s{\"Annotation\": \"node \\\\%d \\\"[{,}]\\\\\\\"\", \"Deps\": [%d, %d], \"Flag\": %s}\n",
+             i ? "," : "", i, i / 2, i / 3, (i & 1) ? "true" : "null");
+    BufferAppend(&doc, &heap, node, strlen(node));
+  }
+  const char* tail = "], \"Named\": {\"all\": [\"x\\\\\"]} }";
+  BufferAppend(&doc, &heap, tail, strlen(tail) + 1);
+
+  char* copy = (char*) HeapAllocate(&heap, doc.m_Size);
+  memcpy(copy, doc.m_Storage, doc.m_Size);
+
+  MemAllocLinear alloc, scratch, alloc2, scratch2;
+  LinearAllocInit(&alloc, &heap, MB(64), "json alloc");
+  LinearAllocInit(&scratch, &heap, MB(1), "json scratch");
+  LinearAllocInit(&alloc2, &heap, MB(64), "json alloc 2");
+  LinearAllocInit(&scratch2, &heap, MB(1), "json scratch 2");
+
+  JsonParseWorkers workers;
+  JsonParseWorkersInit(&workers, &heap);
+
+  char error_msg[1024], error_msg2[1024];
+  const JsonValue* serial = JsonParse(doc.m_Storage, &alloc, &scratch, error_msg);
+  const JsonValue* parallel = JsonParseParallel(copy, doc.m_Size - 1, &alloc2, &scratch2, &workers, error_msg2);
+
+  ASSERT_STREQ("", error_msg);
+  ASSERT_STREQ("", error_msg2);
+  ASSERT_NE(nullptr, serial);
+  ASSERT_NE(nullptr, parallel);
+  ASSERT_EQ(60000, parallel->Find("Nodes")->AsArray()->m_Count);
+  ASSERT_TRUE(JsonValuesEqual(serial, parallel));
+
+  JsonParseWorkersDestroy(&workers);
+  LinearAllocDestroy(&scratch2);
+  LinearAllocDestroy(&alloc2);
+  LinearAllocDestroy(&scratch);
+  LinearAllocDestroy(&alloc);
+  HeapFree(&heap, copy);
+  BufferDestroy(&doc, &heap);
+  HeapDestroy(&heap);
+}
+
+static const JsonValue* ParseWithKernel(int kernel, const char* text, MemAllocLinear* alloc, MemAllocLinear* scratch, char (&error_msg)[1024])
+{
+  const int original_kernel = JsonSelectedScanKernel();
+  JsonSelectScanKernel(kernel);
+
+  size_t len = strlen(text);
+  char* copy = (char*) LinearAllocate(alloc, len + 1, 1);
+  memcpy(copy, text, len + 1);
+  const JsonValue* result = JsonParse(copy, alloc, scratch, error_msg);
+
+  JsonSelectScanKernel(original_kernel);
+  return result;
+}
+
+TEST(JsonScanTest, KernelsAgree)
+{
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  // Runs of backslashes of every length up to two blocks, at every offset into
+  // a block, so escapes and quotes straddle block boundaries. The document ends
+  // up well past one scan window.
+  Buffer<char> doc;
+  BufferInit(&doc);
+  BufferAppend(&doc, &heap, "[", 1);
+  for (int run = 0; run < 130; ++run)
+  {
+    char item[512];
+    int len = snprintf(item, sizeof item, "%s\"%.*s", run ? ",\n" : "", run % 64, "                                                                ");
+    for (int i = 0; i < run; ++i)
+      item[len++] = '\\';
+    // An odd run escapes the quote that follows it, so the string goes on.
+    len += snprintf(item + len, sizeof item - len, (run & 1) ? "\" {]\", %d" : "\", %d", run);
+    BufferAppend(&doc, &heap, item, len);
+  }
+  BufferAppend(&doc, &heap, "]", 2);
+
+  const char* documents[] = {
+    doc.m_Storage,
+    "{ \"a\": [1, 2, {\"b\": null}], \"c\": \"\\u0041\\n\" }",
+    "{ \"a\": [1true, 2] }",
+    "{ \"a\": [1, 2]\n\n, }",
+    "[ \"unterminated\\\" ]",
+    "[ \"x\" \\ ]",
+    "[ -, 1 ]",
+    "[ falsey ]",
+    "{\v\"a\"\f:\t[1,\r\n2 ]\v}",
+    "[ 1\f\n, \"x\" \v\n\n} ]",
+  };
+
+  for (const char* text : documents)
+  {
+    MemAllocLinear alloc, scratch;
+    LinearAllocInit(&alloc, &heap, MB(4), "json alloc");
+    LinearAllocInit(&scratch, &heap, MB(1), "json scratch");
+
+    char expected_error[1024];
+    const JsonValue* expected = ParseWithKernel(kJsonScanKernelScalar, text, &alloc, &scratch, expected_error);
+
+    for (int kernel = kJsonScanKernelScalar + 1; kernel < kJsonScanKernelCount; ++kernel)
+    {
+      if (!JsonSelectScanKernel(kernel))
+        continue;
+
+      char error_msg[1024];
+      const JsonValue* value = ParseWithKernel(kernel, text, &alloc, &scratch, error_msg);
+      ASSERT_STREQ(expected_error, error_msg);
+      ASSERT_EQ(nullptr == expected, nullptr == value);
+      if (value)
+      {
+        ASSERT_TRUE(JsonValuesEqual(expected, value));
+      }
+    }
+
+    LinearAllocDestroy(&scratch);
+    LinearAllocDestroy(&alloc);
+  }
+
+  BufferDestroy(&doc, &heap);
+  HeapDestroy(&heap);
+}
+
+// Not a correctness test; reports parse throughput per scan kernel on a
+// synthetic DAG file shaped like what the frontend writes. At the default 1 GB
+// it needs a few GB of memory, so it only runs when asked for; set
+// TUNDRA_JSON_BENCH_MB to try other sizes.
+TEST(JsonScanTest, DISABLED_Throughput)
+{
+  size_t size = MB(size_t(1024));
+  if (const char* env = getenv("TUNDRA_JSON_BENCH_MB"))
+    size = MB(size_t(atoi(env)));
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  Buffer<char> doc;
+  BufferInit(&doc);
+  const char* head = "{\n  \"Nodes\": [\n";
+  BufferAppend(&doc, &heap, head, strlen(head));
+  for (int i = 0; doc.m_Size < size; ++i)
+  {
+    char node[1024];
+    int len = snprintf(node, sizeof node,
+        "%s    {\n"
+        "      \"Annotation\": \"Cc artifacts/obj/module%d/file%d.o\",\n"
+        "      \"Action\": \"gcc -c -O2 -g -Wall -I\\\"include\\\" -DMODULE=%d -o artifacts/obj/module%d/file%d.o src/module%d/file%d.c\",\n"
+        "      \"Inputs\": [\"src/module%d/file%d.c\", \"include/module%d.h\"],\n"
+        "      \"Outputs\": [\"artifacts/obj/module%d/file%d.o\"],\n"
+        "      \"Deps\": [%d, %d, %d],\n"
+        "      \"Scanner\": 0,\n"
+        "      \"Env\": [{\"Key\": \"PATH\", \"Value\": \"C:\\\\tools\\\\bin;/usr/bin\"}],\n"
+        "      \"Flags\": {\"Overwrite\": true, \"PreciousOutputs\": false}\n"
+        "    }",
+        i ? ",\n" : "", i / 100, i, i / 100, i / 100, i, i / 100, i,
+        i / 100, i, i / 100, i / 100, i, i / 2, i / 3, i / 5);
+    BufferAppend(&doc, &heap, node, len);
+  }
+  const char* tail = "\n  ],\n  \"Passes\": [\"Default\"]\n}\n";
+  BufferAppend(&doc, &heap, tail, strlen(tail) + 1);
+
+  char* copy = (char*) HeapAllocate(&heap, doc.m_Size);
+  const size_t json_size = doc.m_Size - 1;
+  const double mb = json_size / (1024.0 * 1024.0);
+
+  MemAllocLinear alloc, scratch;
+  LinearAllocInit(&alloc, &heap, json_size * 3, "json alloc");
+  LinearAllocInit(&scratch, &heap, MB(64), "json scratch");
+
+  const int original_kernel = JsonSelectedScanKernel();
+  char error_msg[1024];
+
+  // The first parse pays for faulting in the allocator's pages; don't time it.
+  memcpy(copy, doc.m_Storage, doc.m_Size);
+  ASSERT_NE(nullptr, JsonParse(copy, &alloc, &scratch, error_msg));
+
+  for (int kernel = 0; kernel < kJsonScanKernelCount; ++kernel)
+  {
+    if (!JsonSelectScanKernel(kernel))
+      continue;
+
+    memcpy(copy, doc.m_Storage, doc.m_Size);
+    LinearAllocReset(&alloc);
+
+    uint64_t start = TimerGet();
+    const JsonValue* value = JsonParse(copy, &alloc, &scratch, error_msg);
+    double seconds = TimerDiffSeconds(start, TimerGet());
+    ASSERT_NE(nullptr, value);
+    printf("[ json     ] %-7s serial:   %8.1f MB/s (%.0f MB)\n", JsonScanKernelName(kernel), mb / seconds, mb);
+  }
+
+  JsonSelectScanKernel(original_kernel);
+
+  JsonParseWorkers workers;
+  JsonParseWorkersInit(&workers, &heap);
+  memcpy(copy, doc.m_Storage, doc.m_Size);
+  LinearAllocReset(&alloc);
+
+  uint64_t start = TimerGet();
+  const JsonValue* value = JsonParseParallel(copy, json_size, &alloc, &scratch, &workers, error_msg);
+  double seconds = TimerDiffSeconds(start, TimerGet());
+  ASSERT_NE(nullptr, value);
+  printf("[ json     ] %-7s parallel: %8.1f MB/s (%d threads)\n", JsonScanKernelName(original_kernel), mb / seconds, std::max(workers.m_Count, 1));
+
+  JsonParseWorkersDestroy(&workers);
+  LinearAllocDestroy(&scratch);
+  LinearAllocDestroy(&alloc);
+  HeapFree(&heap, copy);
+  BufferDestroy(&doc, &heap);
+  HeapDestroy(&heap);
+}
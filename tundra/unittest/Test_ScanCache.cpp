@@ -0,0 +1,179 @@
+#include "TestHarness.hpp"
+#include "ScanCache.hpp"
+#include "ScanData.hpp"
+#include "LoadFrozenData.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemAllocLinear.hpp"
+#include "FileInfo.hpp"
+
+#include <stdio.h>
+#include <string>
+
+#include "Banned.hpp"
+
+class ScanCacheTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  MemAllocLinear alloc;
+  MemAllocLinear scratch;
+  ScanCache cache;
+  MemoryMappedFile frozen_file;
+  const Frozen::ScanData* frozen = nullptr;
+  const char* filename = "scan_cache_test";
+  const char* tmp_filename = "scan_cache_test.tmp";
+  const char* log_filename = "scan_cache_test.log";
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    LinearAllocInit(&alloc, &heap, MB(4), "scan cache test");
+    LinearAllocInit(&scratch, &heap, MB(1), "scan cache test scratch");
+    MmapFileInit(&frozen_file);
+    RemoveFileOrDir(filename);
+    RemoveFileOrDir(log_filename);
+    ScanCacheInit(&cache, &heap, &alloc);
+  }
+
+  void TearDown() override
+  {
+    ScanCacheDestroy(&cache);
+    MmapFileDestroy(&frozen_file);
+    LinearAllocDestroy(&scratch);
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+    RemoveFileOrDir(filename);
+    RemoveFileOrDir(log_filename);
+  }
+
+  // Ends this session and starts the next one from what is on disk, like the next build would.
+  void Reopen()
+  {
+    ScanCacheDestroy(&cache);
+    MmapFileDestroy(&frozen_file);
+    MmapFileInit(&frozen_file);
+    LinearAllocReset(&alloc);
+
+    frozen = nullptr;
+    ScanCacheInit(&cache, &heap, &alloc);
+    LoadFrozenData<Frozen::ScanData>(filename, &frozen_file, &frozen);
+    ScanCacheSetCache(&cache, frozen, log_filename);
+  }
+
+  // Compacts everything into new frozen data, the way DriverSaveScanCache does.
+  void Save()
+  {
+    ASSERT_TRUE(ScanCacheSave(&cache, tmp_filename, &heap));
+    MmapFileUnmap(&frozen_file);
+    ASSERT_TRUE(RenameFile(tmp_filename, filename));
+    RemoveFileOrDir(log_filename);
+  }
+
+  static HashDigest KeyFor(int i)
+  {
+    char name[64];
+    snprintf(name, sizeof name, "src/file%d.c", i);
+    HashDigest key;
+    HashSingleString(&key, name);
+    return key;
+  }
+
+  // Every file includes header<i> and header<i + 1>.
+  void Insert(int i)
+  {
+    std::string first = "include/header" + std::to_string(i) + ".h";
+    std::string second = "include/header" + std::to_string(i + 1) + ".h";
+    const char* includes[] = { first.c_str(), second.c_str() };
+    ScanCacheInsert(&cache, KeyFor(i), 100 + i, includes, 2);
+  }
+
+  bool Found(int i)
+  {
+    ScanCacheLookupResult result;
+    if (!ScanCacheLookup(&cache, KeyFor(i), 100 + i, &result, &scratch))
+      return false;
+    EXPECT_EQ(2, result.m_IncludedFileCount);
+    EXPECT_EQ("include/header" + std::to_string(i + 1) + ".h", std::string(result.m_IncludedFiles[1].m_Filename));
+    return true;
+  }
+};
+
+TEST_F(ScanCacheTest, RoundTripsThroughFrozenDataAndLog)
+{
+  for (int i = 0; i < 500; ++i)
+    Insert(i);
+  ASSERT_TRUE(ScanCacheDirty(&cache));
+  Save();
+
+  Reopen();
+  ASSERT_NE(nullptr, frozen);
+  ASSERT_EQ(500, frozen->m_EntryCount);
+  ASSERT_FALSE(ScanCacheDirty(&cache));
+  for (int i = 0; i < 500; ++i)
+    ASSERT_TRUE(Found(i)) << i;
+
+  // A file that changed since isn't a hit.
+  ScanCacheLookupResult result;
+  ASSERT_FALSE(ScanCacheLookup(&cache, KeyFor(0), 99, &result, &scratch));
+  ASSERT_FALSE(Found(500));
+
+  // Changes on top of the frozen data go to the log.
+  Insert(500);
+  Insert(501);
+  ASSERT_TRUE(ScanCacheDirty(&cache));
+  ASSERT_FALSE(ScanCacheShouldCompact(&cache));
+  ASSERT_TRUE(ScanCacheAppendLog(&cache));
+  ASSERT_FALSE(ScanCacheDirty(&cache));
+
+  Reopen();
+  ASSERT_EQ(500, frozen->m_EntryCount);
+  for (int i = 0; i < 502; ++i)
+    ASSERT_TRUE(Found(i)) << i;
+
+  // Compacting folds the log into new frozen data.
+  Save();
+  Reopen();
+  ASSERT_EQ(502, frozen->m_EntryCount);
+  for (int i = 0; i < 502; ++i)
+    ASSERT_TRUE(Found(i)) << i;
+}
+
+TEST_F(ScanCacheTest, KeepsTheRecordsBeforeADamagedLogTail)
+{
+  Insert(0);
+  Save();
+  Reopen();
+
+  Insert(1);
+  ASSERT_TRUE(ScanCacheAppendLog(&cache));
+  Insert(2);
+  ASSERT_TRUE(ScanCacheAppendLog(&cache));
+
+  // Cut the last record short, as if the save was interrupted.
+  std::string log;
+  FILE* f = OpenFile(log_filename, "rb");
+  ASSERT_NE(nullptr, f);
+  char buffer[4096];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof buffer, f)) > 0)
+    log.append(buffer, n);
+  fclose(f);
+  f = OpenFile(log_filename, "wb");
+  ASSERT_NE(nullptr, f);
+  fwrite(log.data(), 1, log.size() - 3, f);
+  fclose(f);
+
+  Reopen();
+  ASSERT_TRUE(Found(0));
+  ASSERT_TRUE(Found(1));
+  ASSERT_FALSE(Found(2));
+
+  // What could be read is written again as a fresh log.
+  ASSERT_TRUE(ScanCacheDirty(&cache));
+  Insert(2);
+  ASSERT_TRUE(ScanCacheAppendLog(&cache));
+  Reopen();
+  for (int i = 0; i < 3; ++i)
+    ASSERT_TRUE(Found(i)) << i;
+}